@@ -10,12 +10,22 @@ extern "C" {
 #endif
 
 struct mrpc_client;
+struct mrpc_client_batch;
 
 /**
- * Creates an mrpc client.
+ * Handler, which reads the response from the asynchronous request stream.
+ * See mrpc_client_create_async_request_stream().
+ */
+typedef void (*mrpc_client_response_handler)(struct ff_stream *stream, void *ctx);
+
+/**
+ * Creates an mrpc client, which establishes connections_cnt connections to the server.
+ * Request streams are spread among connections, so each new request stream is created over the connection
+ * with the least number of in-flight requests. Each connection is re-established independently of other connections,
+ * so a stalled connection doesn't block requests sent over other connections.
  * Always returns correct result.
  */
-MRPC_API struct mrpc_client *mrpc_client_create();
+MRPC_API struct mrpc_client *mrpc_client_create(int connections_cnt);
 
 /**
  * Deletes the client.
@@ -30,6 +40,29 @@ MRPC_API void mrpc_client_delete(struct mrpc_client *client);
  */
 MRPC_API void mrpc_client_start(struct mrpc_client *client, struct ff_stream_connector *stream_connector);
 
+/**
+ * Sets the policy for coalescing flushes of packets sent over the client's connections.
+ * By default packets are flushed as soon as there are no more packets to send, so each packet
+ * can result in a separate network segment under moderate load. Non-zero flush_delay allows
+ * delaying the flush for up to flush_delay milliseconds since the first unflushed packet, unless
+ * flush_threshold bytes are accumulated. This automatically coalesces small requests sent
+ * by multiple fibers into a single network write even if the connection is idle. Packets the remote side can be blocked on
+ * (such as flow control credits) and requests with the MRPC_PRIORITY_HIGH priority are always flushed immediately.
+ * Flush delay increases latency of lone requests, so use it only for throughput-oriented traffic.
+ * Defaults are MRPC_DEFAULT_FLUSH_DELAY and MRPC_DEFAULT_FLUSH_THRESHOLD.
+ * This function must be called before the mrpc_client_start().
+ */
+MRPC_API void mrpc_client_set_flush_policy(struct mrpc_client *client, int flush_delay, int flush_threshold);
+
+/**
+ * Sets the timeout (in milliseconds) of inactivity, after which the client's connections hibernate,
+ * i.e. free idle request streams and packet buffers. They are allocated again on demand,
+ * so hibernation reduces memory usage of mostly idle connections at the cost of slower first request after it.
+ * The default is MRPC_DEFAULT_HIBERNATION_TIMEOUT.
+ * This function must be called before the mrpc_client_start().
+ */
+MRPC_API void mrpc_client_set_hibernation_timeout(struct mrpc_client *client, int hibernation_timeout);
+
 /**
  * Stops the given client.
  * After the client is stopped, it can be started again using the mrpc_client_start() function.
@@ -45,11 +78,82 @@ MRPC_API void mrpc_client_stop(struct mrpc_client *client);
 MRPC_API struct ff_stream *mrpc_client_create_request_stream(struct mrpc_client *client);
 
 /**
- * closes the underlying connection to the server and opens new one.
- * Use this method if the stream returned from the mrpc_client_create_request_stream()
- * returns garbage (i.e. broken client-server protocol synchronization).
+ * creates request stream with the given priority for sending rpc request.
+ * Packets of request streams with higher priority are sent to the server before packets
+ * of request streams with lower priority. Request streams with the same priority share
+ * the connection in round-robin order, so large requests don't delay small requests.
+ * Requests with the MRPC_PRIORITY_HIGH priority are flushed immediately regardless of the flush policy
+ * (see mrpc_client_set_flush_policy()), so use it for latency-sensitive requests.
+ * The priority is passed to the server, which executes pending requests of the connection
+ * and sends responses to them in the order of their priorities.
+ * The mrpc_client_create_request_stream() creates request streams with the MRPC_PRIORITY_NORMAL priority.
+ * This request stream must be deleted using the ff_stream_delete().
+ * Returns request stream on success, NULL if the request stream cannot be created.
+ */
+MRPC_API struct ff_stream *mrpc_client_create_request_stream_with_priority(struct mrpc_client *client, enum mrpc_priority priority);
+
+/**
+ * creates asynchronous request stream with the given priority for sending rpc request.
+ * The request must be written to the stream and then flushed using the ff_stream_flush().
+ * After the successful flush the stream is owned by the response_handler, so the caller mustn't use it anymore.
+ * The response_handler(stream, ctx) is called in a separate fiber as soon as the first packet
+ * of the response is received or the connection is closed. It must read the response from the stream
+ * and delete the stream using the ff_stream_delete().
+ * This allows pipelining multiple requests from a single fiber without blocking a fiber per request
+ * while the server processes them.
+ * If the request cannot be written or flushed, then the caller must delete the stream.
+ * The response_handler isn't called in this case.
+ * Returns request stream on success, NULL if the request stream cannot be created.
+ */
+MRPC_API struct ff_stream *mrpc_client_create_async_request_stream(struct mrpc_client *client, enum mrpc_priority priority,
+	mrpc_client_response_handler response_handler, void *ctx);
+
+/**
+ * Starts a batch of requests sent over the given client.
+ * Requests sent via the returned batch (see mrpc_client_create_batch_request_stream())
+ * until the matching mrpc_client_end_batch() call are accumulated and written
+ * to the network using a single flush per connection, so a batch of small requests costs
+ * a single network write instead of a write per request. The batch is flushed earlier
+ * if it exceeds the flush_threshold (see mrpc_client_set_flush_policy()) or if requests
+ * outside the batch are flushed over the same connection.
+ * Requests sent by other fibers outside the batch aren't delayed by the batch.
+ * Multiple batches can be active simultaneously.
+ * Always returns correct result.
+ */
+MRPC_API struct mrpc_client_batch *mrpc_client_begin_batch(struct mrpc_client *client);
+
+/**
+ * Ends the batch started by the mrpc_client_begin_batch() and deletes it.
+ * Requests accumulated during the batch are sent to the server.
+ */
+MRPC_API void mrpc_client_end_batch(struct mrpc_client_batch *batch);
+
+/**
+ * creates asynchronous request stream with the given priority for sending rpc request in the given batch.
+ * The request stream is used the same way as the stream returned from the mrpc_client_create_async_request_stream().
+ * Only asynchronous requests can be sent in the batch, because responses to batched requests
+ * cannot be received until the batch is ended.
+ * Returns request stream on success, NULL if the request stream cannot be created.
+ */
+MRPC_API struct ff_stream *mrpc_client_create_batch_request_stream(struct mrpc_client_batch *batch, enum mrpc_priority priority,
+	mrpc_client_response_handler response_handler, void *ctx);
+
+/**
+ * Returns non-zero if the last read from the given request stream failed,
+ * because the server rejected the request due to overload (see mrpc_server_set_load_shedding()).
+ * Such requests can be safely retried later or sent to another server, and there is no need
+ * in resetting the connection.
+ * The stream must be created by the given client and mustn't be deleted yet.
+ */
+MRPC_API int mrpc_client_is_server_overloaded(struct mrpc_client *client, struct ff_stream *stream);
+
+/**
+ * closes the underlying connection to the server, which is used by the given request stream, and opens new one.
+ * Requests over other connections aren't affected.
+ * Use this method if the given stream fails or returns garbage (i.e. broken client-server protocol synchronization).
+ * The stream must be created by the given client and mustn't be deleted yet.
  */
-MRPC_API void mrpc_client_reset_connection(struct mrpc_client *client);
+MRPC_API void mrpc_client_reset_connection(struct mrpc_client *client, struct ff_stream *stream);
 
 #ifdef __cplusplus
 }
@@ -5,4 +5,31 @@
 
 #include "mrpc/mrpc_api.h"
 
+/**
+ * The default flush policy for rpc connections.
+ * See mrpc_server_set_flush_policy() and mrpc_client_set_flush_policy().
+ */
+#define MRPC_DEFAULT_FLUSH_DELAY 0
+#define MRPC_DEFAULT_FLUSH_THRESHOLD 0x4000
+
+/**
+ * The default timeout (in milliseconds) of rpc connection's inactivity, after which the connection hibernates.
+ * See mrpc_server_set_hibernation_timeout() and mrpc_client_set_hibernation_timeout().
+ */
+#define MRPC_DEFAULT_HIBERNATION_TIMEOUT (30 * 1000)
+
+/**
+ * Priority classes of rpc requests.
+ * Higher priority requests sharing the same connection are sent, executed by the server
+ * and responded before lower priority requests. See mrpc_client_create_request_stream_with_priority().
+ */
+enum mrpc_priority
+{
+	MRPC_PRIORITY_HIGH,
+	MRPC_PRIORITY_NORMAL,
+	MRPC_PRIORITY_LOW,
+};
+
+#define MRPC_PRIORITIES_CNT 3
+
 #endif
@@ -0,0 +1,44 @@
+#ifndef MRPC_MEMORY_PUBLIC_H
+#define MRPC_MEMORY_PUBLIC_H
+
+#include "mrpc/mrpc_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The default limit (in bytes) for memory occupied by packet buffers.
+ */
+#define MRPC_MEMORY_DEFAULT_PACKETS_LIMIT (64 * 1024 * 1024)
+
+/**
+ * The default timeout (in milliseconds) for waiting until packet buffers drop below the limit.
+ */
+#define MRPC_MEMORY_DEFAULT_THROTTLE_TIMEOUT (10 * 1000)
+
+/**
+ * Sets the process-wide limit (in bytes) for memory occupied by packet buffers,
+ * which are shared among all the rpc clients and servers.
+ * When the limit is reached, connections stop reading packets from the underlying streams
+ * until packet buffers are released. This provides predictable memory usage under overload.
+ * Connections, which cannot read packets for too long due to the limit, are closed.
+ * Packets written to connections aren't throttled, because they release their buffers after they are sent.
+ * The limit is MRPC_MEMORY_DEFAULT_PACKETS_LIMIT by default.
+ */
+MRPC_API void mrpc_memory_set_packets_limit(int limit);
+
+/**
+ * Sets the process-wide timeout (in milliseconds) for connections waiting to read packets
+ * while packet buffers exceed the limit set by the mrpc_memory_set_packets_limit().
+ * The memory can be occupied by requests, which wait for packets from throttled connections,
+ * so connections are closed if the limit is still exceeded after the timeout.
+ * The timeout is MRPC_MEMORY_DEFAULT_THROTTLE_TIMEOUT by default.
+ */
+MRPC_API void mrpc_memory_set_throttle_timeout(int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
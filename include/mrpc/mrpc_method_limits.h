@@ -0,0 +1,62 @@
+#ifndef MRPC_METHOD_LIMITS_PUBLIC_H
+#define MRPC_METHOD_LIMITS_PUBLIC_H
+
+#include "mrpc/mrpc_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Limits of concurrently executed calls for methods of an interface.
+ * They are used by generated server stream handlers for isolating slow methods from fast methods.
+ */
+struct mrpc_method_limits;
+
+/**
+ * Creates limits for methods with ids in the range [0 .. methods_cnt).
+ * Calls of all the methods are unlimited by default.
+ * Always returns correct result.
+ */
+MRPC_API struct mrpc_method_limits *mrpc_method_limits_create(int methods_cnt);
+
+/**
+ * Deletes the given limits.
+ * There must be no active calls, which acquired slots from the limits.
+ */
+MRPC_API void mrpc_method_limits_delete(struct mrpc_method_limits *limits);
+
+/**
+ * Sets the maximum number of concurrently executed calls of the method with the given method_id.
+ * Zero max_active_cnt means unlimited number of calls.
+ * If is_queued isn't zero, then calls exceeding the limit wait until the number of active calls
+ * drops below the limit, otherwise such calls are rejected.
+ * Calls waiting for the previous limit are checked against the new limit, so raising the limit
+ * lets waiting calls occupy all the new slots.
+ */
+MRPC_API void mrpc_method_limits_set(struct mrpc_method_limits *limits, int method_id, int max_active_cnt, int is_queued);
+
+/**
+ * Returns non-zero if the mrpc_method_limits_acquire_slot() for the method with the given method_id
+ * would wait for a free slot.
+ */
+MRPC_API int mrpc_method_limits_is_wait_needed(struct mrpc_method_limits *limits, int method_id);
+
+/**
+ * Acquires a slot for a call of the method with the given method_id.
+ * Waits for a free slot if the limit is reached and calls of the method are queued.
+ * Returns FF_SUCCESS on success, FF_FAILURE if the call is rejected.
+ * The acquired slot must be released using the mrpc_method_limits_release_slot().
+ */
+MRPC_API enum ff_result mrpc_method_limits_acquire_slot(struct mrpc_method_limits *limits, int method_id);
+
+/**
+ * Releases the slot acquired by the mrpc_method_limits_acquire_slot().
+ */
+MRPC_API void mrpc_method_limits_release_slot(struct mrpc_method_limits *limits, int method_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
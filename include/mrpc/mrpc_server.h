@@ -11,6 +11,30 @@ extern "C" {
 
 struct mrpc_server;
 
+/**
+ * The callback must return a positive weight for the given client connection.
+ * See mrpc_server_set_fair_scheduling().
+ */
+typedef int (*mrpc_server_connection_weight_func)(struct ff_stream *client_stream, void *service_ctx);
+
+/**
+ * Policies for new connections accepted when the server has reached the limit of connections.
+ * See mrpc_server_set_admission_policy().
+ */
+enum mrpc_server_admission_policy
+{
+	/* the server stops accepting connections until one of active connections is closed */
+	MRPC_SERVER_ADMISSION_WAIT,
+
+	/* new connections are closed immediately */
+	MRPC_SERVER_ADMISSION_REJECT,
+
+	/* the least recently active idle connection is closed in order to admit new connection.
+	 * New connection is closed immediately if there are no idle connections.
+	 */
+	MRPC_SERVER_ADMISSION_EVICT_IDLE,
+};
+
 /**
  * Creates a rpc server, which can simultaneously service up to max_stream_processors client connections.
  * The returned rpc server must be started using the mrpc_server_start() before it will process client's requests.
@@ -30,12 +54,107 @@ MRPC_API void mrpc_server_delete(struct mrpc_server *server);
  */
 MRPC_API void mrpc_server_start(struct mrpc_server *server, mrpc_server_stream_handler stream_handler, void *service_ctx, struct ff_stream_acceptor *stream_acceptor);
 
+/**
+ * Enables or disables inline processing of requests, which fit into a single packet.
+ * Such requests are handled directly by the fiber reading packets from the connection
+ * instead of a separate fiber, so the most common case of small requests
+ * avoids fiber creation and context switches.
+ * The connection doesn't read new packets while the request is handled, so use this mode
+ * only for stream handlers, which are fast, don't block and send small responses.
+ * If the response exceeds the flow control window, then reading from the connection
+ * is handed off to a new fiber while the handler waits for credits from the client.
+ * Stream handlers must call the mrpc_server_stream_handler_prepare_to_block() before other blocking waits,
+ * otherwise the request can stall the connection. Generated stream handlers do this before waiting
+ * for queued method limits and before executing blocking methods in the thread pool.
+ * Inline requests occupy execution slots limited by the mrpc_server_set_fair_scheduling(), so requests
+ * are handled inline only while there are free slots. Otherwise they wait for their turn in a separate fiber.
+ * Inline processing is disabled by default.
+ * This function must be called before the mrpc_server_start().
+ */
+MRPC_API void mrpc_server_set_inline_requests(struct mrpc_server *server, int is_enabled);
+
+/**
+ * Sets the policy for coalescing flushes of packets sent over the server's connections.
+ * By default packets are flushed as soon as there are no more packets to send, so each packet
+ * can result in a separate network segment under moderate load. Non-zero flush_delay allows
+ * delaying the flush for up to flush_delay milliseconds since the first unflushed packet, unless
+ * flush_threshold bytes are accumulated. Packets the remote side can be blocked on
+ * (such as flow control credits) are always flushed immediately.
+ * Flush delay increases latency of lone requests, so use it only for throughput-oriented traffic.
+ * Defaults are MRPC_DEFAULT_FLUSH_DELAY and MRPC_DEFAULT_FLUSH_THRESHOLD.
+ * This function must be called before the mrpc_server_start().
+ */
+MRPC_API void mrpc_server_set_flush_policy(struct mrpc_server *server, int flush_delay, int flush_threshold);
+
+/**
+ * Sets the timeout (in milliseconds) of inactivity, after which the server's connections hibernate,
+ * i.e. free idle request streams and packet buffers. They are allocated again on demand,
+ * so hibernation reduces memory usage of large number of mostly idle connections.
+ * The default is MRPC_DEFAULT_HIBERNATION_TIMEOUT.
+ * This function must be called before the mrpc_server_start().
+ */
+MRPC_API void mrpc_server_set_hibernation_timeout(struct mrpc_server *server, int hibernation_timeout);
+
+/**
+ * Enables load shedding for the server's connections, so overloaded connections reject new requests
+ * early instead of queueing them. Rejected requests receive an empty response, which is reported
+ * by the mrpc_client_is_server_overloaded() on the client side, so the client can retry the request later
+ * or send it to another server.
+ * A request is rejected in the following cases:
+ * - the number of in-flight requests on the connection reaches max_inflight_requests;
+ * - the number of in-flight requests on the connection stays at or above target_inflight_requests
+ *   for a long time, i.e. requests form a standing queue instead of short bursts;
+ * - target_inflight_requests isn't zero and packet buffers exceed the limit set by the mrpc_memory_set_packets_limit().
+ * Zero values disable the corresponding checks. Load shedding is disabled by default.
+ * Stream handlers mustn't send empty responses if load shedding is used.
+ * This function must be called before the mrpc_server_start().
+ */
+MRPC_API void mrpc_server_set_load_shedding(struct mrpc_server *server, int max_inflight_requests, int target_inflight_requests);
+
+/**
+ * Sets the admission_policy for new connections accepted when the server has max_stream_processors
+ * active connections (see mrpc_server_create()). The default policy is MRPC_SERVER_ADMISSION_WAIT.
+ * Connections without in-flight requests, which didn't receive data for more than idle_timeout milliseconds,
+ * are closed. Zero idle_timeout disables closing idle connections (the default).
+ * Only connections without in-flight requests, which didn't receive data for at least 100 milliseconds,
+ * can be evicted by the MRPC_SERVER_ADMISSION_EVICT_IDLE policy. Idle time is measured with this granularity.
+ * This function must be called before the mrpc_server_start().
+ */
+MRPC_API void mrpc_server_set_admission_policy(struct mrpc_server *server, enum mrpc_server_admission_policy admission_policy, int idle_timeout);
+
+/**
+ * Limits the number of simultaneously running stream handlers to max_active_handlers_cnt.
+ * Requests exceeding the limit wait for free execution slots, which are shared among connections
+ * using deficit round-robin, so a single connection flooding the server with requests cannot
+ * increase latency of requests from other connections.
+ * Each connection receives execution slots proportionally to its weight returned
+ * by the connection_weight_func, which is called for each accepted connection.
+ * All connections have equal weights if connection_weight_func is NULL.
+ * Pending requests of a connection are executed in the order of priorities set by the client
+ * (see mrpc_client_create_request_stream_with_priority()).
+ * Requests handled inline (see mrpc_server_set_inline_requests()) are counted against this limit too.
+ * Zero max_active_handlers_cnt means unlimited number of simultaneously running stream handlers (the default).
+ * The limit must be large enough, so stream handlers waiting for other requests to the same server cannot deadlock.
+ * This function must be called before the mrpc_server_start().
+ */
+MRPC_API void mrpc_server_set_fair_scheduling(struct mrpc_server *server, int max_active_handlers_cnt, mrpc_server_connection_weight_func connection_weight_func);
+
 /**
  * Stops the given server.
  * This function waits while the server will stop and returns only when the server is stopped.
  */
 MRPC_API void mrpc_server_stop(struct mrpc_server *server);
 
+/**
+ * Gracefully stops the given server.
+ * The server stops accepting new connections and notifies clients that they must send new requests
+ * over new connections. Connections are closed as soon as they complete their in-flight requests.
+ * Connections, which didn't complete in-flight requests during drain_timeout milliseconds,
+ * are closed the same way as in the mrpc_server_stop().
+ * This function returns only when the server is stopped.
+ */
+MRPC_API void mrpc_server_drain(struct mrpc_server *server, int drain_timeout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,6 +14,15 @@ extern "C" {
  */
 typedef enum ff_result (*mrpc_server_stream_handler)(struct ff_stream *stream, void *service_ctx);
 
+/**
+ * Notifies the server, that the stream handler is going to block while handling the request
+ * from the given stream (for example, it waits for a free slot of the method limit or for the thread pool).
+ * If the request is handled inline by the fiber reading from the connection (see mrpc_server_set_inline_requests()),
+ * then reading from the connection is handed off to a new fiber, so other requests on the connection
+ * aren't stalled while the handler blocks. Otherwise the function does nothing.
+ */
+MRPC_API void mrpc_server_stream_handler_prepare_to_block(struct ff_stream *stream);
+
 #ifdef __cplusplus
 }
 #endif
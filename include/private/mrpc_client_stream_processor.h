@@ -2,6 +2,7 @@
 #define MRPC_CLIENT_STREAM_PROCESSOR_PRIVATE_H
 
 #include "private/mrpc_common.h"
+#include "mrpc/mrpc_client.h"
 #include "ff/ff_stream.h"
 
 #ifdef __cplusplus
@@ -29,6 +30,52 @@ void mrpc_client_stream_processor_delete(struct mrpc_client_stream_processor *st
  */
 void mrpc_client_stream_processor_process_stream(struct mrpc_client_stream_processor *stream_processor, struct ff_stream *stream);
 
+/**
+ * Sets the flush policy for packets written by the given stream_processor.
+ * Written packets are flushed after the writer queue becomes empty and either flush_delay milliseconds
+ * passed since the first unflushed packet or flush_threshold bytes are accumulated.
+ * Zero flush_delay means that packets are flushed as soon as the writer queue becomes empty.
+ */
+void mrpc_client_stream_processor_set_flush_policy(struct mrpc_client_stream_processor *stream_processor, int flush_delay, int flush_threshold);
+
+/**
+ * Sets the timeout (in milliseconds) of the connection's inactivity, after which the given stream_processor
+ * frees idle request streams and trims packet buffers.
+ */
+void mrpc_client_stream_processor_set_hibernation_timeout(struct mrpc_client_stream_processor *stream_processor, int hibernation_timeout);
+
+/**
+ * Starts a batch of packets written by the given stream_processor.
+ * Packets of batched request streams aren't flushed until the matching mrpc_client_stream_processor_end_batch() call,
+ * unless they exceed the flush_threshold or packets of other request streams are flushed.
+ * Multiple batches can be active simultaneously.
+ */
+void mrpc_client_stream_processor_begin_batch(struct mrpc_client_stream_processor *stream_processor);
+
+/**
+ * Ends the batch started by the mrpc_client_stream_processor_begin_batch().
+ * Accumulated packets are flushed even if other batches are active.
+ */
+void mrpc_client_stream_processor_end_batch(struct mrpc_client_stream_processor *stream_processor);
+
+/**
+ * Returns the number of active request streams created by the given stream_processor,
+ * i.e. the number of in-flight requests over its connection.
+ */
+int mrpc_client_stream_processor_get_active_request_streams_cnt(struct mrpc_client_stream_processor *stream_processor);
+
+/**
+ * Returns non-zero if the given stream is an active request stream created by the given stream_processor.
+ */
+int mrpc_client_stream_processor_has_request_stream(struct mrpc_client_stream_processor *stream_processor, struct ff_stream *stream);
+
+/**
+ * Returns non-zero if the last read from the given request stream failed,
+ * because the server rejected the request due to overload.
+ * The stream must be an active request stream created by the given stream_processor.
+ */
+int mrpc_client_stream_processor_is_request_stream_server_overloaded(struct mrpc_client_stream_processor *stream_processor, struct ff_stream *stream);
+
 /**
  * Notifies the stream_processor, that it should be stopped.
  * This function is used for unblocking the mrpc_client_stream_processor_process_stream() function.
@@ -38,11 +85,17 @@ void mrpc_client_stream_processor_process_stream(struct mrpc_client_stream_proce
 void mrpc_client_stream_processor_stop_async(struct mrpc_client_stream_processor *stream_processor);
 
 /**
- * Creates stream for sending rpc requests.
- * This stream must be deleted using ff_stream_delete().
+ * Creates stream for sending rpc requests with the given priority.
+ * If is_batched is non-zero, then packets of the stream are delayed while batches are active
+ * (see mrpc_client_stream_processor_begin_batch()).
+ * If response_handler is NULL, then this stream must be deleted using ff_stream_delete().
+ * Otherwise the response_handler(stream, response_handler_ctx) is called in a separate fiber
+ * after the request is flushed and the first packet of the response is received (or the connection is closed).
+ * See mrpc_client_create_async_request_stream() for details.
  * Returns request stream on success, NULL on error.
  */
-struct ff_stream *mrpc_client_stream_processor_create_request_stream(struct mrpc_client_stream_processor *stream_processor);
+struct ff_stream *mrpc_client_stream_processor_create_request_stream(struct mrpc_client_stream_processor *stream_processor, enum mrpc_priority priority,
+	int is_batched, mrpc_client_response_handler response_handler, void *response_handler_ctx);
 
 #ifdef __cplusplus
 }
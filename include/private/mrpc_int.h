@@ -7,6 +7,25 @@
 extern "C" {
 #endif
 
+/**
+ * The maximum number of bytes, which can be written by the mrpc_uint32_encode().
+ */
+#define MRPC_UINT32_MAX_ENCODED_SIZE 5
+
+/**
+ * Encodes the given data into the buf in the same way as the mrpc_uint32_serialize() does,
+ * but without going through the ff_stream interface.
+ * The buf must have enough space for holding MRPC_UINT32_MAX_ENCODED_SIZE bytes.
+ * Returns the number of bytes written into the buf.
+ */
+int mrpc_uint32_encode(uint32_t data, char *buf);
+
+/**
+ * Decodes uint32 data encoded by the mrpc_uint32_encode() from the buf containing len bytes.
+ * Returns the number of bytes decoded on success, 0 if the buf doesn't contain the whole
+ * encoded value yet, -1 if the encoded value is invalid.
+ */
+int mrpc_uint32_decode(uint32_t *data, const char *buf, int len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,76 @@
+#ifndef MRPC_MEMORY_PRIVATE_H
+#define MRPC_MEMORY_PRIVATE_H
+
+#include "private/mrpc_common.h"
+#include "mrpc/mrpc_memory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Functions declared in this header are exported from the library, so the pool of packet buffers
+ * can be unit-tested without establishing rpc connections.
+ */
+
+/**
+ * Acquires a reference to the process-wide pool of packet buffers.
+ * The pool is created on the first call.
+ * Packet buffers can be acquired only while the caller holds the reference.
+ */
+MRPC_API void mrpc_memory_acquire(void);
+
+/**
+ * Releases the reference acquired by the mrpc_memory_acquire().
+ * The pool is deleted when the last reference is released.
+ * All the packet buffers must be released before this call.
+ */
+MRPC_API void mrpc_memory_release(void);
+
+/**
+ * Acquires a packet buffer, which can hold at least size bytes.
+ * Buffers are allocated from a few size classes, so the actual buffer's size
+ * is stored into the capacity. It can exceed the size.
+ * Buffers are aligned to the cache line size.
+ * Always returns correct result.
+ */
+MRPC_API char *mrpc_memory_acquire_packet_buf(int size, int *capacity);
+
+/**
+ * Releases the buffer acquired by the mrpc_memory_acquire_packet_buf().
+ * capacity must be in the range between the size passed to the mrpc_memory_acquire_packet_buf()
+ * and the capacity returned by it.
+ */
+MRPC_API void mrpc_memory_release_packet_buf(char *buf, int capacity);
+
+/**
+ * Waits while memory occupied by packet buffers exceeds the limit set by the mrpc_memory_set_packets_limit().
+ * The wait is limited by the timeout set by the mrpc_memory_set_throttle_timeout(), so connections cannot deadlock if all the memory
+ * is occupied by packets, which can be released only after reading new packets.
+ * Returns FF_SUCCESS if the memory is below the limit, FF_FAILURE if the limit is still exceeded
+ * after the timeout. In this case the caller must close the connection instead of reading new packets.
+ */
+MRPC_API enum ff_result mrpc_memory_throttle(void);
+
+/**
+ * Returns non-zero if memory occupied by packet buffers exceeds the limit set by the mrpc_memory_set_packets_limit().
+ */
+MRPC_API int mrpc_memory_is_over_limit(void);
+
+/**
+ * Frees memory blocks, which contain only free packet buffers.
+ * Blocks with buffers in use are kept.
+ */
+MRPC_API void mrpc_memory_trim(void);
+
+/**
+ * Returns the number of bytes in memory blocks allocated for packet buffers,
+ * including free buffers kept for reuse.
+ */
+MRPC_API int mrpc_memory_get_allocated_bytes(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef MRPC_METHOD_LIMITS_PRIVATE_H
+#define MRPC_METHOD_LIMITS_PRIVATE_H
+
+#include "mrpc/mrpc_method_limits.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,6 +2,7 @@
 #define MRPC_PACKET_PRIVATE_H
 
 #include "private/mrpc_common.h"
+#include "private/mrpc_protocol.h"
 #include "ff/ff_stream.h"
 
 #ifdef __cplusplus
@@ -18,33 +19,65 @@ enum mrpc_packet_type
 
 struct mrpc_packet;
 
+struct mrpc_packet_arena;
+
 /**
- * Creates a packet.
+ * Creates a packet, which can hold up to max_size bytes of data.
+ * The packet is serialized and read from streams according to the given protocol_version.
+ * max_size mustn't exceed the maximum packet size for the given protocol_version.
  * Always returns correct result.
  */
-struct mrpc_packet *mrpc_packet_create();
+struct mrpc_packet *mrpc_packet_create(enum mrpc_protocol_version protocol_version, int max_size);
 
 /**
- * Deletes the packet.
+ * Deletes the packet created by the mrpc_packet_create().
  */
 void mrpc_packet_delete(struct mrpc_packet *packet);
 
+/**
+ * Creates an arena for packets, which can hold up to max_size bytes of data.
+ * Packet headers are allocated contiguously in memory blocks. Packet buffers
+ * are acquired from the process-wide pool (see mrpc_memory.h), so small packets don't occupy max_size bytes
+ * and idle buffers are shared among all the connections.
+ * Buffers are attached to packets on demand and are released by the mrpc_packet_reset().
+ * Packets acquired from the arena are serialized and read from streams
+ * according to the given protocol_version.
+ * Always returns correct result.
+ */
+struct mrpc_packet_arena *mrpc_packet_arena_create(enum mrpc_protocol_version protocol_version, int max_size);
+
+/**
+ * Deletes the arena and frees memory occupied by all the packets acquired from the arena.
+ * The packets mustn't be used after this call.
+ */
+void mrpc_packet_arena_delete(struct mrpc_packet_arena *arena);
+
+/**
+ * Acquires new packet from the arena.
+ * Packets acquired from the arena cannot be deleted individually, so the arena
+ * should be used in conjunction with a pool of packets (for instance, ff_pool).
+ * Always returns correct result.
+ */
+struct mrpc_packet *mrpc_packet_arena_acquire_packet(struct mrpc_packet_arena *arena);
+
+
 /**
  * Resets the packet, so it can be used again for either
  * reading data from the stream by using the mrpc_packet_read_from_stream()
- * either writing data into the packet by using the mrpc_packet_write_data().
+ * either writing data into the packet by using the mrpc_packet_get_write_window().
+ * Buffers of packets acquired from an arena are released to the process-wide pool.
  */
 void mrpc_packet_reset(struct mrpc_packet *packet);
 
 /**
  * Returns the packet's request_id
  */
-uint8_t mrpc_packet_get_request_id(struct mrpc_packet *packet);
+uint32_t mrpc_packet_get_request_id(struct mrpc_packet *packet);
 
 /**
  * Sets the packet's request_id.
  */
-void mrpc_packet_set_request_id(struct mrpc_packet *packet, uint8_t request_id);
+void mrpc_packet_set_request_id(struct mrpc_packet *packet, uint32_t request_id);
 
 /**
  * Returns the packet's type.
@@ -57,28 +90,82 @@ enum mrpc_packet_type mrpc_packet_get_type(struct mrpc_packet *packet);
 void mrpc_packet_set_type(struct mrpc_packet *packet, enum mrpc_packet_type type);
 
 /**
- * Reads up to len bytes from the packet into the buf.
- * Returns the number of bytes read. It can be in the range 0..len.
+ * Returns the size of data in the packet.
  */
-int mrpc_packet_read_data(struct mrpc_packet *packet, void *buf, int len);
+int mrpc_packet_get_size(struct mrpc_packet *packet);
 
 /**
- * Writes up to len bytes from the buf into the packet.
- * Returns the number of bytes written. It can be in the range 0..len.
+ * Returns the next packet in the intrusive list of packets, which contains the given packet.
+ * A packet can belong to only one such list at a time.
  */
-int mrpc_packet_write_data(struct mrpc_packet *packet, const void *buf, int len);
+struct mrpc_packet *mrpc_packet_get_next(struct mrpc_packet *packet);
 
 /**
- * Read the next packet contents from the stream into the packet.
- * Returns FF_SUCCESS on success, FF_FAILURE on error.
+ * Sets the next packet in the intrusive list of packets.
  */
-enum ff_result mrpc_packet_read_from_stream(struct mrpc_packet *packet, struct ff_stream *stream);
+void mrpc_packet_set_next(struct mrpc_packet *packet, struct mrpc_packet *next);
 
 /**
- * Writes the packet contents to the stream.
+ * Returns the pointer to unread data in the packet and stores the pointer
+ * to the end of this data into the limit.
+ * The data can be consumed directly from the packet's memory.
+ * There is no need in reporting the number of consumed bytes back to the packet,
+ * because the packet is reset with mrpc_packet_reset() after it has been read.
+ */
+const char *mrpc_packet_get_read_window(struct mrpc_packet *packet, const char **limit);
+
+/**
+ * Returns the pointer to free space in the packet and stores the pointer
+ * to the end of this space into the limit.
+ * The space can be extended by the mrpc_packet_grow().
+ * Data can be written directly into the packet's memory. The end of written data
+ * must be reported back to the packet using the mrpc_packet_commit_write_window().
+ */
+char *mrpc_packet_get_write_window(struct mrpc_packet *packet, char **limit);
+
+/**
+ * Sets the end of data written into the window returned by the mrpc_packet_get_write_window().
+ */
+void mrpc_packet_commit_write_window(struct mrpc_packet *packet, const char *pos);
+
+/**
+ * Promotes the packet's buffer to the bigger one, so more data can be written into the packet.
+ * Data written into the packet is preserved, but the packet's buffer can be moved,
+ * so the write window must be obtained again via the mrpc_packet_get_write_window().
+ * The end of data written into the previous window must be committed before this call.
+ * Returns non-zero on success, zero if the packet already can hold the maximum packet size.
+ */
+int mrpc_packet_grow(struct mrpc_packet *packet);
+
+/**
+ * Returns the maximum number of bytes, which can be written
+ * into the buffer by the mrpc_packet_serialize() for the given packet.
+ */
+int mrpc_packet_get_serialized_size(struct mrpc_packet *packet);
+
+/**
+ * Serializes the packet (header and body) into the buf.
+ * The buf must have enough space for holding mrpc_packet_get_serialized_size() bytes.
+ * This function allows to pack multiple packets into a single buffer, which then can be written
+ * to the underlying stream with a single ff_stream_write() call.
+ * Returns the number of bytes written into the buf.
+ */
+int mrpc_packet_serialize(struct mrpc_packet *packet, char *buf);
+
+/**
+ * Copies contents of the src packet into the empty dst packet.
+ * The dst packet must be able to hold all the data from the src packet.
+ */
+void mrpc_packet_copy(struct mrpc_packet *dst, struct mrpc_packet *src);
+
+/**
+ * Read the next packet contents from the stream into the packet.
+ * The MRPC_PROTOCOL_V2 framing doesn't distinguish MRPC_PACKET_START and MRPC_PACKET_SINGLE packets
+ * from MRPC_PACKET_MIDDLE and MRPC_PACKET_END packets, so packets read using this framing
+ * always have either MRPC_PACKET_MIDDLE or MRPC_PACKET_END type.
  * Returns FF_SUCCESS on success, FF_FAILURE on error.
  */
-enum ff_result mrpc_packet_write_to_stream(struct mrpc_packet *packet, struct ff_stream *stream);
+enum ff_result mrpc_packet_read_from_stream(struct mrpc_packet *packet, struct ff_stream *stream);
 
 #ifdef __cplusplus
 }
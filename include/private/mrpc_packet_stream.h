@@ -3,7 +3,6 @@
 
 #include "private/mrpc_common.h"
 #include "private/mrpc_packet.h"
-#include "ff/ff_blocking_queue.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,21 +20,36 @@ typedef struct mrpc_packet *(*mrpc_packet_stream_acquire_packet_func)(void *pack
  */
 typedef void (*mrpc_packet_stream_release_packet_func)(void *packet_func_ctx, struct mrpc_packet *packet);
 
+/**
+ * This callback must send the given packet to the remote side and release it afterwards.
+ * The callback takes ownership of the packet.
+ * If is_flush_required isn't zero, then the packet must be flushed without delay,
+ * since the remote side can be blocked awaiting for it.
+ */
+typedef void (*mrpc_packet_stream_write_packet_func)(void *packet_func_ctx, struct mrpc_packet *packet, int is_flush_required);
+
 struct mrpc_packet_stream;
 
+/**
+ * This callback is called before the mrpc_packet_stream_write() blocks awaiting for credits
+ * from the remote side for the given stream. Credits are pushed to the stream by the reader of the connection,
+ * so the callback must ensure the reader isn't blocked by the caller.
+ */
+typedef void (*mrpc_packet_stream_wait_for_credits_func)(void *packet_func_ctx, struct mrpc_packet_stream *stream);
+
 /**
  * Creates packet stream.
- * writer_queue is used for pushing packets written by the mrpc_packet_stream_write() and mrpc_packet_stream_flush().
- * packets from the writer_queue must be deleted using the same technique as used by
- * the mrpc_packet_stream_release_packet_func() callback.
- * max_reader_queue_size is the maximum number of packets, which can be accumulated in the reader queue
- * by calling the mrpc_packet_stream_push_packet() function.
- * acquire_packet_func and release_packet_func are used for acquiring packets for pushing them into the writer_queue
+ * write_packet_func is used for sending packets written by the mrpc_packet_stream_write() and mrpc_packet_stream_flush().
+ * Credit packets, which allow the remote side to send more data, are sent via the write_packet_func
+ * by the mrpc_packet_stream_read().
+ * acquire_packet_func and release_packet_func are used for acquiring packets for sending them via the write_packet_func
  * and releasing packets pushed to the mrpc_packet_stream_push_packet() function.
+ * wait_for_credits_func can be NULL.
  * Always returns correct result.
  */
-struct mrpc_packet_stream *mrpc_packet_stream_create(struct ff_blocking_queue *writer_queue, int max_reader_queue_size,
-	mrpc_packet_stream_acquire_packet_func acquire_packet_func, mrpc_packet_stream_release_packet_func release_packet_func, void *packet_func_ctx);
+struct mrpc_packet_stream *mrpc_packet_stream_create(mrpc_packet_stream_write_packet_func write_packet_func,
+	mrpc_packet_stream_acquire_packet_func acquire_packet_func, mrpc_packet_stream_release_packet_func release_packet_func,
+	mrpc_packet_stream_wait_for_credits_func wait_for_credits_func, void *packet_func_ctx);
 
 /**
  * Deletes the given stream.
@@ -44,10 +58,12 @@ void mrpc_packet_stream_delete(struct mrpc_packet_stream *stream);
 
 /**
  * Initializes the given stream and associates it with the given request_id.
+ * If is_flow_control_enabled is zero, then the stream neither sends nor expects credits.
+ * This is required for connections, which didn't negotiate the MRPC_PROTOCOL_FEATURE_CREDITS.
  * This function must be called before starting reading / writing to the stream.
  * It is usually called after mrpc_packet_stream_create() or mrpc_packet_stream_shutdown() calls.
  */
-void mrpc_packet_stream_initialize(struct mrpc_packet_stream *stream, uint8_t request_id);
+void mrpc_packet_stream_initialize(struct mrpc_packet_stream *stream, uint32_t request_id, int is_flow_control_enabled);
 
 /**
  * Shutdowns the given stream.
@@ -62,8 +78,30 @@ void mrpc_packet_stream_shutdown(struct mrpc_packet_stream *stream);
  */
 enum ff_result mrpc_packet_stream_read(struct mrpc_packet_stream *stream, void *buf, int len);
 
+/**
+ * Skips all the data, which wasn't read from the stream yet, up to the end of the stream.
+ * Returns FF_SUCCESS on success, FF_FAILURE on error.
+ */
+enum ff_result mrpc_packet_stream_skip_read_data(struct mrpc_packet_stream *stream);
+
+/**
+ * Skips the data, which has been already pushed to the stream, without waiting for the rest of the stream.
+ * Consumed packets are credited to the remote side, so it can send the rest of the stream.
+ * Sets is_end to 1 if the end of the stream has been reached, otherwise sets it to 0.
+ * Returns FF_SUCCESS on success, FF_FAILURE on error.
+ */
+enum ff_result mrpc_packet_stream_skip_pushed_data(struct mrpc_packet_stream *stream, int *is_end);
+
+/**
+ * Returns non-zero if the remote side finished the stream without sending any data.
+ * The result is valid only after the first mrpc_packet_stream_read() call.
+ * Servers respond with empty streams to requests rejected due to overload.
+ */
+int mrpc_packet_stream_is_empty(struct mrpc_packet_stream *stream);
+
 /**
  * Writes exactly len bytes from the buf into the stream.
+ * If the flow control is enabled, then it blocks if the remote side didn't grant enough credits for sending the data.
  * It cannot be called after the mrpc_packet_stream_flush() call.
  * Returns FF_SUCCESS on success, FF_FAILURE on error.
  */
@@ -71,23 +109,36 @@ enum ff_result mrpc_packet_stream_write(struct mrpc_packet_stream *stream, const
 
 /**
  * Flushes the write buffer of the stream.
- * It can be called only after at least single successful call to the mrpc_packet_stream_write().
+ * If nothing has been written into the stream, then an empty packet is flushed.
  * It cannot be called multiple times.
- * Returns FF_SUCCESS on success, FF_FAILURE on error.
+ * Returns FF_SUCCESS on success, FF_FAILURE on error, including the case when the stream
+ * has been disconnected, so the flushed data won't be delivered.
  */
 enum ff_result mrpc_packet_stream_flush(struct mrpc_packet_stream *stream);
 
 /**
- * Unblocks pending and subsequent mrpc_packet_stream_read() calls.
+ * Unblocks pending and subsequent mrpc_packet_stream_read() and mrpc_packet_stream_write() calls.
  */
 void mrpc_packet_stream_disconnect(struct mrpc_packet_stream *stream);
 
 /**
- * Pushes the given packet to the reader queue of the given stream.
+ * Pushes the given packet to the list of unread packets of the given stream.
+ * Credit packets aren't pushed to this list. Instead they unblock
+ * mrpc_packet_stream_write() calls waiting for credits.
  * The packet must be allocated using the same technique as used by the mrpc_packet_stream_acquire_packet_func() callback
  * passed to the mrpc_packet_stream_create() function.
+ * The stream takes ownership of the packet even if the function fails.
+ * Returns FF_SUCCESS on success, FF_FAILURE if the remote side violated the flow control protocol.
+ */
+enum ff_result mrpc_packet_stream_push_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet);
+
+/**
+ * Returns non-zero if the given packet is a credit packet.
+ * Credit packets are sent only over connections with the flow control enabled.
+ * They can be received for already released packet streams,
+ * so they should be silently dropped in this case.
  */
-void mrpc_packet_stream_push_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet);
+int mrpc_packet_stream_is_credit_packet(struct mrpc_packet *packet);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,146 @@
+#ifndef MRPC_PROTOCOL_PRIVATE_H
+#define MRPC_PROTOCOL_PRIVATE_H
+
+#include "private/mrpc_common.h"
+#include "ff/ff_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum mrpc_protocol_version
+{
+	/* the original protocol with 1-byte request_id, 2-bit packet types and packets up to 4095 bytes.
+	 * It is used if the remote side doesn't support the handshake.
+	 */
+	MRPC_PROTOCOL_V1 = 1,
+
+	/* the protocol with variable-length request_id, packets up to 64Kb
+	 * and only the 'end of stream' flag instead of packet types.
+	 */
+	MRPC_PROTOCOL_V2 = 2
+};
+
+/**
+ * The maximum packet size for the MRPC_PROTOCOL_V1.
+ */
+#define MRPC_PROTOCOL_V1_MAX_PACKET_SIZE ((1 << 12) - 1)
+
+/**
+ * The maximum number of simultaneously running requests per connection for the MRPC_PROTOCOL_V1.
+ * This number is limited by the size of request_id field (1 byte) in the packet header.
+ */
+#define MRPC_PROTOCOL_V1_MAX_REQUEST_STREAMS_CNT 0x100
+
+/**
+ * The maximum packet size for the MRPC_PROTOCOL_V2.
+ */
+#define MRPC_PROTOCOL_V2_MAX_PACKET_SIZE ((1 << 16) - 1)
+
+/**
+ * The maximum number of simultaneously running requests per connection for the MRPC_PROTOCOL_V2.
+ * This limit is artificial. It limits the amount of memory, which can be occupied
+ * by a single connection.
+ */
+#define MRPC_PROTOCOL_V2_MAX_REQUEST_STREAMS_CNT 0x1000
+
+/**
+ * The maximum packet size among all the supported protocol versions.
+ */
+#define MRPC_PROTOCOL_MAX_PACKET_SIZE MRPC_PROTOCOL_V2_MAX_PACKET_SIZE
+
+/**
+ * The maximum number of simultaneously running requests per connection among all the supported protocol versions.
+ */
+#define MRPC_PROTOCOL_MAX_REQUEST_STREAMS_CNT MRPC_PROTOCOL_V2_MAX_REQUEST_STREAMS_CNT
+
+/**
+ * The server can send the GOAWAY control packet, after which the client mustn't send new requests
+ * over the connection and must close it as soon as its in-flight requests are completed.
+ */
+#define MRPC_PROTOCOL_FEATURE_GOAWAY 0x01
+
+/**
+ * Request streams use credit-based flow control (see mrpc_packet_stream.h).
+ * Peers without this feature neither send credits nor accept empty MRPC_PACKET_MIDDLE
+ * packets used as credits, so packet streams work without credits on such connections.
+ */
+#define MRPC_PROTOCOL_FEATURE_CREDITS 0x02
+
+/**
+ * The first byte of each request is the request's priority (see enum mrpc_priority).
+ * The server executes pending requests of the connection and sends responses according to their priorities.
+ * Peers without this feature neither send nor expect the priority, so all their requests
+ * have the MRPC_PRIORITY_NORMAL priority on the server.
+ */
+#define MRPC_PROTOCOL_FEATURE_PRIORITIES 0x04
+
+/**
+ * Optional features supported by this implementation. Features are negotiated during the handshake,
+ * so they are used only if both sides support them.
+ */
+#define MRPC_PROTOCOL_SUPPORTED_FEATURES (MRPC_PROTOCOL_FEATURE_GOAWAY | MRPC_PROTOCOL_FEATURE_CREDITS | MRPC_PROTOCOL_FEATURE_PRIORITIES)
+
+struct mrpc_packet;
+
+/**
+ * Parameters of the connection, which are negotiated during the handshake.
+ */
+struct mrpc_protocol_params
+{
+	enum mrpc_protocol_version version;
+	int max_packet_size;
+	int max_request_streams_cnt;
+
+	/* bitmask of MRPC_PROTOCOL_FEATURE_* flags */
+	int features;
+};
+
+/**
+ * Initializes params with the maximum values supported by the given protocol version.
+ */
+void mrpc_protocol_get_default_params(struct mrpc_protocol_params *params, enum mrpc_protocol_version version);
+
+/**
+ * Performs the client side of the handshake on the given stream.
+ * params must contain parameters proposed by the client. On success they are replaced
+ * by parameters negotiated with the server.
+ * The handshake is sent as MRPC_PROTOCOL_V1 packet, which is rejected by servers,
+ * which don't support the handshake, so they close the connection.
+ * is_rejected is set to non-zero if the handshake has been sent, but the server closed the connection
+ * or responded with invalid handshake. Otherwise the failure is caused by an I/O error
+ * while sending the handshake, so is_rejected is set to zero.
+ * Returns FF_SUCCESS on success, FF_FAILURE on error.
+ */
+enum ff_result mrpc_protocol_client_handshake(struct ff_stream *stream, struct mrpc_protocol_params *params, int *is_rejected);
+
+/**
+ * Performs the server side of the handshake on the given stream.
+ * params must contain parameters supported by the server. On success they are replaced
+ * by parameters negotiated with the client.
+ * If the client doesn't send the handshake, then the MRPC_PROTOCOL_V1 is used
+ * and the first packet read from the client is returned in the first_packet.
+ * The caller is responsible for deleting the first_packet using the mrpc_packet_delete().
+ * Otherwise the first_packet is set to NULL.
+ * Returns FF_SUCCESS on success, FF_FAILURE on error.
+ */
+enum ff_result mrpc_protocol_server_handshake(struct ff_stream *stream, struct mrpc_protocol_params *params, struct mrpc_packet **first_packet);
+
+/**
+ * Writes the GOAWAY control packet into the given empty packet.
+ * Control packets have request_id equal to max_request_streams_cnt, so they cannot be confused
+ * with packets of request streams. The MRPC_PROTOCOL_FEATURE_GOAWAY must be negotiated
+ * for the connection with the given params.
+ */
+void mrpc_protocol_write_goaway(const struct mrpc_protocol_params *params, struct mrpc_packet *packet);
+
+/**
+ * Returns non-zero if the given packet is the GOAWAY control packet.
+ */
+int mrpc_protocol_is_goaway(const struct mrpc_protocol_params *params, struct mrpc_packet *packet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
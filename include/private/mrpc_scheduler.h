@@ -0,0 +1,102 @@
+#ifndef MRPC_SCHEDULER_PRIVATE_H
+#define MRPC_SCHEDULER_PRIVATE_H
+
+#include "private/mrpc_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Function, which is executed by the scheduler.
+ */
+typedef void (*mrpc_scheduler_func)(void *ctx);
+
+struct mrpc_scheduler;
+
+struct mrpc_scheduler_queue;
+
+/**
+ * Task, which can be executed by the scheduler.
+ * Tasks are embedded into structures they process, so the scheduler doesn't allocate memory
+ * for pending tasks. Fields of the task are private to the scheduler.
+ */
+struct mrpc_scheduler_task
+{
+	struct mrpc_scheduler_queue *queue;
+	struct mrpc_scheduler_task *next;
+	mrpc_scheduler_func func;
+	void *ctx;
+	enum mrpc_priority priority;
+};
+
+/**
+ * Creates a scheduler, which executes tasks in separate fibers.
+ * The number of simultaneously executed tasks is unlimited by default.
+ * Always returns correct result.
+ */
+struct mrpc_scheduler *mrpc_scheduler_create();
+
+/**
+ * Deletes the given scheduler.
+ * All the queues of the scheduler must be deleted before deleting the scheduler.
+ */
+void mrpc_scheduler_delete(struct mrpc_scheduler *scheduler);
+
+/**
+ * Sets the maximum number of simultaneously executed tasks for the given scheduler.
+ * Tasks exceeding this limit are queued in their queues. Pending tasks are executed
+ * in deficit round-robin order across queues, so each queue receives a share of execution slots
+ * proportional to its weight, regardless of the number of its pending tasks.
+ * Zero max_active_tasks_cnt means unlimited number of simultaneously executed tasks.
+ * This function can be called only if there are no pending tasks.
+ */
+void mrpc_scheduler_set_max_active_tasks(struct mrpc_scheduler *scheduler, int max_active_tasks_cnt);
+
+/**
+ * Creates a queue of tasks for the given scheduler.
+ * The queue's weight is 1 by default.
+ * Always returns correct result.
+ */
+struct mrpc_scheduler_queue *mrpc_scheduler_queue_create(struct mrpc_scheduler *scheduler);
+
+/**
+ * Deletes the given queue. The queue mustn't contain pending tasks.
+ */
+void mrpc_scheduler_queue_delete(struct mrpc_scheduler_queue *queue);
+
+/**
+ * Sets the weight of the given queue, i.e. the number of tasks, which can be executed from the queue
+ * in a single round of the deficit round-robin. The weight must be positive.
+ */
+void mrpc_scheduler_queue_set_weight(struct mrpc_scheduler_queue *queue, int weight);
+
+/**
+ * Executes func(ctx) in a separate fiber as soon as the scheduler has a free execution slot.
+ * Pending tasks of the queue with higher priority are executed before pending tasks with lower priority.
+ * The priority doesn't change the share of execution slots received by the queue.
+ * The task must remain valid until the func is called.
+ * This function returns immediately.
+ */
+void mrpc_scheduler_queue_execute(struct mrpc_scheduler_queue *queue, struct mrpc_scheduler_task *task, enum mrpc_priority priority,
+	mrpc_scheduler_func func, void *ctx);
+
+/**
+ * Acquires a free execution slot of the scheduler for a task, which is executed by the caller's fiber.
+ * Returns non-zero on success. Returns zero if all the execution slots are occupied, so the task must be
+ * executed via the mrpc_scheduler_queue_execute() in order to wait for its turn.
+ * The acquired slot must be released by the mrpc_scheduler_queue_release_slot().
+ */
+int mrpc_scheduler_queue_try_acquire_slot(struct mrpc_scheduler_queue *queue);
+
+/**
+ * Releases the execution slot acquired by the mrpc_scheduler_queue_try_acquire_slot().
+ * The slot is passed to the next pending task if there is any.
+ */
+void mrpc_scheduler_queue_release_slot(struct mrpc_scheduler_queue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
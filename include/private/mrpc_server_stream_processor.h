@@ -3,6 +3,7 @@
 
 #include "private/mrpc_common.h"
 #include "private/mrpc_server_stream_handler.h"
+#include "private/mrpc_scheduler.h"
 #include "ff/ff_stream.h"
 
 #ifdef __cplusplus
@@ -27,10 +28,11 @@ typedef void (*mrpc_server_stream_processor_release_id_func)(void *release_id_fu
  * Creates a stream processor.
  * release_func will be called when the given stream processor has been stopped.
  * release_id_func will be called at the beginning of the mrpc_server_stream_processor_delete()
+ * Requests are executed by the given scheduler, which must outlive the stream processor.
  * Alwasy returns correct result.
  */
 struct mrpc_server_stream_processor *mrpc_server_stream_processor_create(mrpc_server_stream_processor_release_func release_func, void *release_func_ctx,
-	mrpc_server_stream_processor_release_id_func release_id_func, void *release_id_func_ctx, int id);
+	mrpc_server_stream_processor_release_id_func release_id_func, void *release_id_func_ctx, int id, struct mrpc_scheduler *scheduler);
 
 /**
  * Deletes the given stream_processor.
@@ -41,8 +43,42 @@ void mrpc_server_stream_processor_delete(struct mrpc_server_stream_processor *st
 /**
  * Starts processing the given stream using the given stream_processor, stream_handler and service_ctx.
  * stream_handler and service_ctx are used for handling rpc at server side.
+ * If is_inline_requests_enabled isn't zero, then requests, which fit into a single packet,
+ * are handled by the fiber reading packets from the stream.
  */
-void mrpc_server_stream_processor_start(struct mrpc_server_stream_processor *stream_processor, mrpc_server_stream_handler stream_handler, void *service_ctx, struct ff_stream *stream);
+void mrpc_server_stream_processor_start(struct mrpc_server_stream_processor *stream_processor, mrpc_server_stream_handler stream_handler, void *service_ctx,
+	struct ff_stream *stream, int is_inline_requests_enabled);
+
+/**
+ * Sets the flush policy for packets written by the given stream_processor.
+ * Written packets are flushed after the writer queue becomes empty and either flush_delay milliseconds
+ * passed since the first unflushed packet or flush_threshold bytes are accumulated.
+ * Zero flush_delay means that packets are flushed as soon as the writer queue becomes empty.
+ */
+void mrpc_server_stream_processor_set_flush_policy(struct mrpc_server_stream_processor *stream_processor, int flush_delay, int flush_threshold);
+
+/**
+ * Sets the timeout (in milliseconds) of the connection's inactivity, after which the given stream_processor
+ * frees idle request streams and trims packet buffers.
+ */
+void mrpc_server_stream_processor_set_hibernation_timeout(struct mrpc_server_stream_processor *stream_processor, int hibernation_timeout);
+
+/**
+ * Sets load shedding parameters for the given stream_processor.
+ * New requests are rejected with an empty response if the number of in-flight requests reaches max_inflight_requests.
+ * If target_inflight_requests isn't zero, then new requests are also rejected when the number of in-flight requests
+ * doesn't drop below target_inflight_requests for a long time (i.e. there is a standing queue of requests)
+ * or when packet buffers exceed the memory limit.
+ * Zero values disable the corresponding checks.
+ */
+void mrpc_server_stream_processor_set_load_shedding(struct mrpc_server_stream_processor *stream_processor, int max_inflight_requests, int target_inflight_requests);
+
+/**
+ * Sets the weight of the given stream_processor in the scheduler passed to the mrpc_server_stream_processor_create().
+ * The stream_processor receives execution slots for its requests proportionally to its weight
+ * when the scheduler is saturated. This function must be called before the mrpc_server_stream_processor_start().
+ */
+void mrpc_server_stream_processor_set_weight(struct mrpc_server_stream_processor *stream_processor, int weight);
 
 /**
  * Notifies the stream_processor to stop ASAP.
@@ -53,12 +89,36 @@ void mrpc_server_stream_processor_start(struct mrpc_server_stream_processor *str
  */
 void mrpc_server_stream_processor_stop_async(struct mrpc_server_stream_processor *stream_processor);
 
+/**
+ * Initiates graceful stop of the given stream_processor.
+ * If the client supports it, the GOAWAY packet is sent to the client, so it stops sending new requests
+ * and closes the connection after receiving responses for in-flight requests.
+ * Otherwise the stream_processor stops as soon as it has no in-flight requests and all the responses are flushed.
+ * The release_func() callback passed to the mrpc_server_stream_processor_create() is called
+ * when the stream_processor stops.
+ * This function returns immediately.
+ */
+void mrpc_server_stream_processor_drain(struct mrpc_server_stream_processor *stream_processor);
+
 /**
  * returns the id of the given stream processor.
  * This id is passed to the mrpc_server_stream_processor_create()
  */
 int mrpc_server_stream_processor_get_id(struct mrpc_server_stream_processor *stream_processor);
 
+/**
+ * Notifies the given stream_processor about the next tick of the server's idle connections reaper.
+ * Returns the number of ticks since the last packet was read by the stream_processor.
+ * Ticks are counted only while the stream_processor has no in-flight requests.
+ */
+int mrpc_server_stream_processor_tick_idle(struct mrpc_server_stream_processor *stream_processor);
+
+/**
+ * Returns the number of ticks since the last packet was read by the given stream_processor.
+ * See mrpc_server_stream_processor_tick_idle().
+ */
+int mrpc_server_stream_processor_get_idle_ticks(struct mrpc_server_stream_processor *stream_processor);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,68 @@
+#ifndef MRPC_WRITE_BATCH_PRIVATE_H
+#define MRPC_WRITE_BATCH_PRIVATE_H
+
+#include "private/mrpc_common.h"
+#include "private/mrpc_packet.h"
+#include "ff/ff_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mrpc_write_batch;
+
+/**
+ * Creates a write batch, which is used by stream processors' writers
+ * for accumulating multiple serialized packets before writing them
+ * to the underlying stream with a single ff_stream_write() call.
+ * Always returns correct result.
+ */
+struct mrpc_write_batch *mrpc_write_batch_create();
+
+/**
+ * Deletes the given batch.
+ */
+void mrpc_write_batch_delete(struct mrpc_write_batch *batch);
+
+/**
+ * Returns 1 if the given packet can be added into the batch
+ * using the mrpc_write_batch_add_packet() without overflowing it.
+ * Otherwise returns 0. In this case the batch must be written to the stream
+ * using the mrpc_write_batch_write_to_stream() before adding the packet.
+ * Empty batch can always hold any packet.
+ */
+int mrpc_write_batch_has_space_for_packet(struct mrpc_write_batch *batch, struct mrpc_packet *packet);
+
+/**
+ * Serializes the given packet into the batch.
+ * The packet isn't referenced by the batch after the call, so it can be released.
+ */
+void mrpc_write_batch_add_packet(struct mrpc_write_batch *batch, struct mrpc_packet *packet);
+
+/**
+ * Returns 1 if the batch doesn't contain packets, otherwise returns 0.
+ */
+int mrpc_write_batch_is_empty(struct mrpc_write_batch *batch);
+
+/**
+ * Returns the number of bytes accumulated in the batch.
+ */
+int mrpc_write_batch_get_size(struct mrpc_write_batch *batch);
+
+/**
+ * Removes all the packets from the batch without writing them.
+ */
+void mrpc_write_batch_clear(struct mrpc_write_batch *batch);
+
+/**
+ * Writes all the packets accumulated in the batch to the stream and empties the batch.
+ * The stream isn't flushed by this function.
+ * Returns FF_SUCCESS on success, FF_FAILURE on error.
+ */
+enum ff_result mrpc_write_batch_write_to_stream(struct mrpc_write_batch *batch, struct ff_stream *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
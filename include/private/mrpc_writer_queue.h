@@ -0,0 +1,86 @@
+#ifndef MRPC_WRITER_QUEUE_PRIVATE_H
+#define MRPC_WRITER_QUEUE_PRIVATE_H
+
+#include "private/mrpc_common.h"
+
+#include "private/mrpc_packet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mrpc_writer_queue;
+
+/**
+ * Flow of packets in the writer queue. Usually each request stream has its own flow.
+ * Flows are embedded into structures they belong to, so the writer queue doesn't allocate memory
+ * for flows. Fields of the flow are private to the writer queue.
+ */
+struct mrpc_writer_queue_flow
+{
+	struct mrpc_packet *packets_head;
+	struct mrpc_packet *packets_tail;
+	struct mrpc_writer_queue_flow *next;
+	enum mrpc_priority priority;
+};
+
+/**
+ * Initializes the given flow with the MRPC_PRIORITY_NORMAL priority.
+ */
+void mrpc_writer_queue_flow_initialize(struct mrpc_writer_queue_flow *flow);
+
+/**
+ * Sets the priority of the given flow. The priority is applied to packets,
+ * which are pushed into the flow after this call.
+ */
+void mrpc_writer_queue_flow_set_priority(struct mrpc_writer_queue_flow *flow, enum mrpc_priority priority);
+
+/**
+ * Creates the writer queue.
+ * The writer queue returns packets from flows with the highest priority first.
+ * Flows with the same priority are served in round-robin order by one packet,
+ * so a large request cannot delay small requests, which are sent simultaneously with it.
+ * Packets from the same flow are returned in the order they were pushed into the flow.
+ * Always returns correct result.
+ */
+struct mrpc_writer_queue *mrpc_writer_queue_create();
+
+/**
+ * Deletes the given writer queue. The queue must be empty.
+ */
+void mrpc_writer_queue_delete(struct mrpc_writer_queue *queue);
+
+/**
+ * Pushes the packet into the given flow of the writer queue.
+ */
+void mrpc_writer_queue_put(struct mrpc_writer_queue *queue, struct mrpc_writer_queue_flow *flow, struct mrpc_packet *packet);
+
+/**
+ * Pushes the stop marker into the writer queue.
+ * The mrpc_writer_queue_get() and mrpc_writer_queue_get_with_timeout() return NULL packet for the stop marker
+ * after all the packets, which are pushed before the stop marker, are returned.
+ */
+void mrpc_writer_queue_put_stop_marker(struct mrpc_writer_queue *queue);
+
+/**
+ * Pops the next packet from the writer queue. Waits until the queue becomes non-empty.
+ */
+void mrpc_writer_queue_get(struct mrpc_writer_queue *queue, struct mrpc_packet **packet);
+
+/**
+ * Pops the next packet from the writer queue. Waits until the queue becomes non-empty
+ * for up to timeout milliseconds.
+ * Returns FF_SUCCESS on success, FF_FAILURE on timeout.
+ */
+enum ff_result mrpc_writer_queue_get_with_timeout(struct mrpc_writer_queue *queue, struct mrpc_packet **packet, int timeout);
+
+/**
+ * Returns non-zero if the writer queue doesn't contain packets and the stop marker.
+ */
+int mrpc_writer_queue_is_empty(struct mrpc_writer_queue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,6 +13,8 @@ const char *c_get_param_type(const struct param *param);
 
 const char *c_get_param_code_constructor(const struct param *param);
 
+const char *c_get_method_code_priority(const struct method *method);
+
 int c_is_param_ptr(const struct param *param);
 
 #ifdef __cplusplus
@@ -31,11 +31,20 @@ struct param_list
 	const struct param_list *next;
 };
 
+enum method_priority
+{
+	METHOD_PRIORITY_HIGH,
+	METHOD_PRIORITY_NORMAL,
+	METHOD_PRIORITY_LOW,
+};
+
 struct method
 {
 	const struct param_list *request_params;
 	const struct param_list *response_params;
 	const char *name;
+	enum method_priority priority;
+	int is_blocking;
 };
 
 struct method_list
@@ -14,6 +14,8 @@ static void dump_client_method_declaration(const struct interface *interface, co
 		 " * Returns FF_SUCCESS on success, FF_FAILURE on error.\n"
 		 " * If the function returns FF_FAILURE, then there is no need to delete response parameters,\n"
 		 " * because they aren't set in this case.\n"
+		 " * If the server rejected the call due to overload, then FF_FAILURE is returned\n"
+		 " * without resetting the connection. Such calls can be retried.\n"
 		 " */\n"
 	);
 	dump("enum ff_result client_%s_%s(struct mrpc_client *client", interface->name, method->name);
@@ -34,31 +36,54 @@ static void dump_client_method_declaration(const struct interface *interface, co
 	dump(")");
 }
 
-static void dump_client_method(const struct interface *interface, const struct method *method, int id)
+static void dump_client_async_callback_declaration(const struct interface *interface, const struct method *method)
 {
 	const struct param_list *param_list;
 	const struct param *param;
 
-	dump_client_method_declaration(interface, method);
-	dump("\n{\n");
-
-	dump("\tstruct ff_stream *stream;\n");
+	dump("/* callback, which receives the result of the asynchronous call of the rpc method [%s] of the client interface [%s].\n", method->name, interface->name);
+	dump(" * The callback is responsible for deleting response parameters if the result is FF_SUCCESS.\n"
+		 " * Response parameters are NULL or zero if the result is FF_FAILURE.\n"
+		 " */\n"
+	);
+	dump("typedef void (*client_%s_%s_callback)(enum ff_result result", interface->name, method->name);
 	param_list = method->response_params;
 	while (param_list != NULL)
 	{
 		param = param_list->param;
-		dump("\t%sresponse_%s%s;\n", c_get_param_code_type(param), param->name, (c_is_param_ptr(param) ? " = NULL" : ""));
+		dump(", %s%s", c_get_param_code_type(param), param->name);
 		param_list = param_list->next;
 	}
-	dump("\tuint8_t method_id = %d;\n", id);
-	dump("\tenum ff_result result;\n\n");
+	dump(", void *ctx);\n");
+}
 
-	dump("\tstream = mrpc_client_create_request_stream(client);\n"
-		 "\tif (stream == NULL)\n\t{\n"
-		 "\t\tff_log_debug(L\"cannot create request stream using the client=%%p and tries_cnt=%%d. See previous messages for more info\", client, REQUEST_STREAM_TRIES_CNT);\n"
-		 "\t\tresult = FF_FAILURE;\n"
-		 "\t\tgoto end;\n\t}\n\n"
+static void dump_client_async_method_declaration(const struct interface *interface, const struct method *method)
+{
+	const struct param_list *param_list;
+	const struct param *param;
+
+	dump("/* asynchronously invokes the rpc method [%s] of the client interface [%s] using the given client.\n", method->name, interface->name);
+	dump(" * The function returns as soon as the request is sent, so multiple calls can be pipelined from a single fiber.\n"
+		 " * callback(result, response parameters, ctx) is called in a separate fiber when the response is received.\n"
+		 " * Returns FF_SUCCESS if the request has been sent. The callback is called exactly once in this case.\n"
+		 " * Returns FF_FAILURE if the request cannot be sent. The callback isn't called in this case.\n"
+		 " */\n"
 	);
+	dump("enum ff_result client_%s_%s_async(struct mrpc_client *client", interface->name, method->name);
+	param_list = method->request_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump(", %s%s", c_get_param_code_type(param), param->name);
+		param_list = param_list->next;
+	}
+	dump(", client_%s_%s_callback callback, void *ctx)", interface->name, method->name);
+}
+
+static void dump_client_request_serialization(const struct method *method)
+{
+	const struct param_list *param_list;
+	const struct param *param;
 
 	dump("\tresult = ff_stream_write(stream, &method_id, 1);\n"
 	     "\tif (result != FF_SUCCESS)\n\t{\n"
@@ -84,11 +109,12 @@ static void dump_client_method(const struct interface *interface, const struct m
 		}
 		while (param_list != NULL);
 	}
+}
 
-	dump("\n\tresult = ff_stream_flush(stream);\n");
-	dump("\tif (result != FF_SUCCESS)\n\t{\n"
-		 "\t\tff_log_debug(L\"cannot flush the stream=%%p. See previous messages for more info\", stream);\n"
-		 "\t\tgoto end;\n\t}\n\n");
+static void dump_client_response_unserialization(const struct method *method)
+{
+	const struct param_list *param_list;
+	const struct param *param;
 
 	param_list = method->response_params;
 	if (param_list == NULL)
@@ -117,7 +143,173 @@ static void dump_client_method(const struct interface *interface, const struct m
 			param_list = param_list->next;
 		}
 		while (param_list != NULL);
+	}
+}
+
+static void dump_client_create_request_stream(const struct interface *interface, const struct method *method, int is_async)
+{
+	if (is_async)
+	{
+		dump("\tstream = mrpc_client_create_async_request_stream(client, %s, client_response_handler_%s_%s, call);\n",
+			c_get_method_code_priority(method), interface->name, method->name);
+	}
+	else if (method->priority == METHOD_PRIORITY_NORMAL)
+	{
+		dump("\tstream = mrpc_client_create_request_stream(client);\n");
+	}
+	else
+	{
+		dump("\tstream = mrpc_client_create_request_stream_with_priority(client, %s);\n", c_get_method_code_priority(method));
+	}
+	dump("\tif (stream == NULL)\n\t{\n"
+		 "\t\tff_log_debug(L\"cannot create request stream using the client=%%p and tries_cnt=%%d. See previous messages for more info\", client, REQUEST_STREAM_TRIES_CNT);\n"
+		 "\t\tresult = FF_FAILURE;\n"
+		 "\t\tgoto end;\n\t}\n\n"
+	);
+}
+
+static int has_ptr_params(const struct param_list *param_list)
+{
+	while (param_list != NULL)
+	{
+		if (c_is_param_ptr(param_list->param))
+		{
+			return 1;
+		}
+		param_list = param_list->next;
+	}
+	return 0;
+}
 
+static void dump_client_async_call(const struct interface *interface, const struct method *method)
+{
+	const struct param_list *param_list;
+	const struct param *param;
+
+	dump("struct client_async_call_%s_%s\n{\n", interface->name, method->name);
+	dump("\tstruct mrpc_client *client;\n"
+		 "\tclient_%s_%s_callback callback;\n"
+		 "\tvoid *ctx;\n", interface->name, method->name);
+	dump("};\n\n");
+
+	dump("static void client_response_handler_%s_%s(struct ff_stream *stream, void *ctx)\n{\n", interface->name, method->name);
+	dump("\tstruct client_async_call_%s_%s *call;\n", interface->name, method->name);
+	param_list = method->response_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump("\t%sresponse_%s = %s;\n", c_get_param_code_type(param), param->name, (c_is_param_ptr(param) ? "NULL" : "0"));
+		param_list = param_list->next;
+	}
+	dump("\tenum ff_result result;\n\n");
+	dump("\tcall = (struct client_async_call_%s_%s *) ctx;\n", interface->name, method->name);
+	dump_client_response_unserialization(method);
+
+	dump("\nend:\n");
+	dump("\tif (result != FF_SUCCESS && !mrpc_client_is_server_overloaded(call->client, stream))\n\t{\n"
+		"\t\tmrpc_client_reset_connection(call->client, stream);\n\t}\n"
+	);
+	dump("\tff_stream_delete(stream);\n");
+	if (has_ptr_params(method->response_params))
+	{
+		dump("\tif (result != FF_SUCCESS)\n\t{\n");
+		dump("\t\t/* response parameters are owned by the callback only on success */\n");
+		param_list = method->response_params;
+		while (param_list != NULL)
+		{
+			param = param_list->param;
+			if (c_is_param_ptr(param))
+			{
+				dump("\t\tif (response_%s != NULL)\n\t\t{\n\t\t\tmrpc_%s_dec_ref(response_%s);\n\t\t\tresponse_%s = NULL;\n\t\t}\n",
+					param->name, c_get_param_type(param), param->name, param->name);
+			}
+			param_list = param_list->next;
+		}
+		dump("\t}\n");
+	}
+	dump("\tcall->callback(result");
+	param_list = method->response_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump(", response_%s", param->name);
+		param_list = param_list->next;
+	}
+	dump(", call->ctx);\n");
+	dump("\tff_free(call);\n}\n\n");
+}
+
+static void dump_client_async_method(const struct interface *interface, const struct method *method, int id)
+{
+	dump_client_async_call(interface, method);
+
+	dump_client_async_method_declaration(interface, method);
+	dump("\n{\n");
+	dump("\tstruct client_async_call_%s_%s *call;\n", interface->name, method->name);
+	dump("\tstruct ff_stream *stream;\n");
+	dump("\tuint8_t method_id = %d;\n", id);
+	dump("\tenum ff_result result;\n\n");
+
+	dump("\tcall = (struct client_async_call_%s_%s *) ff_malloc(sizeof(*call));\n", interface->name, method->name);
+	dump("\tcall->client = client;\n"
+		 "\tcall->callback = callback;\n"
+		 "\tcall->ctx = ctx;\n"
+	);
+	dump_client_create_request_stream(interface, method, 1);
+	dump_client_request_serialization(method);
+
+	dump("\n\tresult = ff_stream_flush(stream);\n");
+	dump("\tif (result != FF_SUCCESS)\n\t{\n"
+		 "\t\tff_log_debug(L\"cannot flush the stream=%%p. See previous messages for more info\", stream);\n"
+		 "\t\tgoto end;\n\t}\n\n"
+	);
+	dump("\t/* the stream and the call are owned by the response handler after the successful flush,\n"
+		 "\t * so further errors are reported to the callback.\n"
+		 "\t */\n"
+		 "\tcall = NULL;\n"
+		 "\tstream = NULL;\n"
+	);
+
+	dump("\nend:\n");
+	dump("\tif (result != FF_SUCCESS && stream != NULL)\n\t{\n"
+		"\t\tmrpc_client_reset_connection(client, stream);\n\t}\n"
+	);
+	dump("\tif (stream != NULL)\n\t{\n\t\tff_stream_delete(stream);\n\t}\n");
+	dump("\tif (call != NULL)\n\t{\n\t\tff_free(call);\n\t}\n");
+	dump("\treturn result;\n}\n");
+}
+
+static void dump_client_method(const struct interface *interface, const struct method *method, int id)
+{
+	const struct param_list *param_list;
+	const struct param *param;
+
+	dump_client_method_declaration(interface, method);
+	dump("\n{\n");
+
+	dump("\tstruct ff_stream *stream;\n");
+	param_list = method->response_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump("\t%sresponse_%s%s;\n", c_get_param_code_type(param), param->name, (c_is_param_ptr(param) ? " = NULL" : ""));
+		param_list = param_list->next;
+	}
+	dump("\tuint8_t method_id = %d;\n", id);
+	dump("\tenum ff_result result;\n\n");
+
+	dump_client_create_request_stream(interface, method, 0);
+	dump_client_request_serialization(method);
+
+	dump("\n\tresult = ff_stream_flush(stream);\n");
+	dump("\tif (result != FF_SUCCESS)\n\t{\n"
+		 "\t\tff_log_debug(L\"cannot flush the stream=%%p. See previous messages for more info\", stream);\n"
+		 "\t\tgoto end;\n\t}\n\n");
+
+	dump_client_response_unserialization(method);
+	param_list = method->response_params;
+	if (param_list != NULL)
+	{
 		dump("\n");
 		param_list = method->response_params;
 		while (param_list != NULL)
@@ -133,8 +325,8 @@ static void dump_client_method(const struct interface *interface, const struct m
 	}
 
 	dump("\nend:\n");
-	dump("\tif (result != FF_SUCCESS)\n\t{\n"
-		"\t\tmrpc_client_reset_connection(client);\n\t}\n"
+	dump("\tif (result != FF_SUCCESS && stream != NULL && !mrpc_client_is_server_overloaded(client, stream))\n\t{\n"
+		"\t\tmrpc_client_reset_connection(client, stream);\n\t}\n"
 	);
 	param_list = method->response_params;
 	while (param_list != NULL)
@@ -177,6 +369,8 @@ static void dump_client_source(const struct interface *interface)
     	method = method_list->method;
 		dump("\n");
     	dump_client_method(interface, method, i);
+		dump("\n");
+		dump_client_async_method(interface, method, i);
     	method_list = method_list->next;
     	i++;
     }
@@ -329,6 +523,10 @@ static void dump_client_header(const struct interface *interface)
 		method = method_list->method;
 		dump_client_method_declaration(interface, method);
 		dump(";\n\n");
+		dump_client_async_callback_declaration(interface, method);
+		dump("\n");
+		dump_client_async_method_declaration(interface, method);
+		dump(";\n\n");
 		method_list = method_list->next;
 	}
 
@@ -51,6 +51,18 @@ const char *c_get_param_code_constructor(const struct param *param)
 	return NULL;
 }
 
+const char *c_get_method_code_priority(const struct method *method)
+{
+	switch (method->priority)
+	{
+		case METHOD_PRIORITY_HIGH: return "MRPC_PRIORITY_HIGH";
+		case METHOD_PRIORITY_NORMAL: return "MRPC_PRIORITY_NORMAL";
+		case METHOD_PRIORITY_LOW: return "MRPC_PRIORITY_LOW";
+		default: die("unknown priority for the method [%s]", method->name);
+	}
+	return NULL;
+}
+
 int c_is_param_ptr(const struct param *param)
 {
 	switch (param->type)
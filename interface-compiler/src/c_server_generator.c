@@ -4,6 +4,80 @@
 #include "c_common.h"
 #include "types.h"
 
+static void dump_server_blocking_call(const struct interface *interface, const struct method *method)
+{
+	const struct param_list *param_list;
+	const struct param *param;
+
+	dump("/* parameters of the blocking method [%s], which is executed in the thread pool */\n", method->name);
+	dump("struct server_blocking_call_%s_%s\n{\n", interface->name, method->name);
+	dump("\tstruct service_%s *service;\n", interface->name);
+	param_list = method->request_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump("\t%srequest_%s;\n", c_get_param_code_type(param), param->name);
+		param_list = param_list->next;
+	}
+	param_list = method->response_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump("\t%s*response_%s;\n", c_get_param_code_type(param), param->name);
+		param_list = param_list->next;
+	}
+	dump("};\n\n");
+
+	dump("static void server_blocking_call_func_%s_%s(void *ctx)\n{\n", interface->name, method->name);
+	dump("\tstruct server_blocking_call_%s_%s *call;\n\n", interface->name, method->name);
+	dump("\tcall = (struct server_blocking_call_%s_%s *) ctx;\n", interface->name, method->name);
+	dump("\tservice_%s_%s(call->service", interface->name, method->name);
+	param_list = method->request_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump(", call->request_%s", param->name);
+		param_list = param_list->next;
+	}
+	param_list = method->response_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump(", call->response_%s", param->name);
+		param_list = param_list->next;
+	}
+	dump(");\n}\n\n");
+}
+
+static void dump_server_blocking_call_invocation(const struct interface *interface, const struct method *method)
+{
+	const struct param_list *param_list;
+	const struct param *param;
+
+	dump("\n\t/* the method is blocking, so it is executed in the thread pool. This suspends only the current fiber,\n"
+		 "\t * while other fibers continue running.\n"
+		 "\t */\n"
+	);
+	dump("\t{\n\t\tstruct server_blocking_call_%s_%s call;\n\n", interface->name, method->name);
+	dump("\t\tcall.service = service;\n");
+	param_list = method->request_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump("\t\tcall.request_%s = request_%s;\n", param->name, param->name);
+		param_list = param_list->next;
+	}
+	param_list = method->response_params;
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		dump("\t\tcall.response_%s = &response_%s;\n", param->name, param->name);
+		param_list = param_list->next;
+	}
+	dump("\t\tmrpc_server_stream_handler_prepare_to_block(stream);\n");
+	dump("\t\tff_core_threadpool_execute(server_blocking_call_func_%s_%s, &call);\n\t}\n\n", interface->name, method->name);
+}
+
 static void dump_server_method_handler(const struct interface *interface, const struct method *method)
 {
 	const struct param_list *param_list;
@@ -48,23 +122,30 @@ static void dump_server_method_handler(const struct interface *interface, const
 		while (param_list != NULL);
 	}
 
-	dump("\n\tservice_%s_%s(service", interface->name, method->name);
-	param_list = method->request_params;
-	while (param_list != NULL)
+	if (method->is_blocking)
 	{
-		param = param_list->param;
-		dump(", request_%s", param->name);
-		param_list = param_list->next;
+		dump_server_blocking_call_invocation(interface, method);
 	}
-
-	param_list = method->response_params;
-	while (param_list != NULL)
+	else
 	{
-		param = param_list->param;
-		dump(", &response_%s", param->name);
-		param_list = param_list->next;
+		dump("\n\tservice_%s_%s(service", interface->name, method->name);
+		param_list = method->request_params;
+		while (param_list != NULL)
+		{
+			param = param_list->param;
+			dump(", request_%s", param->name);
+			param_list = param_list->next;
+		}
+
+		param_list = method->response_params;
+		while (param_list != NULL)
+		{
+			param = param_list->param;
+			dump(", &response_%s", param->name);
+			param_list = param_list->next;
+		}
+		dump(");\n\n");
 	}
-	dump(");\n\n");
 
 	param_list = method->response_params;
 	if (param_list == NULL)
@@ -119,6 +200,66 @@ static void dump_server_method_handler(const struct interface *interface, const
 	dump("\treturn result;\n}\n\n");
 }
 
+static void dump_server_method_ids(const struct interface *interface)
+{
+	const struct method_list *method_list;
+	const struct method *method;
+	int id;
+
+	dump("/* method ids of the interface [%s] */\n", interface->name);
+	dump("enum server_method_id_%s\n{\n", interface->name);
+	method_list = interface->methods;
+	id = 0;
+	while (method_list != NULL)
+	{
+		method = method_list->method;
+		dump("\tSERVER_METHOD_ID_%s_%s = %d,\n", interface->name, method->name, id);
+		method_list = method_list->next;
+		id++;
+	}
+	dump("};\n");
+}
+
+static void dump_server_set_method_limit_declaration(const struct interface *interface)
+{
+	dump("/* sets the maximum number of concurrently executed calls of the method with the given method_id\n"
+		 " * for the interface [%s]. Zero max_active_cnt means unlimited number of calls.\n"
+		 " * If is_queued isn't zero, then calls exceeding the limit wait until the number of active calls\n"
+		 " * drops below the limit, otherwise such calls are rejected with the 'server overloaded' status.\n"
+		 " * Limits can be changed at any time.\n"
+		 " */\n", interface->name);
+	dump("void server_stream_handler_%s_set_method_limit(enum server_method_id_%s method_id, int max_active_cnt, int is_queued)",
+		interface->name, interface->name);
+}
+
+static void dump_server_reset_method_limits_declaration(const struct interface *interface)
+{
+	dump("/* removes all the limits set by the server_stream_handler_%s_set_method_limit() and frees resources\n"
+		 " * occupied by them. This function must be called before the ff_core_shutdown() if method limits were set.\n"
+		 " */\n", interface->name);
+	dump("void server_stream_handler_%s_reset_method_limits()", interface->name);
+}
+
+static void dump_server_method_limits(const struct interface *interface, int methods_cnt)
+{
+	dump("/* limits are created on the first server_stream_handler_%s_set_method_limit() call */\n", interface->name);
+	dump("static struct mrpc_method_limits *server_method_limits_%s = NULL;\n\n", interface->name);
+
+	dump_server_set_method_limit_declaration(interface);
+	dump("\n{\n");
+	dump("\tff_assert(method_id >= 0 && method_id < %d);\n", methods_cnt);
+	dump("\tff_assert(max_active_cnt >= 0);\n\n"
+		 "\tif (server_method_limits_%s == NULL)\n\t{\n", interface->name);
+	dump("\t\tserver_method_limits_%s = mrpc_method_limits_create(%d);\n\t}\n", interface->name, methods_cnt);
+	dump("\tmrpc_method_limits_set(server_method_limits_%s, method_id, max_active_cnt, is_queued);\n}\n\n", interface->name);
+
+	dump_server_reset_method_limits_declaration(interface);
+	dump("\n{\n");
+	dump("\tif (server_method_limits_%s != NULL)\n\t{\n", interface->name);
+	dump("\t\tmrpc_method_limits_delete(server_method_limits_%s);\n", interface->name);
+	dump("\t\tserver_method_limits_%s = NULL;\n\t}\n}\n\n", interface->name);
+}
+
 static void dump_server_stream_handler_declaration(const struct interface *interface)
 {
 	dump("/* mrpc_server_stream_handler for the interface [%s] */\n", interface->name);
@@ -130,7 +271,8 @@ static void dump_server_stream_handler(const struct interface *interface, int me
 {
 	dump_server_stream_handler_declaration(interface);
 	dump("\n{\n\tstruct service_%s *service;\n", interface->name);
-	dump("\tuint8_t method_id;\n"
+	dump("\tstruct mrpc_method_limits *limits;\n"
+		 "\tuint8_t method_id;\n"
 		 "\tenum ff_result result;\n\n"
 	);
 	dump("\tservice = (struct service_%s *) service_ctx;\n", interface->name);
@@ -144,10 +286,24 @@ static void dump_server_stream_handler(const struct interface *interface, int me
 	dump("\t\tresult = FF_FAILURE;\n"
 		 "\t\tgoto end;\n\t}\n\n"
 	);
-	dump("\tresult = server_method_handlers_%s[method_id](stream, service);\n", interface->name);
-	dump("\tif (result != FF_SUCCESS)\n\t{\n"
-		 "\t\tff_log_debug(L\"cannot handle the method with method_id=%%d using the stream=%%p. See previous messages for more info\", (int) method_id, stream);\n"
-		 "\t\tgoto end;\n\t}\n\n"
+	dump("\tlimits = server_method_limits_%s;\n", interface->name);
+	dump("\tif (limits != NULL && mrpc_method_limits_is_wait_needed(limits, method_id))\n\t{\n"
+		 "\t\t/* the call waits for a free slot, so it mustn't stall other requests on the connection */\n"
+		 "\t\tmrpc_server_stream_handler_prepare_to_block(stream);\n\t}\n"
+	);
+	dump("\tif (limits == NULL || mrpc_method_limits_acquire_slot(limits, method_id) == FF_SUCCESS)\n\t{\n");
+	dump("\t\tresult = server_method_handlers_%s[method_id](stream, service);\n", interface->name);
+	dump("\t\tif (limits != NULL)\n\t\t{\n"
+		 "\t\t\tmrpc_method_limits_release_slot(limits, method_id);\n\t\t}\n"
+	);
+	dump("\t\tif (result != FF_SUCCESS)\n\t\t{\n"
+		 "\t\t\tff_log_debug(L\"cannot handle the method with method_id=%%d using the stream=%%p. See previous messages for more info\", (int) method_id, stream);\n"
+		 "\t\t\tgoto end;\n\t\t}\n"
+		 "\t}\n"
+		 "\telse\n\t{\n"
+		 "\t\t/* the empty response is interpreted by clients as the 'server overloaded' status */\n"
+		 "\t\tff_log_debug(L\"the method with method_id=%%d is overloaded, so the empty response is sent to the stream=%%p\", (int) method_id, stream);\n"
+		 "\t}\n\n"
 	);
 	dump("\tresult = ff_stream_flush(stream);\n"
 		 "\tif (result != FF_SUCCESS)\n\t{\n"
@@ -173,7 +329,9 @@ static void dump_server_stream_handler_source(const struct interface *interface)
 		 "#include \"mrpc/mrpc_char_array.h\"\n"
 		 "#include \"mrpc/mrpc_wchar_array.h\"\n"
 		 "#include \"mrpc/mrpc_server_stream_handler.h\"\n"
-		 "#include \"ff/ff_stream.h\"\n\n"
+		 "#include \"mrpc/mrpc_method_limits.h\"\n"
+		 "#include \"ff/ff_stream.h\"\n"
+		 "#include \"ff/ff_core.h\"\n\n"
 	);
 	dump("typedef enum ff_result (*server_method_handler)(struct ff_stream *stream, struct service_%s *service);\n\n", interface->name);
 
@@ -181,6 +339,10 @@ static void dump_server_stream_handler_source(const struct interface *interface)
 	while (method_list != NULL)
 	{
 		method = method_list->method;
+		if (method->is_blocking)
+		{
+			dump_server_blocking_call(interface, method);
+		}
 		dump_server_method_handler(interface, method);
 		method_list = method_list->next;
 	}
@@ -197,6 +359,7 @@ static void dump_server_stream_handler_source(const struct interface *interface)
 	}
 	dump("};\n\n");
 
+	dump_server_method_limits(interface, methods_cnt);
 	dump_server_stream_handler(interface, methods_cnt);
 }
 
@@ -209,9 +372,18 @@ static void dump_server_stream_handler_header(const struct interface *interface)
 
 	dump("#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
 
+	dump_server_method_ids(interface);
+	dump("\n");
+
 	dump_server_stream_handler_declaration(interface);
 	dump(";\n\n");
 
+	dump_server_set_method_limit_declaration(interface);
+	dump(";\n\n");
+
+	dump_server_reset_method_limits_declaration(interface);
+	dump(";\n\n");
+
 	dump("#ifdef __cplusplus\n}\n#endif\n\n");
 	dump("#endif\n");
 }
@@ -222,6 +394,15 @@ static void dump_service_method_declaration(const struct interface *interface, c
 	const struct param *param;
 
 	dump("/* implements the server method [%s] of the interface [%s] */\n", method->name, interface->name);
+	if (method->is_blocking)
+	{
+		dump("/* the method is declared as blocking, so it is executed in a thread pool's thread instead of a fiber.\n"
+			 " * It can perform blocking i/o and heavy computations, but it mustn't call fiber-framework functions,\n"
+			 " * which require a fiber.\n"
+			 " * The service is shared by all the fibers and threads executing methods of the interface\n"
+			 " * simultaneously, so the method must synchronize access to it.\n"
+			 " */\n");
+	}
 	dump("void service_%s_%s(struct service_%s *service", interface->name, method->name, interface->name);
 	param_list = method->request_params;
 	while (param_list != NULL)
@@ -42,9 +42,11 @@ void help(char *app_name)
 		"      Do not modify this file!\n"
 		"\n"
 		"  - c_server - generates server source files for the C mrpc library:\n"
-		"    - server_stream_handler_{interface_name}.h contains single declaration\n"
+		"    - server_stream_handler_{interface_name}.h contains declaration\n"
 		"      of the mrpc_server_stream_handler, which implements the interface\n"
-		"      defined in the interface definition file.\n"
+		"      defined in the interface definition file. It also contains\n"
+		"      declarations of functions for limiting the number of concurrently\n"
+		"      executed calls per method.\n"
 		"\n"
 		"    - server_stream_handler_{interface_name}.c contains definition\n"
 		"      of the mrpc_server_stream_handler. Do not modify this file!\n"
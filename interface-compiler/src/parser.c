@@ -406,18 +406,86 @@ static const struct param_list *match_params(enum params_type params_type)
 	return first_entry;
 }
 
+static enum method_priority match_method_priority()
+{
+	enum method_priority priority;
+
+	match_id("priority");
+	if (test_id("high"))
+	{
+		priority = METHOD_PRIORITY_HIGH;
+	}
+	else if (test_id("normal"))
+	{
+		priority = METHOD_PRIORITY_NORMAL;
+	}
+	else if (test_id("low"))
+	{
+		priority = METHOD_PRIORITY_LOW;
+	}
+	else
+	{
+		fail("method priority");
+	}
+	match(LEXEME_ID);
+
+	return priority;
+}
+
+static void check_blocking_method_params(const struct method *method, const struct param_list *param_list)
+{
+	const struct param *param;
+
+	/* blobs are backed by fiber-framework files, which cannot be accessed from the thread pool's threads,
+	 * where blocking methods are executed.
+	 */
+	while (param_list != NULL)
+	{
+		param = param_list->param;
+		if (param->type == PARAM_BLOB)
+		{
+			die("the blocking method [%s] cannot have the blob parameter [%s] at the file [%s]",
+				method->name, param->name, parser_ctx.filename);
+		}
+		param_list = param_list->next;
+	}
+}
+
 static const struct method *match_method()
 {
 	struct method *method;
 
 	method = (struct method *) malloc(sizeof(*method));
+	method->priority = METHOD_PRIORITY_NORMAL;
+	method->is_blocking = 0;
 
 	match_id("method");
 	method->name = copy_current_lexeme();
 	match(LEXEME_ID);
+	while (!test(LEXEME_OPEN_BRACE))
+	{
+		if (test_id("priority"))
+		{
+			method->priority = match_method_priority();
+		}
+		else if (test_id("blocking"))
+		{
+			method->is_blocking = 1;
+			match(LEXEME_ID);
+		}
+		else
+		{
+			fail("method option");
+		}
+	}
 	match(LEXEME_OPEN_BRACE);
 	method->request_params = match_params(REQUEST_PARAMS);
 	method->response_params = match_params(RESPONSE_PARAMS);
+	if (method->is_blocking)
+	{
+		check_blocking_method_params(method, method->request_params);
+		check_blocking_method_params(method, method->response_params);
+	}
 	match(LEXEME_CLOSE_BRACE);
 
 	return method;
@@ -17,21 +17,46 @@
  */
 #define MAX_CREATE_REQUEST_STREAM_TRIES_CNT 3
 
+/**
+ * Connection of the client to the server.
+ * Each connection is served by its own stream processor and is re-established independently of other connections.
+ */
+struct mrpc_client_connection
+{
+	struct mrpc_client *client;
+	struct mrpc_client_stream_processor *stream_processor;
+};
+
+struct mrpc_client_batch
+{
+	struct mrpc_client *client;
+};
+
 struct mrpc_client
 {
 	struct ff_event *stop_event;
-	struct mrpc_client_stream_processor *stream_processor;
+	struct mrpc_client_connection *connections;
 	struct ff_stream_connector *stream_connector;
+	int connections_cnt;
+	int active_connections_cnt;
+
+	/* the index of the connection, which is checked first when selecting a connection for new request stream.
+	 * It is rotated, so connections with equal load are selected in round-robin order.
+	 */
+	int next_connection_index;
 };
 
 static void main_client_func(void *ctx)
 {
+	struct mrpc_client_connection *connection;
 	struct mrpc_client *client;
 
-	client = (struct mrpc_client *) ctx;
+	connection = (struct mrpc_client_connection *) ctx;
+	client = connection->client;
 
 	ff_assert(client != NULL);
 	ff_assert(client->stream_connector != NULL);
+	ff_assert(client->active_connections_cnt > 0);
 	for (;;)
 	{
 		struct ff_stream *stream;
@@ -40,22 +65,139 @@ static void main_client_func(void *ctx)
 		if (stream == NULL)
 		{
 			/* the mrpc_client_delete() was called */
-			ff_log_debug(L"cannot establish connection for the client=%p, because the mrpc_client_stop() has been called", client);
+			ff_log_debug(L"cannot establish connection=%p for the client=%p, because the mrpc_client_stop() has been called", connection, client);
 			break;
 		}
-		mrpc_client_stream_processor_process_stream(client->stream_processor, stream);
+		mrpc_client_stream_processor_process_stream(connection->stream_processor, stream);
 		ff_stream_delete(stream);
 	}
-	ff_event_set(client->stop_event);
+	client->active_connections_cnt--;
+	if (client->active_connections_cnt == 0)
+	{
+		ff_event_set(client->stop_event);
+	}
+}
+
+static struct mrpc_client_connection *get_request_stream_connection(struct mrpc_client *client, struct ff_stream *stream)
+{
+	struct mrpc_client_connection *connection = NULL;
+	int i;
+
+	for (i = 0; i < client->connections_cnt; i++)
+	{
+		if (mrpc_client_stream_processor_has_request_stream(client->connections[i].stream_processor, stream))
+		{
+			connection = &client->connections[i];
+			break;
+		}
+	}
+	ff_assert(connection != NULL);
+	return connection;
 }
 
-struct mrpc_client *mrpc_client_create()
+static struct mrpc_client_stream_processor *get_least_loaded_stream_processor(struct mrpc_client *client)
+{
+	struct mrpc_client_stream_processor *least_loaded_stream_processor = NULL;
+	int min_active_request_streams_cnt = 0;
+	int connections_cnt;
+	int index;
+	int i;
+
+	connections_cnt = client->connections_cnt;
+	index = client->next_connection_index;
+	client->next_connection_index = (index + 1) % connections_cnt;
+	for (i = 0; i < connections_cnt; i++)
+	{
+		struct mrpc_client_stream_processor *stream_processor;
+		int active_request_streams_cnt;
+
+		stream_processor = client->connections[index].stream_processor;
+		active_request_streams_cnt = mrpc_client_stream_processor_get_active_request_streams_cnt(stream_processor);
+		if (least_loaded_stream_processor == NULL || active_request_streams_cnt < min_active_request_streams_cnt)
+		{
+			least_loaded_stream_processor = stream_processor;
+			min_active_request_streams_cnt = active_request_streams_cnt;
+		}
+		index = (index + 1) % connections_cnt;
+	}
+	ff_assert(least_loaded_stream_processor != NULL);
+	return least_loaded_stream_processor;
+}
+
+static struct ff_stream *try_create_request_stream(struct mrpc_client *client, enum mrpc_priority priority, int is_batched,
+	mrpc_client_response_handler response_handler, void *response_handler_ctx)
+{
+	struct mrpc_client_stream_processor *least_loaded_stream_processor;
+	struct ff_stream *stream;
+	int i;
+
+	least_loaded_stream_processor = get_least_loaded_stream_processor(client);
+	stream = mrpc_client_stream_processor_create_request_stream(least_loaded_stream_processor, priority, is_batched,
+		response_handler, response_handler_ctx);
+	if (stream == NULL)
+	{
+		/* the least loaded connection isn't established yet or is being closed, so try other connections */
+		for (i = 0; i < client->connections_cnt; i++)
+		{
+			struct mrpc_client_stream_processor *stream_processor;
+
+			stream_processor = client->connections[i].stream_processor;
+			if (stream_processor != least_loaded_stream_processor)
+			{
+				stream = mrpc_client_stream_processor_create_request_stream(stream_processor, priority, is_batched,
+						response_handler, response_handler_ctx);
+				if (stream != NULL)
+				{
+					break;
+				}
+			}
+		}
+	}
+	return stream;
+}
+
+static struct ff_stream *create_request_stream(struct mrpc_client *client, enum mrpc_priority priority, int is_batched,
+	mrpc_client_response_handler response_handler, void *response_handler_ctx)
+{
+	struct ff_stream *stream;
+	int tries_cnt = MAX_CREATE_REQUEST_STREAM_TRIES_CNT;
+
+	for (;;)
+	{
+		stream = try_create_request_stream(client, priority, is_batched, response_handler, response_handler_ctx);
+		if (stream != NULL)
+		{
+			break;
+		}
+		ff_log_debug(L"the client=%p cannot acquire request stream. See previous messages for more info", client);
+		tries_cnt--;
+		if (tries_cnt == 0)
+		{
+			break;
+		}
+		ff_core_sleep(CREATE_REQUEST_STREAM_TRY_INTERVAL);
+	}
+	return stream;
+}
+
+struct mrpc_client *mrpc_client_create(int connections_cnt)
 {
 	struct mrpc_client *client;
+	int i;
+
+	ff_assert(connections_cnt > 0);
 
 	client = (struct mrpc_client *) ff_malloc(sizeof(*client));
 	client->stop_event = ff_event_create(FF_EVENT_AUTO);
-	client->stream_processor = mrpc_client_stream_processor_create();
+	client->connections = (struct mrpc_client_connection *) ff_calloc(connections_cnt, sizeof(client->connections[0]));
+	for (i = 0; i < connections_cnt; i++)
+	{
+		client->connections[i].client = client;
+		client->connections[i].stream_processor = mrpc_client_stream_processor_create();
+	}
+	client->connections_cnt = connections_cnt;
+	client->active_connections_cnt = 0;
+	client->next_connection_index = 0;
 
 	client->stream_connector = NULL;
 
@@ -64,33 +206,80 @@ struct mrpc_client *mrpc_client_create()
 
 void mrpc_client_delete(struct mrpc_client *client)
 {
+	int i;
+
 	ff_assert(client != NULL);
 	ff_assert(client->stream_connector == NULL);
+	ff_assert(client->active_connections_cnt == 0);
 
-	mrpc_client_stream_processor_delete(client->stream_processor);
+	for (i = 0; i < client->connections_cnt; i++)
+	{
+		mrpc_client_stream_processor_delete(client->connections[i].stream_processor);
+	}
+	ff_free(client->connections);
 	ff_event_delete(client->stop_event);
 	ff_free(client);
 }
 
 void mrpc_client_start(struct mrpc_client *client, struct ff_stream_connector *stream_connector)
 {
+	int i;
+
 	ff_assert(client != NULL);
 	ff_assert(stream_connector != NULL);
 	ff_assert(client->stream_connector == NULL);
+	ff_assert(client->active_connections_cnt == 0);
 
 	client->stream_connector = stream_connector;
 	ff_stream_connector_initialize(client->stream_connector);
-	ff_core_fiberpool_execute_async(main_client_func, client);
+	client->active_connections_cnt = client->connections_cnt;
+	for (i = 0; i < client->connections_cnt; i++)
+	{
+		ff_core_fiberpool_execute_async(main_client_func, &client->connections[i]);
+	}
+}
+
+void mrpc_client_set_flush_policy(struct mrpc_client *client, int flush_delay, int flush_threshold)
+{
+	int i;
+
+	ff_assert(client != NULL);
+	ff_assert(client->stream_connector == NULL);
+
+	for (i = 0; i < client->connections_cnt; i++)
+	{
+		mrpc_client_stream_processor_set_flush_policy(client->connections[i].stream_processor, flush_delay, flush_threshold);
+	}
+}
+
+void mrpc_client_set_hibernation_timeout(struct mrpc_client *client, int hibernation_timeout)
+{
+	int i;
+
+	ff_assert(client != NULL);
+	ff_assert(client->stream_connector == NULL);
+	ff_assert(hibernation_timeout > 0);
+
+	for (i = 0; i < client->connections_cnt; i++)
+	{
+		mrpc_client_stream_processor_set_hibernation_timeout(client->connections[i].stream_processor, hibernation_timeout);
+	}
 }
 
 void mrpc_client_stop(struct mrpc_client *client)
 {
+	int i;
+
 	ff_assert(client != NULL);
 	ff_assert(client->stream_connector != NULL);
 
 	ff_stream_connector_shutdown(client->stream_connector);
-	mrpc_client_stream_processor_stop_async(client->stream_processor);
+	for (i = 0; i < client->connections_cnt; i++)
+	{
+		mrpc_client_stream_processor_stop_async(client->connections[i].stream_processor);
+	}
 	ff_event_wait(client->stop_event);
+	ff_assert(client->active_connections_cnt == 0);
 
 	client->stream_connector = NULL;
 }
@@ -98,30 +287,103 @@ void mrpc_client_stop(struct mrpc_client *client)
 struct ff_stream *mrpc_client_create_request_stream(struct mrpc_client *client)
 {
 	struct ff_stream *stream;
-	int tries_cnt = MAX_CREATE_REQUEST_STREAM_TRIES_CNT;
+
+	stream = mrpc_client_create_request_stream_with_priority(client, MRPC_PRIORITY_NORMAL);
+	return stream;
+}
+
+struct ff_stream *mrpc_client_create_request_stream_with_priority(struct mrpc_client *client, enum mrpc_priority priority)
+{
+	struct ff_stream *stream;
 
 	ff_assert(client != NULL);
-	for (;;)
+	ff_assert(priority >= 0);
+	ff_assert(priority < MRPC_PRIORITIES_CNT);
+
+	stream = create_request_stream(client, priority, 0, NULL, NULL);
+	return stream;
+}
+
+struct ff_stream *mrpc_client_create_async_request_stream(struct mrpc_client *client, enum mrpc_priority priority,
+	mrpc_client_response_handler response_handler, void *ctx)
+{
+	struct ff_stream *stream;
+
+	ff_assert(client != NULL);
+	ff_assert(priority >= 0);
+	ff_assert(priority < MRPC_PRIORITIES_CNT);
+	ff_assert(response_handler != NULL);
+
+	stream = create_request_stream(client, priority, 0, response_handler, ctx);
+	return stream;
+}
+
+struct mrpc_client_batch *mrpc_client_begin_batch(struct mrpc_client *client)
+{
+	struct mrpc_client_batch *batch;
+	int i;
+
+	ff_assert(client != NULL);
+
+	batch = (struct mrpc_client_batch *) ff_malloc(sizeof(*batch));
+	batch->client = client;
+	for (i = 0; i < client->connections_cnt; i++)
 	{
-		stream = mrpc_client_stream_processor_create_request_stream(client->stream_processor);
-		if (stream != NULL)
-		{
-			break;
-		}
-		ff_log_debug(L"the client=%p cannot acquire request stream. See previous messages for more info");
-		tries_cnt--;
-		if (tries_cnt == 0)
-		{
-			break;
-		}
-		ff_core_sleep(CREATE_REQUEST_STREAM_TRY_INTERVAL);
+		mrpc_client_stream_processor_begin_batch(client->connections[i].stream_processor);
 	}
+	return batch;
+}
+
+void mrpc_client_end_batch(struct mrpc_client_batch *batch)
+{
+	struct mrpc_client *client;
+	int i;
+
+	ff_assert(batch != NULL);
+
+	client = batch->client;
+	ff_assert(client != NULL);
+	for (i = 0; i < client->connections_cnt; i++)
+	{
+		mrpc_client_stream_processor_end_batch(client->connections[i].stream_processor);
+	}
+	ff_free(batch);
+}
+
+struct ff_stream *mrpc_client_create_batch_request_stream(struct mrpc_client_batch *batch, enum mrpc_priority priority,
+	mrpc_client_response_handler response_handler, void *ctx)
+{
+	struct ff_stream *stream;
+
+	ff_assert(batch != NULL);
+	ff_assert(priority >= 0);
+	ff_assert(priority < MRPC_PRIORITIES_CNT);
+	ff_assert(response_handler != NULL);
+
+	stream = create_request_stream(batch->client, priority, 1, response_handler, ctx);
 	return stream;
 }
 
-void mrpc_client_reset_connection(struct mrpc_client *client)
+int mrpc_client_is_server_overloaded(struct mrpc_client *client, struct ff_stream *stream)
 {
+	struct mrpc_client_connection *connection;
+	int is_overloaded;
+
+	ff_assert(client != NULL);
+	ff_assert(stream != NULL);
+
+	connection = get_request_stream_connection(client, stream);
+	is_overloaded = mrpc_client_stream_processor_is_request_stream_server_overloaded(connection->stream_processor, stream);
+	return is_overloaded;
+}
+
+void mrpc_client_reset_connection(struct mrpc_client *client, struct ff_stream *stream)
+{
+	struct mrpc_client_connection *connection;
+
 	ff_assert(client != NULL);
+	ff_assert(stream != NULL);
 
-	mrpc_client_stream_processor_stop_async(client->stream_processor);
+	connection = get_request_stream_connection(client, stream);
+	mrpc_client_stream_processor_stop_async(connection->stream_processor);
 }
@@ -2,8 +2,11 @@
 
 #include "private/mrpc_client_stream_processor.h"
 #include "private/mrpc_packet_stream.h"
+#include "private/mrpc_protocol.h"
+#include "private/mrpc_memory.h"
+#include "private/mrpc_write_batch.h"
+#include "private/mrpc_writer_queue.h"
 #include "private/mrpc_bitmap.h"
-#include "ff/ff_blocking_queue.h"
 #include "ff/ff_pool.h"
 #include "ff/ff_event.h"
 #include "ff/ff_stream.h"
@@ -11,23 +14,38 @@
 
 /**
  * the maximum number of request streams, which can be simultaneously created by the mrpc_client_stream_processor.
- * This number should be less or equal to the 0x100, because of restriction on the size (1 bytes) of request_id
- * field in the mrpc client-server protocol. request_id is assigned for each currently running request
- * and is used for association with the corresponding asynchronous response.
- * So there are 0x100 maximum request streams can be created in parallel.
+ * The actual limit is negotiated with the server during the handshake.
+ * request_id is assigned for each currently running request and is used for association
+ * with the corresponding asynchronous response.
  */
-#define MAX_REQUEST_STREAMS_CNT 0x100
+#define MAX_REQUEST_STREAMS_CNT MRPC_PROTOCOL_MAX_REQUEST_STREAMS_CNT
 
 /**
  * the maximum number of mrpc_packet packets, which can be used by the instance of the
- * mrpc_client_stream_processor. These packets are used when receiving data from the underlying stream.
+ * mrpc_client_stream_processor for the connection with the given number of request streams.
+ * These packets are used when receiving data from the underlying stream.
  * Also they are used by the request streams when serializing rpc requests.
- * In order to avoid deadlocks this number must be not less than (2 * MAX_REQUEST_STREAMS_CNT).
+ * In order to avoid deadlocks this number must be not less than (2 * request_streams_cnt).
+ * The number of packets, which can be occupied by a single request stream, is limited
+ * by the flow control in the mrpc_packet_stream, so a single bulk transfer cannot exhaust packets
+ * required by other request streams. Additional packets are reserved for such transfers.
  */
-#define MAX_PACKETS_CNT (2 * MAX_REQUEST_STREAMS_CNT)
+#define GET_MAX_PACKETS_CNT(request_streams_cnt) (3 * (request_streams_cnt))
+
+#define MAX_PACKETS_CNT GET_MAX_PACKETS_CNT(MAX_REQUEST_STREAMS_CNT)
+
+/**
+ * The number of consecutive connections, on which the server rejected the handshake,
+ * after which the stream processor falls back to the MRPC_PROTOCOL_V1.
+ * Servers, which don't support the handshake, reject it by closing the connection.
+ * This cannot be distinguished from a connection dropped due to a transient network error,
+ * so a single rejection isn't enough for the fallback.
+ */
+#define MAX_HANDSHAKE_REJECTIONS_CNT 2
 
 enum client_stream_processor_state
 {
+	STATE_HANDSHAKE,
 	STATE_WORKING,
 	STATE_STOP_INITIATED,
 	STATE_STOPPED,
@@ -37,20 +55,107 @@ struct request_stream
 {
 	struct mrpc_client_stream_processor *stream_processor;
 	struct mrpc_packet_stream *packet_stream;
-	uint8_t request_id;
+	uint32_t request_id;
+
+	/* the flow of packets of the request stream in the writer_queue */
+	struct mrpc_writer_queue_flow writer_queue_flow;
+	enum mrpc_priority priority;
+
+	/* this flag is set if the request stream belongs to a batch, so its packets
+	 * can wait for the end of batches instead of being flushed immediately.
+	 */
+	int is_batched;
+
+	/* the handler, which reads the response from the asynchronous request stream.
+	 * It is NULL for synchronous request streams.
+	 */
+	mrpc_client_response_handler response_handler;
+	void *response_handler_ctx;
+
+	/* the stream, which wraps the request stream. It is passed to the response_handler */
+	struct ff_stream *stream;
+
+	/* this flag is set if the last read from the request stream failed, because the server rejected
+	 * the request due to overload.
+	 */
+	int is_server_overloaded;
+
+	/* the response_handler is started when both flags are set */
+	int is_request_flushed;
+	int is_response_started;
+	int is_response_handler_started;
 };
 
 struct mrpc_client_stream_processor
 {
-	struct ff_blocking_queue *writer_queue;
+	struct mrpc_writer_queue *writer_queue;
+	struct mrpc_write_batch *write_batch;
 	struct ff_event *writer_stop_event;
+
+	/* this event is set when a fiber finishes writing a packet directly to the stream */
+	struct ff_event *direct_write_event;
+
+	/* this event is set when the delayed flush must be performed before the flush_delay expires */
+	struct ff_event *flush_event;
 	struct mrpc_bitmap *request_streams_bitmap;
 	struct ff_pool *request_streams_pool;
 	struct ff_event *request_streams_stop_event;
 	struct ff_pool *packets_pool;
+	struct mrpc_packet_arena *packets_arena;
 	struct request_stream **active_request_streams;
 	struct ff_stream *stream;
+	struct mrpc_protocol_params protocol_params;
+
+	/* the maximum protocol version, which is proposed to the server during the handshake.
+	 * It is downgraded to the MRPC_PROTOCOL_V1 if the server doesn't support the handshake.
+	 */
+	enum mrpc_protocol_version max_protocol_version;
+
+	/* the number of consecutive connections, on which the server rejected the handshake */
+	int handshake_rejections_cnt;
+
 	int active_request_streams_cnt;
+
+	/* this flag is cleared by the reader on each packet read from the stream.
+	 * It is used for detecting idle connections, which can hibernate.
+	 */
+	int is_idle;
+
+	/* this flag is set while either the stream writer or a fiber writing a packet directly
+	 * to the stream owns the stream and the write_batch.
+	 */
+	int is_writing;
+
+	/* this flag is set when a packet requiring immediate flush is pushed into the writer_queue */
+	int is_flush_required;
+
+	/* this flag is set while the stream writer delays the flush of the write_batch.
+	 * delayed_bytes is the number of bytes, which are waiting for the delayed flush.
+	 */
+	int is_flush_delayed;
+	int delayed_bytes;
+
+	/* this flag is set when the server sends the GOAWAY packet, so new requests mustn't be sent
+	 * over the current connection.
+	 */
+	int is_goaway_received;
+
+	/* the maximum time (in milliseconds), during which the stream writer can delay flushing written packets,
+	 * and the number of accumulated bytes, after which the packets are flushed without delay.
+	 */
+	int flush_delay;
+	int flush_threshold;
+
+	/* the timeout (in milliseconds) of the connection's inactivity, after which the stream processor hibernates,
+	 * i.e. frees idle request streams and packet buffers. They are allocated again on demand.
+	 */
+	int hibernation_timeout;
+
+	/* the number of batches started by the mrpc_client_stream_processor_begin_batch(), which aren't ended yet.
+	 * Packets of batched request streams aren't flushed while there are active batches.
+	 */
+	int batches_cnt;
+
 	enum client_stream_processor_state state;
 };
 
@@ -88,108 +193,135 @@ static void release_packet(void *ctx, struct mrpc_packet *packet)
 	release_client_packet(stream_processor, packet);
 }
 
-static void skip_writer_queue_packets(struct mrpc_client_stream_processor *stream_processor)
+static enum ff_result write_packet_directly(struct mrpc_client_stream_processor *stream_processor, struct mrpc_packet *packet)
 {
-	struct ff_blocking_queue *writer_queue;
-
-	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-	writer_queue = stream_processor->writer_queue;
-	for (;;)
-	{
-		struct mrpc_packet *packet;
+	struct mrpc_write_batch *write_batch;
+	struct ff_stream *stream;
+	enum ff_result result;
 
-		ff_blocking_queue_get(writer_queue, (const void **) &packet);
-		if (packet == NULL)
-		{
-			int is_empty;
+	ff_assert(!stream_processor->is_writing);
+	ff_assert(stream_processor->state == STATE_WORKING);
 
-			is_empty = ff_blocking_queue_is_empty(writer_queue);
-			ff_assert(is_empty);
-			break;
-		}
-		release_client_packet(stream_processor, packet);
+	write_batch = stream_processor->write_batch;
+	stream = stream_processor->stream;
+	ff_assert(mrpc_write_batch_is_empty(write_batch));
+	stream_processor->is_writing = 1;
+	mrpc_write_batch_add_packet(write_batch, packet);
+	release_client_packet(stream_processor, packet);
+	result = mrpc_write_batch_write_to_stream(write_batch, stream);
+	if (result == FF_SUCCESS)
+	{
+		result = ff_stream_flush(stream);
 	}
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot write and flush the packet to the stream=%p of the stream_processor=%p. See previous messages for more info", stream, stream_processor);
+		mrpc_write_batch_clear(write_batch);
+		mrpc_client_stream_processor_stop_async(stream_processor);
+	}
+	stream_processor->is_writing = 0;
+	ff_event_set(stream_processor->direct_write_event);
+	return result;
 }
 
-static void stream_writer_func(void *ctx)
+static void write_packet(void *ctx, struct mrpc_packet *packet, int is_flush_required)
 {
 	struct mrpc_client_stream_processor *stream_processor;
-	struct ff_blocking_queue *writer_queue;
-	struct ff_stream *stream;
+	struct request_stream *request_stream;
+	uint32_t request_id;
+	enum mrpc_packet_type packet_type;
+	int is_empty;
+	enum ff_result result;
 
 	stream_processor = (struct mrpc_client_stream_processor *) ctx;
-	ff_assert(stream_processor->stream != NULL);
 	ff_assert(stream_processor->state != STATE_STOPPED);
-	writer_queue = stream_processor->writer_queue;
-	stream = stream_processor->stream;
-	for (;;)
-	{
-		struct mrpc_packet *packet;
-		int is_empty;
-		enum ff_result result;
 
-		ff_blocking_queue_get(writer_queue, (const void **) &packet);
-		if (packet == NULL)
+	/* if the connection is idle, then the packet is written to the stream by the current fiber.
+	 * This avoids waking up the stream writer, so saves a context switch per packet
+	 * on lightly loaded connections. Under load packets are batched by the stream writer.
+	 * Packets are always passed to the stream writer if the flush can be delayed, so small requests
+	 * sent during the flush_delay or during the batch are coalesced into a single write.
+	 */
+	request_id = mrpc_packet_get_request_id(packet);
+	ff_assert(request_id < MAX_REQUEST_STREAMS_CNT);
+	request_stream = stream_processor->active_request_streams[request_id];
+	ff_assert(request_stream != NULL);
+	is_empty = mrpc_writer_queue_is_empty(stream_processor->writer_queue);
+	if (is_empty && !stream_processor->is_writing && stream_processor->state == STATE_WORKING &&
+		stream_processor->flush_delay == 0 && !request_stream->is_batched)
+	{
+		result = write_packet_directly(stream_processor, packet);
+		if (result != FF_SUCCESS)
 		{
-			ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-			is_empty = ff_blocking_queue_is_empty(writer_queue);
-			ff_assert(is_empty);
-			break;
+			/* the packet has been lost, so disconnect the request stream.
+			 * This way the mrpc_packet_stream_flush() reports the error to the caller.
+			 */
+			mrpc_packet_stream_disconnect(request_stream->packet_stream);
 		}
-		result = mrpc_packet_write_to_stream(packet, stream);
-		if (result != FF_SUCCESS)
+	}
+	else
+	{
+		/* high priority requests are latency-sensitive, so they are flushed without delay */
+		packet_type = mrpc_packet_get_type(packet);
+		if (request_stream->priority == MRPC_PRIORITY_HIGH && (packet_type == MRPC_PACKET_END || packet_type == MRPC_PACKET_SINGLE))
 		{
-			ff_log_debug(L"cannot write packet=%p to the stream=%p of the stream_processor=%p. See previous messages for more info",
-				packet, stream, stream_processor);
+			is_flush_required = 1;
 		}
-		release_client_packet(stream_processor, packet);
 
-		/* below is an optimization, which is used for minimizing the number of
-		 * usually expensive ff_stream_flush() calls. These calls are invoked only
-		 * if the writer_queue is empty at the moment. If we won't flush the stream
-		 * this moment moment, then potential deadlock can occur:
-		 * 1) client serializes rpc request into the mrpc_packets and pushes them into the writer_queue.
-		 * 2) this function writes these packets into the stream.
-		 *    Usually this means that the packets' content is buffered in the underlying stream buffer
-		 *    and not sent to the remote side (i.e. server).
-		 * 3) this function blocks awaiting for the new packets in the writer_packet.
-		 * 4) deadlock:
-		 *     - server is blocked awaiting for request from the client, which is still buffered on the client side;
-		 *     - client is blocked awaiting for response from the server.
-		 */
-		is_empty = ff_blocking_queue_is_empty(writer_queue);
-		if (result == FF_SUCCESS && is_empty)
+		/* batches are started by other callers, so requests outside batches mustn't wait for their end */
+		if (!request_stream->is_batched && stream_processor->batches_cnt > 0)
 		{
-			result = ff_stream_flush(stream);
-			if (result != FF_SUCCESS)
-			{
-				ff_log_debug(L"cannot flush the stream=%p of the stream_processor=%p. See previous messages for more info", stream, stream_processor);
-			}
+			is_flush_required = 1;
 		}
-		if (result != FF_SUCCESS)
+		if (is_flush_required)
 		{
-			mrpc_client_stream_processor_stop_async(stream_processor);
-			ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-			skip_writer_queue_packets(stream_processor);
-			break;
+			stream_processor->is_flush_required = 1;
+		}
+		if (stream_processor->is_flush_delayed)
+		{
+			/* the stream writer waits until the flush_delay expires, so wake it up if the packet cannot wait */
+			stream_processor->delayed_bytes += mrpc_packet_get_serialized_size(packet);
+			if (is_flush_required || stream_processor->delayed_bytes >= stream_processor->flush_threshold)
+			{
+				ff_event_set(stream_processor->flush_event);
+			}
 		}
+		/* packets are queued into the flow of their request stream, so the stream writer can interleave
+		 * packets of simultaneously sent requests instead of writing them in arrival order.
+		 */
+		mrpc_writer_queue_put(stream_processor->writer_queue, &request_stream->writer_queue_flow, packet);
 	}
-	ff_event_set(stream_processor->writer_stop_event);
 }
 
-static uint8_t acquire_request_id(struct mrpc_client_stream_processor *stream_processor)
+static void acquire_stream_for_writing(struct mrpc_client_stream_processor *stream_processor)
+{
+	/* wait while a fiber writing a packet directly to the stream finishes */
+	while (stream_processor->is_writing)
+	{
+		ff_event_wait(stream_processor->direct_write_event);
+	}
+	stream_processor->is_writing = 1;
+}
+
+static void release_stream_for_writing(struct mrpc_client_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->is_writing);
+	stream_processor->is_writing = 0;
+}
+
+static uint32_t acquire_request_id(struct mrpc_client_stream_processor *stream_processor)
 {
 	int request_id;
 
 	ff_assert(stream_processor->state != STATE_STOPPED);
 	request_id = mrpc_bitmap_acquire_bit(stream_processor->request_streams_bitmap);
 	ff_assert(request_id >= 0);
-	ff_assert(request_id < MAX_REQUEST_STREAMS_CNT);
+	ff_assert(request_id < stream_processor->protocol_params.max_request_streams_cnt);
 
-	return (uint8_t) request_id;
+	return (uint32_t) request_id;
 }
 
-static void release_request_id(struct mrpc_client_stream_processor *stream_processor, uint8_t request_id)
+static void release_request_id(struct mrpc_client_stream_processor *stream_processor, uint32_t request_id)
 {
 	mrpc_bitmap_release_bit(stream_processor->request_streams_bitmap, request_id);
 }
@@ -202,13 +334,20 @@ static void *create_request_stream(void *ctx)
 	stream_processor = (struct mrpc_client_stream_processor *) ctx;
 	ff_assert(stream_processor->state != STATE_STOPPED);
 
-	/* The current stream processor can simultaneously use up to MAX_PACKETS_CNT packets.
-	 * So, it will be safe to set the reader queue's size to MAX_PACKETS_CNT.
-	 */
 	request_stream = (struct request_stream *) ff_malloc(sizeof(*request_stream));
 	request_stream->stream_processor = stream_processor;
-	request_stream->packet_stream = mrpc_packet_stream_create(stream_processor->writer_queue, MAX_PACKETS_CNT, acquire_packet, release_packet, stream_processor);
+	request_stream->packet_stream = mrpc_packet_stream_create(write_packet, acquire_packet, release_packet, NULL, stream_processor);
+	mrpc_writer_queue_flow_initialize(&request_stream->writer_queue_flow);
+	request_stream->priority = MRPC_PRIORITY_NORMAL;
+	request_stream->is_batched = 0;
 	request_stream->request_id = acquire_request_id(stream_processor);
+	request_stream->response_handler = NULL;
+	request_stream->response_handler_ctx = NULL;
+	request_stream->stream = NULL;
+	request_stream->is_server_overloaded = 0;
+	request_stream->is_request_flushed = 0;
+	request_stream->is_response_started = 0;
+	request_stream->is_response_handler_started = 0;
 
 	return request_stream;
 }
@@ -224,10 +363,20 @@ static void delete_request_stream(void *ctx)
 	ff_free(request_stream);
 }
 
+static int is_flow_control_enabled(struct mrpc_client_stream_processor *stream_processor)
+{
+	return ((stream_processor->protocol_params.features & MRPC_PROTOCOL_FEATURE_CREDITS) != 0);
+}
+
+static int is_priorities_supported(struct mrpc_client_stream_processor *stream_processor)
+{
+	return ((stream_processor->protocol_params.features & MRPC_PROTOCOL_FEATURE_PRIORITIES) != 0);
+}
+
 static struct request_stream *acquire_request_stream(struct mrpc_client_stream_processor *stream_processor)
 {
 	struct request_stream *request_stream;
-	uint8_t request_id;
+	uint32_t request_id;
 
 	ff_assert(stream_processor->active_request_streams_cnt >= 0);
 	ff_assert(stream_processor->active_request_streams_cnt <= MAX_REQUEST_STREAMS_CNT);
@@ -236,7 +385,14 @@ static struct request_stream *acquire_request_stream(struct mrpc_client_stream_p
 	ff_pool_acquire_entry(stream_processor->request_streams_pool, (void **) &request_stream);
 	request_id = request_stream->request_id;
 	ff_assert(stream_processor->active_request_streams[request_id] == NULL);
-	mrpc_packet_stream_initialize(request_stream->packet_stream, request_id);
+	mrpc_packet_stream_initialize(request_stream->packet_stream, request_id, is_flow_control_enabled(stream_processor));
+	request_stream->response_handler = NULL;
+	request_stream->response_handler_ctx = NULL;
+	request_stream->stream = NULL;
+	request_stream->is_server_overloaded = 0;
+	request_stream->is_request_flushed = 0;
+	request_stream->is_response_started = 0;
+	request_stream->is_response_handler_started = 0;
 	stream_processor->active_request_streams[request_id] = request_stream;
 
 	stream_processor->active_request_streams_cnt++;
@@ -248,9 +404,27 @@ static struct request_stream *acquire_request_stream(struct mrpc_client_stream_p
 	return request_stream;
 }
 
+static struct request_stream *find_request_stream(struct mrpc_client_stream_processor *stream_processor, struct ff_stream *stream)
+{
+	struct request_stream *request_stream = NULL;
+	uint32_t request_id;
+
+	/* this is a linear search, but it is performed only when the rpc call fails */
+	for (request_id = 0; request_id < MAX_REQUEST_STREAMS_CNT; request_id++)
+	{
+		if (stream_processor->active_request_streams[request_id] != NULL &&
+			stream_processor->active_request_streams[request_id]->stream == stream)
+		{
+			request_stream = stream_processor->active_request_streams[request_id];
+			break;
+		}
+	}
+	return request_stream;
+}
+
 static void release_request_stream(struct mrpc_client_stream_processor *stream_processor, struct request_stream *request_stream)
 {
-	uint8_t request_id;
+	uint32_t request_id;
 
 	ff_assert(stream_processor->active_request_streams_cnt > 0);
 	ff_assert(stream_processor->active_request_streams_cnt <= MAX_REQUEST_STREAMS_CNT);
@@ -266,6 +440,44 @@ static void release_request_stream(struct mrpc_client_stream_processor *stream_p
 	if (stream_processor->active_request_streams_cnt == 0)
 	{
 		ff_event_set(stream_processor->request_streams_stop_event);
+		if (stream_processor->is_goaway_received && stream_processor->state == STATE_WORKING)
+		{
+			/* the connection will be re-established by the mrpc_client */
+			ff_log_debug(L"the stream_processor=%p completed all the requests after receiving GOAWAY, so it closes the connection", stream_processor);
+			mrpc_client_stream_processor_stop_async(stream_processor);
+		}
+	}
+}
+
+static void response_handler_func(void *ctx)
+{
+	struct request_stream *request_stream;
+	mrpc_client_response_handler response_handler;
+	void *response_handler_ctx;
+	struct ff_stream *stream;
+
+	request_stream = (struct request_stream *) ctx;
+	ff_assert(request_stream->response_handler != NULL);
+	ff_assert(request_stream->stream != NULL);
+
+	/* the request_stream is released by the response_handler, so copy its fields before calling the handler */
+	response_handler = request_stream->response_handler;
+	response_handler_ctx = request_stream->response_handler_ctx;
+	stream = request_stream->stream;
+	response_handler(stream, response_handler_ctx);
+}
+
+static void start_response_handler_if_ready(struct request_stream *request_stream)
+{
+	/* the response_handler is started only after the first response packet is received, so no fibers
+	 * are blocked while the server processes asynchronous requests. The response_handler reads the rest
+	 * of the response as it arrives, so flow control works the same way as for synchronous request streams.
+	 */
+	if (request_stream->response_handler != NULL && request_stream->is_request_flushed &&
+		request_stream->is_response_started && !request_stream->is_response_handler_started)
+	{
+		request_stream->is_response_handler_started = 1;
+		ff_core_fiberpool_execute_async(response_handler_func, request_stream);
 	}
 }
 
@@ -277,16 +489,13 @@ static void *create_packet(void *ctx)
 	stream_processor = (struct mrpc_client_stream_processor *) ctx;
 	ff_assert(stream_processor->state != STATE_STOPPED);
 
-	packet = mrpc_packet_create();
+	packet = mrpc_packet_arena_acquire_packet(stream_processor->packets_arena);
 	return packet;
 }
 
 static void delete_packet(void *ctx)
 {
-	struct mrpc_packet *packet;
-
-	packet = (struct mrpc_packet *) ctx;
-	mrpc_packet_delete(packet);
+	/* packets' memory is owned by the packets_arena, which is deleted after the packets_pool */
 }
 
 static void stop_all_request_streams(struct mrpc_client_stream_processor *stream_processor)
@@ -296,7 +505,7 @@ static void stop_all_request_streams(struct mrpc_client_stream_processor *stream
 
 	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
 	active_request_streams = stream_processor->active_request_streams;
-	for (i = 0; i < MAX_REQUEST_STREAMS_CNT; i++)
+	for (i = 0; i < stream_processor->protocol_params.max_request_streams_cnt; i++)
 	{
 		struct request_stream *request_stream;
 
@@ -304,12 +513,263 @@ static void stop_all_request_streams(struct mrpc_client_stream_processor *stream
 		if (request_stream != NULL)
 		{
 			mrpc_packet_stream_disconnect(request_stream->packet_stream);
+
+			/* the response won't be received, so let the response_handler observe the error */
+			request_stream->is_response_started = 1;
+			start_response_handler_if_ready(request_stream);
 		}
 	}
 	ff_event_wait(stream_processor->request_streams_stop_event);
 	ff_assert(stream_processor->active_request_streams_cnt == 0);
 }
 
+static void shrink_request_streams_pool(struct mrpc_client_stream_processor *stream_processor)
+{
+	int max_request_streams_cnt;
+
+	ff_assert(stream_processor->active_request_streams_cnt == 0);
+
+	/* the ff_pool cannot free its idle entries, so recreate it.
+	 * Request streams will be created again on demand.
+	 */
+	max_request_streams_cnt = stream_processor->protocol_params.max_request_streams_cnt;
+	ff_pool_delete(stream_processor->request_streams_pool);
+	stream_processor->request_streams_pool = ff_pool_create(max_request_streams_cnt, create_request_stream, stream_processor, delete_request_stream);
+}
+
+static void hibernate_if_idle(struct mrpc_client_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->state != STATE_STOPPED);
+
+	/* this function is called by the writer when the writer_queue is empty, so only active request streams
+	 * can hold packets with buffers. The packet held by the reader while it waits for the next packet
+	 * has no buffer. Packet buffers are shared among all the connections, so they can be freed
+	 * only if all the connections in the process are idle.
+	 */
+	if (stream_processor->is_idle && stream_processor->active_request_streams_cnt == 0 && stream_processor->state == STATE_WORKING)
+	{
+		ff_log_debug(L"the stream_processor=%p was idle during the timeout=%d, so it hibernates", stream_processor, stream_processor->hibernation_timeout);
+		shrink_request_streams_pool(stream_processor);
+		mrpc_memory_trim();
+	}
+	stream_processor->is_idle = 1;
+}
+
+static void skip_writer_queue_packets(struct mrpc_client_stream_processor *stream_processor)
+{
+	struct mrpc_writer_queue *writer_queue;
+
+	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
+	writer_queue = stream_processor->writer_queue;
+	for (;;)
+	{
+		struct mrpc_packet *packet;
+
+		mrpc_writer_queue_get(writer_queue, &packet);
+		if (packet == NULL)
+		{
+			int is_empty;
+
+			is_empty = mrpc_writer_queue_is_empty(writer_queue);
+			ff_assert(is_empty);
+			break;
+		}
+		release_client_packet(stream_processor, packet);
+	}
+}
+
+static enum ff_result flush_write_batch(struct mrpc_client_stream_processor *stream_processor)
+{
+	struct mrpc_write_batch *write_batch;
+	struct ff_stream *stream;
+	enum ff_result result;
+
+	write_batch = stream_processor->write_batch;
+	stream = stream_processor->stream;
+	stream_processor->is_flush_required = 0;
+	result = mrpc_write_batch_write_to_stream(write_batch, stream);
+	if (result == FF_SUCCESS)
+	{
+		result = ff_stream_flush(stream);
+	}
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot write and flush packets to the stream=%p of the stream_processor=%p. See previous messages for more info", stream, stream_processor);
+	}
+	return result;
+}
+
+static int is_flush_needed(struct mrpc_client_stream_processor *stream_processor)
+{
+	int batch_size;
+	int is_needed;
+
+	batch_size = mrpc_write_batch_get_size(stream_processor->write_batch);
+	if (stream_processor->batches_cnt > 0)
+	{
+		/* packets are flushed when the batch is ended */
+		is_needed = (stream_processor->is_flush_required || batch_size >= stream_processor->flush_threshold);
+	}
+	else
+	{
+		is_needed = (stream_processor->flush_delay == 0 || stream_processor->is_flush_required ||
+			batch_size >= stream_processor->flush_threshold);
+	}
+	return is_needed;
+}
+
+static void wait_for_delayed_flush(struct mrpc_client_stream_processor *stream_processor)
+{
+	int timeout;
+
+	ff_assert(!stream_processor->is_flush_delayed);
+
+	/* packets aren't flushed while there are active batches. The stream writer is woken up when the batch is ended */
+	timeout = (stream_processor->batches_cnt > 0) ? stream_processor->hibernation_timeout : stream_processor->flush_delay;
+	stream_processor->delayed_bytes = mrpc_write_batch_get_size(stream_processor->write_batch);
+	stream_processor->is_flush_delayed = 1;
+	ff_event_reset(stream_processor->flush_event);
+	ff_event_wait_with_timeout(stream_processor->flush_event, timeout);
+	stream_processor->is_flush_delayed = 0;
+}
+
+static void stream_writer_func(void *ctx)
+{
+	struct mrpc_client_stream_processor *stream_processor;
+	struct mrpc_writer_queue *writer_queue;
+	struct mrpc_write_batch *write_batch;
+	struct ff_stream *stream;
+	int is_stream_acquired;
+
+	/* this flag is set when the flush_delay expired, so the write_batch must be flushed
+	 * as soon as the writer_queue becomes empty.
+	 */
+	int is_flush_due;
+
+	stream_processor = (struct mrpc_client_stream_processor *) ctx;
+	ff_assert(stream_processor->stream != NULL);
+	ff_assert(stream_processor->state != STATE_STOPPED);
+	writer_queue = stream_processor->writer_queue;
+	write_batch = stream_processor->write_batch;
+	ff_assert(mrpc_write_batch_is_empty(write_batch));
+	stream = stream_processor->stream;
+	is_stream_acquired = 0;
+	is_flush_due = 0;
+	for (;;)
+	{
+		struct mrpc_packet *packet;
+		int is_batch_empty;
+		int is_empty;
+		enum ff_result result = FF_SUCCESS;
+
+		is_batch_empty = mrpc_write_batch_is_empty(write_batch);
+		is_empty = mrpc_writer_queue_is_empty(writer_queue);
+		if (!is_batch_empty && is_empty && !is_flush_due)
+		{
+			/* non-empty write_batch means that its flush is delayed in order to coalesce
+			 * packets arriving during the flush_delay into a single ff_stream_flush() call.
+			 * The delay isn't restarted by new packets, so the batch is flushed in flush_delay milliseconds
+			 * after the first delayed packet even under steady traffic.
+			 */
+			ff_assert(is_stream_acquired);
+			wait_for_delayed_flush(stream_processor);
+			is_flush_due = 1;
+			is_empty = mrpc_writer_queue_is_empty(writer_queue);
+		}
+		if (is_flush_due && is_empty)
+		{
+			result = flush_write_batch(stream_processor);
+			is_flush_due = 0;
+		}
+		else
+		{
+			result = mrpc_writer_queue_get_with_timeout(writer_queue, &packet, stream_processor->hibernation_timeout);
+			if (result != FF_SUCCESS)
+			{
+				/* there were no packets to write during the hibernation_timeout */
+				ff_assert(is_batch_empty);
+				hibernate_if_idle(stream_processor);
+				continue;
+			}
+			if (!is_stream_acquired)
+			{
+				/* packets can be written directly to the stream by other fibers while the writer_queue is empty,
+				 * so wait until the direct write completes before touching the stream and the write_batch.
+				 */
+				acquire_stream_for_writing(stream_processor);
+				is_stream_acquired = 1;
+			}
+			if (packet == NULL)
+			{
+				ff_assert(stream_processor->state == STATE_STOP_INITIATED);
+				is_empty = mrpc_writer_queue_is_empty(writer_queue);
+				ff_assert(is_empty);
+				/* the stream is already disconnected, so there is no need in writing pending packets to it */
+				mrpc_write_batch_clear(write_batch);
+				release_stream_for_writing(stream_processor);
+				break;
+			}
+
+			/* packets are accumulated in the write_batch while the writer_queue isn't empty,
+			 * so multiple packets are written to the stream using a single ff_stream_write() call
+			 * instead of writing each packet separately.
+			 */
+			if (!mrpc_write_batch_has_space_for_packet(write_batch, packet))
+			{
+				result = mrpc_write_batch_write_to_stream(write_batch, stream);
+				if (result != FF_SUCCESS)
+				{
+					ff_log_debug(L"cannot write packets to the stream=%p of the stream_processor=%p. See previous messages for more info", stream, stream_processor);
+				}
+			}
+			mrpc_write_batch_add_packet(write_batch, packet);
+			release_client_packet(stream_processor, packet);
+
+			/* below is an optimization, which is used for minimizing the number of
+			 * usually expensive ff_stream_write() and ff_stream_flush() calls. These calls are invoked only
+			 * if the writer_queue is empty at the moment. If we won't write and flush the batch
+			 * this moment moment, then potential deadlock can occur:
+			 * 1) client serializes rpc request into the mrpc_packets and pushes them into the writer_queue.
+			 * 2) this function writes these packets into the stream.
+			 *    Usually this means that the packets' content is buffered in the underlying stream buffer
+			 *    and not sent to the remote side (i.e. server).
+			 * 3) this function blocks awaiting for the new packets in the writer_packet.
+			 * 4) deadlock:
+			 *     - server is blocked awaiting for request from the client, which is still buffered on the client side;
+			 *     - client is blocked awaiting for response from the server.
+			 * If the flush_delay is set, then the flush can be postponed for up to flush_delay milliseconds
+			 * in order to coalesce packets arriving during this interval. This doesn't break the deadlock
+			 * avoidance, because delayed packets are always flushed when the flush_delay expires.
+			 */
+			is_empty = mrpc_writer_queue_is_empty(writer_queue);
+			if (result == FF_SUCCESS && is_empty && (is_flush_due || is_flush_needed(stream_processor)))
+			{
+				result = flush_write_batch(stream_processor);
+				is_flush_due = 0;
+			}
+		}
+		if (result != FF_SUCCESS)
+		{
+			mrpc_write_batch_clear(write_batch);
+			release_stream_for_writing(stream_processor);
+			mrpc_client_stream_processor_stop_async(stream_processor);
+			ff_assert(stream_processor->state == STATE_STOP_INITIATED);
+			skip_writer_queue_packets(stream_processor);
+			break;
+		}
+
+		is_batch_empty = mrpc_write_batch_is_empty(write_batch);
+		is_empty = mrpc_writer_queue_is_empty(writer_queue);
+		if (is_batch_empty && is_empty)
+		{
+			/* the writer_queue is drained, so let other fibers write packets directly to the stream */
+			release_stream_for_writing(stream_processor);
+			is_stream_acquired = 0;
+		}
+	}
+	ff_event_set(stream_processor->writer_stop_event);
+}
+
 static void start_stream_writer(struct mrpc_client_stream_processor *stream_processor)
 {
 	ff_assert(stream_processor->state != STATE_STOPPED);
@@ -319,10 +779,81 @@ static void start_stream_writer(struct mrpc_client_stream_processor *stream_proc
 static void stop_stream_writer(struct mrpc_client_stream_processor *stream_processor)
 {
 	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-	ff_blocking_queue_put(stream_processor->writer_queue, NULL);
+	mrpc_writer_queue_put_stop_marker(stream_processor->writer_queue);
+	if (stream_processor->is_flush_delayed)
+	{
+		ff_event_set(stream_processor->flush_event);
+	}
 	ff_event_wait(stream_processor->writer_stop_event);
 }
 
+static enum ff_result perform_handshake(struct mrpc_client_stream_processor *stream_processor)
+{
+	struct mrpc_protocol_params *protocol_params;
+	int is_rejected;
+	enum ff_result result;
+
+	ff_assert(stream_processor->state == STATE_HANDSHAKE);
+	protocol_params = &stream_processor->protocol_params;
+	mrpc_protocol_get_default_params(protocol_params, stream_processor->max_protocol_version);
+	if (protocol_params->version == MRPC_PROTOCOL_V1)
+	{
+		/* the server doesn't support the handshake */
+		return FF_SUCCESS;
+	}
+
+	result = mrpc_protocol_client_handshake(stream_processor->stream, protocol_params, &is_rejected);
+	if (result == FF_SUCCESS)
+	{
+		stream_processor->handshake_rejections_cnt = 0;
+	}
+	else if (is_rejected && stream_processor->state == STATE_HANDSHAKE)
+	{
+		stream_processor->handshake_rejections_cnt++;
+		if (stream_processor->handshake_rejections_cnt == MAX_HANDSHAKE_REJECTIONS_CNT)
+		{
+			/* the server repeatedly rejects the handshake, so it doesn't support it.
+			 * Fall back to the MRPC_PROTOCOL_V1 for subsequent connections.
+			 */
+			ff_log_debug(L"the server rejected the handshake %d times for the stream_processor=%p. Falling back to the protocol version=%d",
+				MAX_HANDSHAKE_REJECTIONS_CNT, stream_processor, (int) MRPC_PROTOCOL_V1);
+			stream_processor->max_protocol_version = MRPC_PROTOCOL_V1;
+		}
+	}
+	return result;
+}
+
+static void create_connection_resources(struct mrpc_client_stream_processor *stream_processor)
+{
+	int max_request_streams_cnt;
+
+	/* request_id range and packets' size depend on the protocol parameters negotiated
+	 * during the handshake, so these resources are created for each connection.
+	 */
+	max_request_streams_cnt = stream_processor->protocol_params.max_request_streams_cnt;
+	stream_processor->request_streams_bitmap = mrpc_bitmap_create(max_request_streams_cnt);
+	stream_processor->request_streams_pool = ff_pool_create(max_request_streams_cnt, create_request_stream, stream_processor, delete_request_stream);
+	stream_processor->packets_arena = mrpc_packet_arena_create(stream_processor->protocol_params.version, stream_processor->protocol_params.max_packet_size);
+	stream_processor->packets_pool = ff_pool_create(GET_MAX_PACKETS_CNT(max_request_streams_cnt), create_packet, stream_processor, delete_packet);
+}
+
+static void delete_connection_resources(struct mrpc_client_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->active_request_streams_cnt == 0);
+
+	/* request streams must be deleted before the request_streams_bitmap,
+	 * because they release their request_id's into it.
+	 */
+	ff_pool_delete(stream_processor->request_streams_pool);
+	mrpc_bitmap_delete(stream_processor->request_streams_bitmap);
+	ff_pool_delete(stream_processor->packets_pool);
+	mrpc_packet_arena_delete(stream_processor->packets_arena);
+	stream_processor->request_streams_pool = NULL;
+	stream_processor->request_streams_bitmap = NULL;
+	stream_processor->packets_pool = NULL;
+	stream_processor->packets_arena = NULL;
+}
+
 static void delete_request_stream_wrapper(void *ctx)
 {
 	struct request_stream *request_stream;
@@ -336,14 +867,22 @@ static void delete_request_stream_wrapper(void *ctx)
 static enum ff_result read_from_request_stream_wrapper(void *ctx, void *buf, int len)
 {
 	struct request_stream *request_stream;
+	struct mrpc_packet_stream *packet_stream;
 	enum ff_result result;
 
 	request_stream = (struct request_stream *) ctx;
 	ff_assert(request_stream->packet_stream != NULL);
-	result = mrpc_packet_stream_read(request_stream->packet_stream, buf, len);
+	packet_stream = request_stream->packet_stream;
+	result = mrpc_packet_stream_read(packet_stream, buf, len);
+	request_stream->is_server_overloaded = 0;
 	if (result != FF_SUCCESS)
 	{
 		ff_log_debug(L"cannot read data from the request_stream=%p to the buf=%p, len=%d. See previous messages for more info", request_stream, buf, len);
+		if (mrpc_packet_stream_is_empty(packet_stream))
+		{
+			ff_log_debug(L"the server rejected the request in the request_stream=%p, because it is overloaded", request_stream);
+			request_stream->is_server_overloaded = 1;
+		}
 	}
 	return result;
 }
@@ -375,6 +914,14 @@ static enum ff_result flush_request_stream_wrapper(void *ctx)
 	{
 		ff_log_debug(L"cannot flush the request_stream=%p. See previous messages for more info", request_stream);
 	}
+	else if (request_stream->response_handler != NULL)
+	{
+		/* the asynchronous request stream is owned by the response_handler after the request is flushed.
+		 * It remains owned by the caller if the flush fails, so the caller can report the failure.
+		 */
+		request_stream->is_request_flushed = 1;
+		start_response_handler_if_ready(request_stream);
+	}
 	return result;
 }
 
@@ -396,7 +943,8 @@ static const struct ff_stream_vtable request_stream_wrapper_vtable =
 	disconnect_request_stream_wrapper
 };
 
-static struct ff_stream *create_request_stream_wrapper(struct mrpc_client_stream_processor *stream_processor)
+static struct ff_stream *create_request_stream_wrapper(struct mrpc_client_stream_processor *stream_processor, enum mrpc_priority priority,
+	int is_batched, mrpc_client_response_handler response_handler, void *response_handler_ctx)
 {
 	struct request_stream *request_stream;
 	struct ff_stream *stream;
@@ -406,7 +954,28 @@ static struct ff_stream *create_request_stream_wrapper(struct mrpc_client_stream
 	request_stream = acquire_request_stream(stream_processor);
 	ff_assert(request_stream->packet_stream != NULL);
 	ff_assert(request_stream->stream_processor == stream_processor);
+	mrpc_writer_queue_flow_set_priority(&request_stream->writer_queue_flow, priority);
+	request_stream->priority = priority;
+	request_stream->is_batched = is_batched;
+	if (is_priorities_supported(stream_processor))
+	{
+		uint8_t priority_value;
+		enum ff_result result;
+
+		/* the server schedules the request and its response according to the priority,
+		 * which precedes the request. The priority fits into the empty first packet, so it cannot fail.
+		 */
+		priority_value = (uint8_t) priority;
+		result = mrpc_packet_stream_write(request_stream->packet_stream, &priority_value, 1);
+		ff_assert(result == FF_SUCCESS);
+	}
 	stream = ff_stream_create(&request_stream_wrapper_vtable, request_stream);
+	request_stream->stream = stream;
+	if (response_handler != NULL)
+	{
+		request_stream->response_handler = response_handler;
+		request_stream->response_handler_ctx = response_handler_ctx;
+	}
 	return stream;
 }
 
@@ -416,19 +985,36 @@ struct mrpc_client_stream_processor *mrpc_client_stream_processor_create()
 
 	stream_processor = (struct mrpc_client_stream_processor *) ff_malloc(sizeof(*stream_processor));
 
-	/* the maximum number of packets in the writer_queue is limited by the packets_pool size (MAX_PACKETS_CNT),
+	/* the writer_queue is unbounded, but the maximum number of packets in it is limited by the packets_pool size (MAX_PACKETS_CNT),
 	 * because only packets from those pool can be used by the stream_processor.
 	 */
-	stream_processor->writer_queue = ff_blocking_queue_create(MAX_PACKETS_CNT);
+	stream_processor->writer_queue = mrpc_writer_queue_create();
+	stream_processor->write_batch = mrpc_write_batch_create();
 	stream_processor->writer_stop_event = ff_event_create(FF_EVENT_AUTO);
-	stream_processor->request_streams_bitmap = mrpc_bitmap_create(MAX_REQUEST_STREAMS_CNT);
-	stream_processor->request_streams_pool = ff_pool_create(MAX_REQUEST_STREAMS_CNT, create_request_stream, stream_processor, delete_request_stream);
+	stream_processor->direct_write_event = ff_event_create(FF_EVENT_AUTO);
+	stream_processor->flush_event = ff_event_create(FF_EVENT_AUTO);
+	stream_processor->request_streams_bitmap = NULL;
+	stream_processor->request_streams_pool = NULL;
 	stream_processor->request_streams_stop_event = ff_event_create(FF_EVENT_AUTO);
-	stream_processor->packets_pool = ff_pool_create(MAX_PACKETS_CNT, create_packet, stream_processor, delete_packet);
+	stream_processor->packets_pool = NULL;
+	stream_processor->packets_arena = NULL;
 	stream_processor->active_request_streams = (struct request_stream **) ff_calloc(MAX_REQUEST_STREAMS_CNT, sizeof(stream_processor->active_request_streams[0]));
 
 	stream_processor->stream = NULL;
+	mrpc_protocol_get_default_params(&stream_processor->protocol_params, MRPC_PROTOCOL_V2);
+	stream_processor->max_protocol_version = MRPC_PROTOCOL_V2;
+	stream_processor->handshake_rejections_cnt = 0;
 	stream_processor->active_request_streams_cnt = 0;
+	stream_processor->is_idle = 0;
+	stream_processor->is_writing = 0;
+	stream_processor->is_flush_required = 0;
+	stream_processor->is_flush_delayed = 0;
+	stream_processor->delayed_bytes = 0;
+	stream_processor->is_goaway_received = 0;
+	stream_processor->flush_delay = MRPC_DEFAULT_FLUSH_DELAY;
+	stream_processor->flush_threshold = MRPC_DEFAULT_FLUSH_THRESHOLD;
+	stream_processor->hibernation_timeout = MRPC_DEFAULT_HIBERNATION_TIMEOUT;
+	stream_processor->batches_cnt = 0;
 	stream_processor->state = STATE_STOPPED;
 
 	return stream_processor;
@@ -444,24 +1030,32 @@ void mrpc_client_stream_processor_delete(struct mrpc_client_stream_processor *st
 	 * after the mrpc_client_stream_processor_stop_async() call.
 	 */
 	ff_assert(stream_processor->state != STATE_WORKING);
+	ff_assert(stream_processor->state != STATE_HANDSHAKE);
+	ff_assert(stream_processor->packets_pool == NULL);
+	ff_assert(stream_processor->packets_arena == NULL);
+	ff_assert(stream_processor->request_streams_pool == NULL);
+	ff_assert(stream_processor->request_streams_bitmap == NULL);
 
 	ff_free(stream_processor->active_request_streams);
-	ff_pool_delete(stream_processor->packets_pool);
 	ff_event_delete(stream_processor->request_streams_stop_event);
-	ff_pool_delete(stream_processor->request_streams_pool);
-	mrpc_bitmap_delete(stream_processor->request_streams_bitmap);
+	ff_event_delete(stream_processor->flush_event);
+	ff_event_delete(stream_processor->direct_write_event);
 	ff_event_delete(stream_processor->writer_stop_event);
-	ff_blocking_queue_delete(stream_processor->writer_queue);
+	mrpc_write_batch_delete(stream_processor->write_batch);
+	mrpc_writer_queue_delete(stream_processor->writer_queue);
 	ff_free(stream_processor);
 }
 
 void mrpc_client_stream_processor_process_stream(struct mrpc_client_stream_processor *stream_processor, struct ff_stream *stream)
 {
 	struct request_stream **active_request_streams;
+	uint32_t max_request_streams_cnt;
+	enum ff_result result;
 
 	ff_assert(stream_processor->stream == NULL);
 	ff_assert(stream_processor->active_request_streams_cnt == 0);
 	ff_assert(stream_processor->state != STATE_WORKING);
+	ff_assert(stream_processor->state != STATE_HANDSHAKE);
 
 	if (stream_processor->state == STATE_STOP_INITIATED)
 	{
@@ -469,17 +1063,29 @@ void mrpc_client_stream_processor_process_stream(struct mrpc_client_stream_proce
 		goto end;
 	}
 	ff_assert(stream_processor->state == STATE_STOPPED);
-	stream_processor->state = STATE_WORKING;
+	stream_processor->state = STATE_HANDSHAKE;
 	stream_processor->stream = stream;
+	result = perform_handshake(stream_processor);
+	if (result != FF_SUCCESS || stream_processor->state != STATE_HANDSHAKE)
+	{
+		ff_log_debug(L"cannot perform handshake on the stream=%p for the stream_processor=%p. See previous messages for more info", stream, stream_processor);
+		stream_processor->stream = NULL;
+		goto end;
+	}
+	stream_processor->state = STATE_WORKING;
+	create_connection_resources(stream_processor);
+	stream_processor->is_idle = 0;
+	stream_processor->is_goaway_received = 0;
 	start_stream_writer(stream_processor);
 	ff_event_set(stream_processor->request_streams_stop_event);
 	active_request_streams = stream_processor->active_request_streams;
+	max_request_streams_cnt = (uint32_t) stream_processor->protocol_params.max_request_streams_cnt;
 	for (;;)
 	{
 		struct mrpc_packet *packet;
 		struct request_stream *request_stream;
-		uint8_t request_id;
-		enum ff_result result;
+		uint32_t request_id;
+		int is_credit_packet;
 
 		packet = acquire_client_packet(stream_processor);
 		result = mrpc_packet_read_from_stream(packet, stream);
@@ -489,31 +1095,137 @@ void mrpc_client_stream_processor_process_stream(struct mrpc_client_stream_proce
 			release_client_packet(stream_processor, packet);
 			break;
 		}
+		stream_processor->is_idle = 0;
+
+		if (mrpc_protocol_is_goaway(&stream_processor->protocol_params, packet))
+		{
+			ff_log_debug(L"the server sent GOAWAY over the stream=%p, so new requests won't be sent over it", stream);
+			release_client_packet(stream_processor, packet);
+			stream_processor->is_goaway_received = 1;
+			if (stream_processor->active_request_streams_cnt == 0)
+			{
+				break;
+			}
+			continue;
+		}
 
 		request_id = mrpc_packet_get_request_id(packet);
+		if (request_id >= max_request_streams_cnt)
+		{
+			ff_log_debug(L"wrong request_id=%lu has been read from the stream=%p. It must be less than %lu", request_id, stream, max_request_streams_cnt);
+			release_client_packet(stream_processor, packet);
+			break;
+		}
 		request_stream = active_request_streams[request_id];
+		is_credit_packet = (is_flow_control_enabled(stream_processor) && mrpc_packet_stream_is_credit_packet(packet));
 		if (request_stream == NULL)
 		{
-			ff_log_debug(L"there is no active request_stream for the request_id=%lu read from the stream=%p", (uint32_t) request_id, stream);
+			if (is_credit_packet)
+			{
+				/* the server can send credits for the request after the request_stream has been released */
+				release_client_packet(stream_processor, packet);
+				continue;
+			}
+			ff_log_debug(L"there is no active request_stream for the request_id=%lu read from the stream=%p", request_id, stream);
 			release_client_packet(stream_processor, packet);
 			break;
 		}
-		mrpc_packet_stream_push_packet(request_stream->packet_stream, packet);
+		result = mrpc_packet_stream_push_packet(request_stream->packet_stream, packet);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot push the packet=%p read from the stream=%p to the request_stream=%p. See previous messages for more info", packet, stream, request_stream);
+			break;
+		}
+		if (!is_credit_packet && request_stream->response_handler != NULL)
+		{
+			request_stream->is_response_started = 1;
+			start_response_handler_if_ready(request_stream);
+		}
 	}
 	mrpc_client_stream_processor_stop_async(stream_processor);
 	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
 	stop_all_request_streams(stream_processor);
 	ff_assert(stream_processor->active_request_streams_cnt == 0);
 	stop_stream_writer(stream_processor);
+	delete_connection_resources(stream_processor);
 	stream_processor->stream = NULL;
 
 end:
 	stream_processor->state = STATE_STOPPED;
 }
 
+void mrpc_client_stream_processor_set_flush_policy(struct mrpc_client_stream_processor *stream_processor, int flush_delay, int flush_threshold)
+{
+	ff_assert(flush_delay >= 0);
+	ff_assert(flush_threshold >= 0);
+
+	stream_processor->flush_delay = flush_delay;
+	stream_processor->flush_threshold = flush_threshold;
+}
+
+void mrpc_client_stream_processor_set_hibernation_timeout(struct mrpc_client_stream_processor *stream_processor, int hibernation_timeout)
+{
+	ff_assert(hibernation_timeout > 0);
+
+	stream_processor->hibernation_timeout = hibernation_timeout;
+}
+
+void mrpc_client_stream_processor_begin_batch(struct mrpc_client_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->batches_cnt >= 0);
+
+	stream_processor->batches_cnt++;
+	if (stream_processor->is_writing)
+	{
+		/* packets written before the batch mustn't wait for its end */
+		stream_processor->is_flush_required = 1;
+	}
+}
+
+void mrpc_client_stream_processor_end_batch(struct mrpc_client_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->batches_cnt > 0);
+
+	stream_processor->batches_cnt--;
+
+	/* packets of the batch can be either in the write_batch or in the writer_queue, which isn't read
+	 * by the stream writer yet. They mustn't wait for the end of batches started by other callers,
+	 * so they are flushed by the stream writer as soon as the writer_queue becomes empty.
+	 * The stream writer delays the flush with the hibernation_timeout while batches are active,
+	 * so wake it up if it is waiting.
+	 */
+	stream_processor->is_flush_required = 1;
+	if (stream_processor->is_flush_delayed)
+	{
+		ff_event_set(stream_processor->flush_event);
+	}
+}
+
+int mrpc_client_stream_processor_get_active_request_streams_cnt(struct mrpc_client_stream_processor *stream_processor)
+{
+	return stream_processor->active_request_streams_cnt;
+}
+
+int mrpc_client_stream_processor_has_request_stream(struct mrpc_client_stream_processor *stream_processor, struct ff_stream *stream)
+{
+	struct request_stream *request_stream;
+
+	request_stream = find_request_stream(stream_processor, stream);
+	return (request_stream != NULL);
+}
+
+int mrpc_client_stream_processor_is_request_stream_server_overloaded(struct mrpc_client_stream_processor *stream_processor, struct ff_stream *stream)
+{
+	struct request_stream *request_stream;
+
+	request_stream = find_request_stream(stream_processor, stream);
+	ff_assert(request_stream != NULL);
+	return request_stream->is_server_overloaded;
+}
+
 void mrpc_client_stream_processor_stop_async(struct mrpc_client_stream_processor *stream_processor)
 {
-	if (stream_processor->state == STATE_WORKING)
+	if (stream_processor->state == STATE_WORKING || stream_processor->state == STATE_HANDSHAKE)
 	{
 		ff_assert(stream_processor->stream != NULL);
 		stream_processor->state = STATE_STOP_INITIATED;
@@ -538,17 +1250,18 @@ void mrpc_client_stream_processor_stop_async(struct mrpc_client_stream_processor
 	}
 }
 
-struct ff_stream *mrpc_client_stream_processor_create_request_stream(struct mrpc_client_stream_processor *stream_processor)
+struct ff_stream *mrpc_client_stream_processor_create_request_stream(struct mrpc_client_stream_processor *stream_processor, enum mrpc_priority priority,
+	int is_batched, mrpc_client_response_handler response_handler, void *response_handler_ctx)
 {
 	struct ff_stream *stream = NULL;
 
-	if (stream_processor->state == STATE_WORKING)
+	if (stream_processor->state == STATE_WORKING && !stream_processor->is_goaway_received)
 	{
-		stream = create_request_stream_wrapper(stream_processor);
+		stream = create_request_stream_wrapper(stream_processor, priority, is_batched, response_handler, response_handler_ctx);
 	}
 	else
 	{
-		ff_log_debug(L"the stream_processor=%p cannot create request stream, because it is stopped or its stop process is initiated");
+		ff_log_debug(L"the stream_processor=%p cannot create request stream, because it is stopped, its stop process is initiated or the server sent GOAWAY", stream_processor);
 	}
 	return stream;
 }
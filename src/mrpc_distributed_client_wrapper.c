@@ -17,7 +17,7 @@ struct mrpc_distributed_client_wrapper *mrpc_distributed_client_wrapper_create()
 	struct mrpc_distributed_client_wrapper *client_wrapper;
 
 	client_wrapper = (struct mrpc_distributed_client_wrapper *) ff_malloc(sizeof(*client_wrapper));
-	client_wrapper->client = mrpc_client_create();
+	client_wrapper->client = mrpc_client_create(1);
 	client_wrapper->stop_event = ff_event_create(FF_EVENT_MANUAL);
 
 	client_wrapper->stream_connector = NULL;
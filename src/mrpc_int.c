@@ -12,6 +12,8 @@
 
 #define MAX_UINT32_VALUE ((1ull << 32) - 1)
 
+#define MAX_UINT32_OCTETS MAX_UINT_N_OCTETS(32)
+
 enum ff_result mrpc_uint64_serialize(uint64_t data, struct ff_stream *stream)
 {
 	int len;
@@ -226,3 +228,56 @@ uint32_t mrpc_int32_get_hash(int32_t data, uint32_t start_value)
 	hash_value = ff_hash_uint32(start_value, (uint32_t *) &data, 1);
 	return hash_value;
 }
+
+
+int mrpc_uint32_encode(uint32_t data, char *buf)
+{
+	int len;
+
+	len = 0;
+	do
+	{
+		uint8_t octet;
+
+		ff_assert(len < MAX_UINT32_OCTETS);
+		octet = (uint8_t) (data & OCTET_MASK);
+		data >>= BITS_PER_OCTET;
+		octet |= (uint8_t) ((data != 0) ? CONTINUE_NUMBER_FLAG : 0);
+		buf[len] = (char) octet;
+		len++;
+	}
+	while (data != 0);
+
+	return len;
+}
+
+int mrpc_uint32_decode(uint32_t *data, const char *buf, int len)
+{
+	uint64_t u_data = 0;
+	int i;
+
+	ff_assert(len >= 0);
+	for (i = 0; i < len; i++)
+	{
+		uint8_t octet;
+
+		if (i >= MAX_UINT32_OCTETS)
+		{
+			return -1;
+		}
+		octet = (uint8_t) buf[i];
+		u_data |= ((uint64_t) (octet & OCTET_MASK)) << (i * BITS_PER_OCTET);
+		if ((octet & CONTINUE_NUMBER_FLAG) == 0)
+		{
+			if (u_data > MAX_UINT32_VALUE)
+			{
+				return -1;
+			}
+			*data = (uint32_t) u_data;
+			return i + 1;
+		}
+	}
+
+	/* the buf doesn't contain the whole encoded value yet */
+	return 0;
+}
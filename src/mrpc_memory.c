@@ -0,0 +1,523 @@
+#include "private/mrpc_common.h"
+
+#include "private/mrpc_memory.h"
+#include "private/mrpc_protocol.h"
+#include "ff/ff_event.h"
+
+#include <stdlib.h>
+
+/* the approximate size of a single memory block with packet buffers.
+ * Blocks are allocated lazily. The block contains at least one packet buffer.
+ */
+#define BLOCK_SIZE 0x10000
+
+/* alignment of packet buffers. It is equal to the typical cache line size. */
+#define PACKET_BUF_ALIGNMENT 64
+
+/* sizes of packet buffers' classes.
+ * Most of rpc requests and responses are small, so packets start with the smallest buffer
+ * and are promoted to buffers from bigger classes as they are filled.
+ * The last class has the maximum packet size among all the protocol versions.
+ */
+#define SMALL_BUF_SIZE 0x80
+#define MEDIUM_BUF_SIZE 0x400
+#define LARGE_BUF_SIZE 0x2000
+#define MAX_BUF_SIZE MRPC_PROTOCOL_MAX_PACKET_SIZE
+
+#define BUF_CLASSES_CNT 4
+
+#define ALIGN_UP(n, alignment) (((n) + (alignment) - 1) & ~((alignment) - 1))
+
+struct memory_block
+{
+	struct memory_block *next;
+
+	/* packet buffers of the same class are located between bufs and bufs_end */
+	char *bufs;
+	char *bufs_end;
+	int bufs_cnt;
+
+	/* the number of free buffers in the block. It is calculated by the mrpc_memory_trim() */
+	int free_bufs_cnt;
+};
+
+struct buf_class
+{
+	/* the list of free buffers. Pointer to the next free buffer
+	 * is stored at the beginning of each free buffer.
+	 */
+	char *free_bufs;
+
+	/* buffers, which weren't used yet, in the last allocated block */
+	char *next_buf;
+	int bufs_left;
+
+	int buf_size;
+	int buf_stride;
+};
+
+struct packets_memory
+{
+	struct memory_block *blocks;
+	struct buf_class buf_classes[BUF_CLASSES_CNT];
+
+	/* this event is set while the used_bytes is below the limit */
+	struct ff_event *below_limit_event;
+	int is_below_limit;
+
+	int refs_cnt;
+	int used_bytes;
+	int allocated_bytes;
+	int acquired_bufs_cnt;
+
+	/* this flag is set by the mrpc_memory_trim() and is cleared when a buffer is released,
+	 * so subsequent mrpc_memory_trim() calls don't scan free buffers in vain.
+	 */
+	int is_trimmed;
+};
+
+/* all the fibers are executed in the same thread, so the pool is shared
+ * among all the connections without locking.
+ */
+static struct packets_memory packets_memory;
+
+static int packets_limit = MRPC_MEMORY_DEFAULT_PACKETS_LIMIT;
+
+/* timeout (in milliseconds) for waiting in the mrpc_memory_throttle().
+ * The connection is closed if the limit is still exceeded after this timeout, so packets occupied
+ * by its request streams are released and other connections can proceed.
+ */
+static int throttle_timeout = MRPC_MEMORY_DEFAULT_THROTTLE_TIMEOUT;
+
+static void reset_buf_class(struct buf_class *buf_class)
+{
+	buf_class->free_bufs = NULL;
+	buf_class->next_buf = NULL;
+	buf_class->bufs_left = 0;
+}
+
+static void free_blocks(struct packets_memory *memory)
+{
+	struct memory_block *block;
+	int i;
+
+	block = memory->blocks;
+	while (block != NULL)
+	{
+		struct memory_block *next_block;
+
+		next_block = block->next;
+		ff_free(block);
+		block = next_block;
+	}
+	memory->blocks = NULL;
+	memory->allocated_bytes = 0;
+	for (i = 0; i < BUF_CLASSES_CNT; i++)
+	{
+		reset_buf_class(&memory->buf_classes[i]);
+	}
+}
+
+static char *allocate_block(struct packets_memory *memory, int bufs_cnt, int buf_stride)
+{
+	struct memory_block *block;
+	char *p;
+	int size;
+
+	size = bufs_cnt * buf_stride;
+	p = (char *) ff_malloc(sizeof(*block) + PACKET_BUF_ALIGNMENT + size);
+	block = (struct memory_block *) p;
+	block->next = memory->blocks;
+	memory->blocks = block;
+	p += sizeof(*block);
+	p = (char *) ALIGN_UP((size_t) p, PACKET_BUF_ALIGNMENT);
+	block->bufs = p;
+	block->bufs_end = p + size;
+	block->bufs_cnt = bufs_cnt;
+	block->free_bufs_cnt = 0;
+	memory->allocated_bytes += size;
+
+	return p;
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+	const struct memory_block *block_a;
+	const struct memory_block *block_b;
+
+	block_a = *(const struct memory_block **) a;
+	block_b = *(const struct memory_block **) b;
+	if (block_a->bufs < block_b->bufs)
+	{
+		return -1;
+	}
+	return (block_a->bufs > block_b->bufs) ? 1 : 0;
+}
+
+/**
+ * Returns the block containing the given buffer.
+ * blocks must be sorted by the compare_blocks().
+ */
+static struct memory_block *find_block(struct memory_block **blocks, int blocks_cnt, const char *buf)
+{
+	int lo;
+	int hi;
+
+	lo = 0;
+	hi = blocks_cnt - 1;
+	while (lo <= hi)
+	{
+		struct memory_block *block;
+		int mid;
+
+		mid = lo + (hi - lo) / 2;
+		block = blocks[mid];
+		if (buf < block->bufs)
+		{
+			hi = mid - 1;
+		}
+		else if (buf >= block->bufs_end)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			return block;
+		}
+	}
+	ff_assert(0);
+	return NULL;
+}
+
+static int is_block_free(struct memory_block *block)
+{
+	return (block->free_bufs_cnt == block->bufs_cnt);
+}
+
+static void count_free_bufs(struct buf_class *buf_class, struct memory_block **blocks, int blocks_cnt)
+{
+	struct memory_block *block;
+	char *buf;
+
+	buf = buf_class->free_bufs;
+	while (buf != NULL)
+	{
+		block = find_block(blocks, blocks_cnt, buf);
+		block->free_bufs_cnt++;
+		buf = *(char **) buf;
+	}
+	if (buf_class->bufs_left > 0)
+	{
+		/* buffers, which weren't used yet, are free too */
+		block = find_block(blocks, blocks_cnt, buf_class->next_buf);
+		block->free_bufs_cnt += buf_class->bufs_left;
+	}
+}
+
+static void remove_free_blocks_bufs(struct buf_class *buf_class, struct memory_block **blocks, int blocks_cnt)
+{
+	struct memory_block *block;
+	char **link;
+
+	link = &buf_class->free_bufs;
+	while (*link != NULL)
+	{
+		char *buf;
+
+		buf = *link;
+		block = find_block(blocks, blocks_cnt, buf);
+		if (is_block_free(block))
+		{
+			*link = *(char **) buf;
+		}
+		else
+		{
+			link = (char **) buf;
+		}
+	}
+	if (buf_class->bufs_left > 0)
+	{
+		block = find_block(blocks, blocks_cnt, buf_class->next_buf);
+		if (is_block_free(block))
+		{
+			buf_class->next_buf = NULL;
+			buf_class->bufs_left = 0;
+		}
+	}
+}
+
+static struct buf_class *get_buf_class(struct packets_memory *memory, int size)
+{
+	struct buf_class *buf_class;
+	int i;
+
+	ff_assert(size > 0);
+	ff_assert(size <= MAX_BUF_SIZE);
+	for (i = 0; i < BUF_CLASSES_CNT; i++)
+	{
+		buf_class = &memory->buf_classes[i];
+		if (size <= buf_class->buf_size)
+		{
+			break;
+		}
+	}
+	ff_assert(i < BUF_CLASSES_CNT);
+
+	return buf_class;
+}
+
+static void update_below_limit_event(struct packets_memory *memory)
+{
+	int is_below_limit;
+
+	is_below_limit = (memory->used_bytes < packets_limit);
+	if (is_below_limit != memory->is_below_limit)
+	{
+		if (is_below_limit)
+		{
+			ff_event_set(memory->below_limit_event);
+		}
+		else
+		{
+			ff_event_reset(memory->below_limit_event);
+		}
+		memory->is_below_limit = is_below_limit;
+	}
+}
+
+void mrpc_memory_set_packets_limit(int limit)
+{
+	ff_assert(limit > 0);
+
+	packets_limit = limit;
+	if (packets_memory.refs_cnt > 0)
+	{
+		update_below_limit_event(&packets_memory);
+	}
+}
+
+void mrpc_memory_set_throttle_timeout(int timeout)
+{
+	ff_assert(timeout > 0);
+
+	throttle_timeout = timeout;
+}
+
+void mrpc_memory_acquire(void)
+{
+	struct packets_memory *memory;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt >= 0);
+	if (memory->refs_cnt == 0)
+	{
+		static const int buf_sizes[BUF_CLASSES_CNT] = {SMALL_BUF_SIZE, MEDIUM_BUF_SIZE, LARGE_BUF_SIZE, MAX_BUF_SIZE};
+		int i;
+
+		memory->blocks = NULL;
+		memory->allocated_bytes = 0;
+		for (i = 0; i < BUF_CLASSES_CNT; i++)
+		{
+			struct buf_class *buf_class;
+
+			buf_class = &memory->buf_classes[i];
+			reset_buf_class(buf_class);
+			buf_class->buf_size = buf_sizes[i];
+			buf_class->buf_stride = ALIGN_UP(buf_sizes[i], PACKET_BUF_ALIGNMENT);
+		}
+		memory->below_limit_event = ff_event_create(FF_EVENT_MANUAL);
+		memory->is_below_limit = 0;
+		memory->used_bytes = 0;
+		memory->acquired_bufs_cnt = 0;
+		memory->is_trimmed = 0;
+		update_below_limit_event(memory);
+	}
+	memory->refs_cnt++;
+}
+
+void mrpc_memory_release(void)
+{
+	struct packets_memory *memory;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt > 0);
+	memory->refs_cnt--;
+	if (memory->refs_cnt == 0)
+	{
+		ff_assert(memory->acquired_bufs_cnt == 0);
+		ff_assert(memory->used_bytes == 0);
+		free_blocks(memory);
+		ff_event_delete(memory->below_limit_event);
+		memory->below_limit_event = NULL;
+	}
+}
+
+char *mrpc_memory_acquire_packet_buf(int size, int *capacity)
+{
+	struct packets_memory *memory;
+	struct buf_class *buf_class;
+	char *buf;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt > 0);
+
+	buf_class = get_buf_class(memory, size);
+	buf = buf_class->free_bufs;
+	if (buf != NULL)
+	{
+		buf_class->free_bufs = *(char **) buf;
+	}
+	else
+	{
+		if (buf_class->bufs_left == 0)
+		{
+			int bufs_cnt;
+
+			bufs_cnt = BLOCK_SIZE / buf_class->buf_stride;
+			if (bufs_cnt == 0)
+			{
+				bufs_cnt = 1;
+			}
+			buf_class->next_buf = allocate_block(memory, bufs_cnt, buf_class->buf_stride);
+			buf_class->bufs_left = bufs_cnt;
+		}
+		buf = buf_class->next_buf;
+		buf_class->next_buf += buf_class->buf_stride;
+		buf_class->bufs_left--;
+	}
+	*capacity = buf_class->buf_size;
+	memory->acquired_bufs_cnt++;
+	memory->used_bytes += buf_class->buf_size;
+	update_below_limit_event(memory);
+
+	return buf;
+}
+
+void mrpc_memory_release_packet_buf(char *buf, int capacity)
+{
+	struct packets_memory *memory;
+	struct buf_class *buf_class;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt > 0);
+	ff_assert(memory->acquired_bufs_cnt > 0);
+
+	buf_class = get_buf_class(memory, capacity);
+	*(char **) buf = buf_class->free_bufs;
+	buf_class->free_bufs = buf;
+	memory->acquired_bufs_cnt--;
+	memory->used_bytes -= buf_class->buf_size;
+	ff_assert(memory->used_bytes >= 0);
+	memory->is_trimmed = 0;
+	update_below_limit_event(memory);
+}
+
+enum ff_result mrpc_memory_throttle(void)
+{
+	struct packets_memory *memory;
+	enum ff_result result = FF_SUCCESS;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt > 0);
+
+	if (memory->used_bytes >= packets_limit)
+	{
+		result = ff_event_wait_with_timeout(memory->below_limit_event, throttle_timeout);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"packet buffers occupy used_bytes=%d, which exceeds the limit=%d during the timeout=%d", memory->used_bytes, packets_limit, throttle_timeout);
+		}
+	}
+	return result;
+}
+
+int mrpc_memory_is_over_limit(void)
+{
+	struct packets_memory *memory;
+	int is_over_limit;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt > 0);
+
+	is_over_limit = (memory->used_bytes >= packets_limit);
+	return is_over_limit;
+}
+
+void mrpc_memory_trim(void)
+{
+	struct packets_memory *memory;
+	struct memory_block **blocks;
+	struct memory_block *block;
+	int blocks_cnt;
+	int i;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt > 0);
+
+	if (memory->is_trimmed)
+	{
+		/* no buffers have been released since the last trim */
+		return;
+	}
+	memory->is_trimmed = 1;
+	if (memory->acquired_bufs_cnt == 0)
+	{
+		/* all the buffers are free, so blocks with buffers can be freed.
+		 * New blocks will be allocated on demand.
+		 */
+		free_blocks(memory);
+		return;
+	}
+
+	/* free blocks, which contain only free buffers. Blocks are sorted by address,
+	 * so the block for each free buffer is found using binary search.
+	 */
+	blocks_cnt = 0;
+	for (block = memory->blocks; block != NULL; block = block->next)
+	{
+		blocks_cnt++;
+	}
+	blocks = (struct memory_block **) ff_calloc(blocks_cnt, sizeof(blocks[0]));
+	i = 0;
+	for (block = memory->blocks; block != NULL; block = block->next)
+	{
+		block->free_bufs_cnt = 0;
+		blocks[i] = block;
+		i++;
+	}
+	qsort(blocks, blocks_cnt, sizeof(blocks[0]), compare_blocks);
+	for (i = 0; i < BUF_CLASSES_CNT; i++)
+	{
+		count_free_bufs(&memory->buf_classes[i], blocks, blocks_cnt);
+	}
+	for (i = 0; i < BUF_CLASSES_CNT; i++)
+	{
+		remove_free_blocks_bufs(&memory->buf_classes[i], blocks, blocks_cnt);
+	}
+	memory->blocks = NULL;
+	for (i = 0; i < blocks_cnt; i++)
+	{
+		block = blocks[i];
+		if (is_block_free(block))
+		{
+			memory->allocated_bytes -= (int) (block->bufs_end - block->bufs);
+			ff_free(block);
+		}
+		else
+		{
+			block->next = memory->blocks;
+			memory->blocks = block;
+		}
+	}
+	ff_free(blocks);
+}
+
+int mrpc_memory_get_allocated_bytes(void)
+{
+	struct packets_memory *memory;
+
+	memory = &packets_memory;
+	ff_assert(memory->refs_cnt > 0);
+
+	return memory->allocated_bytes;
+}
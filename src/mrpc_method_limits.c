@@ -0,0 +1,152 @@
+#include "private/mrpc_common.h"
+
+#include "private/mrpc_method_limits.h"
+#include "ff/ff_event.h"
+
+struct method_limit
+{
+	/* this event is set when a waiting call can re-check the limit */
+	struct ff_event *slot_released_event;
+	int max_active_cnt;
+	int active_cnt;
+	int waiting_cnt;
+	int is_queued;
+};
+
+struct mrpc_method_limits
+{
+	struct method_limit *limits;
+	int methods_cnt;
+};
+
+static struct method_limit *get_method_limit(struct mrpc_method_limits *limits, int method_id)
+{
+	ff_assert(method_id >= 0);
+	ff_assert(method_id < limits->methods_cnt);
+
+	return &limits->limits[method_id];
+}
+
+static int has_free_slot(struct method_limit *limit)
+{
+	return (limit->max_active_cnt == 0 || limit->active_cnt < limit->max_active_cnt);
+}
+
+static void wake_up_waiting_call(struct method_limit *limit)
+{
+	/* the slot_released_event wakes up a single waiting call, which wakes up the next one
+	 * if it can proceed. See the mrpc_method_limits_acquire_slot().
+	 */
+	if (limit->waiting_cnt > 0)
+	{
+		ff_event_set(limit->slot_released_event);
+	}
+}
+
+struct mrpc_method_limits *mrpc_method_limits_create(int methods_cnt)
+{
+	struct mrpc_method_limits *limits;
+	int i;
+
+	ff_assert(methods_cnt > 0);
+
+	limits = (struct mrpc_method_limits *) ff_malloc(sizeof(*limits));
+	limits->limits = (struct method_limit *) ff_calloc(methods_cnt, sizeof(limits->limits[0]));
+	limits->methods_cnt = methods_cnt;
+	for (i = 0; i < methods_cnt; i++)
+	{
+		struct method_limit *limit;
+
+		limit = &limits->limits[i];
+		limit->slot_released_event = ff_event_create(FF_EVENT_AUTO);
+		limit->max_active_cnt = 0;
+		limit->active_cnt = 0;
+		limit->waiting_cnt = 0;
+		limit->is_queued = 0;
+	}
+
+	return limits;
+}
+
+void mrpc_method_limits_delete(struct mrpc_method_limits *limits)
+{
+	int i;
+
+	for (i = 0; i < limits->methods_cnt; i++)
+	{
+		struct method_limit *limit;
+
+		limit = &limits->limits[i];
+		ff_assert(limit->active_cnt == 0);
+		ff_assert(limit->waiting_cnt == 0);
+		ff_event_delete(limit->slot_released_event);
+	}
+	ff_free(limits->limits);
+	ff_free(limits);
+}
+
+void mrpc_method_limits_set(struct mrpc_method_limits *limits, int method_id, int max_active_cnt, int is_queued)
+{
+	struct method_limit *limit;
+
+	ff_assert(max_active_cnt >= 0);
+
+	limit = get_method_limit(limits, method_id);
+	limit->max_active_cnt = max_active_cnt;
+	limit->is_queued = is_queued;
+
+	/* calls waiting for the previous limit must re-check the new limit */
+	wake_up_waiting_call(limit);
+}
+
+int mrpc_method_limits_is_wait_needed(struct mrpc_method_limits *limits, int method_id)
+{
+	struct method_limit *limit;
+
+	limit = get_method_limit(limits, method_id);
+	return (!has_free_slot(limit) && limit->is_queued);
+}
+
+enum ff_result mrpc_method_limits_acquire_slot(struct mrpc_method_limits *limits, int method_id)
+{
+	struct method_limit *limit;
+	enum ff_result result = FF_SUCCESS;
+
+	limit = get_method_limit(limits, method_id);
+	while (!has_free_slot(limit))
+	{
+		if (!limit->is_queued)
+		{
+			ff_log_debug(L"the method with method_id=%d has reached the limit of concurrently executed calls=%d, so the call is rejected",
+				method_id, limit->max_active_cnt);
+			result = FF_FAILURE;
+			break;
+		}
+		limit->waiting_cnt++;
+		ff_event_wait(limit->slot_released_event);
+		limit->waiting_cnt--;
+	}
+	if (result == FF_SUCCESS)
+	{
+		limit->active_cnt++;
+	}
+
+	/* the limit could be raised or queueing could be disabled while the call was waiting,
+	 * so pass the wake up to the next waiting call if it can proceed.
+	 */
+	if (has_free_slot(limit) || !limit->is_queued)
+	{
+		wake_up_waiting_call(limit);
+	}
+	return result;
+}
+
+void mrpc_method_limits_release_slot(struct mrpc_method_limits *limits, int method_id)
+{
+	struct method_limit *limit;
+
+	limit = get_method_limit(limits, method_id);
+	ff_assert(limit->active_cnt > 0);
+	limit->active_cnt--;
+	wake_up_waiting_call(limit);
+}
@@ -1,35 +1,123 @@
 #include "private/mrpc_common.h"
 
 #include "private/mrpc_packet.h"
+#include "private/mrpc_protocol.h"
 #include "private/mrpc_int.h"
+#include "private/mrpc_memory.h"
 #include "ff/ff_stream.h"
 
-/* this size allows to pack packet header into maximum three bytes:
+/* the MRPC_PROTOCOL_V1 header is packed into maximum three bytes:
  * the first byte is the request_id and the second with third bytes
  * contain packet length (14bits) alongside with packet type (2bits).
  * Packet length is variable-length encoded, so the maximum packet size is 2^12 - 1.
  */
-#define MAX_PACKET_SIZE ((1 << 12) - 1)
+#define MAX_V1_PACKET_HEADER_SIZE 3
+
+/* the MRPC_PROTOCOL_V2 header consists of variable-length encoded request_id
+ * followed by variable-length encoded packet length (16bits) alongside with 'end of stream' flag (1bit).
+ */
+#define MAX_V2_PACKET_HEADER_SIZE (MRPC_UINT32_MAX_ENCODED_SIZE + 3)
+
+/* the maximum size of the serialized packet header among all the protocol versions */
+#define MAX_PACKET_HEADER_SIZE MAX_V2_PACKET_HEADER_SIZE
+
+#define BITS_PER_OCTET 7
+#define OCTET_MASK ((1 << BITS_PER_OCTET) - 1)
+#define CONTINUE_NUMBER_FLAG (1 << BITS_PER_OCTET)
+
+/* the approximate size of a single memory block with packet headers allocated by the mrpc_packet_arena.
+ * Blocks are allocated lazily.
+ */
+#define ARENA_BLOCK_SIZE 0x1000
 
 struct mrpc_packet
 {
+	struct mrpc_packet *next;
+	struct mrpc_packet_arena *arena;
 	char *buf;
+	int capacity;
 	int curr_pos;
 	int size;
+	int max_size;
 	enum mrpc_packet_type type;
-	uint8_t request_id;
+	enum mrpc_protocol_version protocol_version;
+	uint32_t request_id;
 };
 
-struct mrpc_packet *mrpc_packet_create()
+struct arena_block
 {
-	struct mrpc_packet *packet;
+	struct arena_block *next;
+};
 
-	packet = (struct mrpc_packet *) ff_malloc(sizeof(*packet));
-	packet->buf = (char *) ff_calloc(MAX_PACKET_SIZE, sizeof(packet->buf[0]));
+struct mrpc_packet_arena
+{
+	struct arena_block *blocks;
+	struct mrpc_packet *next_packet;
+	int packets_left;
+	enum mrpc_protocol_version protocol_version;
+	int max_size;
+};
+
+static void init_packet(struct mrpc_packet *packet, struct mrpc_packet_arena *arena, char *buf, int capacity,
+	enum mrpc_protocol_version protocol_version, int max_size)
+{
+	packet->next = NULL;
+	packet->arena = arena;
+	packet->buf = buf;
+	packet->capacity = capacity;
 	packet->curr_pos = 0;
 	packet->size = 0;
+	packet->max_size = max_size;
 	packet->type = MRPC_PACKET_START;
+	packet->protocol_version = protocol_version;
 	packet->request_id = 0;
+}
+
+/**
+ * Ensures that the packet's buffer can hold at least size bytes.
+ * Data already written into the packet is preserved.
+ */
+static void reserve_buf(struct mrpc_packet *packet, int size)
+{
+	char *buf;
+	int capacity;
+
+	ff_assert(size <= packet->max_size);
+	if (size <= packet->capacity)
+	{
+		return;
+	}
+
+	ff_assert(packet->arena != NULL);
+	buf = mrpc_memory_acquire_packet_buf(size, &capacity);
+	ff_assert(capacity >= size);
+	if (capacity > packet->max_size)
+	{
+		/* buffer's classes are shared among all the protocol versions,
+		 * so the buffer can be bigger than the maximum packet size.
+		 */
+		capacity = packet->max_size;
+	}
+	if (packet->buf != NULL)
+	{
+		memcpy(buf, packet->buf, packet->size);
+		mrpc_memory_release_packet_buf(packet->buf, packet->capacity);
+	}
+	packet->buf = buf;
+	packet->capacity = capacity;
+}
+
+struct mrpc_packet *mrpc_packet_create(enum mrpc_protocol_version protocol_version, int max_size)
+{
+	struct mrpc_packet *packet;
+
+	ff_assert(max_size > 0);
+	ff_assert(protocol_version == MRPC_PROTOCOL_V1 || protocol_version == MRPC_PROTOCOL_V2);
+	ff_assert(protocol_version != MRPC_PROTOCOL_V1 || max_size <= MRPC_PROTOCOL_V1_MAX_PACKET_SIZE);
+	ff_assert(max_size <= MRPC_PROTOCOL_MAX_PACKET_SIZE);
+
+	packet = (struct mrpc_packet *) ff_malloc(sizeof(*packet));
+	init_packet(packet, NULL, (char *) ff_malloc(max_size), max_size, protocol_version, max_size);
 
 	return packet;
 }
@@ -38,6 +126,8 @@ void mrpc_packet_delete(struct mrpc_packet *packet)
 {
 	ff_assert(packet->curr_pos == 0);
 	ff_assert(packet->size == 0);
+	ff_assert(packet->next == NULL);
+	ff_assert(packet->arena == NULL);
 
 	ff_free(packet->buf);
 	ff_free(packet);
@@ -45,19 +135,28 @@ void mrpc_packet_delete(struct mrpc_packet *packet)
 
 void mrpc_packet_reset(struct mrpc_packet *packet)
 {
+	if (packet->arena != NULL && packet->buf != NULL)
+	{
+		/* release the buffer, so the packet won't occupy memory while it is idle in a pool */
+		mrpc_memory_release_packet_buf(packet->buf, packet->capacity);
+		packet->buf = NULL;
+		packet->capacity = 0;
+	}
+	packet->next = NULL;
 	packet->curr_pos = 0;
 	packet->size = 0;
 	packet->type = MRPC_PACKET_START;
 	packet->request_id = 0;
 }
 
-uint8_t mrpc_packet_get_request_id(struct mrpc_packet *packet)
+uint32_t mrpc_packet_get_request_id(struct mrpc_packet *packet)
 {
 	return packet->request_id;
 }
 
-void mrpc_packet_set_request_id(struct mrpc_packet *packet, uint8_t request_id)
+void mrpc_packet_set_request_id(struct mrpc_packet *packet, uint32_t request_id)
 {
+	ff_assert(packet->protocol_version != MRPC_PROTOCOL_V1 || request_id < MRPC_PROTOCOL_V1_MAX_REQUEST_STREAMS_CNT);
 	packet->request_id = request_id;
 }
 
@@ -71,110 +170,375 @@ void mrpc_packet_set_type(struct mrpc_packet *packet, enum mrpc_packet_type type
 	packet->type = type;
 }
 
-int mrpc_packet_read_data(struct mrpc_packet *packet, void *buf, int len)
+int mrpc_packet_get_size(struct mrpc_packet *packet)
 {
-	int bytes_read;
-	int bytes_left;
+	return packet->size;
+}
 
-	ff_assert(len >= 0);
-	ff_assert(packet->curr_pos >= 0);
-	ff_assert(packet->size >= packet->curr_pos);
-	ff_assert(packet->size <= MAX_PACKET_SIZE);
+struct mrpc_packet *mrpc_packet_get_next(struct mrpc_packet *packet)
+{
+	return packet->next;
+}
+
+void mrpc_packet_set_next(struct mrpc_packet *packet, struct mrpc_packet *next)
+{
+	packet->next = next;
+}
 
-	bytes_left = packet->size - packet->curr_pos;
-	bytes_read = (len > bytes_left) ? bytes_left : len;
-	memcpy(buf, packet->buf + packet->curr_pos, bytes_read);
-	packet->curr_pos += bytes_read;
+static int encode_v1_header(struct mrpc_packet *packet, char *buf)
+{
+	uint32_t tmp;
+	int len;
+
+	ff_assert(packet->request_id < MRPC_PROTOCOL_V1_MAX_REQUEST_STREAMS_CNT);
+	ff_assert(packet->size <= MRPC_PROTOCOL_V1_MAX_PACKET_SIZE);
 
-	return bytes_read;
+	/* the header is decoded by the read_v1_header() */
+	buf[0] = (char) packet->request_id;
+	tmp = ((uint32_t) packet->type) | (((uint32_t) packet->size) << 2);
+	len = 1 + mrpc_uint32_encode(tmp, buf + 1);
+	ff_assert(len <= MAX_V1_PACKET_HEADER_SIZE);
+
+	return len;
 }
 
-int mrpc_packet_write_data(struct mrpc_packet *packet, const void *buf, int len)
+static int encode_v2_header(struct mrpc_packet *packet, char *buf)
 {
-	int bytes_written;
-	int bytes_left;
+	uint32_t tmp;
+	int len;
+	int is_end;
 
-	ff_assert(len >= 0);
-	ff_assert(packet->curr_pos == 0);
-	ff_assert(packet->size >= 0);
-	ff_assert(packet->size <= MAX_PACKET_SIZE);
+	ff_assert(packet->size <= MRPC_PROTOCOL_V2_MAX_PACKET_SIZE);
 
-	bytes_left = MAX_PACKET_SIZE - packet->size;
-	bytes_written = (len > bytes_left) ? bytes_left : len;
-	memcpy(packet->buf + packet->size, buf, bytes_written);
-	packet->size += bytes_written;
+	/* the header is decoded by the read_v2_header() */
+	is_end = (packet->type == MRPC_PACKET_END || packet->type == MRPC_PACKET_SINGLE);
+	tmp = ((uint32_t) is_end) | (((uint32_t) packet->size) << 1);
+	len = mrpc_uint32_encode(packet->request_id, buf);
+	len += mrpc_uint32_encode(tmp, buf + len);
+	ff_assert(len <= MAX_V2_PACKET_HEADER_SIZE);
 
-	return bytes_written;
+	return len;
 }
 
-enum ff_result mrpc_packet_read_from_stream(struct mrpc_packet *packet, struct ff_stream *stream)
+static enum ff_result read_v1_header(struct mrpc_packet *packet, struct ff_stream *stream)
 {
+	uint8_t header[MAX_V1_PACKET_HEADER_SIZE];
 	uint32_t tmp;
 	enum ff_result result;
 
-	ff_assert(packet->curr_pos == 0);
-	ff_assert(packet->size == 0);
-
-	result = ff_stream_read(stream, &packet->request_id, 1);
+	/* the header always contains at least two bytes: the request_id and the first octet
+	 * of the variable-length encoded packet type and size. So read them at once
+	 * in order to minimize the number of ff_stream_read() calls per packet.
+	 */
+	result = ff_stream_read(stream, header, 2);
 	if (result != FF_SUCCESS)
 	{
-		ff_log_debug(L"cannot read request_id from the stream=%p for the packet=%p. See previous messages for more info", stream, packet);
+		ff_log_debug(L"cannot read packet header from the stream=%p for the packet=%p. See previous messages for more info", stream, packet);
 		goto end;
 	}
-	result = mrpc_uint32_unserialize(&tmp, stream);
-	if (result != FF_SUCCESS)
+	packet->request_id = header[0];
+	tmp = (uint32_t) (header[1] & OCTET_MASK);
+	if ((header[1] & CONTINUE_NUMBER_FLAG) != 0)
 	{
-		ff_log_debug(L"cannot read packet type and size from the stream=%p for the packet=%p. See previous messages for more info", stream, packet);
-		goto end;
+		result = ff_stream_read(stream, &header[2], 1);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot read the last byte of packet header from the stream=%p for the packet=%p. See previous messages for more info", stream, packet);
+			goto end;
+		}
+		if ((header[2] & CONTINUE_NUMBER_FLAG) != 0)
+		{
+			ff_log_debug(L"too long packet header has been read from the stream=%p for the packet=%p. It mustn't exceed %d bytes", stream, packet, MAX_V1_PACKET_HEADER_SIZE);
+			result = FF_FAILURE;
+			goto end;
+		}
+		tmp |= ((uint32_t) header[2]) << BITS_PER_OCTET;
 	}
 	packet->type = (enum mrpc_packet_type) (tmp & 0x03);
 	/* packet type can have only 4 different values, which are mapped to
 	 * the enum mrpc_packet_type, so there is no need to check it for correctess
 	 */
 	packet->size = (int) (tmp >> 2);
-	if (packet->size > MAX_PACKET_SIZE)
+
+end:
+	return result;
+}
+
+static enum ff_result read_v2_header(struct mrpc_packet *packet, struct ff_stream *stream)
+{
+	char header[MAX_V2_PACKET_HEADER_SIZE];
+	uint32_t request_id;
+	uint32_t tmp;
+	int len;
+	enum ff_result result;
+
+	/* the header always contains at least two bytes: the request_id and the packet size.
+	 * So read them at once and then read the remaining bytes one by one
+	 * until both values will be decoded.
+	 */
+	len = 2;
+	result = ff_stream_read(stream, header, len);
+	if (result != FF_SUCCESS)
 	{
-		ff_log_debug(L"wrong packet_size=%d has been read from the stream=%p for the packet=%p. It mustn't exceed the %d", packet->size, stream, packet, MAX_PACKET_SIZE);
-		result = FF_FAILURE;
+		ff_log_debug(L"cannot read packet header from the stream=%p for the packet=%p. See previous messages for more info", stream, packet);
 		goto end;
 	}
-	result = ff_stream_read(stream, packet->buf, packet->size);
-	if (result != FF_SUCCESS)
+	for (;;)
 	{
-		ff_log_debug(L"cannot read packet's body with size=%d from the stream=%p for the packet=%p. See previous messages for more info", packet->size, stream, packet);
+		int request_id_len;
+		int tmp_len = 0;
+
+		request_id_len = mrpc_uint32_decode(&request_id, header, len);
+		if (request_id_len > 0)
+		{
+			tmp_len = mrpc_uint32_decode(&tmp, header + request_id_len, len - request_id_len);
+			if (tmp_len > 0)
+			{
+				break;
+			}
+		}
+		if (request_id_len < 0 || tmp_len < 0 || len == MAX_V2_PACKET_HEADER_SIZE)
+		{
+			ff_log_debug(L"wrong packet header has been read from the stream=%p for the packet=%p", stream, packet);
+			result = FF_FAILURE;
+			goto end;
+		}
+		result = ff_stream_read(stream, header + len, 1);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot read the next byte of packet header from the stream=%p for the packet=%p. See previous messages for more info", stream, packet);
+			goto end;
+		}
+		len++;
 	}
+	packet->request_id = request_id;
+	packet->type = ((tmp & 0x01) != 0) ? MRPC_PACKET_END : MRPC_PACKET_MIDDLE;
+	if ((tmp >> 1) > MRPC_PROTOCOL_V2_MAX_PACKET_SIZE)
+	{
+		ff_log_debug(L"too big packet_size=%lu has been read from the stream=%p for the packet=%p", tmp >> 1, stream, packet);
+		result = FF_FAILURE;
+		goto end;
+	}
+	packet->size = (int) (tmp >> 1);
 
 end:
 	return result;
 }
 
-enum ff_result mrpc_packet_write_to_stream(struct mrpc_packet *packet, struct ff_stream *stream)
+const char *mrpc_packet_get_read_window(struct mrpc_packet *packet, const char **limit)
 {
-	uint32_t tmp;
+	ff_assert(packet->curr_pos >= 0);
+	ff_assert(packet->size >= packet->curr_pos);
+	ff_assert(packet->size <= packet->max_size);
+
+	*limit = packet->buf + packet->size;
+	return packet->buf + packet->curr_pos;
+}
+
+char *mrpc_packet_get_write_window(struct mrpc_packet *packet, char **limit)
+{
+	ff_assert(packet->curr_pos == 0);
+	ff_assert(packet->size >= 0);
+	ff_assert(packet->size <= packet->capacity);
+
+	if (packet->buf == NULL)
+	{
+		/* start with the smallest buffer. It is promoted by the mrpc_packet_grow() when filled */
+		reserve_buf(packet, 1);
+	}
+	*limit = packet->buf + packet->capacity;
+	return packet->buf + packet->size;
+}
+
+int mrpc_packet_grow(struct mrpc_packet *packet)
+{
+	ff_assert(packet->curr_pos == 0);
+	ff_assert(packet->size <= packet->capacity);
+
+	if (packet->capacity == packet->max_size)
+	{
+		return 0;
+	}
+	reserve_buf(packet, packet->capacity + 1);
+	return 1;
+}
+
+void mrpc_packet_commit_write_window(struct mrpc_packet *packet, const char *pos)
+{
+	int size;
+
+	size = (int) (pos - packet->buf);
+	ff_assert(packet->curr_pos == 0);
+	ff_assert(size >= packet->size);
+	ff_assert(size <= packet->capacity);
+
+	packet->size = size;
+}
+
+void mrpc_packet_copy(struct mrpc_packet *dst, struct mrpc_packet *src)
+{
+	ff_assert(dst->curr_pos == 0);
+	ff_assert(dst->size == 0);
+	ff_assert(src->curr_pos == 0);
+	ff_assert(src->size <= dst->max_size);
+
+	reserve_buf(dst, src->size);
+	memcpy(dst->buf, src->buf, src->size);
+	dst->size = src->size;
+	dst->type = src->type;
+	dst->request_id = src->request_id;
+}
+
+enum ff_result mrpc_packet_read_from_stream(struct mrpc_packet *packet, struct ff_stream *stream)
+{
+	int size;
 	enum ff_result result;
 
 	ff_assert(packet->curr_pos == 0);
-	ff_assert(packet->size <= MAX_PACKET_SIZE);
+	ff_assert(packet->size == 0);
 
-	result = ff_stream_write(stream, &packet->request_id, 1);
+	if (packet->protocol_version == MRPC_PROTOCOL_V1)
+	{
+		result = read_v1_header(packet, stream);
+	}
+	else
+	{
+		ff_assert(packet->protocol_version == MRPC_PROTOCOL_V2);
+		result = read_v2_header(packet, stream);
+	}
 	if (result != FF_SUCCESS)
 	{
-		ff_log_debug(L"cannot write request_id=%lu to the stream=%p for the packet=%p. See previous messages for more info", (uint32_t) packet->request_id, stream, packet);
+		ff_log_debug(L"cannot read packet header from the stream=%p for the packet=%p. See previous messages for more info", stream, packet);
 		goto end;
 	}
-	tmp = ((uint32_t) packet->type) | (((uint32_t) packet->size) << 2);
-	result = mrpc_uint32_serialize(tmp, stream);
-	if (result != FF_SUCCESS)
+	if (packet->size > packet->max_size)
 	{
-		ff_log_debug(L"cannot serialize packet type and size (%lu) to the stream=%p for the packet=%p. See previous messages for more info", tmp, stream, packet);
+		ff_log_debug(L"wrong packet_size=%d has been read from the stream=%p for the packet=%p. It mustn't exceed the %d", packet->size, stream, packet, packet->max_size);
+		packet->size = 0;
+		result = FF_FAILURE;
 		goto end;
 	}
-	result = ff_stream_write(stream, packet->buf, packet->size);
+	size = packet->size;
+	if (packet->arena != NULL && size > 0)
+	{
+		/* stop reading from the stream while packet buffers exceed the memory limit */
+		result = mrpc_memory_throttle();
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"packet buffers exceed the memory limit, so the packet=%p cannot be read from the stream=%p. See previous messages for more info", packet, stream);
+			packet->size = 0;
+			goto end;
+		}
+	}
+
+	/* allocate the buffer according to the decoded packet size.
+	 * There is no data in the packet yet, so there is nothing to preserve.
+	 */
+	packet->size = 0;
+	reserve_buf(packet, size);
+	packet->size = size;
+	result = ff_stream_read(stream, packet->buf, packet->size);
 	if (result != FF_SUCCESS)
 	{
-		ff_log_debug(L"cannot write packet's boyd with size=%d to the stream=%p for the packet=%p. See previous messages for more info", packet->size, stream, packet);
+		ff_log_debug(L"cannot read packet's body with size=%d from the stream=%p for the packet=%p. See previous messages for more info", packet->size, stream, packet);
 	}
 
 end:
 	return result;
 }
+
+int mrpc_packet_get_serialized_size(struct mrpc_packet *packet)
+{
+	ff_assert(packet->curr_pos == 0);
+	ff_assert(packet->size >= 0);
+	ff_assert(packet->size <= packet->max_size);
+
+	return MAX_PACKET_HEADER_SIZE + packet->size;
+}
+
+int mrpc_packet_serialize(struct mrpc_packet *packet, char *buf)
+{
+	int len;
+
+	ff_assert(packet->curr_pos == 0);
+	ff_assert(packet->size >= 0);
+	ff_assert(packet->size <= packet->max_size);
+
+	if (packet->protocol_version == MRPC_PROTOCOL_V1)
+	{
+		len = encode_v1_header(packet, buf);
+	}
+	else
+	{
+		ff_assert(packet->protocol_version == MRPC_PROTOCOL_V2);
+		len = encode_v2_header(packet, buf);
+	}
+	memcpy(buf + len, packet->buf, packet->size);
+	len += packet->size;
+
+	return len;
+}
+
+struct mrpc_packet_arena *mrpc_packet_arena_create(enum mrpc_protocol_version protocol_version, int max_size)
+{
+	struct mrpc_packet_arena *arena;
+
+	ff_assert(max_size > 0);
+	ff_assert(protocol_version == MRPC_PROTOCOL_V1 || protocol_version == MRPC_PROTOCOL_V2);
+	ff_assert(protocol_version != MRPC_PROTOCOL_V1 || max_size <= MRPC_PROTOCOL_V1_MAX_PACKET_SIZE);
+	ff_assert(max_size <= MRPC_PROTOCOL_MAX_PACKET_SIZE);
+
+	arena = (struct mrpc_packet_arena *) ff_malloc(sizeof(*arena));
+	arena->blocks = NULL;
+	arena->next_packet = NULL;
+	arena->packets_left = 0;
+	arena->protocol_version = protocol_version;
+	arena->max_size = max_size;
+	mrpc_memory_acquire();
+
+	return arena;
+}
+
+void mrpc_packet_arena_delete(struct mrpc_packet_arena *arena)
+{
+	struct arena_block *block;
+
+	mrpc_memory_release();
+	block = arena->blocks;
+	while (block != NULL)
+	{
+		struct arena_block *next_block;
+
+		next_block = block->next;
+		ff_free(block);
+		block = next_block;
+	}
+	ff_free(arena);
+}
+
+struct mrpc_packet *mrpc_packet_arena_acquire_packet(struct mrpc_packet_arena *arena)
+{
+	struct mrpc_packet *packet;
+
+	/* packet headers are allocated contiguously in arena blocks.
+	 * Packet buffers are acquired from the process-wide pool on the first write or read.
+	 */
+	if (arena->packets_left == 0)
+	{
+		struct arena_block *block;
+		int packets_cnt;
+
+		packets_cnt = (ARENA_BLOCK_SIZE - sizeof(*block)) / sizeof(*packet);
+		block = (struct arena_block *) ff_malloc(sizeof(*block) + packets_cnt * sizeof(*packet));
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->next_packet = (struct mrpc_packet *) (block + 1);
+		arena->packets_left = packets_cnt;
+	}
+	packet = arena->next_packet;
+	arena->next_packet++;
+	arena->packets_left--;
+	init_packet(packet, arena, NULL, 0, arena->protocol_version, arena->max_size);
+
+	return packet;
+}
@@ -2,28 +2,100 @@
 
 #include "private/mrpc_packet_stream.h"
 #include "private/mrpc_packet.h"
-#include "ff/ff_blocking_queue.h"
+#include "ff/ff_event.h"
 
 /**
  * Timeout (in milliseconds) for the mrpc_packet_stream_read() function.
  * This timeout prevents DoS from malicious peers, which don't send packets
- * to the stream's reader_queue, so blocking the mrpc_packet_stream_read() callers forever,
+ * to the stream, so blocking the mrpc_packet_stream_read() callers forever,
  * which can lead to workers shortage.
  * This timeout shouldn't be small, because this can lead to frequent failures of the mrpc_packet_stream_read(),
  * because it won't wait for the next data packet.
  */
 #define READ_TIMEOUT (120 * 1000)
 
+/**
+ * Timeout (in milliseconds) for waiting for credits in the mrpc_packet_stream_write().
+ * This timeout prevents from blocking writers forever if the remote side
+ * doesn't read data from the stream.
+ */
+#define WRITE_TIMEOUT (120 * 1000)
+
+/**
+ * The maximum number of non-final packets (i.e. MRPC_PACKET_START and MRPC_PACKET_MIDDLE),
+ * which can be sent via the packet stream without receiving credits from the remote side.
+ * This limits the number of packets, which can be occupied by a single packet stream
+ * on the receiving side, so bulk transfers cannot starve other packet streams
+ * sharing the same connection.
+ * This value is a part of the protocol, so it must be the same on both sides.
+ */
+#define CREDITS_WINDOW 8
+
+/**
+ * The number of credits granted by a single credit packet.
+ * The receiving side sends a credit packet after consuming this number of non-final packets.
+ * It must be less than or equal to the CREDITS_WINDOW.
+ * This value is a part of the protocol, so it must be the same on both sides.
+ */
+#define CREDITS_BATCH_SIZE 4
+
 struct mrpc_packet_stream
 {
 	mrpc_packet_stream_acquire_packet_func acquire_packet_func;
 	mrpc_packet_stream_release_packet_func release_packet_func;
+	mrpc_packet_stream_write_packet_func write_packet_func;
+	mrpc_packet_stream_wait_for_credits_func wait_for_credits_func;
 	void *packet_func_ctx;
-	struct ff_blocking_queue *reader_queue;
-	struct ff_blocking_queue *writer_queue;
+
+	/* the list of packets pushed to the stream, but not read yet.
+	 * The list is threaded through packets, so idle streams don't occupy memory for queue slots.
+	 * The number of packets in the list is limited by credits: up to CREDITS_WINDOW non-final packets,
+	 * the final packet and the packet pushed by the mrpc_packet_stream_disconnect().
+	 */
+	struct mrpc_packet *read_packets_head;
+	struct mrpc_packet *read_packets_tail;
+
+	/* this event is set when a packet is added to the read_packets list */
+	struct ff_event *read_packets_event;
+
 	struct mrpc_packet *current_read_packet;
 	struct mrpc_packet *current_write_packet;
-	uint8_t request_id;
+
+	/* read and write cursors over the current_read_packet and the current_write_packet.
+	 * They allow serving the majority of mrpc_packet_stream_read() and mrpc_packet_stream_write() calls
+	 * with a single bounds check and memcpy() directly from / to the packet's memory.
+	 * Cursors are refilled only on packet boundaries.
+	 */
+	const char *read_pos;
+	const char *read_limit;
+	char *write_pos;
+	char *write_limit;
+
+	/* this event is set when credits are received from the remote side or when the stream is disconnected */
+	struct ff_event *credits_event;
+
+	/* the number of non-final packets, which can be sent to the remote side */
+	int write_credits;
+
+	/* the number of non-final packets, which can be received from the remote side */
+	int read_credits;
+
+	/* the number of non-final packets consumed since the last credit packet was sent */
+	int consumed_packets_cnt;
+
+	/* credits are used only if the flow control has been negotiated with the remote side.
+	 * Otherwise the stream works without credits, so it is compatible with peers,
+	 * which don't support the flow control.
+	 */
+	int is_flow_control_enabled;
+
+	int is_first_packet_received;
+	int is_final_packet_received;
+
+	/* this flag is set if the first read packet is the final packet without data */
+	int is_empty;
+	int is_disconnected;
+	uint32_t request_id;
 };
 
 static struct mrpc_packet *acquire_packet(struct mrpc_packet_stream *stream, enum mrpc_packet_type packet_type)
@@ -43,15 +115,137 @@ static void release_packet(struct mrpc_packet_stream *stream, struct mrpc_packet
 	stream->release_packet_func(stream->packet_func_ctx, packet);
 }
 
+static void write_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet, int is_flush_required)
+{
+	stream->write_packet_func(stream->packet_func_ctx, packet, is_flush_required);
+}
+
+static void put_read_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet)
+{
+	ff_assert(mrpc_packet_get_next(packet) == NULL);
+
+	if (stream->read_packets_tail == NULL)
+	{
+		ff_assert(stream->read_packets_head == NULL);
+		stream->read_packets_head = packet;
+	}
+	else
+	{
+		mrpc_packet_set_next(stream->read_packets_tail, packet);
+	}
+	stream->read_packets_tail = packet;
+	ff_event_set(stream->read_packets_event);
+}
+
+static struct mrpc_packet *remove_read_packet(struct mrpc_packet_stream *stream)
+{
+	struct mrpc_packet *packet;
+
+	packet = stream->read_packets_head;
+	ff_assert(packet != NULL);
+	stream->read_packets_head = mrpc_packet_get_next(packet);
+	if (stream->read_packets_head == NULL)
+	{
+		stream->read_packets_tail = NULL;
+	}
+	mrpc_packet_set_next(packet, NULL);
+
+	return packet;
+}
+
+static enum ff_result get_read_packet(struct mrpc_packet_stream *stream, struct mrpc_packet **packet)
+{
+	enum ff_result result;
+
+	while (stream->read_packets_head == NULL)
+	{
+		result = ff_event_wait_with_timeout(stream->read_packets_event, READ_TIMEOUT);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot get the next packet for the packet stream=%p during the timeout=%d", stream, READ_TIMEOUT);
+			return FF_FAILURE;
+		}
+	}
+	*packet = remove_read_packet(stream);
+	return FF_SUCCESS;
+}
+
+static void send_credits(struct mrpc_packet_stream *stream)
+{
+	struct mrpc_packet *packet;
+
+	/* empty MRPC_PACKET_MIDDLE packets are never sent by the mrpc_packet_stream_write(),
+	 * so they are used as credit packets.
+	 */
+	packet = acquire_packet(stream, MRPC_PACKET_MIDDLE);
+	/* the remote side can be blocked awaiting for credits, so they must be flushed immediately */
+	write_packet(stream, packet, 1);
+	stream->read_credits += CREDITS_BATCH_SIZE;
+	ff_assert(stream->read_credits <= CREDITS_WINDOW);
+}
+
+static void consume_read_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet)
+{
+	enum mrpc_packet_type packet_type;
+
+	packet_type = mrpc_packet_get_type(packet);
+	ff_assert(packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_MIDDLE);
+	release_packet(stream, packet);
+	if (!stream->is_flow_control_enabled)
+	{
+		return;
+	}
+	stream->consumed_packets_cnt++;
+	if (stream->consumed_packets_cnt == CREDITS_BATCH_SIZE)
+	{
+		stream->consumed_packets_cnt = 0;
+		send_credits(stream);
+	}
+}
+
+static enum ff_result acquire_write_credit(struct mrpc_packet_stream *stream)
+{
+	enum ff_result result;
+
+	if (!stream->is_flow_control_enabled)
+	{
+		return FF_SUCCESS;
+	}
+	if (stream->write_credits == 0 && !stream->is_disconnected && stream->wait_for_credits_func != NULL)
+	{
+		stream->wait_for_credits_func(stream->packet_func_ctx, stream);
+	}
+	while (stream->write_credits == 0)
+	{
+		if (stream->is_disconnected)
+		{
+			ff_log_debug(L"the packet stream=%p has been disconnected while waiting for credits", stream);
+			return FF_FAILURE;
+		}
+		result = ff_event_wait_with_timeout(stream->credits_event, WRITE_TIMEOUT);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"the packet stream=%p didn't receive credits during the timeout=%d", stream, WRITE_TIMEOUT);
+			return FF_FAILURE;
+		}
+	}
+	stream->write_credits--;
+	return FF_SUCCESS;
+}
+
+static void set_current_read_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet)
+{
+	stream->current_read_packet = packet;
+	stream->read_pos = mrpc_packet_get_read_window(packet, &stream->read_limit);
+}
+
 static enum ff_result prefetch_current_read_packet(struct mrpc_packet_stream *stream)
 {
 	struct mrpc_packet *current_read_packet;
-	struct ff_blocking_queue *reader_queue;
 	enum ff_result result;
 
 	ff_assert(stream->current_read_packet == NULL);
-	reader_queue = stream->reader_queue;
-	result = ff_blocking_queue_get_with_timeout(reader_queue, (const void **) &current_read_packet, READ_TIMEOUT);
+	result = get_read_packet(stream, &current_read_packet);
 	if (result == FF_SUCCESS)
 	{
 		enum mrpc_packet_type packet_type;
@@ -66,12 +260,13 @@ static enum ff_result prefetch_current_read_packet(struct mrpc_packet_stream *st
 		}
 		else
 		{
-			stream->current_read_packet = current_read_packet;
+			stream->is_empty = (packet_type == MRPC_PACKET_SINGLE && mrpc_packet_get_size(current_read_packet) == 0);
+			set_current_read_packet(stream, current_read_packet);
 		}
 	}
 	else
 	{
-		ff_log_debug(L"cannot get next packet from the reader_queue=%p during the timeout=%d", reader_queue, READ_TIMEOUT);
+		ff_log_debug(L"cannot get the first packet for the packet stream=%p. See previous messages for more info", stream);
 	}
 
 	return result;
@@ -86,6 +281,8 @@ static void release_current_read_packet(struct mrpc_packet_stream *stream)
 	{
 		release_packet(stream, current_read_packet);
 		stream->current_read_packet = NULL;
+		stream->read_pos = NULL;
+		stream->read_limit = NULL;
 	}
 	else
 	{
@@ -93,10 +290,19 @@ static void release_current_read_packet(struct mrpc_packet_stream *stream)
 	}
 }
 
+static void set_current_write_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet)
+{
+	stream->current_write_packet = packet;
+	stream->write_pos = mrpc_packet_get_write_window(packet, &stream->write_limit);
+}
+
 static void acquire_current_write_packet(struct mrpc_packet_stream *stream)
 {
+	struct mrpc_packet *packet;
+
 	ff_assert(stream->current_write_packet == NULL);
-	stream->current_write_packet = acquire_packet(stream, MRPC_PACKET_START);
+	packet = acquire_packet(stream, MRPC_PACKET_START);
+	set_current_write_packet(stream, packet);
 }
 
 static void release_current_write_packet(struct mrpc_packet_stream *stream)
@@ -116,6 +322,8 @@ static void release_current_write_packet(struct mrpc_packet_stream *stream)
 		}
 		release_packet(stream, current_write_packet);
 		stream->current_write_packet = NULL;
+		stream->write_pos = NULL;
+		stream->write_limit = NULL;
 	}
 	else
 	{
@@ -123,44 +331,50 @@ static void release_current_write_packet(struct mrpc_packet_stream *stream)
 	}
 }
 
-static void clear_reader_queue(struct mrpc_packet_stream *stream)
+static void clear_read_packets(struct mrpc_packet_stream *stream)
 {
-	struct ff_blocking_queue *reader_queue;
-
-	reader_queue = stream->reader_queue;
-	for (;;)
+	while (stream->read_packets_head != NULL)
 	{
 		struct mrpc_packet *packet;
-		int is_empty;
 
-		is_empty = ff_blocking_queue_is_empty(reader_queue);
-		if (is_empty)
-		{
-			break;
-		}
-		ff_blocking_queue_get(reader_queue, (const void **) &packet);
+		packet = remove_read_packet(stream);
 		release_packet(stream, packet);
 	}
 }
 
-struct mrpc_packet_stream *mrpc_packet_stream_create(struct ff_blocking_queue *writer_queue, int max_reader_queue_size,
-	mrpc_packet_stream_acquire_packet_func acquire_packet_func, mrpc_packet_stream_release_packet_func release_packet_func, void *packet_func_ctx)
+struct mrpc_packet_stream *mrpc_packet_stream_create(mrpc_packet_stream_write_packet_func write_packet_func,
+	mrpc_packet_stream_acquire_packet_func acquire_packet_func, mrpc_packet_stream_release_packet_func release_packet_func,
+	mrpc_packet_stream_wait_for_credits_func wait_for_credits_func, void *packet_func_ctx)
 {
 	struct mrpc_packet_stream *stream;
 
 	ff_assert(acquire_packet_func != NULL);
 	ff_assert(release_packet_func != NULL);
-	ff_assert(writer_queue != NULL);
-	ff_assert(max_reader_queue_size > 0);
+	ff_assert(write_packet_func != NULL);
 
 	stream = (struct mrpc_packet_stream *) ff_malloc(sizeof(*stream));
 	stream->acquire_packet_func = acquire_packet_func;
 	stream->release_packet_func = release_packet_func;
+	stream->write_packet_func = write_packet_func;
+	stream->wait_for_credits_func = wait_for_credits_func;
 	stream->packet_func_ctx = packet_func_ctx;
-	stream->reader_queue = ff_blocking_queue_create(max_reader_queue_size);
-	stream->writer_queue = writer_queue;
+	stream->read_packets_head = NULL;
+	stream->read_packets_tail = NULL;
+	stream->read_packets_event = ff_event_create(FF_EVENT_AUTO);
 	stream->current_read_packet = NULL;
 	stream->current_write_packet = NULL;
+	stream->read_pos = NULL;
+	stream->read_limit = NULL;
+	stream->write_pos = NULL;
+	stream->write_limit = NULL;
+	stream->credits_event = ff_event_create(FF_EVENT_AUTO);
+	stream->write_credits = 0;
+	stream->read_credits = 0;
+	stream->consumed_packets_cnt = 0;
+	stream->is_flow_control_enabled = 0;
+	stream->is_first_packet_received = 0;
+	stream->is_final_packet_received = 0;
+	stream->is_disconnected = 0;
 	stream->request_id = 0;
 
 	return stream;
@@ -172,16 +386,32 @@ void mrpc_packet_stream_delete(struct mrpc_packet_stream *stream)
 	ff_assert(stream->current_write_packet == NULL);
 	ff_assert(stream->request_id == 0);
 
-	ff_blocking_queue_delete(stream->reader_queue);
+	ff_assert(stream->read_packets_head == NULL);
+	ff_assert(stream->read_packets_tail == NULL);
+
+	ff_event_delete(stream->credits_event);
+	ff_event_delete(stream->read_packets_event);
 	ff_free(stream);
 }
 
-void mrpc_packet_stream_initialize(struct mrpc_packet_stream *stream, uint8_t request_id)
+void mrpc_packet_stream_initialize(struct mrpc_packet_stream *stream, uint32_t request_id, int is_flow_control_enabled)
 {
 	ff_assert(stream->current_read_packet == NULL);
 	ff_assert(stream->current_write_packet == NULL);
 	ff_assert(stream->request_id == 0);
 
+	ff_assert(stream->read_packets_head == NULL);
+
+	ff_event_reset(stream->read_packets_event);
+	ff_event_reset(stream->credits_event);
+	stream->write_credits = CREDITS_WINDOW;
+	stream->read_credits = CREDITS_WINDOW;
+	stream->consumed_packets_cnt = 0;
+	stream->is_flow_control_enabled = is_flow_control_enabled;
+	stream->is_first_packet_received = 0;
+	stream->is_final_packet_received = 0;
+	stream->is_empty = 0;
+	stream->is_disconnected = 0;
 	stream->request_id = request_id;
 }
 
@@ -191,19 +421,19 @@ void mrpc_packet_stream_shutdown(struct mrpc_packet_stream *stream)
 	ff_assert(stream->current_write_packet == NULL);
 	release_current_read_packet(stream);
 	ff_assert(stream->current_read_packet == NULL);
-	clear_reader_queue(stream);
+	clear_read_packets(stream);
 
 	stream->request_id = 0;
 }
 
-enum ff_result mrpc_packet_stream_read(struct mrpc_packet_stream *stream, void *buf, int len)
+static enum ff_result refill_read_window(struct mrpc_packet_stream *stream)
 {
 	struct mrpc_packet *current_read_packet;
-	char *p;
+	struct mrpc_packet *packet;
 	enum mrpc_packet_type packet_type;
 	enum ff_result result = FF_FAILURE;
 
-	ff_assert(len >= 0);
+	ff_assert(stream->read_pos == stream->read_limit);
 
 	current_read_packet = stream->current_read_packet;
 	if (current_read_packet == NULL)
@@ -213,109 +443,234 @@ enum ff_result mrpc_packet_stream_read(struct mrpc_packet_stream *stream, void *
 		if (result != FF_SUCCESS)
 		{
 			ff_log_debug(L"cannot prefetch the first read packet for the packet stream=%p. See previous messages for more info", stream);
-			goto end;
-		}
-		else
-		{
-			ff_assert(stream->current_read_packet != NULL);
-			current_read_packet = stream->current_read_packet;
 		}
+		goto end;
 	}
 
-	p = (char *) buf;
 	packet_type = mrpc_packet_get_type(current_read_packet);
-	while (len > 0)
+	if (packet_type == MRPC_PACKET_SINGLE || packet_type == MRPC_PACKET_END)
+	{
+		/* error: the previous packet should be the last in the stream */
+		ff_log_debug(L"the packet stream=%p has been finished", stream);
+		result = FF_FAILURE;
+		goto end;
+	}
+
+	result = get_read_packet(stream, &packet);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot get the next packet for the packet stream=%p. See previous messages for more info", stream);
+		goto end;
+	}
+	ff_assert(packet != NULL);
+	packet_type = mrpc_packet_get_type(packet);
+	if (packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_SINGLE)
+	{
+		/* wrong packet type. */
+		ff_log_debug(L"packet with wrong type=%d has been received from the packet stream=%p", (int) packet_type, stream);
+		release_packet(stream, packet);
+		result = FF_FAILURE;
+		goto end;
+	}
+
+	consume_read_packet(stream, current_read_packet);
+	set_current_read_packet(stream, packet);
+
+end:
+	return result;
+}
+
+static enum ff_result refill_write_window(struct mrpc_packet_stream *stream)
+{
+	struct mrpc_packet *current_write_packet;
+	enum mrpc_packet_type packet_type;
+	enum ff_result result;
+
+	ff_assert(stream->write_pos == stream->write_limit);
+
+	current_write_packet = stream->current_write_packet;
+	if (current_write_packet == NULL)
 	{
-		int bytes_read;
+		/* this is the first call of the mrpc_packet_stream_write() function. So acquire the writer packet */
+		acquire_current_write_packet(stream);
+		ff_assert(stream->current_write_packet != NULL);
+		return FF_SUCCESS;
+	}
 
-		bytes_read = mrpc_packet_read_data(current_read_packet, p, len);
-		ff_assert(bytes_read >= 0);
-		ff_assert(bytes_read <= len);
-		len -= bytes_read;
-		p += bytes_read;
+	packet_type = mrpc_packet_get_type(current_write_packet);
+	ff_assert(packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_MIDDLE);
+	mrpc_packet_commit_write_window(current_write_packet, stream->write_pos);
+	if (mrpc_packet_grow(current_write_packet))
+	{
+		/* the packet's buffer has been promoted to the bigger one, so continue writing into the same packet */
+		set_current_write_packet(stream, current_write_packet);
+		return FF_SUCCESS;
+	}
+	result = acquire_write_credit(stream);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot acquire credit for sending the packet=%p via the packet stream=%p. See previous messages for more info", current_write_packet, stream);
+		return result;
+	}
+	write_packet(stream, current_write_packet, 0);
+	current_write_packet = acquire_packet(stream, MRPC_PACKET_MIDDLE);
+	set_current_write_packet(stream, current_write_packet);
+	return FF_SUCCESS;
+}
 
-        if (len > 0)
+enum ff_result mrpc_packet_stream_read(struct mrpc_packet_stream *stream, void *buf, int len)
+{
+	char *p;
+	enum ff_result result = FF_FAILURE;
+
+	ff_assert(len >= 0);
+
+	p = (char *) buf;
+	for (;;)
+	{
+		int bytes_left;
+
+		bytes_left = (int) (stream->read_limit - stream->read_pos);
+		ff_assert(bytes_left >= 0);
+		if (len <= bytes_left)
+		{
+			/* fast path: the requested data is entirely contained in the current read packet */
+			memcpy(p, stream->read_pos, len);
+			stream->read_pos += len;
+			result = FF_SUCCESS;
+			break;
+		}
+
+		memcpy(p, stream->read_pos, bytes_left);
+		stream->read_pos += bytes_left;
+		len -= bytes_left;
+		p += bytes_left;
+
+		result = refill_read_window(stream);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot read len=%d bytes from the packet stream=%p to the buf=%p. See previous messages for more info", len, stream, buf);
+			break;
+		}
+	}
+
+	return result;
+}
+
+enum ff_result mrpc_packet_stream_skip_read_data(struct mrpc_packet_stream *stream)
+{
+	enum ff_result result;
+
+	for (;;)
+	{
+		struct mrpc_packet *current_read_packet;
+
+		stream->read_pos = stream->read_limit;
+		current_read_packet = stream->current_read_packet;
+		if (current_read_packet != NULL)
 		{
-			struct mrpc_packet *packet;
+			enum mrpc_packet_type packet_type;
 
+			packet_type = mrpc_packet_get_type(current_read_packet);
 			if (packet_type == MRPC_PACKET_SINGLE || packet_type == MRPC_PACKET_END)
 			{
-				/* error: the previous packet should be the last in the stream,
-				 * but we didn't read requested len bytes.
-				 */
-				ff_log_debug(L"the packet stream=%p has been finished, but len=%d bytes yet not read to the buf=%p", stream, len, buf);
-				result = FF_FAILURE;
-				goto end;
+				result = FF_SUCCESS;
+				break;
 			}
+		}
+		result = refill_read_window(stream);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot skip unread data in the packet stream=%p. See previous messages for more info", stream);
+			break;
+		}
+	}
 
-			result = ff_blocking_queue_get_with_timeout(stream->reader_queue, (const void **) &packet, READ_TIMEOUT);
-			if (result != FF_SUCCESS)
-			{
-				ff_log_debug(L"cannot get the next packet from the reader_queue=%d during the timeout=%d", stream->reader_queue, READ_TIMEOUT);
-				goto end;
-			}
-			ff_assert(packet != NULL);
-			packet_type = mrpc_packet_get_type(packet);
-			if (packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_SINGLE)
+	return result;
+}
+
+enum ff_result mrpc_packet_stream_skip_pushed_data(struct mrpc_packet_stream *stream, int *is_end)
+{
+	enum ff_result result;
+
+	*is_end = 0;
+	for (;;)
+	{
+		struct mrpc_packet *current_read_packet;
+
+		stream->read_pos = stream->read_limit;
+		current_read_packet = stream->current_read_packet;
+		if (current_read_packet != NULL)
+		{
+			enum mrpc_packet_type packet_type;
+
+			packet_type = mrpc_packet_get_type(current_read_packet);
+			if (packet_type == MRPC_PACKET_SINGLE || packet_type == MRPC_PACKET_END)
 			{
-				/* wrong packet type. */
-				ff_log_debug(L"packet with wrong type=%d has been received from the packet stream=%p", (int) packet_type, stream);
-				release_packet(stream, packet);
-				result = FF_FAILURE;
-				goto end;
+				*is_end = 1;
+				result = FF_SUCCESS;
+				break;
 			}
-
-			release_packet(stream, current_read_packet);
-			current_read_packet = packet;
+		}
+		if (stream->read_packets_head == NULL)
+		{
+			/* the rest of the stream hasn't been pushed yet */
+			result = FF_SUCCESS;
+			break;
+		}
+		result = refill_read_window(stream);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot skip pushed data in the packet stream=%p. See previous messages for more info", stream);
+			break;
 		}
 	}
-	result = FF_SUCCESS;
 
-end:
-	stream->current_read_packet = current_read_packet;
 	return result;
 }
 
+int mrpc_packet_stream_is_empty(struct mrpc_packet_stream *stream)
+{
+	return stream->is_empty;
+}
+
 enum ff_result mrpc_packet_stream_write(struct mrpc_packet_stream *stream, const void *buf, int len)
 {
-	struct mrpc_packet *current_write_packet;
-	struct ff_blocking_queue *writer_queue;
 	const char *p;
-	enum mrpc_packet_type packet_type;
+	enum ff_result result = FF_FAILURE;
 
 	ff_assert(len >= 0);
-	current_write_packet = stream->current_write_packet;
-	if (current_write_packet == NULL)
-	{
-		/* this is the first call of the mrpc_packet_stream_write() function. So acquire the writer packet */
-		acquire_current_write_packet(stream);
-		ff_assert(stream->current_write_packet != NULL);
-		current_write_packet = stream->current_write_packet;
-	}
 
 	p = (const char *) buf;
-	packet_type = mrpc_packet_get_type(current_write_packet);
-	ff_assert(packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_MIDDLE);
-	writer_queue = stream->writer_queue;
-	while (len > 0)
+	for (;;)
 	{
-		int bytes_written;
+		int bytes_left;
+
+		bytes_left = (int) (stream->write_limit - stream->write_pos);
+		ff_assert(bytes_left >= 0);
+		if (len <= bytes_left)
+		{
+			/* fast path: the data entirely fits into the current write packet */
+			memcpy(stream->write_pos, p, len);
+			stream->write_pos += len;
+			result = FF_SUCCESS;
+			break;
+		}
 
-		bytes_written = mrpc_packet_write_data(current_write_packet, p, len);
-		ff_assert(bytes_written >= 0);
-		ff_assert(bytes_written <= len);
-		len -= bytes_written;
-		p += bytes_written;
+		memcpy(stream->write_pos, p, bytes_left);
+		stream->write_pos += bytes_left;
+		len -= bytes_left;
+		p += bytes_left;
 
-		if (len > 0)
+		result = refill_write_window(stream);
+		if (result != FF_SUCCESS)
 		{
-			ff_blocking_queue_put(writer_queue, current_write_packet);
-			current_write_packet = acquire_packet(stream, MRPC_PACKET_MIDDLE);
+			ff_log_debug(L"cannot write len=%d bytes from the buf=%p to the packet stream=%p. See previous messages for more info", len, buf, stream);
+			break;
 		}
 	}
 
-	stream->current_write_packet = current_write_packet;
-	return FF_SUCCESS;
+	return result;
 }
 
 enum ff_result mrpc_packet_stream_flush(struct mrpc_packet_stream *stream)
@@ -323,7 +678,11 @@ enum ff_result mrpc_packet_stream_flush(struct mrpc_packet_stream *stream)
 	struct mrpc_packet *current_write_packet;
 	enum mrpc_packet_type packet_type;
 
-	ff_assert(stream->current_write_packet != NULL);
+	if (stream->current_write_packet == NULL)
+	{
+		/* nothing has been written to the stream, so flush an empty packet */
+		acquire_current_write_packet(stream);
+	}
 	current_write_packet = stream->current_write_packet;
 
 	packet_type = mrpc_packet_get_type(current_write_packet);
@@ -336,10 +695,22 @@ enum ff_result mrpc_packet_stream_flush(struct mrpc_packet_stream *stream)
 	{
 		packet_type = MRPC_PACKET_END;
 	}
+	mrpc_packet_commit_write_window(current_write_packet, stream->write_pos);
 	mrpc_packet_set_type(current_write_packet, packet_type);
-	ff_blocking_queue_put(stream->writer_queue, current_write_packet);
+	write_packet(stream, current_write_packet, 0);
 	stream->current_write_packet = acquire_packet(stream, MRPC_PACKET_END);
 
+	/* close the write window, so subsequent mrpc_packet_stream_write() calls
+	 * with non-zero len will hit the assertion in the refill_write_window().
+	 */
+	stream->write_pos = NULL;
+	stream->write_limit = NULL;
+
+	if (stream->is_disconnected)
+	{
+		ff_log_debug(L"the packet stream=%p has been disconnected, so the flushed data won't be delivered", stream);
+		return FF_FAILURE;
+	}
 	return FF_SUCCESS;
 }
 
@@ -347,13 +718,92 @@ void mrpc_packet_stream_disconnect(struct mrpc_packet_stream *stream)
 {
 	struct mrpc_packet *packet;
 
+	if (stream->is_disconnected)
+	{
+		ff_log_debug(L"the packet stream=%p is already disconnected", stream);
+		return;
+	}
+	stream->is_disconnected = 1;
+	ff_event_set(stream->credits_event);
 	packet = acquire_packet(stream, MRPC_PACKET_END);
-	ff_blocking_queue_put(stream->reader_queue, packet);
+	put_read_packet(stream, packet);
 }
 
-void mrpc_packet_stream_push_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet)
+enum ff_result mrpc_packet_stream_push_packet(struct mrpc_packet_stream *stream, struct mrpc_packet *packet)
 {
+	enum mrpc_packet_type packet_type;
+	enum ff_result result = FF_FAILURE;
+
 	ff_assert(packet != NULL);
 
-	ff_blocking_queue_put(stream->reader_queue, packet);
+	if (stream->is_flow_control_enabled && mrpc_packet_stream_is_credit_packet(packet))
+	{
+		release_packet(stream, packet);
+		stream->write_credits += CREDITS_BATCH_SIZE;
+		if (stream->write_credits > CREDITS_WINDOW)
+		{
+			ff_log_debug(L"the remote side granted too many credits=%d for the packet stream=%p. They mustn't exceed %d", stream->write_credits, stream, CREDITS_WINDOW);
+			goto end;
+		}
+		ff_event_set(stream->credits_event);
+		result = FF_SUCCESS;
+		goto end;
+	}
+
+	if (stream->is_final_packet_received)
+	{
+		ff_log_debug(L"the packet=%p has been received after the final packet for the packet stream=%p", packet, stream);
+		release_packet(stream, packet);
+		goto end;
+	}
+	packet_type = mrpc_packet_get_type(packet);
+	if (!stream->is_first_packet_received)
+	{
+		/* the MRPC_PROTOCOL_V2 framing doesn't transfer MRPC_PACKET_START and MRPC_PACKET_SINGLE types,
+		 * so restore them for the first packet in the stream.
+		 */
+		if (packet_type == MRPC_PACKET_MIDDLE)
+		{
+			packet_type = MRPC_PACKET_START;
+		}
+		else if (packet_type == MRPC_PACKET_END)
+		{
+			packet_type = MRPC_PACKET_SINGLE;
+		}
+		mrpc_packet_set_type(packet, packet_type);
+		stream->is_first_packet_received = 1;
+	}
+	if (packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_MIDDLE)
+	{
+		/* peers without the flow control aren't limited by credits */
+		if (stream->is_flow_control_enabled)
+		{
+			if (stream->read_credits == 0)
+			{
+				ff_log_debug(L"the remote side exceeded the credits window=%d for the packet stream=%p", CREDITS_WINDOW, stream);
+				release_packet(stream, packet);
+				goto end;
+			}
+			stream->read_credits--;
+		}
+	}
+	else
+	{
+		stream->is_final_packet_received = 1;
+	}
+	put_read_packet(stream, packet);
+	result = FF_SUCCESS;
+
+end:
+	return result;
+}
+
+int mrpc_packet_stream_is_credit_packet(struct mrpc_packet *packet)
+{
+	enum mrpc_packet_type packet_type;
+	int size;
+
+	packet_type = mrpc_packet_get_type(packet);
+	size = mrpc_packet_get_size(packet);
+	return (packet_type == MRPC_PACKET_MIDDLE && size == 0);
 }
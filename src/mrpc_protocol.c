@@ -0,0 +1,275 @@
+#include "private/mrpc_common.h"
+
+#include "private/mrpc_protocol.h"
+#include "private/mrpc_packet.h"
+#include "private/mrpc_int.h"
+#include "ff/ff_stream.h"
+
+/**
+ * Magic bytes at the beginning of the handshake packet.
+ * The first five bytes are the variable-length encoded 0xffffffff value.
+ * Servers, which don't support the handshake, treat the handshake packet
+ * as a request for the method with this id, which cannot exist, so they
+ * close the connection.
+ */
+#define HANDSHAKE_MAGIC "\xff\xff\xff\xff\x0f" "mrpc"
+
+#define HANDSHAKE_MAGIC_SIZE (sizeof(HANDSHAKE_MAGIC) - 1)
+
+/**
+ * The maximum size of the handshake packet's body:
+ * magic bytes followed by version, max_packet_size, max_request_streams_cnt and features.
+ * The features value is optional, because older implementations don't send it.
+ */
+#define MAX_HANDSHAKE_SIZE (HANDSHAKE_MAGIC_SIZE + 4 * MRPC_UINT32_MAX_ENCODED_SIZE)
+
+/**
+ * The maximum size of the serialized handshake packet including the packet header.
+ */
+#define MAX_SERIALIZED_HANDSHAKE_SIZE (MAX_HANDSHAKE_SIZE + 0x10)
+
+/**
+ * request_id of the handshake packet.
+ */
+#define HANDSHAKE_REQUEST_ID 0
+
+static int get_min(int a, int b)
+{
+	return (a < b) ? a : b;
+}
+
+static void write_handshake(struct mrpc_packet *packet, const struct mrpc_protocol_params *params)
+{
+	char *p;
+	char *limit;
+
+	p = mrpc_packet_get_write_window(packet, &limit);
+	ff_assert(limit - p >= MAX_HANDSHAKE_SIZE);
+	memcpy(p, HANDSHAKE_MAGIC, HANDSHAKE_MAGIC_SIZE);
+	p += HANDSHAKE_MAGIC_SIZE;
+	p += mrpc_uint32_encode((uint32_t) params->version, p);
+	p += mrpc_uint32_encode((uint32_t) params->max_packet_size, p);
+	p += mrpc_uint32_encode((uint32_t) params->max_request_streams_cnt, p);
+	p += mrpc_uint32_encode((uint32_t) params->features, p);
+	mrpc_packet_commit_write_window(packet, p);
+	mrpc_packet_set_request_id(packet, HANDSHAKE_REQUEST_ID);
+	mrpc_packet_set_type(packet, MRPC_PACKET_SINGLE);
+}
+
+static int read_handshake_value(uint32_t *value, const char **p, const char *limit)
+{
+	int len;
+
+	len = mrpc_uint32_decode(value, *p, (int) (limit - *p));
+	if (len <= 0)
+	{
+		return 0;
+	}
+	*p += len;
+	return 1;
+}
+
+/**
+ * Returns non-zero if the given packet contains valid handshake.
+ * In this case params are filled with values from the handshake.
+ */
+static int read_handshake(struct mrpc_packet *packet, struct mrpc_protocol_params *params)
+{
+	const char *p;
+	const char *limit;
+	uint32_t version;
+	uint32_t max_packet_size;
+	uint32_t max_request_streams_cnt;
+	uint32_t features;
+
+	if (mrpc_packet_get_request_id(packet) != HANDSHAKE_REQUEST_ID || mrpc_packet_get_type(packet) != MRPC_PACKET_SINGLE)
+	{
+		return 0;
+	}
+	p = mrpc_packet_get_read_window(packet, &limit);
+	if (limit - p < HANDSHAKE_MAGIC_SIZE || memcmp(p, HANDSHAKE_MAGIC, HANDSHAKE_MAGIC_SIZE) != 0)
+	{
+		return 0;
+	}
+	p += HANDSHAKE_MAGIC_SIZE;
+	if (!read_handshake_value(&version, &p, limit) ||
+		!read_handshake_value(&max_packet_size, &p, limit) ||
+		!read_handshake_value(&max_request_streams_cnt, &p, limit))
+	{
+		ff_log_debug(L"cannot read handshake values from the packet=%p", packet);
+		return 0;
+	}
+	if (version < MRPC_PROTOCOL_V2 ||
+		max_packet_size == 0 || max_packet_size > MRPC_PROTOCOL_MAX_PACKET_SIZE ||
+		max_request_streams_cnt == 0 || max_request_streams_cnt > MRPC_PROTOCOL_MAX_REQUEST_STREAMS_CNT)
+	{
+		ff_log_debug(L"wrong handshake values: version=%lu, max_packet_size=%lu, max_request_streams_cnt=%lu",
+			version, max_packet_size, max_request_streams_cnt);
+		return 0;
+	}
+
+	/* older implementations don't send features. Unknown features are ignored */
+	features = 0;
+	if (p < limit && !read_handshake_value(&features, &p, limit))
+	{
+		ff_log_debug(L"cannot read features from the handshake packet=%p", packet);
+		return 0;
+	}
+
+	/* versions above the MRPC_PROTOCOL_V2 aren't known yet, so they are downgraded to the MRPC_PROTOCOL_V2 */
+	params->version = MRPC_PROTOCOL_V2;
+	params->max_packet_size = (int) max_packet_size;
+	params->max_request_streams_cnt = (int) max_request_streams_cnt;
+	params->features = (int) (features & MRPC_PROTOCOL_SUPPORTED_FEATURES);
+	return 1;
+}
+
+static enum ff_result write_handshake_packet(struct mrpc_packet *packet, struct ff_stream *stream)
+{
+	char buf[MAX_SERIALIZED_HANDSHAKE_SIZE];
+	int len;
+	enum ff_result result;
+
+	ff_assert(mrpc_packet_get_serialized_size(packet) <= MAX_SERIALIZED_HANDSHAKE_SIZE);
+	len = mrpc_packet_serialize(packet, buf);
+	result = ff_stream_write(stream, buf, len);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot write the handshake packet=%p to the stream=%p. See previous messages for more info", packet, stream);
+		goto end;
+	}
+	result = ff_stream_flush(stream);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot flush the stream=%p after writing the handshake packet=%p. See previous messages for more info", stream, packet);
+	}
+
+end:
+	return result;
+}
+
+void mrpc_protocol_get_default_params(struct mrpc_protocol_params *params, enum mrpc_protocol_version version)
+{
+	params->version = version;
+	if (version == MRPC_PROTOCOL_V1)
+	{
+		params->max_packet_size = MRPC_PROTOCOL_V1_MAX_PACKET_SIZE;
+		params->max_request_streams_cnt = MRPC_PROTOCOL_V1_MAX_REQUEST_STREAMS_CNT;
+		params->features = 0;
+	}
+	else
+	{
+		ff_assert(version == MRPC_PROTOCOL_V2);
+		params->max_packet_size = MRPC_PROTOCOL_V2_MAX_PACKET_SIZE;
+		params->max_request_streams_cnt = MRPC_PROTOCOL_V2_MAX_REQUEST_STREAMS_CNT;
+		params->features = MRPC_PROTOCOL_SUPPORTED_FEATURES;
+	}
+}
+
+enum ff_result mrpc_protocol_client_handshake(struct ff_stream *stream, struct mrpc_protocol_params *params, int *is_rejected)
+{
+	struct mrpc_packet *packet;
+	struct mrpc_protocol_params server_params;
+	enum ff_result result;
+
+	ff_assert(params->version == MRPC_PROTOCOL_V2);
+
+	*is_rejected = 0;
+	packet = mrpc_packet_create(MRPC_PROTOCOL_V1, MRPC_PROTOCOL_V1_MAX_PACKET_SIZE);
+	write_handshake(packet, params);
+	result = write_handshake_packet(packet, stream);
+	mrpc_packet_reset(packet);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot send handshake to the stream=%p. See previous messages for more info", stream);
+		goto end;
+	}
+
+	result = mrpc_packet_read_from_stream(packet, stream);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot read handshake response from the stream=%p. The server probably doesn't support the handshake", stream);
+		*is_rejected = 1;
+		goto end;
+	}
+	if (!read_handshake(packet, &server_params) ||
+		server_params.max_packet_size > params->max_packet_size ||
+		server_params.max_request_streams_cnt > params->max_request_streams_cnt ||
+		(server_params.features & ~params->features) != 0)
+	{
+		ff_log_debug(L"wrong handshake response has been read from the stream=%p", stream);
+		*is_rejected = 1;
+		result = FF_FAILURE;
+		goto end;
+	}
+	*params = server_params;
+
+end:
+	mrpc_packet_reset(packet);
+	mrpc_packet_delete(packet);
+	return result;
+}
+
+enum ff_result mrpc_protocol_server_handshake(struct ff_stream *stream, struct mrpc_protocol_params *params, struct mrpc_packet **first_packet)
+{
+	struct mrpc_packet *packet;
+	struct mrpc_protocol_params client_params;
+	enum ff_result result;
+
+	*first_packet = NULL;
+	packet = mrpc_packet_create(MRPC_PROTOCOL_V1, MRPC_PROTOCOL_V1_MAX_PACKET_SIZE);
+	result = mrpc_packet_read_from_stream(packet, stream);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot read the first packet from the stream=%p. See previous messages for more info", stream);
+		mrpc_packet_reset(packet);
+		mrpc_packet_delete(packet);
+		goto end;
+	}
+
+	if (!read_handshake(packet, &client_params))
+	{
+		/* the client doesn't support the handshake */
+		mrpc_protocol_get_default_params(params, MRPC_PROTOCOL_V1);
+		*first_packet = packet;
+		goto end;
+	}
+
+	params->version = client_params.version;
+	params->max_packet_size = get_min(params->max_packet_size, client_params.max_packet_size);
+	params->max_request_streams_cnt = get_min(params->max_request_streams_cnt, client_params.max_request_streams_cnt);
+	params->features &= client_params.features;
+	mrpc_packet_reset(packet);
+	write_handshake(packet, params);
+	result = write_handshake_packet(packet, stream);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot send handshake response to the stream=%p. See previous messages for more info", stream);
+	}
+	mrpc_packet_reset(packet);
+	mrpc_packet_delete(packet);
+
+end:
+	return result;
+}
+
+void mrpc_protocol_write_goaway(const struct mrpc_protocol_params *params, struct mrpc_packet *packet)
+{
+	ff_assert(params->version == MRPC_PROTOCOL_V2);
+	ff_assert((params->features & MRPC_PROTOCOL_FEATURE_GOAWAY) != 0);
+	ff_assert(mrpc_packet_get_size(packet) == 0);
+
+	mrpc_packet_set_request_id(packet, (uint32_t) params->max_request_streams_cnt);
+	mrpc_packet_set_type(packet, MRPC_PACKET_END);
+}
+
+int mrpc_protocol_is_goaway(const struct mrpc_protocol_params *params, struct mrpc_packet *packet)
+{
+	int is_goaway;
+
+	is_goaway = ((params->features & MRPC_PROTOCOL_FEATURE_GOAWAY) != 0 &&
+		mrpc_packet_get_request_id(packet) == (uint32_t) params->max_request_streams_cnt &&
+		mrpc_packet_get_type(packet) == MRPC_PACKET_END &&
+		mrpc_packet_get_size(packet) == 0);
+	return is_goaway;
+}
@@ -0,0 +1,342 @@
+#include "private/mrpc_common.h"
+
+#include "private/mrpc_scheduler.h"
+#include "ff/ff_core.h"
+
+/**
+ * The default weight of scheduler queues.
+ */
+#define DEFAULT_WEIGHT 1
+
+struct mrpc_scheduler_queue
+{
+	struct mrpc_scheduler *scheduler;
+
+	/* lists of pending tasks. There is a separate list per priority.
+	 * Tasks with higher priority are executed first when the queue receives an execution slot,
+	 * so priorities don't affect the share of execution slots received by the queue.
+	 */
+	struct mrpc_scheduler_task *tasks_heads[MRPC_PRIORITIES_CNT];
+	struct mrpc_scheduler_task *tasks_tails[MRPC_PRIORITIES_CNT];
+	int pending_tasks_cnt;
+
+	/* the ring of queues with pending tasks. These fields are valid only if is_active is set */
+	struct mrpc_scheduler_queue *prev;
+	struct mrpc_scheduler_queue *next;
+
+	int weight;
+
+	/* the number of tasks, which can be executed from the queue during the current round */
+	int deficit;
+	int is_active;
+};
+
+struct mrpc_scheduler
+{
+	/* the queue, which is served during the current round.
+	 * It is NULL if there are no pending tasks.
+	 */
+	struct mrpc_scheduler_queue *current_queue;
+
+	int max_active_tasks_cnt;
+	int active_tasks_cnt;
+	int queues_cnt;
+};
+
+static void activate_queue(struct mrpc_scheduler_queue *queue)
+{
+	struct mrpc_scheduler *scheduler;
+	struct mrpc_scheduler_queue *current_queue;
+
+	ff_assert(!queue->is_active);
+
+	scheduler = queue->scheduler;
+	current_queue = scheduler->current_queue;
+	if (current_queue == NULL)
+	{
+		queue->prev = queue;
+		queue->next = queue;
+		queue->deficit = queue->weight;
+		scheduler->current_queue = queue;
+	}
+	else
+	{
+		/* the queue is added to the end of the current round */
+		queue->prev = current_queue->prev;
+		queue->next = current_queue;
+		current_queue->prev->next = queue;
+		current_queue->prev = queue;
+		queue->deficit = 0;
+	}
+	queue->is_active = 1;
+}
+
+static void deactivate_queue(struct mrpc_scheduler_queue *queue)
+{
+	struct mrpc_scheduler *scheduler;
+	struct mrpc_scheduler_queue *next_queue;
+
+	ff_assert(queue->is_active);
+	ff_assert(queue->pending_tasks_cnt == 0);
+
+	scheduler = queue->scheduler;
+	next_queue = queue->next;
+	if (next_queue == queue)
+	{
+		next_queue = NULL;
+	}
+	else
+	{
+		queue->prev->next = next_queue;
+		next_queue->prev = queue->prev;
+	}
+	if (scheduler->current_queue == queue)
+	{
+		scheduler->current_queue = next_queue;
+		if (next_queue != NULL)
+		{
+			next_queue->deficit = next_queue->weight;
+		}
+	}
+	queue->prev = NULL;
+	queue->next = NULL;
+	queue->deficit = 0;
+	queue->is_active = 0;
+}
+
+static void push_task(struct mrpc_scheduler_queue *queue, struct mrpc_scheduler_task *task)
+{
+	int priority;
+
+	ff_assert(task->next == NULL);
+
+	priority = task->priority;
+	if (queue->tasks_tails[priority] == NULL)
+	{
+		ff_assert(queue->tasks_heads[priority] == NULL);
+		queue->tasks_heads[priority] = task;
+	}
+	else
+	{
+		queue->tasks_tails[priority]->next = task;
+	}
+	queue->tasks_tails[priority] = task;
+	queue->pending_tasks_cnt++;
+	if (queue->pending_tasks_cnt == 1)
+	{
+		activate_queue(queue);
+	}
+}
+
+static struct mrpc_scheduler_task *pop_task(struct mrpc_scheduler_queue *queue)
+{
+	struct mrpc_scheduler_task *task;
+	int priority;
+
+	ff_assert(queue->pending_tasks_cnt > 0);
+
+	priority = 0;
+	while (queue->tasks_heads[priority] == NULL)
+	{
+		priority++;
+		ff_assert(priority < MRPC_PRIORITIES_CNT);
+	}
+
+	task = queue->tasks_heads[priority];
+	queue->tasks_heads[priority] = task->next;
+	task->next = NULL;
+	if (queue->tasks_heads[priority] == NULL)
+	{
+		queue->tasks_tails[priority] = NULL;
+	}
+	queue->pending_tasks_cnt--;
+	if (queue->pending_tasks_cnt == 0)
+	{
+		deactivate_queue(queue);
+	}
+	return task;
+}
+
+static struct mrpc_scheduler_task *get_next_task(struct mrpc_scheduler *scheduler)
+{
+	struct mrpc_scheduler_queue *queue;
+	struct mrpc_scheduler_task *task;
+
+	queue = scheduler->current_queue;
+	if (queue == NULL)
+	{
+		/* there are no pending tasks */
+		return NULL;
+	}
+
+	if (queue->deficit == 0)
+	{
+		/* the queue has exhausted its share in the current round, so move to the next queue */
+		queue = queue->next;
+		queue->deficit = queue->weight;
+		scheduler->current_queue = queue;
+	}
+	ff_assert(queue->deficit > 0);
+	queue->deficit--;
+	task = pop_task(queue);
+	return task;
+}
+
+static void task_func(void *ctx)
+{
+	struct mrpc_scheduler_task *task;
+	struct mrpc_scheduler *scheduler;
+
+	task = (struct mrpc_scheduler_task *) ctx;
+	scheduler = task->queue->scheduler;
+	ff_assert(scheduler->active_tasks_cnt > 0);
+
+	/* pending tasks are executed in the current fiber, so execution slots are passed between tasks
+	 * without creating new fibers.
+	 */
+	do
+	{
+		mrpc_scheduler_func func;
+		void *func_ctx;
+
+		/* the task can be re-used by the func, so copy its fields before calling the func */
+		func = task->func;
+		func_ctx = task->ctx;
+		task->queue = NULL;
+		func(func_ctx);
+		task = get_next_task(scheduler);
+	}
+	while (task != NULL);
+
+	scheduler->active_tasks_cnt--;
+}
+
+struct mrpc_scheduler *mrpc_scheduler_create()
+{
+	struct mrpc_scheduler *scheduler;
+
+	scheduler = (struct mrpc_scheduler *) ff_malloc(sizeof(*scheduler));
+	scheduler->current_queue = NULL;
+	scheduler->max_active_tasks_cnt = 0;
+	scheduler->active_tasks_cnt = 0;
+	scheduler->queues_cnt = 0;
+
+	return scheduler;
+}
+
+void mrpc_scheduler_delete(struct mrpc_scheduler *scheduler)
+{
+	ff_assert(scheduler->current_queue == NULL);
+	ff_assert(scheduler->queues_cnt == 0);
+
+	ff_free(scheduler);
+}
+
+void mrpc_scheduler_set_max_active_tasks(struct mrpc_scheduler *scheduler, int max_active_tasks_cnt)
+{
+	ff_assert(max_active_tasks_cnt >= 0);
+	ff_assert(scheduler->current_queue == NULL);
+
+	scheduler->max_active_tasks_cnt = max_active_tasks_cnt;
+}
+
+struct mrpc_scheduler_queue *mrpc_scheduler_queue_create(struct mrpc_scheduler *scheduler)
+{
+	struct mrpc_scheduler_queue *queue;
+	int i;
+
+	queue = (struct mrpc_scheduler_queue *) ff_malloc(sizeof(*queue));
+	queue->scheduler = scheduler;
+	for (i = 0; i < MRPC_PRIORITIES_CNT; i++)
+	{
+		queue->tasks_heads[i] = NULL;
+		queue->tasks_tails[i] = NULL;
+	}
+	queue->pending_tasks_cnt = 0;
+	queue->prev = NULL;
+	queue->next = NULL;
+	queue->weight = DEFAULT_WEIGHT;
+	queue->deficit = 0;
+	queue->is_active = 0;
+
+	scheduler->queues_cnt++;
+
+	return queue;
+}
+
+void mrpc_scheduler_queue_delete(struct mrpc_scheduler_queue *queue)
+{
+	ff_assert(queue->pending_tasks_cnt == 0);
+	ff_assert(!queue->is_active);
+	ff_assert(queue->scheduler->queues_cnt > 0);
+
+	queue->scheduler->queues_cnt--;
+	ff_free(queue);
+}
+
+void mrpc_scheduler_queue_set_weight(struct mrpc_scheduler_queue *queue, int weight)
+{
+	ff_assert(weight > 0);
+
+	queue->weight = weight;
+}
+
+void mrpc_scheduler_queue_execute(struct mrpc_scheduler_queue *queue, struct mrpc_scheduler_task *task, enum mrpc_priority priority,
+	mrpc_scheduler_func func, void *ctx)
+{
+	struct mrpc_scheduler *scheduler;
+
+	scheduler = queue->scheduler;
+	task->queue = queue;
+	task->next = NULL;
+	task->func = func;
+	task->ctx = ctx;
+	task->priority = priority;
+	if (scheduler->max_active_tasks_cnt == 0 || scheduler->active_tasks_cnt < scheduler->max_active_tasks_cnt)
+	{
+		/* there is a free execution slot, so there are no pending tasks */
+		ff_assert(scheduler->current_queue == NULL);
+		scheduler->active_tasks_cnt++;
+		ff_core_fiberpool_execute_async(task_func, task);
+	}
+	else
+	{
+		push_task(queue, task);
+	}
+}
+
+int mrpc_scheduler_queue_try_acquire_slot(struct mrpc_scheduler_queue *queue)
+{
+	struct mrpc_scheduler *scheduler;
+
+	scheduler = queue->scheduler;
+	if (scheduler->max_active_tasks_cnt != 0 && scheduler->active_tasks_cnt >= scheduler->max_active_tasks_cnt)
+	{
+		return 0;
+	}
+
+	/* there is a free execution slot, so there are no pending tasks */
+	ff_assert(scheduler->current_queue == NULL);
+	scheduler->active_tasks_cnt++;
+	return 1;
+}
+
+void mrpc_scheduler_queue_release_slot(struct mrpc_scheduler_queue *queue)
+{
+	struct mrpc_scheduler *scheduler;
+	struct mrpc_scheduler_task *task;
+
+	scheduler = queue->scheduler;
+	ff_assert(scheduler->active_tasks_cnt > 0);
+
+	/* tasks could be queued while the slot was occupied, so pass the slot to the next pending task */
+	task = get_next_task(scheduler);
+	if (task != NULL)
+	{
+		ff_core_fiberpool_execute_async(task_func, task);
+	}
+	else
+	{
+		scheduler->active_tasks_cnt--;
+	}
+}
@@ -3,6 +3,7 @@
 #include "private/mrpc_server.h"
 #include "private/mrpc_server_stream_handler.h"
 #include "private/mrpc_server_stream_processor.h"
+#include "private/mrpc_scheduler.h"
 #include "private/mrpc_bitmap.h"
 #include "ff/ff_stream_acceptor.h"
 #include "ff/ff_stream.h"
@@ -10,18 +11,37 @@
 #include "ff/ff_pool.h"
 #include "ff/ff_core.h"
 
+/**
+ * Interval (in milliseconds) between ticks of the idle connections reaper.
+ * Idle time of connections is measured in these ticks.
+ */
+#define REAPER_TICK_INTERVAL 100
+
 struct mrpc_server
 {
 	struct ff_event *stop_event;
 	struct ff_event *stream_processors_stop_event;
+	struct ff_event *reaper_stop_event;
+	struct ff_event *reaper_stopped_event;
 	struct mrpc_bitmap *stream_processors_bitmap;
 	struct ff_pool *stream_processors_pool;
 	struct mrpc_server_stream_processor **active_stream_processors;
+	struct mrpc_scheduler *scheduler;
+	mrpc_server_connection_weight_func connection_weight_func;
 	mrpc_server_stream_handler stream_handler;
 	void *service_ctx;
 	struct ff_stream_acceptor *stream_acceptor;
 	int max_stream_processors_cnt;
 	int active_stream_processors_cnt;
+	int is_inline_requests_enabled;
+	int flush_delay;
+	int flush_threshold;
+	int hibernation_timeout;
+	int max_inflight_requests;
+	int target_inflight_requests;
+	enum mrpc_server_admission_policy admission_policy;
+	int idle_timeout;
+	int drain_timeout;
 };
 
 static void stop_all_stream_processors(struct mrpc_server *server)
@@ -47,6 +67,41 @@ static void stop_all_stream_processors(struct mrpc_server *server)
 	ff_assert(server->active_stream_processors_cnt == 0);
 }
 
+static void drain_all_stream_processors(struct mrpc_server *server)
+{
+	struct mrpc_server_stream_processor **active_stream_processors;
+	int max_stream_processors_cnt;
+	int i;
+	enum ff_result result;
+
+	ff_assert(server->max_stream_processors_cnt > 0);
+	ff_assert(server->drain_timeout > 0);
+	active_stream_processors = server->active_stream_processors;
+	max_stream_processors_cnt = server->max_stream_processors_cnt;
+	for (i = 0; i < max_stream_processors_cnt; i++)
+	{
+		struct mrpc_server_stream_processor *stream_processor;
+
+		stream_processor = active_stream_processors[i];
+		if (stream_processor != NULL)
+		{
+			mrpc_server_stream_processor_drain(stream_processor);
+		}
+	}
+	result = ff_event_wait_with_timeout(server->stream_processors_stop_event, server->drain_timeout);
+	if (result == FF_SUCCESS)
+	{
+		/* all the stream processors are stopped. Set the event again, because stop_all_stream_processors() waits for it */
+		ff_assert(server->active_stream_processors_cnt == 0);
+		ff_event_set(server->stream_processors_stop_event);
+	}
+	else
+	{
+		ff_log_debug(L"%d stream processors of the server=%p didn't complete in-flight requests during drain_timeout=%d, so they will be stopped",
+			server->active_stream_processors_cnt, server, server->drain_timeout);
+	}
+}
+
 static struct mrpc_server_stream_processor *acquire_stream_processor(struct mrpc_server *server)
 {
 	struct mrpc_server_stream_processor *stream_processor;
@@ -122,7 +177,8 @@ static void *create_stream_processor(void *ctx)
 
 	server = (struct mrpc_server *) ctx;
 	stream_processor_id = acquire_stream_processor_id(server);
-	stream_processor = mrpc_server_stream_processor_create(release_stream_processor, server, release_stream_processor_id, server, stream_processor_id);
+	stream_processor = mrpc_server_stream_processor_create(release_stream_processor, server, release_stream_processor_id, server, stream_processor_id,
+		server->scheduler);
 	return stream_processor;
 }
 
@@ -134,12 +190,143 @@ static void delete_stream_processor(void *ctx)
 	mrpc_server_stream_processor_delete(stream_processor);
 }
 
+static int is_reaper_required(struct mrpc_server *server)
+{
+	int is_required;
+
+	/* idle ticks are required both for reaping and for evicting idle connections */
+	is_required = (server->idle_timeout > 0 || server->admission_policy == MRPC_SERVER_ADMISSION_EVICT_IDLE);
+	return is_required;
+}
+
+static void reap_idle_stream_processors(struct mrpc_server *server, int max_idle_ticks_cnt)
+{
+	struct mrpc_server_stream_processor **active_stream_processors;
+	int max_stream_processors_cnt;
+	int i;
+
+	active_stream_processors = server->active_stream_processors;
+	max_stream_processors_cnt = server->max_stream_processors_cnt;
+	for (i = 0; i < max_stream_processors_cnt; i++)
+	{
+		struct mrpc_server_stream_processor *stream_processor;
+
+		stream_processor = active_stream_processors[i];
+		if (stream_processor != NULL)
+		{
+			int idle_ticks_cnt;
+
+			idle_ticks_cnt = mrpc_server_stream_processor_tick_idle(stream_processor);
+			if (max_idle_ticks_cnt > 0 && idle_ticks_cnt >= max_idle_ticks_cnt)
+			{
+				ff_log_debug(L"the stream_processor=%p of the server=%p was idle for more than %d milliseconds, so it is stopped",
+					stream_processor, server, server->idle_timeout);
+				mrpc_server_stream_processor_stop_async(stream_processor);
+			}
+		}
+	}
+}
+
+static void reaper_func(void *ctx)
+{
+	struct mrpc_server *server;
+	int max_idle_ticks_cnt;
+
+	server = (struct mrpc_server *) ctx;
+
+	/* zero max_idle_ticks_cnt means that idle connections aren't reaped */
+	max_idle_ticks_cnt = (server->idle_timeout + REAPER_TICK_INTERVAL - 1) / REAPER_TICK_INTERVAL;
+	for (;;)
+	{
+		enum ff_result result;
+
+		result = ff_event_wait_with_timeout(server->reaper_stop_event, REAPER_TICK_INTERVAL);
+		if (result == FF_SUCCESS)
+		{
+			break;
+		}
+		reap_idle_stream_processors(server, max_idle_ticks_cnt);
+	}
+	ff_event_set(server->reaper_stopped_event);
+}
+
+static struct mrpc_server_stream_processor *get_least_recently_active_stream_processor(struct mrpc_server *server)
+{
+	struct mrpc_server_stream_processor **active_stream_processors;
+	struct mrpc_server_stream_processor *least_recently_active_stream_processor = NULL;
+	int max_idle_ticks_cnt = 0;
+	int max_stream_processors_cnt;
+	int i;
+
+	active_stream_processors = server->active_stream_processors;
+	max_stream_processors_cnt = server->max_stream_processors_cnt;
+	for (i = 0; i < max_stream_processors_cnt; i++)
+	{
+		struct mrpc_server_stream_processor *stream_processor;
+
+		stream_processor = active_stream_processors[i];
+		if (stream_processor != NULL)
+		{
+			int idle_ticks_cnt;
+
+			/* connections, which were active during the last tick, aren't idle */
+			idle_ticks_cnt = mrpc_server_stream_processor_get_idle_ticks(stream_processor);
+			if (idle_ticks_cnt > max_idle_ticks_cnt)
+			{
+				max_idle_ticks_cnt = idle_ticks_cnt;
+				least_recently_active_stream_processor = stream_processor;
+			}
+		}
+	}
+	return least_recently_active_stream_processor;
+}
+
+static int admit_connection(struct mrpc_server *server)
+{
+	struct mrpc_server_stream_processor *stream_processor;
+	int is_admitted = 1;
+
+	if (server->active_stream_processors_cnt == server->max_stream_processors_cnt)
+	{
+		switch (server->admission_policy)
+		{
+		case MRPC_SERVER_ADMISSION_WAIT:
+			/* the connection waits in the acquire_stream_processor() until one of active connections is closed */
+			break;
+		case MRPC_SERVER_ADMISSION_REJECT:
+			ff_log_debug(L"the server=%p reached the limit of connections=%d, so new connection is rejected", server, server->max_stream_processors_cnt);
+			is_admitted = 0;
+			break;
+		case MRPC_SERVER_ADMISSION_EVICT_IDLE:
+			stream_processor = get_least_recently_active_stream_processor(server);
+			if (stream_processor == NULL)
+			{
+				ff_log_debug(L"the server=%p reached the limit of connections=%d and there are no idle connections, so new connection is rejected",
+					server, server->max_stream_processors_cnt);
+				is_admitted = 0;
+			}
+			else
+			{
+				/* the acquire_stream_processor() will wait until the evicted stream_processor is released */
+				ff_log_debug(L"the server=%p reached the limit of connections=%d, so the idle stream_processor=%p is evicted",
+					server, server->max_stream_processors_cnt, stream_processor);
+				mrpc_server_stream_processor_stop_async(stream_processor);
+			}
+			break;
+		default:
+			ff_assert(0);
+		}
+	}
+	return is_admitted;
+}
+
 static void main_server_func(void *ctx)
 {
 	struct mrpc_server *server;
 	struct ff_stream_acceptor *stream_acceptor;
 	mrpc_server_stream_handler stream_handler;
 	void *service_ctx;
+	int is_reaper_started;
 
 	server = (struct mrpc_server *) ctx;
 
@@ -151,10 +338,16 @@ static void main_server_func(void *ctx)
 	stream_acceptor = server->stream_acceptor;
 	stream_handler = server->stream_handler;
 	service_ctx = server->service_ctx;
+	is_reaper_started = is_reaper_required(server);
+	if (is_reaper_started)
+	{
+		ff_core_fiberpool_execute_async(reaper_func, server);
+	}
 	for (;;)
 	{
 		struct mrpc_server_stream_processor *stream_processor;
 		struct ff_stream *client_stream;
+		int is_admitted;
 
 		client_stream = ff_stream_acceptor_accept(stream_acceptor);
 		if (client_stream == NULL)
@@ -162,8 +355,33 @@ static void main_server_func(void *ctx)
 			ff_log_debug(L"mrpc_server_stop() has been called, so the stream_acceptor=%p of the server=%p returned NULL", stream_acceptor, server);
 			break;
 		}
+		is_admitted = admit_connection(server);
+		if (!is_admitted)
+		{
+			ff_stream_delete(client_stream);
+			continue;
+		}
 		stream_processor = acquire_stream_processor(server);
-		mrpc_server_stream_processor_start(stream_processor, stream_handler, service_ctx, client_stream);
+		mrpc_server_stream_processor_set_flush_policy(stream_processor, server->flush_delay, server->flush_threshold);
+		mrpc_server_stream_processor_set_hibernation_timeout(stream_processor, server->hibernation_timeout);
+		mrpc_server_stream_processor_set_load_shedding(stream_processor, server->max_inflight_requests, server->target_inflight_requests);
+		if (server->connection_weight_func != NULL)
+		{
+			int weight;
+
+			weight = server->connection_weight_func(client_stream, service_ctx);
+			mrpc_server_stream_processor_set_weight(stream_processor, weight);
+		}
+		mrpc_server_stream_processor_start(stream_processor, stream_handler, service_ctx, client_stream, server->is_inline_requests_enabled);
+	}
+	if (is_reaper_started)
+	{
+		ff_event_set(server->reaper_stop_event);
+		ff_event_wait(server->reaper_stopped_event);
+	}
+	if (server->drain_timeout > 0)
+	{
+		drain_all_stream_processors(server);
 	}
 	stop_all_stream_processors(server);
 
@@ -179,11 +397,24 @@ struct mrpc_server *mrpc_server_create(int max_stream_processors_cnt)
 	server = (struct mrpc_server *) ff_malloc(sizeof(*server));
 	server->stop_event = ff_event_create(FF_EVENT_AUTO);
 	server->stream_processors_stop_event = ff_event_create(FF_EVENT_AUTO);
+	server->reaper_stop_event = ff_event_create(FF_EVENT_AUTO);
+	server->reaper_stopped_event = ff_event_create(FF_EVENT_AUTO);
 	server->stream_processors_bitmap = mrpc_bitmap_create(max_stream_processors_cnt);
+	server->scheduler = mrpc_scheduler_create();
 	server->stream_processors_pool = ff_pool_create(max_stream_processors_cnt, create_stream_processor, server, delete_stream_processor);
 	server->active_stream_processors = (struct mrpc_server_stream_processor **) ff_calloc(max_stream_processors_cnt, sizeof(server->active_stream_processors[0]));
 	server->max_stream_processors_cnt = max_stream_processors_cnt;
 	server->active_stream_processors_cnt = 0;
+	server->is_inline_requests_enabled = 0;
+	server->flush_delay = MRPC_DEFAULT_FLUSH_DELAY;
+	server->flush_threshold = MRPC_DEFAULT_FLUSH_THRESHOLD;
+	server->hibernation_timeout = MRPC_DEFAULT_HIBERNATION_TIMEOUT;
+	server->max_inflight_requests = 0;
+	server->target_inflight_requests = 0;
+	server->connection_weight_func = NULL;
+	server->admission_policy = MRPC_SERVER_ADMISSION_WAIT;
+	server->idle_timeout = 0;
+	server->drain_timeout = 0;
 
 	server->stream_handler = NULL;
 	server->service_ctx = NULL;
@@ -203,7 +434,10 @@ void mrpc_server_delete(struct mrpc_server *server)
 
 	ff_free(server->active_stream_processors);
 	ff_pool_delete(server->stream_processors_pool);
+	mrpc_scheduler_delete(server->scheduler);
 	mrpc_bitmap_delete(server->stream_processors_bitmap);
+	ff_event_delete(server->reaper_stopped_event);
+	ff_event_delete(server->reaper_stop_event);
 	ff_event_delete(server->stream_processors_stop_event);
 	ff_event_delete(server->stop_event);
 	ff_free(server);
@@ -227,6 +461,65 @@ void mrpc_server_start(struct mrpc_server *server, mrpc_server_stream_handler st
 	ff_core_fiberpool_execute_async(main_server_func, server);
 }
 
+void mrpc_server_set_inline_requests(struct mrpc_server *server, int is_enabled)
+{
+	ff_assert(server != NULL);
+	ff_assert(server->stream_handler == NULL);
+
+	server->is_inline_requests_enabled = is_enabled;
+}
+
+void mrpc_server_set_flush_policy(struct mrpc_server *server, int flush_delay, int flush_threshold)
+{
+	ff_assert(server != NULL);
+	ff_assert(server->stream_handler == NULL);
+	ff_assert(flush_delay >= 0);
+	ff_assert(flush_threshold >= 0);
+
+	server->flush_delay = flush_delay;
+	server->flush_threshold = flush_threshold;
+}
+
+void mrpc_server_set_hibernation_timeout(struct mrpc_server *server, int hibernation_timeout)
+{
+	ff_assert(server != NULL);
+	ff_assert(server->stream_handler == NULL);
+	ff_assert(hibernation_timeout > 0);
+
+	server->hibernation_timeout = hibernation_timeout;
+}
+
+void mrpc_server_set_load_shedding(struct mrpc_server *server, int max_inflight_requests, int target_inflight_requests)
+{
+	ff_assert(server != NULL);
+	ff_assert(server->stream_handler == NULL);
+	ff_assert(max_inflight_requests >= 0);
+	ff_assert(target_inflight_requests >= 0);
+
+	server->max_inflight_requests = max_inflight_requests;
+	server->target_inflight_requests = target_inflight_requests;
+}
+
+void mrpc_server_set_fair_scheduling(struct mrpc_server *server, int max_active_handlers_cnt, mrpc_server_connection_weight_func connection_weight_func)
+{
+	ff_assert(server != NULL);
+	ff_assert(server->stream_handler == NULL);
+	ff_assert(max_active_handlers_cnt >= 0);
+
+	mrpc_scheduler_set_max_active_tasks(server->scheduler, max_active_handlers_cnt);
+	server->connection_weight_func = connection_weight_func;
+}
+
+void mrpc_server_set_admission_policy(struct mrpc_server *server, enum mrpc_server_admission_policy admission_policy, int idle_timeout)
+{
+	ff_assert(server != NULL);
+	ff_assert(server->stream_handler == NULL);
+	ff_assert(idle_timeout >= 0);
+
+	server->admission_policy = admission_policy;
+	server->idle_timeout = idle_timeout;
+}
+
 void mrpc_server_stop(struct mrpc_server *server)
 {
 	ff_assert(server != NULL);
@@ -242,3 +535,14 @@ void mrpc_server_stop(struct mrpc_server *server)
 	server->service_ctx = NULL;
 	server->stream_acceptor = NULL;
 }
+
+void mrpc_server_drain(struct mrpc_server *server, int drain_timeout)
+{
+	ff_assert(server != NULL);
+	ff_assert(drain_timeout > 0);
+	ff_assert(server->drain_timeout == 0);
+
+	server->drain_timeout = drain_timeout;
+	mrpc_server_stop(server);
+	server->drain_timeout = 0;
+}
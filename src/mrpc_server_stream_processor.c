@@ -2,29 +2,44 @@
 
 #include "private/mrpc_server_stream_processor.h"
 #include "private/mrpc_packet_stream.h"
+#include "private/mrpc_protocol.h"
+#include "private/mrpc_memory.h"
+#include "private/mrpc_write_batch.h"
+#include "private/mrpc_writer_queue.h"
+#include "private/mrpc_scheduler.h"
 #include "private/mrpc_server_stream_handler.h"
 #include "ff/ff_event.h"
 #include "ff/ff_pool.h"
-#include "ff/ff_blocking_queue.h"
 #include "ff/ff_stream.h"
 #include "ff/ff_core.h"
 
 /**
- * the maximum number of request streams, which can be simultaneously created by the mrpc_client_stream_processor.
- * This number should be less or equal to the 0x100, because of restriction on the size (1 bytes) of request_id
- * field in the mrpc client-server protocol. request_id is assigned for each currently running request
- * and is used for association with the corresponding asynchronous response.
- * So there are 0x100 maximum request streams can be created in parallel.
+ * the maximum number of request streams, which can be simultaneously created by the mrpc_server_stream_processor.
+ * The actual limit is negotiated with the client during the handshake.
+ * request_id is assigned for each currently running request and is used for association
+ * with the corresponding asynchronous response.
  */
-#define MAX_REQUEST_STREAMS_CNT 0x100
+#define MAX_REQUEST_STREAMS_CNT MRPC_PROTOCOL_MAX_REQUEST_STREAMS_CNT
 
 /**
  * the maximum number of mrpc_packet packets, which can be used by the instance of the
- * mrpc_server_stream_processor. These packets are used when receiving data from the underlying stream.
+ * mrpc_server_stream_processor for the connection with the given number of request streams.
+ * These packets are used when receiving data from the underlying stream.
  * Also they are used by the request streams when serializing rpc responses.
- * In order to avoid deadlocks this number must be not less than (2 * MAX_REQUEST_STREAMS_CNT).
+ * In order to avoid deadlocks this number must be not less than (2 * request_streams_cnt).
+ * The number of packets, which can be occupied by a single request stream, is limited
+ * by the flow control in the mrpc_packet_stream, so a single bulk transfer cannot exhaust packets
+ * required by other request streams. Additional packets are reserved for such transfers.
  */
-#define MAX_PACKETS_CNT (2 * MAX_REQUEST_STREAMS_CNT)
+#define GET_MAX_PACKETS_CNT(request_streams_cnt) (3 * (request_streams_cnt))
+
+#define MAX_PACKETS_CNT GET_MAX_PACKETS_CNT(MAX_REQUEST_STREAMS_CNT)
+
+/**
+ * The number of new requests, over which the minimum number of in-flight requests is tracked
+ * for detecting a standing queue of requests. See is_overloaded().
+ */
+#define STANDING_QUEUE_WINDOW 64
 
 enum server_stream_processor_state
 {
@@ -38,9 +53,47 @@ struct request_stream
 	struct mrpc_server_stream_processor *stream_processor;
 	struct mrpc_packet_stream *packet_stream;
 	struct ff_stream *stream;
-	uint8_t request_id;
+	uint32_t request_id;
+
+	/* the flow of packets of the request stream in the writer_queue */
+	struct mrpc_writer_queue_flow writer_queue_flow;
+
+	/* the task for executing the request by the scheduler */
+	struct mrpc_scheduler_task task;
+
+	/* the priority of the request received from the client. See read_request_priority() */
+	enum mrpc_priority priority;
+
+	/* this flag is set for requests rejected due to overload */
+	int is_rejected;
+
+	/* the last packet of the response, which is written directly to the stream
+	 * after the request stream is released. See process_request_func().
+	 */
+	struct mrpc_packet *last_packet;
+};
+
+/* the request, which is handled inline by the stream reader */
+struct inline_request
+{
+	struct request_stream *request_stream;
+
+	/* this flag is set when another fiber took over reading from the stream,
+	 * while the request was waiting for credits or was going to block.
+	 */
+	int is_reader_handed_off;
+
+	/* the next inline request in the active_inline_requests list */
+	struct inline_request *next;
 };
 
+/* inline requests, which occupy stream readers of all the stream processors.
+ * Stream handlers look up their inline requests by request streams
+ * in the mrpc_server_stream_handler_prepare_to_block(). All the fibers run on the same thread,
+ * so the list doesn't require synchronization.
+ */
+static struct inline_request *active_inline_requests = NULL;
+
 struct mrpc_server_stream_processor
 {
 	mrpc_server_stream_processor_release_func release_func;
@@ -48,16 +101,89 @@ struct mrpc_server_stream_processor
 	mrpc_server_stream_processor_release_id_func release_id_func;
 	void *release_id_func_ctx;
 	struct ff_event *writer_stop_event;
+
+	/* this event is set when a fiber finishes writing a packet directly to the stream */
+	struct ff_event *direct_write_event;
+
+	/* this event is set when the delayed flush must be performed before the flush_delay expires */
+	struct ff_event *flush_event;
 	struct ff_event *request_streams_stop_event;
+
+	/* the queue of requests waiting for execution slots in the server's scheduler */
+	struct mrpc_scheduler_queue *scheduler_queue;
 	struct ff_pool *request_streams_pool;
 	struct ff_pool *packets_pool;
-	struct ff_blocking_queue *writer_queue;
+	struct mrpc_packet_arena *packets_arena;
+	struct mrpc_writer_queue *writer_queue;
+	struct mrpc_write_batch *write_batch;
 	struct request_stream **active_request_streams;
 	mrpc_server_stream_handler stream_handler;
 	void *service_ctx;
 	struct ff_stream *stream;
+	struct mrpc_protocol_params protocol_params;
 	int id;
 	int active_request_streams_cnt;
+	int is_inline_requests_enabled;
+
+	/* the request, which is currently handled inline by the stream reader, or NULL */
+	struct inline_request *inline_request;
+
+	/* this flag is cleared by the reader on each packet read from the stream.
+	 * It is used for detecting idle connections, which can hibernate.
+	 */
+	int is_idle;
+
+	/* the number of mrpc_server_stream_processor_tick_idle() calls since the last packet was read from the stream
+	 * while the stream processor had no active request streams. It is used for reaping and evicting idle connections.
+	 */
+	int idle_ticks_cnt;
+
+	/* this flag is set while either the stream writer or a fiber writing a packet directly
+	 * to the stream owns the stream and the write_batch.
+	 */
+	int is_writing;
+
+	/* this flag is set when a packet requiring immediate flush is pushed into the writer_queue */
+	int is_flush_required;
+
+	/* this flag is set while the stream writer delays the flush of the write_batch.
+	 * delayed_bytes is the number of bytes, which are waiting for the delayed flush.
+	 */
+	int is_flush_delayed;
+	int delayed_bytes;
+
+	/* the flow of control packets, which don't belong to request streams, in the writer_queue */
+	struct mrpc_writer_queue_flow control_flow;
+
+	/* this flag is set by the mrpc_server_stream_processor_drain() */
+	int is_draining;
+
+	/* the maximum time (in milliseconds), during which the stream writer can delay flushing written packets,
+	 * and the number of accumulated bytes, after which the packets are flushed without delay.
+	 */
+	int flush_delay;
+	int flush_threshold;
+
+	/* the timeout (in milliseconds) of the connection's inactivity, after which the stream processor hibernates,
+	 * i.e. frees idle request streams and packet buffers. They are allocated again on demand.
+	 */
+	int hibernation_timeout;
+
+	/* load shedding parameters. See mrpc_server_stream_processor_set_load_shedding() */
+	int max_inflight_requests;
+	int target_inflight_requests;
+
+	/* the minimum number of in-flight requests observed during the current STANDING_QUEUE_WINDOW
+	 * and the number of new requests received during the window.
+	 */
+	int min_inflight_requests;
+	int window_requests_cnt;
+
+	/* this flag is set if the number of in-flight requests didn't drop below the target_inflight_requests
+	 * during the previous STANDING_QUEUE_WINDOW.
+	 */
+	int has_standing_queue;
+
 	enum server_stream_processor_state state;
 };
 
@@ -95,93 +221,171 @@ static void release_packet(void *ctx, struct mrpc_packet *packet)
 	release_server_packet(stream_processor, packet);
 }
 
-static void skip_writer_queue_packets(struct mrpc_server_stream_processor *stream_processor)
+static int is_goaway_supported(struct mrpc_server_stream_processor *stream_processor)
 {
-	struct ff_blocking_queue *writer_queue;
+	int is_supported;
 
-	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-	writer_queue = stream_processor->writer_queue;
-	for (;;)
-	{
-		struct mrpc_packet *packet;
+	/* packets_pool is created after the handshake */
+	is_supported = (stream_processor->packets_pool != NULL &&
+		(stream_processor->protocol_params.features & MRPC_PROTOCOL_FEATURE_GOAWAY) != 0);
+	return is_supported;
+}
 
-		ff_blocking_queue_get(writer_queue, (const void **) &packet);
-		if (packet == NULL)
-		{
-			int is_empty;
+static void stop_if_drained(struct mrpc_server_stream_processor *stream_processor)
+{
+	int is_empty;
 
-			is_empty = ff_blocking_queue_is_empty(writer_queue);
-			ff_assert(is_empty);
-			break;
+	/* clients supporting GOAWAY close the connection themselves after receiving responses
+	 * for all the in-flight requests. Other clients cannot be notified, so the connection is closed
+	 * as soon as it has no in-flight requests and all the responses are flushed to the stream.
+	 */
+	if (stream_processor->is_draining && stream_processor->state == STATE_WORKING &&
+		stream_processor->active_request_streams_cnt == 0 && !stream_processor->is_writing &&
+		!is_goaway_supported(stream_processor))
+	{
+		is_empty = mrpc_writer_queue_is_empty(stream_processor->writer_queue);
+		if (is_empty)
+		{
+			ff_log_debug(L"the draining stream_processor=%p completed all the requests, so it is stopped", stream_processor);
+			mrpc_server_stream_processor_stop_async(stream_processor);
 		}
-		release_server_packet(stream_processor, packet);
 	}
 }
 
-static void stream_writer_func(void *ctx)
+static int can_write_directly(struct mrpc_server_stream_processor *stream_processor)
 {
-	struct mrpc_server_stream_processor *stream_processor;
-	struct ff_blocking_queue *writer_queue;
+	int is_empty;
+
+	/* packets are always passed to the stream writer if the flush can be delayed,
+	 * so small responses sent during the flush_delay are coalesced into a single write.
+	 */
+	is_empty = mrpc_writer_queue_is_empty(stream_processor->writer_queue);
+	return (is_empty && !stream_processor->is_writing && stream_processor->state == STATE_WORKING &&
+		stream_processor->flush_delay == 0);
+}
+
+/**
+ * The caller must set the is_writing flag before calling this function.
+ */
+static void write_packet_directly(struct mrpc_server_stream_processor *stream_processor, struct mrpc_packet *packet)
+{
+	struct mrpc_write_batch *write_batch;
 	struct ff_stream *stream;
+	enum ff_result result;
+
+	ff_assert(stream_processor->is_writing);
+	ff_assert(stream_processor->state == STATE_WORKING);
+
+	write_batch = stream_processor->write_batch;
+	stream = stream_processor->stream;
+	ff_assert(mrpc_write_batch_is_empty(write_batch));
+	mrpc_write_batch_add_packet(write_batch, packet);
+	release_server_packet(stream_processor, packet);
+	result = mrpc_write_batch_write_to_stream(write_batch, stream);
+	if (result == FF_SUCCESS)
+	{
+		result = ff_stream_flush(stream);
+	}
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot write and flush the packet to the stream=%p of the stream_processor=%p. See previous messages for more info", stream, stream_processor);
+		mrpc_write_batch_clear(write_batch);
+		mrpc_server_stream_processor_stop_async(stream_processor);
+	}
+	stream_processor->is_writing = 0;
+	ff_event_set(stream_processor->direct_write_event);
+	stop_if_drained(stream_processor);
+}
+
+static void write_packet(void *ctx, struct mrpc_packet *packet, int is_flush_required)
+{
+	struct mrpc_server_stream_processor *stream_processor;
+	struct request_stream *request_stream;
+	struct mrpc_writer_queue_flow *flow;
+	uint32_t request_id;
+	enum mrpc_packet_type packet_type;
 
 	stream_processor = (struct mrpc_server_stream_processor *) ctx;
-	ff_assert(stream_processor->stream != NULL);
 	ff_assert(stream_processor->state != STATE_STOPPED);
-	writer_queue = stream_processor->writer_queue;
-	stream = stream_processor->stream;
-	for (;;)
+
+	request_id = mrpc_packet_get_request_id(packet);
+	if (request_id < (uint32_t) stream_processor->protocol_params.max_request_streams_cnt)
 	{
-		struct mrpc_packet *packet;
-		int is_empty;
-		enum ff_result result;
+		request_stream = stream_processor->active_request_streams[request_id];
+		ff_assert(request_stream != NULL);
+	}
+	else
+	{
+		/* control packets don't belong to request streams */
+		request_stream = NULL;
+	}
 
-		ff_blocking_queue_get(writer_queue, (const void **) &packet);
-		if (packet == NULL)
+	/* if the connection is idle, then the packet is written to the stream by the current fiber.
+	 * This avoids waking up the stream writer, so saves a context switch per packet
+	 * on lightly loaded connections. Under load packets are batched by the stream writer.
+	 */
+	if (can_write_directly(stream_processor))
+	{
+		packet_type = mrpc_packet_get_type(packet);
+		if (request_stream != NULL && (packet_type == MRPC_PACKET_END || packet_type == MRPC_PACKET_SINGLE))
 		{
-			ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-			is_empty = ff_blocking_queue_is_empty(writer_queue);
-			ff_assert(is_empty);
-			break;
+			/* the client can reuse the request_id as soon as it receives the last packet of the response,
+			 * while the direct write can yield before the packet is completely written. So the packet
+			 * is written after the request stream is released.
+			 */
+			ff_assert(request_stream->last_packet == NULL);
+			request_stream->last_packet = packet;
 		}
-		result = mrpc_packet_write_to_stream(packet, stream);
-		if (result != FF_SUCCESS)
+		else
 		{
-			ff_log_debug(L"cannot write packet=%p to the stream=%p of the stream_processor=%p. See previous messages for more info",
-				packet, stream, stream_processor);
+			stream_processor->is_writing = 1;
+			write_packet_directly(stream_processor, packet);
 		}
-		release_server_packet(stream_processor, packet);
-
-		/* below is an optimization, which is used for minimizing the number of
-		 * usually expensive ff_stream_flush() calls. These calls are invoked only
-		 * if the writer_queue is empty at the moment. If we won't flush the stream
-		 * this moment moment, then potential deadlock can occur:
-		 * 1) server serializes rpc response into the mrpc_packets and pushes them into the writer_queue.
-		 * 2) this function writes these packets into the stream.
-		 *    Usually this means that the packets' content is buffered in the underlying stream buffer
-		 *    and not sent to the remote side (i.e. client).
-		 * 3) this function blocks awaiting for the new packets in the writer_packet.
-		 * 4) deadlock:
-		 *     - client is blocked awaiting for response from the server, which is still buffered on the server side;
-		 *     - server is blocked awaiting for next request from the client.
+	}
+	else
+	{
+		/* responses to high priority requests are latency-sensitive, so they are flushed without delay */
+		packet_type = mrpc_packet_get_type(packet);
+		if (request_stream != NULL && request_stream->priority == MRPC_PRIORITY_HIGH &&
+			(packet_type == MRPC_PACKET_END || packet_type == MRPC_PACKET_SINGLE))
+		{
+			is_flush_required = 1;
+		}
+		if (is_flush_required)
+		{
+			stream_processor->is_flush_required = 1;
+		}
+		/* packets are queued into the flow of their request stream, so the stream writer can interleave
+		 * packets of simultaneously sent requests instead of writing them in arrival order.
 		 */
-		is_empty = ff_blocking_queue_is_empty(writer_queue);
-		if (result == FF_SUCCESS && is_empty)
+		flow = (request_stream != NULL) ? &request_stream->writer_queue_flow : &stream_processor->control_flow;
+		if (stream_processor->is_flush_delayed)
 		{
-			result = ff_stream_flush(stream);
-			if (result != FF_SUCCESS)
+			/* the stream writer waits until the flush_delay expires, so wake it up if the packet cannot wait */
+			stream_processor->delayed_bytes += mrpc_packet_get_serialized_size(packet);
+			if (is_flush_required || stream_processor->delayed_bytes >= stream_processor->flush_threshold)
 			{
-				ff_log_debug(L"cannot flush the stream=%p of the stream_processor=%p. See previous messages for more info", stream_processor->stream, stream_processor);
+				ff_event_set(stream_processor->flush_event);
 			}
 		}
-		if (result == FF_FAILURE)
-		{
-			mrpc_server_stream_processor_stop_async(stream_processor);
-			ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-			skip_writer_queue_packets(stream_processor);
-			break;
-		}
+		mrpc_writer_queue_put(stream_processor->writer_queue, flow, packet);
 	}
-	ff_event_set(stream_processor->writer_stop_event);
+}
+
+static void acquire_stream_for_writing(struct mrpc_server_stream_processor *stream_processor)
+{
+	/* wait while a fiber writing a packet directly to the stream finishes */
+	while (stream_processor->is_writing)
+	{
+		ff_event_wait(stream_processor->direct_write_event);
+	}
+	stream_processor->is_writing = 1;
+}
+
+static void release_stream_for_writing(struct mrpc_server_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->is_writing);
+	stream_processor->is_writing = 0;
 }
 
 static void delete_request_stream_wrapper(void *ctx)
@@ -226,11 +430,25 @@ static enum ff_result flush_request_stream_wrapper(void *ctx)
 
 	request_stream = (struct request_stream *) ctx;
 	ff_assert(request_stream->packet_stream != NULL);
+
+	/* the stream_handler can respond without reading the whole request, so skip the rest of the request
+	 * before the last packet of the response is sent. Otherwise credits for the skipped packets would be sent
+	 * after the response, when the client can already reuse the request_id for a new request.
+	 */
+	result = mrpc_packet_stream_skip_read_data(request_stream->packet_stream);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot skip the rest of the request in the request_stream=%p. See previous messages for more info", request_stream);
+		goto end;
+	}
 	result = mrpc_packet_stream_flush(request_stream->packet_stream);
 	if (result != FF_SUCCESS)
 	{
 		ff_log_debug(L"cannot flush the request_stream=%p. See previous messages for more info", request_stream);
+		goto end;
 	}
+
+end:
 	return result;
 }
 
@@ -261,17 +479,55 @@ static struct ff_stream *create_request_stream_wrapper(struct request_stream *re
 	return stream;
 }
 
-static struct request_stream *acquire_request_stream(struct mrpc_server_stream_processor *stream_processor, uint8_t request_id)
+static int is_flow_control_enabled(struct mrpc_server_stream_processor *stream_processor)
+{
+	return ((stream_processor->protocol_params.features & MRPC_PROTOCOL_FEATURE_CREDITS) != 0);
+}
+
+static int is_priorities_supported(struct mrpc_server_stream_processor *stream_processor)
+{
+	return ((stream_processor->protocol_params.features & MRPC_PROTOCOL_FEATURE_PRIORITIES) != 0);
+}
+
+/**
+ * Reads the priority of the request from the first packet of the request without consuming it.
+ * The priority is required before the packet is pushed to the request stream, since the request
+ * is scheduled according to it. See MRPC_PROTOCOL_FEATURE_PRIORITIES.
+ */
+static enum ff_result read_request_priority(struct mrpc_packet *packet, enum mrpc_priority *priority)
+{
+	const char *p;
+	const char *limit;
+	uint8_t value;
+
+	p = mrpc_packet_get_read_window(packet, &limit);
+	if (p == limit)
+	{
+		ff_log_debug(L"the first packet=%p of the request doesn't contain the priority", packet);
+		return FF_FAILURE;
+	}
+	value = (uint8_t) *p;
+	if (value >= MRPC_PRIORITIES_CNT)
+	{
+		ff_log_debug(L"wrong priority=%d of the request in the packet=%p. It must be less than %d", (int) value, packet, MRPC_PRIORITIES_CNT);
+		return FF_FAILURE;
+	}
+	*priority = (enum mrpc_priority) value;
+	return FF_SUCCESS;
+}
+
+static struct request_stream *acquire_request_stream(struct mrpc_server_stream_processor *stream_processor, uint32_t request_id)
 {
 	struct request_stream *request_stream;
 
 	ff_assert(stream_processor->active_request_streams_cnt >= 0);
 	ff_assert(stream_processor->active_request_streams_cnt <= MAX_REQUEST_STREAMS_CNT);
 	ff_assert(stream_processor->state != STATE_STOPPED);
+	ff_assert(request_id < (uint32_t) stream_processor->protocol_params.max_request_streams_cnt);
 
 	ff_pool_acquire_entry(stream_processor->request_streams_pool, (void **) &request_stream);
 	ff_assert(stream_processor->active_request_streams[request_id] == NULL);
-	mrpc_packet_stream_initialize(request_stream->packet_stream, request_id);
+	mrpc_packet_stream_initialize(request_stream->packet_stream, request_id, is_flow_control_enabled(stream_processor));
 	stream_processor->active_request_streams[request_id] = request_stream;
 
 	stream_processor->active_request_streams_cnt++;
@@ -286,7 +542,7 @@ static struct request_stream *acquire_request_stream(struct mrpc_server_stream_p
 
 static void release_request_stream(struct mrpc_server_stream_processor *stream_processor, struct request_stream *request_stream)
 {
-	uint8_t request_id;
+	uint32_t request_id;
 
 	ff_assert(stream_processor->state != STATE_STOPPED);
 	ff_assert(stream_processor->active_request_streams_cnt > 0);
@@ -302,6 +558,66 @@ static void release_request_stream(struct mrpc_server_stream_processor *stream_p
 	if (stream_processor->active_request_streams_cnt == 0)
 	{
 		ff_event_set(stream_processor->request_streams_stop_event);
+		stop_if_drained(stream_processor);
+	}
+}
+
+/* the stream reader and request streams' callbacks depend on each other */
+static void handed_off_stream_reader_func(void *ctx);
+
+static void add_inline_request(struct mrpc_server_stream_processor *stream_processor, struct inline_request *inline_request)
+{
+	ff_assert(stream_processor->inline_request == NULL);
+
+	inline_request->is_reader_handed_off = 0;
+	inline_request->next = active_inline_requests;
+	active_inline_requests = inline_request;
+	stream_processor->inline_request = inline_request;
+}
+
+static void remove_inline_request(struct mrpc_server_stream_processor *stream_processor, struct inline_request *inline_request)
+{
+	struct inline_request **prev_next;
+
+	ff_assert(stream_processor->inline_request == inline_request);
+
+	prev_next = &active_inline_requests;
+	while (*prev_next != inline_request)
+	{
+		ff_assert(*prev_next != NULL);
+		prev_next = &(*prev_next)->next;
+	}
+	*prev_next = inline_request->next;
+	inline_request->next = NULL;
+	stream_processor->inline_request = NULL;
+}
+
+static void hand_off_stream_reader(struct mrpc_server_stream_processor *stream_processor, struct inline_request *inline_request)
+{
+	/* the inline request cannot block the reader's fiber, since other requests on the connection
+	 * can depend on packets read by it. Start another fiber, which continues reading from the stream.
+	 */
+	remove_inline_request(stream_processor, inline_request);
+	inline_request->is_reader_handed_off = 1;
+	ff_core_fiberpool_execute_async(handed_off_stream_reader_func, stream_processor);
+}
+
+static void wait_for_credits(void *ctx, struct mrpc_packet_stream *packet_stream)
+{
+	struct mrpc_server_stream_processor *stream_processor;
+	struct inline_request *inline_request;
+
+	stream_processor = (struct mrpc_server_stream_processor *) ctx;
+	inline_request = stream_processor->inline_request;
+
+	/* credits are read from the stream by the stream reader, so the inline request cannot wait for them
+	 * on the reader's fiber.
+	 */
+	if (inline_request != NULL && inline_request->request_stream->packet_stream == packet_stream)
+	{
+		ff_log_debug(L"the inline request_stream=%p waits for credits, so the stream_processor=%p hands off the stream reader",
+			inline_request->request_stream, stream_processor);
+		hand_off_stream_reader(stream_processor, inline_request);
 	}
 }
 
@@ -313,14 +629,15 @@ static void *create_request_stream(void *ctx)
 	stream_processor = (struct mrpc_server_stream_processor *) ctx;
 	ff_assert(stream_processor->state != STATE_STOPPED);
 
-	/* The current stream processor can simultaneously use up to MAX_PACKETS_CNT packets.
-	 * So, it will be safe to set the reader queue's size to MAX_PACKETS_CNT.
-	 */
 	request_stream = (struct request_stream *) ff_malloc(sizeof(*request_stream));
 	request_stream->stream_processor = stream_processor;
-	request_stream->packet_stream = mrpc_packet_stream_create(stream_processor->writer_queue, MAX_PACKETS_CNT, acquire_packet, release_packet, stream_processor);
+	request_stream->packet_stream = mrpc_packet_stream_create(write_packet, acquire_packet, release_packet, wait_for_credits, stream_processor);
+	mrpc_writer_queue_flow_initialize(&request_stream->writer_queue_flow);
 	request_stream->stream = create_request_stream_wrapper(request_stream);
 	request_stream->request_id = 0;
+	request_stream->priority = MRPC_PRIORITY_NORMAL;
+	request_stream->is_rejected = 0;
+	request_stream->last_packet = NULL;
 
 	return request_stream;
 }
@@ -335,6 +652,21 @@ static void delete_request_stream(void *ctx)
 	ff_free(request_stream);
 }
 
+static enum ff_result reject_request(struct request_stream *request_stream)
+{
+	enum ff_result result;
+
+	/* the whole rejected request has been already skipped by the stream reader (see process_packets()),
+	 * so respond with an empty response, which is interpreted as the 'server overloaded' status by clients.
+	 */
+	result = mrpc_packet_stream_flush(request_stream->packet_stream);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot send the empty response to the rejected request in the request_stream=%p. See previous messages for more info", request_stream);
+	}
+	return result;
+}
+
 static void process_request_func(void *ctx)
 {
 	struct request_stream *request_stream;
@@ -342,6 +674,7 @@ static void process_request_func(void *ctx)
 	mrpc_server_stream_handler stream_handler;
 	void *service_ctx;
 	struct ff_stream *stream;
+	struct mrpc_packet *last_packet;
 	enum ff_result result;
 
 	request_stream = (struct request_stream *) ctx;
@@ -355,13 +688,52 @@ static void process_request_func(void *ctx)
 	service_ctx = stream_processor->service_ctx;
 	stream = request_stream->stream;
 
-	result = stream_handler(stream, service_ctx);
+	if (request_stream->is_rejected)
+	{
+		result = reject_request(request_stream);
+	}
+	else
+	{
+		result = stream_handler(stream, service_ctx);
+		if (result == FF_SUCCESS)
+		{
+			/* the rest of the request is skipped when the response is flushed (see flush_request_stream_wrapper()),
+			 * but the stream_handler can return without flushing the response, so keep the connection synchronized.
+			 */
+			result = mrpc_packet_stream_skip_read_data(request_stream->packet_stream);
+		}
+	}
 	if (result != FF_SUCCESS)
 	{
 		ff_log_debug(L"cannot process remote call from the stream=%p using the stream_handler=%p, service_ctx=%p", stream, stream_handler, service_ctx);
 		mrpc_server_stream_processor_stop_async(stream_processor);
 	}
+
+	/* the request stream must be released before the client receives the last packet of the response,
+	 * since the client can send new request with the same request_id right after that.
+	 */
+	last_packet = request_stream->last_packet;
+	request_stream->last_packet = NULL;
+	if (last_packet != NULL)
+	{
+		if (can_write_directly(stream_processor))
+		{
+			/* reserve the stream, so the stop_if_drained() called by the release_request_stream()
+			 * doesn't stop the stream_processor before the last packet is written.
+			 */
+			stream_processor->is_writing = 1;
+		}
+		else
+		{
+			mrpc_writer_queue_put(stream_processor->writer_queue, &request_stream->writer_queue_flow, last_packet);
+			last_packet = NULL;
+		}
+	}
 	release_request_stream(stream_processor, request_stream);
+	if (last_packet != NULL)
+	{
+		write_packet_directly(stream_processor, last_packet);
+	}
 }
 
 static void *create_packet(void *ctx)
@@ -372,16 +744,13 @@ static void *create_packet(void *ctx)
 	stream_processor = (struct mrpc_server_stream_processor *) ctx;
 	ff_assert(stream_processor->state != STATE_STOPPED);
 
-	packet = mrpc_packet_create();
+	packet = mrpc_packet_arena_acquire_packet(stream_processor->packets_arena);
 	return packet;
 }
 
 static void delete_packet(void *ctx)
 {
-	struct mrpc_packet *packet;
-
-	packet = (struct mrpc_packet *) ctx;
-	mrpc_packet_delete(packet);
+	/* packets' memory is owned by the packets_arena, which is deleted after the packets_pool */
 }
 
 static void stop_all_request_streams(struct mrpc_server_stream_processor *stream_processor)
@@ -391,105 +760,564 @@ static void stop_all_request_streams(struct mrpc_server_stream_processor *stream
 
 	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
 	active_request_streams = stream_processor->active_request_streams;
-	for (i = 0; i < MAX_REQUEST_STREAMS_CNT; i++)
+	for (i = 0; i < stream_processor->protocol_params.max_request_streams_cnt; i++)
 	{
 		struct request_stream *request_stream;
 
 		request_stream = active_request_streams[i];
 		if (request_stream != NULL)
 		{
-			mrpc_packet_stream_disconnect(request_stream->packet_stream);
+			if (request_stream->is_rejected)
+			{
+				/* rejected requests are processed by the stream reader, which has already stopped,
+				 * so nobody else releases the rest of them.
+				 */
+				release_request_stream(stream_processor, request_stream);
+			}
+			else
+			{
+				mrpc_packet_stream_disconnect(request_stream->packet_stream);
+			}
 		}
 	}
 	ff_event_wait(stream_processor->request_streams_stop_event);
 	ff_assert(stream_processor->active_request_streams_cnt == 0);
 }
 
-static void start_stream_writer(struct mrpc_server_stream_processor *stream_processor)
+static void shrink_request_streams_pool(struct mrpc_server_stream_processor *stream_processor)
 {
-	ff_assert(stream_processor->state != STATE_STOPPED);
-	ff_core_fiberpool_execute_async(stream_writer_func, stream_processor);
-}
+	ff_assert(stream_processor->active_request_streams_cnt == 0);
 
-static void stop_stream_writer(struct mrpc_server_stream_processor *stream_processor)
-{
-	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
-	ff_blocking_queue_put(stream_processor->writer_queue, NULL);
-	ff_event_wait(stream_processor->writer_stop_event);
+	/* the ff_pool cannot free its idle entries, so recreate it.
+	 * Request streams will be created again on demand.
+	 */
+	ff_pool_delete(stream_processor->request_streams_pool);
+	stream_processor->request_streams_pool = ff_pool_create(MAX_REQUEST_STREAMS_CNT, create_request_stream, stream_processor, delete_request_stream);
 }
 
-static void stream_reader_func(void *ctx)
+static void hibernate_if_idle(struct mrpc_server_stream_processor *stream_processor)
 {
-	struct mrpc_server_stream_processor *stream_processor;
-	struct ff_stream *stream;
-	struct request_stream **active_request_streams;
-	mrpc_server_stream_handler stream_handler;
-	void *service_ctx;
+	ff_assert(stream_processor->state != STATE_STOPPED);
 
-	stream_processor = (struct mrpc_server_stream_processor *) ctx;
+	/* this function is called by the writer when the writer_queue is empty, so only active request streams
+	 * can hold packets with buffers. The packet held by the reader while it waits for the next packet
+	 * has no buffer. Packet buffers are shared among all the connections, so they can be freed
+	 * only if all the connections in the process are idle.
+	 */
+	if (stream_processor->is_idle && stream_processor->active_request_streams_cnt == 0 && stream_processor->state == STATE_WORKING)
+	{
+		ff_log_debug(L"the stream_processor=%p was idle during the timeout=%d, so it hibernates", stream_processor, stream_processor->hibernation_timeout);
+		shrink_request_streams_pool(stream_processor);
+		mrpc_memory_trim();
+	}
+	stream_processor->is_idle = 1;
+}
 
-	ff_assert(stream_processor->active_request_streams_cnt == 0);
-	ff_assert(stream_processor->stream_handler != NULL);
-	ff_assert(stream_processor->stream != NULL);
-	ff_assert(stream_processor->state != STATE_STOPPED);
+static void skip_writer_queue_packets(struct mrpc_server_stream_processor *stream_processor)
+{
+	struct mrpc_writer_queue *writer_queue;
 
-	start_stream_writer(stream_processor);
-	ff_event_set(stream_processor->request_streams_stop_event);
-	stream = stream_processor->stream;
-	active_request_streams = stream_processor->active_request_streams;
-	stream_handler = stream_processor->stream_handler;
-	service_ctx = stream_processor->service_ctx;
+	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
+	writer_queue = stream_processor->writer_queue;
 	for (;;)
 	{
 		struct mrpc_packet *packet;
-		struct request_stream *request_stream;
-		uint8_t request_id;
-		enum mrpc_packet_type packet_type;
-		enum ff_result result;
 
-		packet = acquire_server_packet(stream_processor);
-		result = mrpc_packet_read_from_stream(packet, stream);
-		if (result != FF_SUCCESS)
+		mrpc_writer_queue_get(writer_queue, &packet);
+		if (packet == NULL)
 		{
-			ff_log_debug(L"cannot read the packet=%p from the stream=%p. See previous messages for more info", packet, stream);
+			int is_empty;
+
+			is_empty = mrpc_writer_queue_is_empty(writer_queue);
+			ff_assert(is_empty);
+			break;
+		}
+		release_server_packet(stream_processor, packet);
+	}
+}
+
+static enum ff_result flush_write_batch(struct mrpc_server_stream_processor *stream_processor)
+{
+	struct mrpc_write_batch *write_batch;
+	struct ff_stream *stream;
+	enum ff_result result;
+
+	write_batch = stream_processor->write_batch;
+	stream = stream_processor->stream;
+	stream_processor->is_flush_required = 0;
+	result = mrpc_write_batch_write_to_stream(write_batch, stream);
+	if (result == FF_SUCCESS)
+	{
+		result = ff_stream_flush(stream);
+	}
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot write and flush packets to the stream=%p of the stream_processor=%p. See previous messages for more info", stream, stream_processor);
+	}
+	return result;
+}
+
+static int is_flush_needed(struct mrpc_server_stream_processor *stream_processor)
+{
+	int batch_size;
+	int is_needed;
+
+	batch_size = mrpc_write_batch_get_size(stream_processor->write_batch);
+	is_needed = (stream_processor->flush_delay == 0 || stream_processor->is_flush_required ||
+		batch_size >= stream_processor->flush_threshold);
+	return is_needed;
+}
+
+static void wait_for_delayed_flush(struct mrpc_server_stream_processor *stream_processor)
+{
+	ff_assert(!stream_processor->is_flush_delayed);
+
+	stream_processor->delayed_bytes = mrpc_write_batch_get_size(stream_processor->write_batch);
+	stream_processor->is_flush_delayed = 1;
+	ff_event_reset(stream_processor->flush_event);
+	ff_event_wait_with_timeout(stream_processor->flush_event, stream_processor->flush_delay);
+	stream_processor->is_flush_delayed = 0;
+}
+
+static void stream_writer_func(void *ctx)
+{
+	struct mrpc_server_stream_processor *stream_processor;
+	struct mrpc_writer_queue *writer_queue;
+	struct mrpc_write_batch *write_batch;
+	struct ff_stream *stream;
+	int is_stream_acquired;
+
+	/* this flag is set when the flush_delay expired, so the write_batch must be flushed
+	 * as soon as the writer_queue becomes empty.
+	 */
+	int is_flush_due;
+
+	stream_processor = (struct mrpc_server_stream_processor *) ctx;
+	ff_assert(stream_processor->stream != NULL);
+	ff_assert(stream_processor->state != STATE_STOPPED);
+	writer_queue = stream_processor->writer_queue;
+	write_batch = stream_processor->write_batch;
+	ff_assert(mrpc_write_batch_is_empty(write_batch));
+	stream = stream_processor->stream;
+	is_stream_acquired = 0;
+	is_flush_due = 0;
+	for (;;)
+	{
+		struct mrpc_packet *packet;
+		int is_batch_empty;
+		int is_empty;
+		enum ff_result result = FF_SUCCESS;
+
+		is_batch_empty = mrpc_write_batch_is_empty(write_batch);
+		is_empty = mrpc_writer_queue_is_empty(writer_queue);
+		if (!is_batch_empty && is_empty && !is_flush_due)
+		{
+			/* non-empty write_batch means that its flush is delayed in order to coalesce
+			 * packets arriving during the flush_delay into a single ff_stream_flush() call.
+			 * The delay isn't restarted by new packets, so the batch is flushed in flush_delay milliseconds
+			 * after the first delayed packet even under steady traffic.
+			 */
+			ff_assert(is_stream_acquired);
+			wait_for_delayed_flush(stream_processor);
+			is_flush_due = 1;
+			is_empty = mrpc_writer_queue_is_empty(writer_queue);
+		}
+		if (is_flush_due && is_empty)
+		{
+			result = flush_write_batch(stream_processor);
+			is_flush_due = 0;
+		}
+		else
+		{
+			result = mrpc_writer_queue_get_with_timeout(writer_queue, &packet, stream_processor->hibernation_timeout);
+			if (result != FF_SUCCESS)
+			{
+				/* there were no packets to write during the hibernation_timeout */
+				ff_assert(is_batch_empty);
+				hibernate_if_idle(stream_processor);
+				continue;
+			}
+			if (!is_stream_acquired)
+			{
+				/* packets can be written directly to the stream by other fibers while the writer_queue is empty,
+				 * so wait until the direct write completes before touching the stream and the write_batch.
+				 */
+				acquire_stream_for_writing(stream_processor);
+				is_stream_acquired = 1;
+			}
+			if (packet == NULL)
+			{
+				ff_assert(stream_processor->state == STATE_STOP_INITIATED);
+				is_empty = mrpc_writer_queue_is_empty(writer_queue);
+				ff_assert(is_empty);
+				/* the stream is already disconnected, so there is no need in writing pending packets to it */
+				mrpc_write_batch_clear(write_batch);
+				release_stream_for_writing(stream_processor);
+				break;
+			}
+
+			/* packets are accumulated in the write_batch while the writer_queue isn't empty,
+			 * so multiple packets are written to the stream using a single ff_stream_write() call
+			 * instead of writing each packet separately.
+			 */
+			if (!mrpc_write_batch_has_space_for_packet(write_batch, packet))
+			{
+				result = mrpc_write_batch_write_to_stream(write_batch, stream);
+				if (result != FF_SUCCESS)
+				{
+					ff_log_debug(L"cannot write packets to the stream=%p of the stream_processor=%p. See previous messages for more info", stream, stream_processor);
+				}
+			}
+			mrpc_write_batch_add_packet(write_batch, packet);
 			release_server_packet(stream_processor, packet);
+
+			/* below is an optimization, which is used for minimizing the number of
+			 * usually expensive ff_stream_write() and ff_stream_flush() calls. These calls are invoked only
+			 * if the writer_queue is empty at the moment. If we won't write and flush the batch
+			 * this moment moment, then potential deadlock can occur:
+			 * 1) server serializes rpc response into the mrpc_packets and pushes them into the writer_queue.
+			 * 2) this function writes these packets into the stream.
+			 *    Usually this means that the packets' content is buffered in the underlying stream buffer
+			 *    and not sent to the remote side (i.e. client).
+			 * 3) this function blocks awaiting for the new packets in the writer_packet.
+			 * 4) deadlock:
+			 *     - client is blocked awaiting for response from the server, which is still buffered on the server side;
+			 *     - server is blocked awaiting for next request from the client.
+			 * If the flush_delay is set, then the flush can be postponed for up to flush_delay milliseconds
+			 * in order to coalesce packets arriving during this interval. This doesn't break the deadlock
+			 * avoidance, because delayed packets are always flushed when the flush_delay expires.
+			 */
+			is_empty = mrpc_writer_queue_is_empty(writer_queue);
+			if (result == FF_SUCCESS && is_empty && (is_flush_due || is_flush_needed(stream_processor)))
+			{
+				result = flush_write_batch(stream_processor);
+				is_flush_due = 0;
+			}
+		}
+		if (result != FF_SUCCESS)
+		{
+			mrpc_write_batch_clear(write_batch);
+			release_stream_for_writing(stream_processor);
+			mrpc_server_stream_processor_stop_async(stream_processor);
+			ff_assert(stream_processor->state == STATE_STOP_INITIATED);
+			skip_writer_queue_packets(stream_processor);
 			break;
 		}
 
+		is_batch_empty = mrpc_write_batch_is_empty(write_batch);
+		is_empty = mrpc_writer_queue_is_empty(writer_queue);
+		if (is_batch_empty && is_empty)
+		{
+			/* the writer_queue is drained, so let other fibers write packets directly to the stream */
+			release_stream_for_writing(stream_processor);
+			is_stream_acquired = 0;
+			stop_if_drained(stream_processor);
+		}
+	}
+	ff_event_set(stream_processor->writer_stop_event);
+}
+
+static void start_stream_writer(struct mrpc_server_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->state != STATE_STOPPED);
+	ff_core_fiberpool_execute_async(stream_writer_func, stream_processor);
+}
+
+static void stop_stream_writer(struct mrpc_server_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
+	mrpc_writer_queue_put_stop_marker(stream_processor->writer_queue);
+	if (stream_processor->is_flush_delayed)
+	{
+		ff_event_set(stream_processor->flush_event);
+	}
+	ff_event_wait(stream_processor->writer_stop_event);
+}
+
+static struct mrpc_packet *acquire_first_packet(struct mrpc_server_stream_processor *stream_processor, struct mrpc_packet *first_packet)
+{
+	struct mrpc_packet *packet;
+
+	/* the first packet was read by the mrpc_protocol_server_handshake() into the packet,
+	 * which doesn't belong to the packets_pool, so copy it into the packet from the pool.
+	 */
+	packet = acquire_server_packet(stream_processor);
+	mrpc_packet_copy(packet, first_packet);
+	mrpc_packet_reset(first_packet);
+	mrpc_packet_delete(first_packet);
+	return packet;
+}
+
+static int is_overloaded(struct mrpc_server_stream_processor *stream_processor)
+{
+	int inflight_requests_cnt;
+	int target_inflight_requests;
+
+	inflight_requests_cnt = stream_processor->active_request_streams_cnt;
+	if (stream_processor->max_inflight_requests > 0 && inflight_requests_cnt >= stream_processor->max_inflight_requests)
+	{
+		return 1;
+	}
+
+	target_inflight_requests = stream_processor->target_inflight_requests;
+	if (target_inflight_requests == 0)
+	{
+		return 0;
+	}
+
+	/* packets cannot be read from the connection while packet buffers exceed the memory limit,
+	 * so requests admitted at this moment would wait for the memory instead of being processed.
+	 */
+	if (mrpc_memory_is_over_limit())
+	{
+		return 1;
+	}
+
+	/* this is a CoDel-like detection of a standing queue. Short bursts of requests are admitted,
+	 * while requests arriving when the number of in-flight requests didn't drop below the target
+	 * during the whole previous window are rejected. The window is measured in requests instead of time,
+	 * so it shrinks under high load, when the standing queue must be detected faster.
+	 */
+	if (inflight_requests_cnt < stream_processor->min_inflight_requests)
+	{
+		stream_processor->min_inflight_requests = inflight_requests_cnt;
+	}
+	stream_processor->window_requests_cnt++;
+	if (stream_processor->window_requests_cnt == STANDING_QUEUE_WINDOW)
+	{
+		stream_processor->has_standing_queue = (stream_processor->min_inflight_requests >= target_inflight_requests);
+		stream_processor->min_inflight_requests = MAX_REQUEST_STREAMS_CNT;
+		stream_processor->window_requests_cnt = 0;
+	}
+	return (stream_processor->has_standing_queue && inflight_requests_cnt >= target_inflight_requests);
+}
+
+/**
+ * Returns 0 if the stream reader has been handed off to another fiber by the inline request.
+ * The stream_processor can be already released in this case.
+ */
+static int process_packets(struct mrpc_server_stream_processor *stream_processor, struct mrpc_packet *first_packet)
+{
+	struct ff_stream *stream;
+	struct request_stream **active_request_streams;
+	enum mrpc_protocol_version protocol_version;
+	uint32_t max_request_streams_cnt;
+
+	stream = stream_processor->stream;
+	active_request_streams = stream_processor->active_request_streams;
+	protocol_version = stream_processor->protocol_params.version;
+	max_request_streams_cnt = (uint32_t) stream_processor->protocol_params.max_request_streams_cnt;
+	for (;;)
+	{
+		struct mrpc_packet *packet;
+		struct request_stream *request_stream;
+		uint32_t request_id;
+		enum mrpc_packet_type packet_type;
+		int is_credit_packet;
+		int is_new_request;
+		int is_single_packet_request;
+		int is_inline_request;
+		int is_rejected;
+		enum mrpc_priority priority;
+		enum ff_result result;
+
+		if (first_packet != NULL)
+		{
+			packet = acquire_first_packet(stream_processor, first_packet);
+			first_packet = NULL;
+		}
+		else
+		{
+			packet = acquire_server_packet(stream_processor);
+			result = mrpc_packet_read_from_stream(packet, stream);
+			if (result != FF_SUCCESS)
+			{
+				ff_log_debug(L"cannot read the packet=%p from the stream=%p. See previous messages for more info", packet, stream);
+				release_server_packet(stream_processor, packet);
+				break;
+			}
+		}
+		stream_processor->is_idle = 0;
+		stream_processor->idle_ticks_cnt = 0;
+
 		packet_type = mrpc_packet_get_type(packet);
 		request_id = mrpc_packet_get_request_id(packet);
+		if (request_id >= max_request_streams_cnt)
+		{
+			ff_log_debug(L"wrong request_id=%lu has been read from the stream=%p. It must be less than %lu. stream_processor=%p",
+				request_id, stream, max_request_streams_cnt, stream_processor);
+			release_server_packet(stream_processor, packet);
+			break;
+		}
 		request_stream = active_request_streams[request_id];
-		if (packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_SINGLE)
+		is_credit_packet = (is_flow_control_enabled(stream_processor) && mrpc_packet_stream_is_credit_packet(packet));
+		is_inline_request = 0;
+		if (protocol_version == MRPC_PROTOCOL_V1)
+		{
+			is_new_request = (packet_type == MRPC_PACKET_START || packet_type == MRPC_PACKET_SINGLE);
+			is_single_packet_request = (packet_type == MRPC_PACKET_SINGLE);
+		}
+		else
+		{
+			/* the MRPC_PROTOCOL_V2 framing doesn't transfer MRPC_PACKET_START and MRPC_PACKET_SINGLE types,
+			 * so the first packet for the request_id without request_stream starts new request.
+			 */
+			is_new_request = (request_stream == NULL && !is_credit_packet);
+			is_single_packet_request = (is_new_request && packet_type == MRPC_PACKET_END);
+		}
+		if (is_new_request)
 		{
 			if (request_stream != NULL)
 			{
 				ff_log_debug(L"there is the request_stream with the given request_id=%lu, but the packet received "
 							 L"from the stream=%p indicates that this request_stream shouldn't exist. stream_processor=%p, packet_type=%d",
-							 	(uint32_t) request_id, stream, stream_processor, (int) packet_type);
+							 	request_id, stream, stream_processor, (int) packet_type);
 				release_server_packet(stream_processor, packet);
 				break;
 			}
+			priority = MRPC_PRIORITY_NORMAL;
+			if (is_priorities_supported(stream_processor))
+			{
+				result = read_request_priority(packet, &priority);
+				if (result != FF_SUCCESS)
+				{
+					ff_log_debug(L"cannot read the priority of the request with request_id=%lu from the stream=%p. stream_processor=%p",
+						request_id, stream, stream_processor);
+					release_server_packet(stream_processor, packet);
+					break;
+				}
+			}
+			is_rejected = is_overloaded(stream_processor);
+			if (is_rejected)
+			{
+				ff_log_debug(L"the stream_processor=%p is overloaded, so the request with request_id=%lu is rejected", stream_processor, request_id);
+			}
 			request_stream = acquire_request_stream(stream_processor, request_id);
-			ff_core_fiberpool_execute_async(process_request_func, request_stream);
+			request_stream->priority = priority;
+			request_stream->is_rejected = is_rejected;
+			mrpc_writer_queue_flow_set_priority(&request_stream->writer_queue_flow, priority);
+
+			/* rejected requests are always processed by the stream reader. See below.
+			 * Other inline requests occupy execution slots of the server's scheduler, so they are handled
+			 * inline only if there is a free slot. Otherwise they wait for their turn in the scheduler's queue.
+			 */
+			is_inline_request = (is_single_packet_request && stream_processor->is_inline_requests_enabled && !is_rejected &&
+				mrpc_scheduler_queue_try_acquire_slot(stream_processor->scheduler_queue));
+			if (!is_inline_request && !is_rejected)
+			{
+				/* the request is executed by the server's scheduler, which fairly shares execution slots
+				 * among connections, so a single connection cannot monopolize the server.
+				 */
+				mrpc_scheduler_queue_execute(stream_processor->scheduler_queue, &request_stream->task, priority, process_request_func, request_stream);
+			}
 		}
 		else
 		{
 			/* packet_type is MRPC_PACKET_MIDDLE or MRPC_PACKET_LAST */
 			if (request_stream == NULL)
 			{
+				if (is_credit_packet)
+				{
+					/* the client can send credits for the response after the request_stream has been released */
+					release_server_packet(stream_processor, packet);
+					continue;
+				}
 				ff_log_debug(L"there is no request_stream with the given request_id=%lu, but the packet received "
 							 L"from the stream=%p indicates that this request_stream should exist. stream_processor=%p, packet_type=%d",
-							 	(uint32_t) request_id, stream, stream_processor, (int) packet_type);
+							 	request_id, stream, stream_processor, (int) packet_type);
 				release_server_packet(stream_processor, packet);
 				break;
 			}
 		}
-		mrpc_packet_stream_push_packet(request_stream->packet_stream, packet);
+		result = mrpc_packet_stream_push_packet(request_stream->packet_stream, packet);
+		if (result != FF_SUCCESS)
+		{
+			ff_log_debug(L"cannot push the packet=%p read from the stream=%p to the request_stream=%p. See previous messages for more info", packet, stream, request_stream);
+			if (is_inline_request)
+			{
+				mrpc_scheduler_queue_release_slot(stream_processor->scheduler_queue);
+			}
+			break;
+		}
+		if (is_new_request && is_priorities_supported(stream_processor))
+		{
+			uint8_t priority_value;
+
+			/* the priority has been already read by the read_request_priority(), so skip it.
+			 * This doesn't block, since the first packet of the request contains the priority.
+			 */
+			result = mrpc_packet_stream_read(request_stream->packet_stream, &priority_value, 1);
+			if (result != FF_SUCCESS)
+			{
+				ff_log_debug(L"cannot skip the priority of the request in the request_stream=%p. See previous messages for more info", request_stream);
+				if (is_inline_request)
+				{
+					mrpc_scheduler_queue_release_slot(stream_processor->scheduler_queue);
+				}
+				break;
+			}
+		}
+		if (request_stream->is_rejected)
+		{
+			int is_end;
+
+			/* rejected requests don't wait in the scheduler's queue, which is saturated during load shedding.
+			 * Their packets are skipped as they arrive, so the client receives credits for sending the rest
+			 * of the request, and the empty response is sent inline after the last packet of the request.
+			 */
+			result = mrpc_packet_stream_skip_pushed_data(request_stream->packet_stream, &is_end);
+			if (result != FF_SUCCESS)
+			{
+				ff_log_debug(L"cannot skip the rejected request in the request_stream=%p. See previous messages for more info", request_stream);
+				break;
+			}
+			is_inline_request = is_end;
+		}
+		if (is_inline_request)
+		{
+			struct inline_request inline_request;
+			int is_slot_acquired;
+
+			/* run-to-completion: the whole request is already in the request_stream,
+			 * so handle it without creating a separate fiber.
+			 * Only rejected requests are handled inline without an execution slot.
+			 */
+			is_slot_acquired = !request_stream->is_rejected;
+			inline_request.request_stream = request_stream;
+			add_inline_request(stream_processor, &inline_request);
+			process_request_func(request_stream);
+			if (is_slot_acquired)
+			{
+				mrpc_scheduler_queue_release_slot(stream_processor->scheduler_queue);
+			}
+			if (inline_request.is_reader_handed_off)
+			{
+				return 0;
+			}
+			remove_inline_request(stream_processor, &inline_request);
+		}
 	}
+	return 1;
+}
+
+static void stop_processing(struct mrpc_server_stream_processor *stream_processor)
+{
 	mrpc_server_stream_processor_stop_async(stream_processor);
 	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
 	stop_all_request_streams(stream_processor);
 	stop_stream_writer(stream_processor);
+	ff_pool_delete(stream_processor->packets_pool);
+	mrpc_packet_arena_delete(stream_processor->packets_arena);
+	stream_processor->packets_pool = NULL;
+	stream_processor->packets_arena = NULL;
+
+	/* the stream processor can stay in the server's pool for a long time, so free its request streams */
+	shrink_request_streams_pool(stream_processor);
+}
+
+static void release_stream_processor(struct mrpc_server_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->state == STATE_STOP_INITIATED);
 	ff_stream_delete(stream_processor->stream);
 	stream_processor->stream_handler = NULL;
 	stream_processor->service_ctx = NULL;
@@ -498,8 +1326,69 @@ static void stream_reader_func(void *ctx)
 	stream_processor->release_func(stream_processor->release_func_ctx, stream_processor);
 }
 
+static void handed_off_stream_reader_func(void *ctx)
+{
+	struct mrpc_server_stream_processor *stream_processor;
+	int is_reader;
+
+	stream_processor = (struct mrpc_server_stream_processor *) ctx;
+	ff_assert(stream_processor->packets_pool != NULL);
+	ff_assert(stream_processor->state != STATE_STOPPED);
+
+	is_reader = process_packets(stream_processor, NULL);
+	if (is_reader)
+	{
+		stop_processing(stream_processor);
+		release_stream_processor(stream_processor);
+	}
+}
+
+static void stream_reader_func(void *ctx)
+{
+	struct mrpc_server_stream_processor *stream_processor;
+	struct mrpc_packet *first_packet;
+	int is_reader;
+	enum ff_result result;
+
+	stream_processor = (struct mrpc_server_stream_processor *) ctx;
+
+	ff_assert(stream_processor->active_request_streams_cnt == 0);
+	ff_assert(stream_processor->stream_handler != NULL);
+	ff_assert(stream_processor->stream != NULL);
+	ff_assert(stream_processor->packets_pool == NULL);
+	ff_assert(stream_processor->state != STATE_STOPPED);
+
+	mrpc_protocol_get_default_params(&stream_processor->protocol_params, MRPC_PROTOCOL_V2);
+	result = mrpc_protocol_server_handshake(stream_processor->stream, &stream_processor->protocol_params, &first_packet);
+	if (result == FF_SUCCESS)
+	{
+		/* packets' size depends on the protocol parameters negotiated during the handshake,
+		 * so the packets_pool is created for each connection.
+		 */
+		stream_processor->packets_arena = mrpc_packet_arena_create(stream_processor->protocol_params.version, stream_processor->protocol_params.max_packet_size);
+		stream_processor->packets_pool = ff_pool_create(GET_MAX_PACKETS_CNT(stream_processor->protocol_params.max_request_streams_cnt),
+			create_packet, stream_processor, delete_packet);
+		stream_processor->is_idle = 0;
+		start_stream_writer(stream_processor);
+		ff_event_set(stream_processor->request_streams_stop_event);
+		is_reader = process_packets(stream_processor, first_packet);
+		if (!is_reader)
+		{
+			/* the fiber, which took over reading from the stream, stops the stream_processor */
+			return;
+		}
+		stop_processing(stream_processor);
+	}
+	else
+	{
+		ff_log_debug(L"cannot perform handshake on the stream=%p for the stream_processor=%p. See previous messages for more info", stream_processor->stream, stream_processor);
+		mrpc_server_stream_processor_stop_async(stream_processor);
+	}
+	release_stream_processor(stream_processor);
+}
+
 struct mrpc_server_stream_processor *mrpc_server_stream_processor_create(mrpc_server_stream_processor_release_func release_func, void *release_func_ctx,
-	mrpc_server_stream_processor_release_id_func release_id_func, void *release_id_func_ctx, int id)
+	mrpc_server_stream_processor_release_id_func release_id_func, void *release_id_func_ctx, int id, struct mrpc_scheduler *scheduler)
 {
 	struct mrpc_server_stream_processor *stream_processor;
 
@@ -509,9 +1398,13 @@ struct mrpc_server_stream_processor *mrpc_server_stream_processor_create(mrpc_se
 	stream_processor->release_id_func = release_id_func;
 	stream_processor->release_id_func_ctx = release_id_func_ctx;
 	stream_processor->writer_stop_event = ff_event_create(FF_EVENT_AUTO);
+	stream_processor->direct_write_event = ff_event_create(FF_EVENT_AUTO);
+	stream_processor->flush_event = ff_event_create(FF_EVENT_AUTO);
 	stream_processor->request_streams_stop_event = ff_event_create(FF_EVENT_AUTO);
 	stream_processor->request_streams_pool = ff_pool_create(MAX_REQUEST_STREAMS_CNT, create_request_stream, stream_processor, delete_request_stream);
-	stream_processor->packets_pool = ff_pool_create(MAX_PACKETS_CNT, create_packet, stream_processor, delete_packet);
+	stream_processor->scheduler_queue = mrpc_scheduler_queue_create(scheduler);
+	stream_processor->packets_pool = NULL;
+	stream_processor->packets_arena = NULL;
 
 	/* in fact, writer_queue's size must be unlimited in order to avoid blocking of process_request_func on packet_stream flush,
 	 * which is the last operation before the client will receive response and will be able
@@ -521,17 +1414,38 @@ struct mrpc_server_stream_processor *mrpc_server_stream_processor_create(mrpc_se
 	 * so it won't be able to process the new request, which will lead to client-server connection termination.
 	 *
 	 * However, the stream processor can operate only with packets from the packets_pool with
-	 * limited size (MAX_PACKETS_CNT). So, it is safe to set writer_queue's size to MAX_PACKETS_CNT,
-	 * because this limit won't never be overflowed.
+	 * limited size (MAX_PACKETS_CNT). So, the writer_queue is unbounded, since the number of packets in it
+	 * cannot exceed this limit.
 	 */
-	stream_processor->writer_queue = ff_blocking_queue_create(MAX_PACKETS_CNT);
+	stream_processor->writer_queue = mrpc_writer_queue_create();
+	stream_processor->write_batch = mrpc_write_batch_create();
 	stream_processor->active_request_streams = (struct request_stream **) ff_calloc(MAX_REQUEST_STREAMS_CNT, sizeof(stream_processor->active_request_streams[0]));
 	stream_processor->id = id;
 
 	stream_processor->stream_handler = NULL;
 	stream_processor->service_ctx = NULL;
 	stream_processor->stream = NULL;
+	mrpc_protocol_get_default_params(&stream_processor->protocol_params, MRPC_PROTOCOL_V1);
 	stream_processor->active_request_streams_cnt = 0;
+	stream_processor->is_inline_requests_enabled = 0;
+	stream_processor->inline_request = NULL;
+	stream_processor->is_idle = 0;
+	stream_processor->idle_ticks_cnt = 0;
+	stream_processor->is_writing = 0;
+	stream_processor->is_flush_required = 0;
+	stream_processor->is_flush_delayed = 0;
+	stream_processor->delayed_bytes = 0;
+	mrpc_writer_queue_flow_initialize(&stream_processor->control_flow);
+	mrpc_writer_queue_flow_set_priority(&stream_processor->control_flow, MRPC_PRIORITY_HIGH);
+	stream_processor->is_draining = 0;
+	stream_processor->max_inflight_requests = 0;
+	stream_processor->target_inflight_requests = 0;
+	stream_processor->min_inflight_requests = MAX_REQUEST_STREAMS_CNT;
+	stream_processor->window_requests_cnt = 0;
+	stream_processor->has_standing_queue = 0;
+	stream_processor->flush_delay = MRPC_DEFAULT_FLUSH_DELAY;
+	stream_processor->flush_threshold = MRPC_DEFAULT_FLUSH_THRESHOLD;
+	stream_processor->hibernation_timeout = MRPC_DEFAULT_HIBERNATION_TIMEOUT;
 	stream_processor->state = STATE_STOPPED;
 
 	return stream_processor;
@@ -547,15 +1461,21 @@ void mrpc_server_stream_processor_delete(struct mrpc_server_stream_processor *st
 
 	stream_processor->release_id_func(stream_processor->release_id_func_ctx, stream_processor->id);
 	ff_free(stream_processor->active_request_streams);
-	ff_blocking_queue_delete(stream_processor->writer_queue);
-	ff_pool_delete(stream_processor->packets_pool);
+	mrpc_write_batch_delete(stream_processor->write_batch);
+	mrpc_writer_queue_delete(stream_processor->writer_queue);
+	ff_assert(stream_processor->packets_pool == NULL);
+	ff_assert(stream_processor->packets_arena == NULL);
+	mrpc_scheduler_queue_delete(stream_processor->scheduler_queue);
 	ff_pool_delete(stream_processor->request_streams_pool);
 	ff_event_delete(stream_processor->request_streams_stop_event);
+	ff_event_delete(stream_processor->flush_event);
+	ff_event_delete(stream_processor->direct_write_event);
 	ff_event_delete(stream_processor->writer_stop_event);
 	ff_free(stream_processor);
 }
 
-void mrpc_server_stream_processor_start(struct mrpc_server_stream_processor *stream_processor, mrpc_server_stream_handler stream_handler, void *service_ctx, struct ff_stream *stream)
+void mrpc_server_stream_processor_start(struct mrpc_server_stream_processor *stream_processor, mrpc_server_stream_handler stream_handler, void *service_ctx,
+	struct ff_stream *stream, int is_inline_requests_enabled)
 {
 	ff_assert(stream_handler != NULL);
 	ff_assert(stream != NULL);
@@ -569,9 +1489,48 @@ void mrpc_server_stream_processor_start(struct mrpc_server_stream_processor *str
 	stream_processor->stream_handler = stream_handler;
 	stream_processor->service_ctx = service_ctx;
 	stream_processor->stream = stream;
+	stream_processor->is_inline_requests_enabled = is_inline_requests_enabled;
+	stream_processor->inline_request = NULL;
+	stream_processor->idle_ticks_cnt = 0;
+	stream_processor->is_draining = 0;
+	stream_processor->min_inflight_requests = MAX_REQUEST_STREAMS_CNT;
+	stream_processor->window_requests_cnt = 0;
+	stream_processor->has_standing_queue = 0;
 	ff_core_fiberpool_execute_async(stream_reader_func, stream_processor);
 }
 
+void mrpc_server_stream_processor_set_flush_policy(struct mrpc_server_stream_processor *stream_processor, int flush_delay, int flush_threshold)
+{
+	ff_assert(flush_delay >= 0);
+	ff_assert(flush_threshold >= 0);
+
+	stream_processor->flush_delay = flush_delay;
+	stream_processor->flush_threshold = flush_threshold;
+}
+
+void mrpc_server_stream_processor_set_hibernation_timeout(struct mrpc_server_stream_processor *stream_processor, int hibernation_timeout)
+{
+	ff_assert(hibernation_timeout > 0);
+
+	stream_processor->hibernation_timeout = hibernation_timeout;
+}
+
+void mrpc_server_stream_processor_set_load_shedding(struct mrpc_server_stream_processor *stream_processor, int max_inflight_requests, int target_inflight_requests)
+{
+	ff_assert(max_inflight_requests >= 0);
+	ff_assert(target_inflight_requests >= 0);
+
+	stream_processor->max_inflight_requests = max_inflight_requests;
+	stream_processor->target_inflight_requests = target_inflight_requests;
+}
+
+void mrpc_server_stream_processor_set_weight(struct mrpc_server_stream_processor *stream_processor, int weight)
+{
+	ff_assert(stream_processor->state == STATE_STOPPED);
+
+	mrpc_scheduler_queue_set_weight(stream_processor->scheduler_queue, weight);
+}
+
 void mrpc_server_stream_processor_stop_async(struct mrpc_server_stream_processor *stream_processor)
 {
 	ff_assert(stream_processor->state != STATE_STOPPED);
@@ -589,7 +1548,81 @@ void mrpc_server_stream_processor_stop_async(struct mrpc_server_stream_processor
 	}
 }
 
+void mrpc_server_stream_processor_drain(struct mrpc_server_stream_processor *stream_processor)
+{
+	struct mrpc_packet *packet;
+
+	ff_assert(stream_processor->state != STATE_STOPPED);
+
+	if (stream_processor->state == STATE_WORKING && !stream_processor->is_draining)
+	{
+		stream_processor->is_draining = 1;
+
+		if (is_goaway_supported(stream_processor))
+		{
+			/* the client stops sending new requests and closes the connection after completing in-flight requests */
+			packet = acquire_server_packet(stream_processor);
+			mrpc_protocol_write_goaway(&stream_processor->protocol_params, packet);
+			write_packet(stream_processor, packet, 1);
+		}
+		else
+		{
+			stop_if_drained(stream_processor);
+		}
+	}
+	else
+	{
+		ff_log_debug(L"the stream_processor=%p is already stopping or draining, so do nothing", stream_processor);
+	}
+}
+
 int mrpc_server_stream_processor_get_id(struct mrpc_server_stream_processor *stream_processor)
 {
 	return stream_processor->id;
 }
+
+int mrpc_server_stream_processor_tick_idle(struct mrpc_server_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->state != STATE_STOPPED);
+
+	/* connections with in-flight requests aren't idle, even if they don't receive packets */
+	if (stream_processor->active_request_streams_cnt == 0)
+	{
+		stream_processor->idle_ticks_cnt++;
+	}
+	else
+	{
+		stream_processor->idle_ticks_cnt = 0;
+	}
+	return stream_processor->idle_ticks_cnt;
+}
+
+int mrpc_server_stream_processor_get_idle_ticks(struct mrpc_server_stream_processor *stream_processor)
+{
+	ff_assert(stream_processor->state != STATE_STOPPED);
+
+	return stream_processor->idle_ticks_cnt;
+}
+
+void mrpc_server_stream_handler_prepare_to_block(struct ff_stream *stream)
+{
+	struct inline_request *inline_request;
+
+	ff_assert(stream != NULL);
+
+	inline_request = active_inline_requests;
+	while (inline_request != NULL)
+	{
+		struct request_stream *request_stream;
+
+		request_stream = inline_request->request_stream;
+		if (request_stream->stream == stream)
+		{
+			ff_log_debug(L"the inline request_stream=%p is going to block, so the stream_processor=%p hands off the stream reader",
+				request_stream, request_stream->stream_processor);
+			hand_off_stream_reader(request_stream->stream_processor, inline_request);
+			break;
+		}
+		inline_request = inline_request->next;
+	}
+}
@@ -2,6 +2,7 @@
 
 #include "private/mrpc_wchar_array.h"
 #include "private/mrpc_int.h"
+#include "ff/ff_stream.h"
 #include "ff/ff_hash.h"
 
 /* the maximum wchar_array length.
@@ -12,6 +13,16 @@
  */
 #define MAX_WCHAR_ARRAY_LENGTH ((1 << 14) - 1)
 
+/* the maximum number of octets required for encoding a single character,
+ * which is less than 0x10000, by the mrpc_uint32_serialize() function.
+ */
+#define MAX_CHAR_OCTETS 3
+
+/* the number of characters, which are encoded into a temporary buffer
+ * before writing it to the stream with a single ff_stream_write() call.
+ */
+#define CHARS_CHUNK_SIZE 64
+
 struct mrpc_wchar_array
 {
 	const wchar_t *value;
@@ -129,6 +140,25 @@ uint32_t mrpc_wchar_array_get_hash(struct mrpc_wchar_array *wchar_array, uint32_
 	return hash_value;
 }
 
+static int encode_chars(const wchar_t *value, int len, char *buf)
+{
+	int i;
+	int buf_len;
+
+	buf_len = 0;
+	for (i = 0; i < len; i++)
+	{
+		uint32_t ch;
+
+		ch = (uint32_t) value[i];
+		ff_assert(ch < 0x10000);
+		buf_len += mrpc_uint32_encode(ch, buf + buf_len);
+	}
+	ff_assert(buf_len <= len * MAX_CHAR_OCTETS);
+
+	return buf_len;
+}
+
 enum ff_result mrpc_wchar_array_serialize(struct mrpc_wchar_array *wchar_array, struct ff_stream *stream)
 {
 	int i;
@@ -147,16 +177,22 @@ enum ff_result mrpc_wchar_array_serialize(struct mrpc_wchar_array *wchar_array,
 	}
 
 	value = mrpc_wchar_array_get_value(wchar_array);
-	for (i = 0; i < len; i++)
+	for (i = 0; i < len; i += CHARS_CHUNK_SIZE)
 	{
-		uint32_t ch;
+		char buf[CHARS_CHUNK_SIZE * MAX_CHAR_OCTETS + MRPC_UINT32_MAX_ENCODED_SIZE];
+		int chunk_len;
+		int buf_len;
 
-		ch = (uint32_t) value[i];
-		ff_assert(ch < 0x10000);
-		result = mrpc_uint32_serialize(ch, stream);
+		chunk_len = len - i;
+		if (chunk_len > CHARS_CHUNK_SIZE)
+		{
+			chunk_len = CHARS_CHUNK_SIZE;
+		}
+		buf_len = encode_chars(value + i, chunk_len, buf);
+		result = ff_stream_write(stream, buf, buf_len);
 		if (result != FF_SUCCESS)
 		{
-			ff_log_debug(L"cannot serialize character ch=%lu number %d from the wchar_array=%p into the stream=%p. See previous messages for more info", ch, i, wchar_array, stream);
+			ff_log_debug(L"cannot write %d characters starting from the number %d from the wchar_array=%p into the stream=%p. See previous messages for more info", chunk_len, i, wchar_array, stream);
 			goto end;
 		}
 	}
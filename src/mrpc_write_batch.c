@@ -0,0 +1,99 @@
+#include "private/mrpc_common.h"
+
+#include "private/mrpc_write_batch.h"
+#include "private/mrpc_packet.h"
+#include "ff/ff_stream.h"
+
+/**
+ * The maximum number of bytes, which can be accumulated in the batch.
+ * Stream processors' writers drain their writer queues into the batch
+ * until it is full, so this value limits the size of a single ff_stream_write() call.
+ * It must be large enough for holding at least one serialized packet
+ * of the maximum size (see MRPC_PROTOCOL_MAX_PACKET_SIZE).
+ */
+#define MAX_BATCH_SIZE 0x20000
+
+struct mrpc_write_batch
+{
+	char *buf;
+	int size;
+};
+
+struct mrpc_write_batch *mrpc_write_batch_create()
+{
+	struct mrpc_write_batch *batch;
+
+	batch = (struct mrpc_write_batch *) ff_malloc(sizeof(*batch));
+	batch->buf = (char *) ff_calloc(MAX_BATCH_SIZE, sizeof(batch->buf[0]));
+	batch->size = 0;
+
+	return batch;
+}
+
+void mrpc_write_batch_delete(struct mrpc_write_batch *batch)
+{
+	ff_assert(batch->size == 0);
+
+	ff_free(batch->buf);
+	ff_free(batch);
+}
+
+int mrpc_write_batch_has_space_for_packet(struct mrpc_write_batch *batch, struct mrpc_packet *packet)
+{
+	int serialized_size;
+	int has_space;
+
+	ff_assert(batch->size >= 0);
+	ff_assert(batch->size <= MAX_BATCH_SIZE);
+
+	serialized_size = mrpc_packet_get_serialized_size(packet);
+	ff_assert(serialized_size <= MAX_BATCH_SIZE);
+	has_space = (serialized_size <= MAX_BATCH_SIZE - batch->size);
+	return has_space;
+}
+
+void mrpc_write_batch_add_packet(struct mrpc_write_batch *batch, struct mrpc_packet *packet)
+{
+	int len;
+
+	ff_assert(mrpc_write_batch_has_space_for_packet(batch, packet));
+
+	len = mrpc_packet_serialize(packet, batch->buf + batch->size);
+	batch->size += len;
+	ff_assert(batch->size <= MAX_BATCH_SIZE);
+}
+
+int mrpc_write_batch_is_empty(struct mrpc_write_batch *batch)
+{
+	int is_empty;
+
+	is_empty = (batch->size == 0);
+	return is_empty;
+}
+
+int mrpc_write_batch_get_size(struct mrpc_write_batch *batch)
+{
+	return batch->size;
+}
+
+void mrpc_write_batch_clear(struct mrpc_write_batch *batch)
+{
+	batch->size = 0;
+}
+
+enum ff_result mrpc_write_batch_write_to_stream(struct mrpc_write_batch *batch, struct ff_stream *stream)
+{
+	enum ff_result result;
+
+	ff_assert(batch->size >= 0);
+	ff_assert(batch->size <= MAX_BATCH_SIZE);
+
+	result = ff_stream_write(stream, batch->buf, batch->size);
+	if (result != FF_SUCCESS)
+	{
+		ff_log_debug(L"cannot write the batch=%p with size=%d to the stream=%p. See previous messages for more info", batch, batch->size, stream);
+	}
+	batch->size = 0;
+
+	return result;
+}
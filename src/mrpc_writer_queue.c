@@ -0,0 +1,208 @@
+#include "private/mrpc_common.h"
+
+#include "private/mrpc_writer_queue.h"
+#include "private/mrpc_packet.h"
+#include "ff/ff_event.h"
+
+struct mrpc_writer_queue
+{
+	/* this event is set when a packet or the stop marker is pushed into the queue */
+	struct ff_event *packets_event;
+
+	/* lists of flows with pending packets. There is a separate list per priority.
+	 * Flows are served in round-robin order inside each list.
+	 */
+	struct mrpc_writer_queue_flow *flows_heads[MRPC_PRIORITIES_CNT];
+	struct mrpc_writer_queue_flow *flows_tails[MRPC_PRIORITIES_CNT];
+
+	int packets_cnt;
+	int has_stop_marker;
+};
+
+static void push_flow(struct mrpc_writer_queue *queue, struct mrpc_writer_queue_flow *flow)
+{
+	int priority;
+
+	ff_assert(flow->next == NULL);
+	ff_assert(flow->packets_head != NULL);
+
+	priority = flow->priority;
+	if (queue->flows_tails[priority] == NULL)
+	{
+		ff_assert(queue->flows_heads[priority] == NULL);
+		queue->flows_heads[priority] = flow;
+	}
+	else
+	{
+		queue->flows_tails[priority]->next = flow;
+	}
+	queue->flows_tails[priority] = flow;
+}
+
+static struct mrpc_writer_queue_flow *pop_flow(struct mrpc_writer_queue *queue, int priority)
+{
+	struct mrpc_writer_queue_flow *flow;
+
+	flow = queue->flows_heads[priority];
+	ff_assert(flow != NULL);
+	queue->flows_heads[priority] = flow->next;
+	flow->next = NULL;
+	if (queue->flows_heads[priority] == NULL)
+	{
+		queue->flows_tails[priority] = NULL;
+	}
+	return flow;
+}
+
+static struct mrpc_packet *pop_packet(struct mrpc_writer_queue *queue)
+{
+	struct mrpc_writer_queue_flow *flow;
+	struct mrpc_packet *packet;
+	int priority;
+
+	ff_assert(queue->packets_cnt > 0);
+
+	priority = 0;
+	while (queue->flows_heads[priority] == NULL)
+	{
+		priority++;
+		ff_assert(priority < MRPC_PRIORITIES_CNT);
+	}
+
+	flow = pop_flow(queue, priority);
+	packet = flow->packets_head;
+	ff_assert(packet != NULL);
+	flow->packets_head = mrpc_packet_get_next(packet);
+	mrpc_packet_set_next(packet, NULL);
+	if (flow->packets_head == NULL)
+	{
+		flow->packets_tail = NULL;
+	}
+	else
+	{
+		/* the flow is moved to the end of the list, so other flows can send their packets
+		 * before the next packet from this flow is sent.
+		 */
+		push_flow(queue, flow);
+	}
+	queue->packets_cnt--;
+	return packet;
+}
+
+void mrpc_writer_queue_flow_initialize(struct mrpc_writer_queue_flow *flow)
+{
+	flow->packets_head = NULL;
+	flow->packets_tail = NULL;
+	flow->next = NULL;
+	flow->priority = MRPC_PRIORITY_NORMAL;
+}
+
+void mrpc_writer_queue_flow_set_priority(struct mrpc_writer_queue_flow *flow, enum mrpc_priority priority)
+{
+	ff_assert(priority >= 0);
+	ff_assert(priority < MRPC_PRIORITIES_CNT);
+
+	/* the flow with pending packets is moved to the list with the new priority when its next packet is popped */
+	flow->priority = priority;
+}
+
+struct mrpc_writer_queue *mrpc_writer_queue_create()
+{
+	struct mrpc_writer_queue *queue;
+	int i;
+
+	queue = (struct mrpc_writer_queue *) ff_malloc(sizeof(*queue));
+	queue->packets_event = ff_event_create(FF_EVENT_AUTO);
+	for (i = 0; i < MRPC_PRIORITIES_CNT; i++)
+	{
+		queue->flows_heads[i] = NULL;
+		queue->flows_tails[i] = NULL;
+	}
+	queue->packets_cnt = 0;
+	queue->has_stop_marker = 0;
+
+	return queue;
+}
+
+void mrpc_writer_queue_delete(struct mrpc_writer_queue *queue)
+{
+	ff_assert(queue->packets_cnt == 0);
+	ff_assert(!queue->has_stop_marker);
+
+	ff_event_delete(queue->packets_event);
+	ff_free(queue);
+}
+
+void mrpc_writer_queue_put(struct mrpc_writer_queue *queue, struct mrpc_writer_queue_flow *flow, struct mrpc_packet *packet)
+{
+	ff_assert(packet != NULL);
+	ff_assert(mrpc_packet_get_next(packet) == NULL);
+	ff_assert(!queue->has_stop_marker);
+
+	if (flow->packets_tail == NULL)
+	{
+		ff_assert(flow->packets_head == NULL);
+		flow->packets_head = packet;
+		flow->packets_tail = packet;
+		push_flow(queue, flow);
+	}
+	else
+	{
+		mrpc_packet_set_next(flow->packets_tail, packet);
+		flow->packets_tail = packet;
+	}
+	queue->packets_cnt++;
+	ff_event_set(queue->packets_event);
+}
+
+void mrpc_writer_queue_put_stop_marker(struct mrpc_writer_queue *queue)
+{
+	ff_assert(!queue->has_stop_marker);
+
+	queue->has_stop_marker = 1;
+	ff_event_set(queue->packets_event);
+}
+
+void mrpc_writer_queue_get(struct mrpc_writer_queue *queue, struct mrpc_packet **packet)
+{
+	while (queue->packets_cnt == 0 && !queue->has_stop_marker)
+	{
+		ff_event_wait(queue->packets_event);
+	}
+
+	if (queue->packets_cnt > 0)
+	{
+		*packet = pop_packet(queue);
+	}
+	else
+	{
+		queue->has_stop_marker = 0;
+		*packet = NULL;
+	}
+}
+
+enum ff_result mrpc_writer_queue_get_with_timeout(struct mrpc_writer_queue *queue, struct mrpc_packet **packet, int timeout)
+{
+	enum ff_result result = FF_SUCCESS;
+
+	while (queue->packets_cnt == 0 && !queue->has_stop_marker)
+	{
+		result = ff_event_wait_with_timeout(queue->packets_event, timeout);
+		if (result != FF_SUCCESS)
+		{
+			goto end;
+		}
+	}
+	mrpc_writer_queue_get(queue, packet);
+
+end:
+	return result;
+}
+
+int mrpc_writer_queue_is_empty(struct mrpc_writer_queue *queue)
+{
+	int is_empty;
+
+	is_empty = (queue->packets_cnt == 0 && !queue->has_stop_marker);
+	return is_empty;
+}
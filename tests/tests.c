@@ -3,11 +3,14 @@
 #include "mrpc/mrpc_char_array.h"
 #include "mrpc/mrpc_wchar_array.h"
 #include "mrpc/mrpc_blob.h"
+#include "mrpc/mrpc_memory.h"
+#include "mrpc/mrpc_method_limits.h"
 #include "mrpc/mrpc_client.h"
 #include "mrpc/mrpc_server.h"
 #include "mrpc/mrpc_server_stream_handler.h"
 #include "mrpc/mrpc_distributed_client.h"
 #include "mrpc/mrpc_distributed_client_controller.h"
+#include "private/mrpc_memory.h"
 
 #include "ff/ff_core.h"
 #include "ff/ff_stream.h"
@@ -639,13 +642,323 @@ static void test_blob_all()
 /* end of mrpc_blob tests */
 
 
+/* start of mrpc_method_limits tests */
+
+static void test_method_limits_create_delete()
+{
+	struct mrpc_method_limits *limits;
+
+	limits = mrpc_method_limits_create(3);
+	mrpc_method_limits_set(limits, 1, 10, 1);
+	mrpc_method_limits_delete(limits);
+}
+
+static void test_method_limits_reject()
+{
+	struct mrpc_method_limits *limits;
+	enum ff_result result;
+
+	limits = mrpc_method_limits_create(2);
+	mrpc_method_limits_set(limits, 0, 1, 0);
+
+	result = mrpc_method_limits_acquire_slot(limits, 0);
+	ASSERT(result == FF_SUCCESS, "the first call must acquire a slot");
+	result = mrpc_method_limits_acquire_slot(limits, 0);
+	ASSERT(result != FF_SUCCESS, "the call exceeding the limit must be rejected");
+
+	/* calls of other methods mustn't be affected by the limit */
+	result = mrpc_method_limits_acquire_slot(limits, 1);
+	ASSERT(result == FF_SUCCESS, "unlimited method must acquire a slot");
+	result = mrpc_method_limits_acquire_slot(limits, 1);
+	ASSERT(result == FF_SUCCESS, "unlimited method must acquire a slot");
+	mrpc_method_limits_release_slot(limits, 1);
+	mrpc_method_limits_release_slot(limits, 1);
+
+	mrpc_method_limits_release_slot(limits, 0);
+	result = mrpc_method_limits_acquire_slot(limits, 0);
+	ASSERT(result == FF_SUCCESS, "the call must acquire the released slot");
+	mrpc_method_limits_release_slot(limits, 0);
+
+	mrpc_method_limits_delete(limits);
+}
+
+struct method_limits_queue_data
+{
+	struct mrpc_method_limits *limits;
+	struct ff_event *done_event;
+	int workers_cnt;
+	int active_cnt;
+	int max_active_cnt;
+};
+
+static void method_limits_queue_fiberpool_func(void *ctx)
+{
+	struct method_limits_queue_data *data;
+	enum ff_result result;
+
+	data = (struct method_limits_queue_data *) ctx;
+
+	result = mrpc_method_limits_acquire_slot(data->limits, 0);
+	ASSERT(result == FF_SUCCESS, "queued call must acquire a slot");
+	data->active_cnt++;
+	if (data->active_cnt > data->max_active_cnt)
+	{
+		data->max_active_cnt = data->active_cnt;
+	}
+	ff_core_sleep(10);
+	data->active_cnt--;
+	mrpc_method_limits_release_slot(data->limits, 0);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->done_event);
+	}
+}
+
+static void test_method_limits_queue()
+{
+	struct method_limits_queue_data data;
+	int i;
+
+	data.limits = mrpc_method_limits_create(1);
+	mrpc_method_limits_set(data.limits, 0, 2, 1);
+	data.done_event = ff_event_create(FF_EVENT_MANUAL);
+	data.workers_cnt = 5;
+	data.active_cnt = 0;
+	data.max_active_cnt = 0;
+	for (i = 0; i < 5; i++)
+	{
+		ff_core_fiberpool_execute_async(method_limits_queue_fiberpool_func, &data);
+	}
+	ff_event_wait(data.done_event);
+	ASSERT(data.max_active_cnt == 2, "unexpected number of concurrently executed calls");
+
+	ff_event_delete(data.done_event);
+	mrpc_method_limits_delete(data.limits);
+}
+
+struct method_limits_raise_data
+{
+	struct mrpc_method_limits *limits;
+	struct ff_event *acquired_event;
+	struct ff_event *release_event;
+	struct ff_event *done_event;
+	int acquired_cnt;
+	int workers_cnt;
+};
+
+static void method_limits_raise_fiberpool_func(void *ctx)
+{
+	struct method_limits_raise_data *data;
+	enum ff_result result;
+
+	data = (struct method_limits_raise_data *) ctx;
+
+	result = mrpc_method_limits_acquire_slot(data->limits, 0);
+	ASSERT(result == FF_SUCCESS, "queued call must acquire a slot");
+	data->acquired_cnt++;
+	if (data->acquired_cnt == 3)
+	{
+		ff_event_set(data->acquired_event);
+	}
+	ff_event_wait(data->release_event);
+	mrpc_method_limits_release_slot(data->limits, 0);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->done_event);
+	}
+}
+
+static void test_method_limits_raise()
+{
+	struct method_limits_raise_data data;
+	int i;
+	enum ff_result result;
+
+	data.limits = mrpc_method_limits_create(1);
+	mrpc_method_limits_set(data.limits, 0, 1, 1);
+	data.acquired_event = ff_event_create(FF_EVENT_MANUAL);
+	data.release_event = ff_event_create(FF_EVENT_MANUAL);
+	data.done_event = ff_event_create(FF_EVENT_MANUAL);
+	data.acquired_cnt = 0;
+	data.workers_cnt = 3;
+
+	result = mrpc_method_limits_acquire_slot(data.limits, 0);
+	ASSERT(result == FF_SUCCESS, "the first call must acquire a slot");
+	for (i = 0; i < 3; i++)
+	{
+		ff_core_fiberpool_execute_async(method_limits_raise_fiberpool_func, &data);
+	}
+	ff_core_sleep(100);
+	ASSERT(data.acquired_cnt == 0, "calls exceeding the limit must wait");
+
+	/* all the waiting calls must acquire new slots without releasing the slot held above */
+	mrpc_method_limits_set(data.limits, 0, 4, 1);
+	result = ff_event_wait_with_timeout(data.acquired_event, 1000);
+	ASSERT(result == FF_SUCCESS, "all the waiting calls must acquire slots after raising the limit");
+
+	ff_event_set(data.release_event);
+	mrpc_method_limits_release_slot(data.limits, 0);
+	ff_event_wait(data.done_event);
+
+	ff_event_delete(data.done_event);
+	ff_event_delete(data.release_event);
+	ff_event_delete(data.acquired_event);
+	mrpc_method_limits_delete(data.limits);
+}
+
+static void test_method_limits_all()
+{
+	ff_core_initialize(LOG_FILENAME);
+	test_method_limits_create_delete();
+	test_method_limits_reject();
+	test_method_limits_queue();
+	test_method_limits_raise();
+	ff_core_shutdown();
+}
+
+/* end of mrpc_method_limits tests */
+
+
+/* start of mrpc_memory tests */
+
+static void test_memory_trim()
+{
+	char *small_buf1, *small_buf2, *medium_buf, *large_buf, *max_buf, *buf;
+	int small_capacity, medium_capacity, large_capacity, max_capacity, capacity;
+	int allocated_bytes, trimmed_allocated_bytes;
+	int i;
+
+	mrpc_memory_acquire();
+	ASSERT(mrpc_memory_get_allocated_bytes() == 0, "blocks must be allocated on demand");
+
+	/* acquire buffers from all the size classes */
+	small_buf1 = mrpc_memory_acquire_packet_buf(0x10, &small_capacity);
+	ASSERT(small_buf1 != NULL, "buffer cannot be NULL");
+	ASSERT(small_capacity >= 0x10, "unexpected capacity");
+	small_buf2 = mrpc_memory_acquire_packet_buf(0x10, &capacity);
+	ASSERT(small_buf2 != NULL, "buffer cannot be NULL");
+	ASSERT(capacity == small_capacity, "buffers of the same size must belong to the same class");
+	medium_buf = mrpc_memory_acquire_packet_buf(small_capacity + 1, &medium_capacity);
+	ASSERT(medium_buf != NULL, "buffer cannot be NULL");
+	ASSERT(medium_capacity > small_capacity, "unexpected capacity");
+	large_buf = mrpc_memory_acquire_packet_buf(medium_capacity + 1, &large_capacity);
+	ASSERT(large_buf != NULL, "buffer cannot be NULL");
+	ASSERT(large_capacity > medium_capacity, "unexpected capacity");
+	max_buf = mrpc_memory_acquire_packet_buf(large_capacity + 1, &max_capacity);
+	ASSERT(max_buf != NULL, "buffer cannot be NULL");
+	ASSERT(max_capacity > large_capacity, "unexpected capacity");
+	memset(small_buf1, 0x5a, small_capacity);
+	memset(small_buf2, 0, small_capacity);
+	memset(medium_buf, 0, medium_capacity);
+	memset(large_buf, 0, large_capacity);
+	memset(max_buf, 0, max_capacity);
+	allocated_bytes = mrpc_memory_get_allocated_bytes();
+	ASSERT(allocated_bytes >= small_capacity * 2 + medium_capacity + large_capacity + max_capacity, "unexpected allocated_bytes");
+
+	/* the block of small buffers is partially used, while other blocks contain only free buffers */
+	mrpc_memory_release_packet_buf(small_buf2, small_capacity);
+	mrpc_memory_release_packet_buf(medium_buf, medium_capacity);
+	mrpc_memory_release_packet_buf(large_buf, large_capacity);
+	mrpc_memory_release_packet_buf(max_buf, max_capacity);
+	ASSERT(mrpc_memory_get_allocated_bytes() == allocated_bytes, "released buffers must be kept for reuse until the trim");
+	mrpc_memory_trim();
+	trimmed_allocated_bytes = mrpc_memory_get_allocated_bytes();
+	ASSERT(trimmed_allocated_bytes > 0, "the partially used block must survive the trim");
+	ASSERT(trimmed_allocated_bytes <= allocated_bytes - medium_capacity - large_capacity - max_capacity, "free blocks must be freed by the trim");
+	for (i = 0; i < small_capacity; i++)
+	{
+		ASSERT(small_buf1[i] == 0x5a, "the buffer in use must be kept intact by the trim");
+	}
+
+	/* free buffers of the surviving block remain available for reuse */
+	buf = mrpc_memory_acquire_packet_buf(0x10, &capacity);
+	ASSERT(buf == small_buf2, "the free buffer from the surviving block must be reused");
+	ASSERT(mrpc_memory_get_allocated_bytes() == trimmed_allocated_bytes, "the block mustn't be allocated for the reused buffer");
+
+	/* blocks of other classes are allocated again on demand */
+	medium_buf = mrpc_memory_acquire_packet_buf(small_capacity + 1, &capacity);
+	ASSERT(medium_buf != NULL, "buffer cannot be NULL");
+	ASSERT(mrpc_memory_get_allocated_bytes() > trimmed_allocated_bytes, "the freed block must be allocated again");
+	memset(medium_buf, 0, capacity);
+	mrpc_memory_release_packet_buf(medium_buf, capacity);
+
+	/* all the blocks are freed if all the buffers are free */
+	mrpc_memory_release_packet_buf(buf, small_capacity);
+	mrpc_memory_release_packet_buf(small_buf1, small_capacity);
+	mrpc_memory_trim();
+	ASSERT(mrpc_memory_get_allocated_bytes() == 0, "all the blocks must be freed");
+
+	mrpc_memory_release();
+}
+
+struct memory_throttle_data
+{
+	char *buf;
+	int capacity;
+};
+
+static void memory_throttle_fiberpool_func(void *ctx)
+{
+	struct memory_throttle_data *data;
+
+	data = (struct memory_throttle_data *) ctx;
+	ff_core_sleep(20);
+	mrpc_memory_release_packet_buf(data->buf, data->capacity);
+}
+
+static void test_memory_throttle()
+{
+	struct memory_throttle_data data;
+	enum ff_result result;
+
+	mrpc_memory_acquire();
+	mrpc_memory_set_packets_limit(0x100);
+	mrpc_memory_set_throttle_timeout(50);
+
+	result = mrpc_memory_throttle();
+	ASSERT(result == FF_SUCCESS, "the throttle mustn't wait while the memory is below the limit");
+	data.buf = mrpc_memory_acquire_packet_buf(0x100, &data.capacity);
+	ASSERT(data.buf != NULL, "buffer cannot be NULL");
+	ASSERT(mrpc_memory_is_over_limit(), "the memory must exceed the limit");
+
+	/* the limit is exceeded during the whole timeout */
+	result = mrpc_memory_throttle();
+	ASSERT(result != FF_SUCCESS, "the throttle must fail after the timeout");
+
+	/* the throttle returns as soon as buffers are released */
+	mrpc_memory_set_throttle_timeout(MRPC_MEMORY_DEFAULT_THROTTLE_TIMEOUT);
+	ff_core_fiberpool_execute_async(memory_throttle_fiberpool_func, &data);
+	result = mrpc_memory_throttle();
+	ASSERT(result == FF_SUCCESS, "the throttle must succeed after buffers are released");
+	ASSERT(!mrpc_memory_is_over_limit(), "the memory must be below the limit");
+
+	mrpc_memory_set_packets_limit(MRPC_MEMORY_DEFAULT_PACKETS_LIMIT);
+	mrpc_memory_trim();
+	mrpc_memory_release();
+}
+
+static void test_memory_all()
+{
+	ff_core_initialize(LOG_FILENAME);
+	test_memory_trim();
+	test_memory_throttle();
+	ff_core_shutdown();
+}
+
+/* end of mrpc_memory tests */
+
+
 /* start of mrpc_client and mrpc_server tests */
 
 static void test_client_create_delete()
 {
 	struct mrpc_client *client;
 
-	client = mrpc_client_create();
+	client = mrpc_client_create(1);
 	ASSERT(client != NULL, "client cannot be NULL");
 	mrpc_client_delete(client);
 }
@@ -786,7 +1099,7 @@ static void test_client_start_stop()
 	result = ff_arch_net_addr_resolve(addr, L"localhost", 8593);
 	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
 	stream_connector = ff_stream_connector_tcp_create(addr);
-	client = mrpc_client_create();
+	client = mrpc_client_create(1);
 	mrpc_client_start(client, stream_connector);
 	mrpc_client_stop(client);
 	mrpc_client_delete(client);
@@ -805,7 +1118,7 @@ static void test_client_start_stop_multiple()
 	result = ff_arch_net_addr_resolve(addr, L"localhost", 8594);
 	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
 	stream_connector = ff_stream_connector_tcp_create(addr);
-	client = mrpc_client_create();
+	client = mrpc_client_create(1);
 	mrpc_client_start(client, stream_connector);
 	ff_core_sleep(100);
 	mrpc_client_stop(client);
@@ -842,7 +1155,7 @@ static void client_multiple_instances_fiberpool_func(void *ctx)
 	result = ff_arch_net_addr_resolve(addr, L"localhost", port);
 	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
 	stream_connector = ff_stream_connector_tcp_create(addr);
-	client = mrpc_client_create();
+	client = mrpc_client_create(1);
 
 	mrpc_client_start(client, stream_connector);
 	ff_core_sleep(100);
@@ -1049,7 +1362,7 @@ static void client_server_connect_fiberpool_func(void *ctx)
 	result = ff_arch_net_addr_resolve(addr, L"localhost", 8598);
 	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
 	stream_connector = ff_stream_connector_tcp_create(addr);
-	client = mrpc_client_create();
+	client = mrpc_client_create(1);
 
 	mrpc_client_start(client, stream_connector);
 	mrpc_client_stop(client);
@@ -1119,7 +1432,7 @@ static void client_server_rpc_client(int port, int iterations_cnt)
 	result = ff_arch_net_addr_resolve(addr, L"localhost", port);
 	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
 	stream_connector = ff_stream_connector_tcp_create(addr);
-	client = mrpc_client_create();
+	client = mrpc_client_create(1);
 	mrpc_client_start(client, stream_connector);
 
 	for (i = 0; i < iterations_cnt; i++)
@@ -1599,7 +1912,7 @@ static void client_server_echo_client(int port, int iterations_cnt)
 	result = ff_arch_net_addr_resolve(addr, L"localhost", port);
 	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
 	stream_connector = ff_stream_connector_tcp_create(addr);
-	client = mrpc_client_create();
+	client = mrpc_client_create(1);
 	mrpc_client_start(client, stream_connector);
 	for (i = 0; i < iterations_cnt; i++)
 	{
@@ -1708,7 +2021,7 @@ static void client_server_echo_rpc_concurrent_fiberpool_func(void *ctx)
 	}
 }
 
-static void client_server_echo_client_concurrent(int port, int workers_cnt)
+static void client_server_echo_client_concurrent(int port, int connections_cnt, int workers_cnt)
 {
 	struct client_server_echo_rpc_concurrent_data data;
 	struct ff_arch_net_addr *addr;
@@ -1721,7 +2034,7 @@ static void client_server_echo_client_concurrent(int port, int workers_cnt)
 	result = ff_arch_net_addr_resolve(addr, L"localhost", port);
 	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
 	stream_connector = ff_stream_connector_tcp_create(addr);
-	client = mrpc_client_create();
+	client = mrpc_client_create(connections_cnt);
 	mrpc_client_start(client, stream_connector);
 
 	data.event = ff_event_create(FF_EVENT_MANUAL);
@@ -1754,7 +2067,2350 @@ static void test_client_server_echo_rpc_concurrent()
 	server = mrpc_server_create(100);
 	mrpc_server_start(server, server_echo_stream_handler, server_ctx, stream_acceptor);
 
-	client_server_echo_client_concurrent(10102, 10);
+	client_server_echo_client_concurrent(10102, 1, 10);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static void test_client_server_echo_rpc_inline()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct mrpc_server *server;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10104);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(100);
+	mrpc_server_set_inline_requests(server, 1);
+	mrpc_server_start(server, server_echo_stream_handler, server_ctx, stream_acceptor);
+
+	client_server_echo_client_concurrent(10104, 1, 10);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static void test_client_server_echo_rpc_packets_limit()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct mrpc_server *server;
+	enum ff_result result;
+
+	mrpc_memory_set_packets_limit(0x4000);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10103);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(100);
+	mrpc_server_start(server, server_echo_stream_handler, server_ctx, stream_acceptor);
+
+	client_server_echo_client_concurrent(10103, 1, 10);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+
+	mrpc_memory_set_packets_limit(MRPC_MEMORY_DEFAULT_PACKETS_LIMIT);
+}
+
+static void test_client_server_echo_rpc_flush_delay()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct mrpc_server *server;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10105);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(100);
+	mrpc_server_set_flush_policy(server, 1, 0x1000);
+	mrpc_server_start(server, server_echo_stream_handler, server_ctx, stream_acceptor);
+
+	client_server_echo_client_concurrent(10105, 1, 10);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static enum ff_result server_slow_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	uint8_t method_id;
+	enum ff_result result;
+
+	result = ff_stream_read(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read method_id");
+	ff_core_sleep(100);
+	result = ff_stream_write(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write method_id");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+struct client_server_load_shedding_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int workers_cnt;
+	int rejected_cnt;
+};
+
+static void client_server_load_shedding_fiberpool_func(void *ctx)
+{
+	struct client_server_load_shedding_data *data;
+	struct ff_stream *stream;
+	uint8_t method_id;
+	enum ff_result result;
+
+	data = (struct client_server_load_shedding_data *) ctx;
+
+	stream = mrpc_client_create_request_stream(data->client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	method_id = 0;
+	result = ff_stream_write(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write method_id to the stream");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = ff_stream_read(stream, &method_id, 1);
+	if (result != FF_SUCCESS)
+	{
+		ASSERT(mrpc_client_is_server_overloaded(data->client, stream), "the server must be overloaded");
+		data->rejected_cnt++;
+	}
+	else
+	{
+		ASSERT(method_id == 0, "unexpected method_id");
+	}
+	ff_stream_delete(stream);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void test_client_server_load_shedding()
+{
+	struct client_server_load_shedding_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10106);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(100);
+	mrpc_server_set_load_shedding(server, 1, 0);
+	mrpc_server_start(server, server_slow_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10106);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.workers_cnt = 2;
+	data.rejected_cnt = 0;
+	ff_core_fiberpool_execute_async(client_server_load_shedding_fiberpool_func, &data);
+	ff_core_fiberpool_execute_async(client_server_load_shedding_fiberpool_func, &data);
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+	ASSERT(data.rejected_cnt == 1, "exactly one request must be rejected");
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static int server_connection_weight_func(struct ff_stream *client_stream, void *service_ctx)
+{
+	ASSERT(client_stream != NULL, "client_stream cannot be NULL");
+	return 2;
+}
+
+static void test_client_server_echo_rpc_fair_scheduling()
+{
+	struct client_server_echo_rpc_multiple_clients_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct mrpc_server *server;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10107);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(100);
+	mrpc_server_set_fair_scheduling(server, 3, server_connection_weight_func);
+	mrpc_server_start(server, server_echo_stream_handler, server_ctx, stream_acceptor);
+
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.port = 10107;
+	data.workers_cnt = 5;
+	for (i = 0; i < 5; i++)
+	{
+		ff_core_fiberpool_execute_async(client_server_echo_rpc_multiple_clients_fiberpool_func, &data);
+	}
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+#define FAIR_SCHEDULING_HEAVY_REQUESTS_CNT 10
+#define FAIR_SCHEDULING_LIGHT_REQUESTS_CNT 2
+
+struct server_fair_scheduling_data
+{
+	int heavy_started_cnt;
+	int light_started_cnt;
+	int heavy_started_before_light_cnt;
+};
+
+static enum ff_result server_fair_scheduling_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	struct server_fair_scheduling_data *data;
+	uint8_t is_light;
+	enum ff_result result;
+
+	data = (struct server_fair_scheduling_data *) service_ctx;
+
+	result = ff_stream_read(stream, &is_light, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read the request");
+	if (is_light)
+	{
+		data->light_started_cnt++;
+		if (data->light_started_cnt == FAIR_SCHEDULING_LIGHT_REQUESTS_CNT)
+		{
+			data->heavy_started_before_light_cnt = data->heavy_started_cnt;
+		}
+	}
+	else
+	{
+		data->heavy_started_cnt++;
+	}
+	ff_core_sleep(100);
+	result = ff_stream_write(stream, &is_light, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write the response");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+struct client_server_fair_scheduling_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int workers_cnt;
+	uint8_t is_light;
+};
+
+static void client_server_fair_scheduling_fiberpool_func(void *ctx)
+{
+	struct client_server_fair_scheduling_data *data;
+	struct ff_stream *stream;
+	uint8_t is_light;
+	enum ff_result result;
+
+	data = (struct client_server_fair_scheduling_data *) ctx;
+
+	stream = mrpc_client_create_request_stream(data->client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	result = ff_stream_write(stream, &data->is_light, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write the request to the stream");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = ff_stream_read(stream, &is_light, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read the response from the stream");
+	ASSERT(is_light == data->is_light, "unexpected response");
+	ff_stream_delete(stream);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static struct mrpc_client *create_fair_scheduling_client(struct ff_stream_connector **stream_connector)
+{
+	struct ff_arch_net_addr *addr;
+	struct mrpc_client *client;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10121);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	*stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, *stream_connector);
+	return client;
+}
+
+static void test_client_server_fair_scheduling_shares()
+{
+	struct server_fair_scheduling_data server_data;
+	struct client_server_fair_scheduling_data heavy_data, light_data;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *heavy_stream_connector, *light_stream_connector;
+	struct mrpc_server *server;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10121);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_fair_scheduling(server, 3, server_connection_weight_func);
+	server_data.heavy_started_cnt = 0;
+	server_data.light_started_cnt = 0;
+	server_data.heavy_started_before_light_cnt = 0;
+	mrpc_server_start(server, server_fair_scheduling_stream_handler, &server_data, stream_acceptor);
+
+	heavy_data.event = ff_event_create(FF_EVENT_MANUAL);
+	heavy_data.client = create_fair_scheduling_client(&heavy_stream_connector);
+	heavy_data.workers_cnt = FAIR_SCHEDULING_HEAVY_REQUESTS_CNT;
+	heavy_data.is_light = 0;
+	light_data.event = ff_event_create(FF_EVENT_MANUAL);
+	light_data.client = create_fair_scheduling_client(&light_stream_connector);
+	light_data.workers_cnt = FAIR_SCHEDULING_LIGHT_REQUESTS_CNT;
+	light_data.is_light = 1;
+
+	/* the heavy connection occupies all the execution slots and queues the rest of its requests
+	 * before the light connection sends its requests.
+	 */
+	for (i = 0; i < FAIR_SCHEDULING_HEAVY_REQUESTS_CNT; i++)
+	{
+		ff_core_fiberpool_execute_async(client_server_fair_scheduling_fiberpool_func, &heavy_data);
+	}
+	ff_core_sleep(50);
+	for (i = 0; i < FAIR_SCHEDULING_LIGHT_REQUESTS_CNT; i++)
+	{
+		ff_core_fiberpool_execute_async(client_server_fair_scheduling_fiberpool_func, &light_data);
+	}
+	ff_event_wait(light_data.event);
+	ff_event_wait(heavy_data.event);
+
+	/* 3 execution slots are occupied by the heavy connection, then it executes up to its weight=2 requests
+	 * from the current round, then the light connection executes its requests in the next turn.
+	 * The FIFO order would execute all the heavy requests before the light ones.
+	 */
+	ASSERT(server_data.light_started_cnt == FAIR_SCHEDULING_LIGHT_REQUESTS_CNT, "all the light requests must be executed");
+	ASSERT(server_data.heavy_started_before_light_cnt <= 3 + 2, "the light connection must receive its share of execution slots");
+	ASSERT(server_data.heavy_started_cnt == FAIR_SCHEDULING_HEAVY_REQUESTS_CNT, "all the heavy requests must be executed");
+
+	mrpc_client_stop(light_data.client);
+	mrpc_client_delete(light_data.client);
+	ff_stream_connector_delete(light_stream_connector);
+	mrpc_client_stop(heavy_data.client);
+	mrpc_client_delete(heavy_data.client);
+	ff_stream_connector_delete(heavy_stream_connector);
+	ff_event_delete(light_data.event);
+	ff_event_delete(heavy_data.event);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static enum ff_result server_payload_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	uint8_t buf[0x100];
+	uint32_t payload_size;
+	uint32_t bytes_read;
+	uint32_t i;
+	enum ff_result result;
+
+	result = mrpc_uint32_unserialize(&payload_size, stream);
+	ASSERT(result == FF_SUCCESS, "cannot read payload_size");
+	bytes_read = 0;
+	while (bytes_read < payload_size)
+	{
+		result = ff_stream_read(stream, buf, sizeof(buf));
+		ASSERT(result == FF_SUCCESS, "cannot read payload");
+		for (i = 0; i < sizeof(buf); i++)
+		{
+			ASSERT(buf[i] == (uint8_t) (bytes_read + i), "unexpected payload byte");
+		}
+		bytes_read += sizeof(buf);
+	}
+	result = mrpc_uint32_serialize(payload_size, stream);
+	ASSERT(result == FF_SUCCESS, "cannot write payload_size");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+struct client_server_priorities_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int workers_cnt;
+	int started_workers_cnt;
+};
+
+static void client_server_priorities_send_request(struct mrpc_client *client, enum mrpc_priority priority, uint32_t payload_size)
+{
+	uint8_t buf[0x100];
+	struct ff_stream *stream;
+	uint32_t bytes_written;
+	uint32_t response_size;
+	uint32_t i;
+	enum ff_result result;
+
+	stream = mrpc_client_create_request_stream_with_priority(client, priority);
+	ASSERT(stream != NULL, "client must return valid stream");
+	result = mrpc_uint32_serialize(payload_size, stream);
+	ASSERT(result == FF_SUCCESS, "cannot write payload_size to the stream");
+	bytes_written = 0;
+	while (bytes_written < payload_size)
+	{
+		for (i = 0; i < sizeof(buf); i++)
+		{
+			buf[i] = (uint8_t) (bytes_written + i);
+		}
+		result = ff_stream_write(stream, buf, sizeof(buf));
+		ASSERT(result == FF_SUCCESS, "cannot write payload to the stream");
+		bytes_written += sizeof(buf);
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = mrpc_uint32_unserialize(&response_size, stream);
+	ASSERT(result == FF_SUCCESS, "cannot read response_size from the stream");
+	ASSERT(response_size == payload_size, "unexpected response_size");
+	ff_stream_delete(stream);
+}
+
+static void client_server_priorities_fiberpool_func(void *ctx)
+{
+	struct client_server_priorities_data *data;
+	enum mrpc_priority priority;
+	uint32_t payload_size;
+
+	data = (struct client_server_priorities_data *) ctx;
+
+	/* large low priority requests are interleaved with small high priority requests */
+	data->started_workers_cnt++;
+	if (data->started_workers_cnt % 2)
+	{
+		priority = MRPC_PRIORITY_LOW;
+		payload_size = 0x10000;
+	}
+	else
+	{
+		priority = MRPC_PRIORITY_HIGH;
+		payload_size = 0x100;
+	}
+	client_server_priorities_send_request(data->client, priority, payload_size);
+	client_server_priorities_send_request(data->client, MRPC_PRIORITY_NORMAL, payload_size);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void test_client_server_priorities()
+{
+	struct client_server_priorities_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10108);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(100);
+	mrpc_server_start(server, server_payload_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10108);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.workers_cnt = 10;
+	data.started_workers_cnt = 0;
+	for (i = 0; i < 10; i++)
+	{
+		ff_core_fiberpool_execute_async(client_server_priorities_fiberpool_func, &data);
+	}
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+struct server_priorities_order_data
+{
+	int started_cnt;
+	int high_started_index;
+};
+
+static enum ff_result server_priorities_order_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	struct server_priorities_order_data *data;
+	uint8_t priority;
+	enum ff_result result;
+
+	data = (struct server_priorities_order_data *) service_ctx;
+
+	result = ff_stream_read(stream, &priority, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read the request");
+	data->started_cnt++;
+	if (priority == MRPC_PRIORITY_HIGH)
+	{
+		data->high_started_index = data->started_cnt;
+	}
+	ff_core_sleep(50);
+	result = ff_stream_write(stream, &priority, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write the response");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+struct client_server_priorities_order_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int workers_cnt;
+	enum mrpc_priority priority;
+};
+
+static void client_server_priorities_order_fiberpool_func(void *ctx)
+{
+	struct client_server_priorities_order_data *data;
+	struct ff_stream *stream;
+	enum mrpc_priority priority;
+	uint8_t priority_value;
+	enum ff_result result;
+
+	data = (struct client_server_priorities_order_data *) ctx;
+	priority = data->priority;
+
+	stream = mrpc_client_create_request_stream_with_priority(data->client, priority);
+	ASSERT(stream != NULL, "client must return valid stream");
+	priority_value = (uint8_t) priority;
+	result = ff_stream_write(stream, &priority_value, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write the request to the stream");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = ff_stream_read(stream, &priority_value, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read the response from the stream");
+	ASSERT(priority_value == (uint8_t) priority, "unexpected response");
+	ff_stream_delete(stream);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void test_client_server_priorities_order()
+{
+	struct server_priorities_order_data server_data;
+	struct client_server_priorities_order_data data;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10122);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_fair_scheduling(server, 1, NULL);
+	server_data.started_cnt = 0;
+	server_data.high_started_index = 0;
+	mrpc_server_start(server, server_priorities_order_stream_handler, &server_data, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10122);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* the first request occupies the only execution slot, so the rest of requests are queued on the server */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.workers_cnt = 5;
+	data.priority = MRPC_PRIORITY_NORMAL;
+	ff_core_fiberpool_execute_async(client_server_priorities_order_fiberpool_func, &data);
+	ff_core_sleep(20);
+	data.priority = MRPC_PRIORITY_LOW;
+	for (i = 0; i < 3; i++)
+	{
+		ff_core_fiberpool_execute_async(client_server_priorities_order_fiberpool_func, &data);
+	}
+	ff_core_sleep(20);
+	data.priority = MRPC_PRIORITY_HIGH;
+	ff_core_fiberpool_execute_async(client_server_priorities_order_fiberpool_func, &data);
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	/* the high priority request must be executed right after the request, which occupied the execution slot,
+	 * while the arrival order would execute it after all the low priority requests.
+	 */
+	ASSERT(server_data.started_cnt == 5, "all the requests must be executed");
+	ASSERT(server_data.high_started_index == 2, "the high priority request must be executed before the low priority requests");
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+
+static void test_client_server_echo_rpc_striping()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct mrpc_server *server;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10111);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(100);
+	mrpc_server_start(server, server_echo_stream_handler, server_ctx, stream_acceptor);
+
+	client_server_echo_client_concurrent(10111, 4, 20);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+struct client_server_async_rpc_data
+{
+	struct ff_event *event;
+	int pending_requests_cnt;
+};
+
+static void client_server_async_rpc_response_handler(struct ff_stream *stream, void *ctx)
+{
+	struct client_server_async_rpc_data *data;
+	uint8_t method_id;
+	enum ff_result result;
+
+	data = (struct client_server_async_rpc_data *) ctx;
+
+	result = ff_stream_read(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read response from the stream");
+	ASSERT(method_id == 1, "unexpected method_id");
+	ff_stream_delete(stream);
+
+	data->pending_requests_cnt--;
+	if (data->pending_requests_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void test_client_server_async_rpc()
+{
+	struct client_server_async_rpc_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10112);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_slow_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10112);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* all the requests are sent from the current fiber without waiting for responses */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.pending_requests_cnt = 20;
+	for (i = 0; i < 20; i++)
+	{
+		struct ff_stream *stream;
+		uint8_t method_id;
+
+		stream = mrpc_client_create_async_request_stream(client, MRPC_PRIORITY_NORMAL, client_server_async_rpc_response_handler, &data);
+		ASSERT(stream != NULL, "client must return valid stream");
+		method_id = 1;
+		result = ff_stream_write(stream, &method_id, 1);
+		ASSERT(result == FF_SUCCESS, "cannot write method_id to the stream");
+		result = ff_stream_flush(stream);
+		ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	}
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static void test_client_server_batch_rpc()
+{
+	struct client_server_async_rpc_data data;
+	struct mrpc_client_batch *batch;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10113);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_slow_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10113);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(2);
+	mrpc_client_start(client, stream_connector);
+
+	/* requests are sent to the server only after the batch is ended */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.pending_requests_cnt = 20;
+	batch = mrpc_client_begin_batch(client);
+	for (i = 0; i < 20; i++)
+	{
+		struct ff_stream *stream;
+		uint8_t method_id;
+
+		stream = mrpc_client_create_batch_request_stream(batch, MRPC_PRIORITY_NORMAL, client_server_async_rpc_response_handler, &data);
+		ASSERT(stream != NULL, "client must return valid stream");
+		method_id = 1;
+		result = ff_stream_write(stream, &method_id, 1);
+		ASSERT(result == FF_SUCCESS, "cannot write method_id to the stream");
+		result = ff_stream_flush(stream);
+		ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	}
+	mrpc_client_end_batch(batch);
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+/* packet types as they are encoded in the MRPC_PROTOCOL_V1 packet header.
+ * The MRPC_PROTOCOL_V2 framing transfers only the 'end of stream' flag,
+ * so packets read using this framing have either RAW_PACKET_MIDDLE or RAW_PACKET_END type.
+ */
+#define RAW_PACKET_START 0
+#define RAW_PACKET_MIDDLE 1
+#define RAW_PACKET_END 2
+#define RAW_PACKET_SINGLE 3
+
+/* magic bytes at the beginning of the handshake packet */
+#define RAW_HANDSHAKE_MAGIC "\xff\xff\xff\xff\x0f" "mrpc"
+#define RAW_HANDSHAKE_MAGIC_SIZE (sizeof(RAW_HANDSHAKE_MAGIC) - 1)
+
+/* the handshake response of the MRPC_PROTOCOL_V2 server without optional features:
+ * magic bytes followed by version=2, max_packet_size=0x1000 and max_request_streams_cnt=0x10.
+ */
+#define RAW_HANDSHAKE_RESPONSE RAW_HANDSHAKE_MAGIC "\x02" "\x80\x20" "\x10" "\x00"
+#define RAW_HANDSHAKE_RESPONSE_SIZE (sizeof(RAW_HANDSHAKE_RESPONSE) - 1)
+
+/* bulk messages are split into more packets than the credits window of packet streams */
+#define BULK_CHUNK_SIZE 0x100
+#define BULK_CHUNKS_CNT 200
+
+static void bulk_fill_chunk(uint8_t *buf, int chunk_index)
+{
+	int i;
+
+	for (i = 0; i < BULK_CHUNK_SIZE; i++)
+	{
+		buf[i] = (uint8_t) (chunk_index + i);
+	}
+}
+
+static void bulk_check_chunk(const uint8_t *buf, int chunk_index)
+{
+	int i;
+
+	for (i = 0; i < BULK_CHUNK_SIZE; i++)
+	{
+		ASSERT(buf[i] == (uint8_t) (chunk_index + i), "unexpected bulk data");
+	}
+}
+
+static enum ff_result server_bulk_echo_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	uint8_t buf[BULK_CHUNK_SIZE];
+	int i;
+	enum ff_result result;
+
+	for (i = 0; i < BULK_CHUNKS_CNT; i++)
+	{
+		result = ff_stream_read(stream, buf, BULK_CHUNK_SIZE);
+		ASSERT(result == FF_SUCCESS, "cannot read bulk request");
+		bulk_check_chunk(buf, i);
+	}
+	for (i = 0; i < BULK_CHUNKS_CNT; i++)
+	{
+		bulk_fill_chunk(buf, i);
+		result = ff_stream_write(stream, buf, BULK_CHUNK_SIZE);
+		ASSERT(result == FF_SUCCESS, "cannot write bulk response");
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+static void client_server_bulk_rpc(struct mrpc_client *client)
+{
+	uint8_t buf[BULK_CHUNK_SIZE];
+	struct ff_stream *stream;
+	int i;
+	enum ff_result result;
+
+	stream = mrpc_client_create_request_stream(client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	for (i = 0; i < BULK_CHUNKS_CNT; i++)
+	{
+		bulk_fill_chunk(buf, i);
+		result = ff_stream_write(stream, buf, BULK_CHUNK_SIZE);
+		ASSERT(result == FF_SUCCESS, "cannot write bulk request to the stream");
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	for (i = 0; i < BULK_CHUNKS_CNT; i++)
+	{
+		result = ff_stream_read(stream, buf, BULK_CHUNK_SIZE);
+		ASSERT(result == FF_SUCCESS, "cannot read bulk response from the stream");
+		bulk_check_chunk(buf, i);
+	}
+	ff_stream_delete(stream);
+}
+
+/* raw peers speak the protocol with the given version (1 or 2) without credits.
+ * They send each bulk chunk in a separate packet.
+ */
+static void raw_peer_write_packet(struct ff_stream *stream, int version, uint32_t request_id, int packet_type, const void *buf, int size)
+{
+	uint32_t tmp;
+	enum ff_result result;
+
+	if (version == 1)
+	{
+		uint8_t u8;
+
+		u8 = (uint8_t) request_id;
+		result = ff_stream_write(stream, &u8, 1);
+		ASSERT(result == FF_SUCCESS, "cannot write request_id");
+		tmp = (((uint32_t) size) << 2) | (uint32_t) packet_type;
+	}
+	else
+	{
+		result = mrpc_uint32_serialize(request_id, stream);
+		ASSERT(result == FF_SUCCESS, "cannot write request_id");
+		tmp = (((uint32_t) size) << 1) | ((packet_type == RAW_PACKET_END || packet_type == RAW_PACKET_SINGLE) ? 1 : 0);
+	}
+	result = mrpc_uint32_serialize(tmp, stream);
+	ASSERT(result == FF_SUCCESS, "cannot write packet type and size");
+	result = ff_stream_write(stream, buf, size);
+	ASSERT(result == FF_SUCCESS, "cannot write packet body");
+}
+
+static void raw_peer_write_bulk(struct ff_stream *stream, int version, uint32_t request_id)
+{
+	uint8_t buf[BULK_CHUNK_SIZE];
+	int packet_type;
+	int i;
+	enum ff_result result;
+
+	for (i = 0; i < BULK_CHUNKS_CNT; i++)
+	{
+		packet_type = (i == 0) ? RAW_PACKET_START : ((i == BULK_CHUNKS_CNT - 1) ? RAW_PACKET_END : RAW_PACKET_MIDDLE);
+		bulk_fill_chunk(buf, i);
+		raw_peer_write_packet(stream, version, request_id, packet_type, buf, BULK_CHUNK_SIZE);
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+}
+
+/* reads the header of the next packet. Returns FF_FAILURE if the remote side closed the connection */
+static enum ff_result raw_peer_read_packet_header(struct ff_stream *stream, int version, uint32_t *request_id, int *packet_type, int *size)
+{
+	uint32_t tmp;
+	enum ff_result result;
+
+	if (version == 1)
+	{
+		uint8_t u8;
+
+		result = ff_stream_read(stream, &u8, 1);
+		*request_id = u8;
+	}
+	else
+	{
+		result = mrpc_uint32_unserialize(request_id, stream);
+	}
+	if (result == FF_SUCCESS)
+	{
+		result = mrpc_uint32_unserialize(&tmp, stream);
+		ASSERT(result == FF_SUCCESS, "cannot read packet type and size");
+		if (version == 1)
+		{
+			*packet_type = (int) (tmp & 0x03);
+			*size = (int) (tmp >> 2);
+		}
+		else
+		{
+			*packet_type = ((tmp & 0x01) != 0) ? RAW_PACKET_END : RAW_PACKET_MIDDLE;
+			*size = (int) (tmp >> 1);
+		}
+	}
+	return result;
+}
+
+static void raw_peer_read_bulk(struct ff_stream *stream, int version, uint32_t request_id, int packet_type, int size)
+{
+	uint8_t buf[BULK_CHUNK_SIZE];
+	int bytes_read;
+	int packets_cnt;
+	enum ff_result result;
+
+	ASSERT(packet_type == ((version == 1) ? RAW_PACKET_START : RAW_PACKET_MIDDLE), "unexpected type of the first packet");
+	bytes_read = 0;
+	packets_cnt = 0;
+	for (;;)
+	{
+		uint32_t packet_request_id;
+
+		ASSERT(packet_type != RAW_PACKET_MIDDLE || size > 0, "credits mustn't be sent to peers without the flow control");
+		packets_cnt++;
+		while (size > 0)
+		{
+			int len;
+
+			len = BULK_CHUNK_SIZE - bytes_read % BULK_CHUNK_SIZE;
+			if (len > size)
+			{
+				len = size;
+			}
+			result = ff_stream_read(stream, buf + bytes_read % BULK_CHUNK_SIZE, len);
+			ASSERT(result == FF_SUCCESS, "cannot read packet body");
+			bytes_read += len;
+			size -= len;
+			if (bytes_read % BULK_CHUNK_SIZE == 0)
+			{
+				bulk_check_chunk(buf, bytes_read / BULK_CHUNK_SIZE - 1);
+			}
+		}
+		if (packet_type == RAW_PACKET_END)
+		{
+			break;
+		}
+		result = raw_peer_read_packet_header(stream, version, &packet_request_id, &packet_type, &size);
+		ASSERT(result == FF_SUCCESS, "cannot read packet header");
+		ASSERT(packet_request_id == request_id, "unexpected request_id");
+		ASSERT(packet_type == RAW_PACKET_MIDDLE || packet_type == RAW_PACKET_END, "unexpected packet type");
+	}
+	ASSERT(bytes_read == BULK_CHUNKS_CNT * BULK_CHUNK_SIZE, "unexpected size of the bulk message");
+	ASSERT(packets_cnt > 8, "the bulk message must exceed the credits window");
+}
+
+static void raw_v1_client_bulk_rpc(struct ff_stream *stream)
+{
+	uint32_t request_id;
+	int packet_type;
+	int size;
+	enum ff_result result;
+
+	raw_peer_write_bulk(stream, 1, 1);
+	result = raw_peer_read_packet_header(stream, 1, &request_id, &packet_type, &size);
+	ASSERT(result == FF_SUCCESS, "the server mustn't close connection to the MRPC_PROTOCOL_V1 client");
+	ASSERT(request_id == 1, "unexpected request_id");
+	raw_peer_read_bulk(stream, 1, 1, packet_type, size);
+}
+
+static void test_client_server_admission_policy()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct ff_stream *idle_stream, *stream;
+	struct mrpc_server *server;
+	uint32_t request_id;
+	int packet_type;
+	int size;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10109);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(1);
+	mrpc_server_set_admission_policy(server, MRPC_SERVER_ADMISSION_EVICT_IDLE, 1000);
+	mrpc_server_start(server, server_bulk_echo_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10109);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	ff_stream_connector_initialize(stream_connector);
+
+	/* the first connection fills the server up to the limit and becomes idle.
+	 * It is idle for less than the idle_timeout, so it isn't closed by the idle connections reaper.
+	 */
+	idle_stream = ff_stream_connector_connect(stream_connector);
+	ASSERT(idle_stream != NULL, "stream cannot be NULL");
+	raw_v1_client_bulk_rpc(idle_stream);
+	ff_core_sleep(300);
+
+	/* the new connection must be admitted by evicting the idle connection */
+	stream = ff_stream_connector_connect(stream_connector);
+	ASSERT(stream != NULL, "stream cannot be NULL");
+	raw_v1_client_bulk_rpc(stream);
+
+	result = raw_peer_read_packet_header(idle_stream, 1, &request_id, &packet_type, &size);
+	ASSERT(result != FF_SUCCESS, "the idle connection must be closed by the server");
+
+	ff_stream_delete(stream);
+	ff_stream_delete(idle_stream);
+	ff_stream_connector_shutdown(stream_connector);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static void test_client_server_v1_client()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct ff_stream *stream;
+	struct mrpc_server *server;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10114);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_bulk_echo_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10114);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	ff_stream_connector_initialize(stream_connector);
+	stream = ff_stream_connector_connect(stream_connector);
+	ASSERT(stream != NULL, "stream cannot be NULL");
+
+	/* the client doesn't send the handshake. The same request_id is reused for subsequent requests */
+	for (i = 0; i < 3; i++)
+	{
+		raw_v1_client_bulk_rpc(stream);
+	}
+
+	ff_stream_delete(stream);
+	ff_stream_connector_shutdown(stream_connector);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+struct raw_server_data
+{
+	struct ff_event *event;
+	struct ff_stream_acceptor *stream_acceptor;
+	int version;
+	int dropped_connections_cnt;
+	int handshakes_cnt;
+	int requests_cnt;
+};
+
+static void raw_server_handshake(struct ff_stream *stream, int size)
+{
+	uint8_t buf[0x100];
+	enum ff_result result;
+
+	ASSERT(size >= RAW_HANDSHAKE_MAGIC_SIZE && size <= sizeof(buf), "unexpected size of the handshake");
+	result = ff_stream_read(stream, buf, size);
+	ASSERT(result == FF_SUCCESS, "cannot read the handshake");
+	ASSERT(memcmp(buf, RAW_HANDSHAKE_MAGIC, RAW_HANDSHAKE_MAGIC_SIZE) == 0, "wrong handshake magic");
+	raw_peer_write_packet(stream, 1, 0, RAW_PACKET_SINGLE, RAW_HANDSHAKE_RESPONSE, RAW_HANDSHAKE_RESPONSE_SIZE);
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the handshake response");
+}
+
+static void raw_server_fiberpool_func(void *ctx)
+{
+	struct raw_server_data *data;
+	struct ff_stream *stream;
+	uint32_t request_id;
+	int packet_type;
+	int size;
+	enum ff_result result;
+
+	data = (struct raw_server_data *) ctx;
+
+	for (;;)
+	{
+		stream = ff_stream_acceptor_accept(data->stream_acceptor);
+		ASSERT(stream != NULL, "cannot accept connection");
+		if (data->dropped_connections_cnt > 0)
+		{
+			/* emulate a transient network error */
+			data->dropped_connections_cnt--;
+			ff_stream_delete(stream);
+			continue;
+		}
+
+		/* the handshake is always sent using the MRPC_PROTOCOL_V1 framing */
+		result = raw_peer_read_packet_header(stream, 1, &request_id, &packet_type, &size);
+		ASSERT(result == FF_SUCCESS, "cannot read the first packet");
+		if (request_id != 0 || packet_type != RAW_PACKET_SINGLE)
+		{
+			ASSERT(data->version == 1, "the client must send the handshake to the MRPC_PROTOCOL_V2 server");
+			break;
+		}
+		data->handshakes_cnt++;
+		if (data->version == 2)
+		{
+			raw_server_handshake(stream, size);
+			result = raw_peer_read_packet_header(stream, 2, &request_id, &packet_type, &size);
+			ASSERT(result == FF_SUCCESS, "cannot read the first packet after the handshake");
+			break;
+		}
+		/* the MRPC_PROTOCOL_V1 server treats the handshake as a request for unknown method, so it closes the connection */
+		ff_stream_delete(stream);
+	}
+
+	for (;;)
+	{
+		raw_peer_read_bulk(stream, data->version, request_id, packet_type, size);
+		data->requests_cnt++;
+		raw_peer_write_bulk(stream, data->version, request_id);
+		result = raw_peer_read_packet_header(stream, data->version, &request_id, &packet_type, &size);
+		if (result != FF_SUCCESS)
+		{
+			/* the client closed the connection */
+			break;
+		}
+	}
+	ff_stream_delete(stream);
+	ff_event_set(data->event);
+}
+
+static void client_server_raw_server(int port, int version, int dropped_connections_cnt, int expected_handshakes_cnt)
+{
+	struct raw_server_data data;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", port);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	ff_stream_acceptor_initialize(stream_acceptor);
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.stream_acceptor = stream_acceptor;
+	data.version = version;
+	data.dropped_connections_cnt = dropped_connections_cnt;
+	data.handshakes_cnt = 0;
+	data.requests_cnt = 0;
+	ff_core_fiberpool_execute_async(raw_server_fiberpool_func, &data);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", port);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	for (i = 0; i < 3; i++)
+	{
+		client_server_bulk_rpc(client);
+	}
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+	ASSERT(data.handshakes_cnt == expected_handshakes_cnt, "unexpected number of handshakes");
+	ASSERT(data.requests_cnt == 3, "unexpected number of requests");
+	ff_stream_acceptor_shutdown(stream_acceptor);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static void test_client_server_v1_server()
+{
+	/* the client falls back to the MRPC_PROTOCOL_V1 after the server rejected two handshakes in a row */
+	client_server_raw_server(10115, 1, 0, 2);
+}
+
+static void test_client_server_v2_server()
+{
+	/* the handshake succeeds, so the MRPC_PROTOCOL_V2 is used without optional features */
+	client_server_raw_server(10116, 2, 0, 1);
+}
+
+static void test_client_server_handshake_transient_error()
+{
+	/* the connection dropped before the handshake doesn't make the client fall back to the MRPC_PROTOCOL_V1 */
+	client_server_raw_server(10117, 2, 1, 1);
+}
+
+static enum ff_result server_bulk_response_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	uint8_t buf[BULK_CHUNK_SIZE];
+	int i;
+	enum ff_result result;
+
+	/* the request fits into a single packet, while the response exceeds the credits window */
+	result = ff_stream_read(stream, buf, BULK_CHUNK_SIZE);
+	ASSERT(result == FF_SUCCESS, "cannot read the request");
+	bulk_check_chunk(buf, 0);
+	for (i = 0; i < BULK_CHUNKS_CNT; i++)
+	{
+		bulk_fill_chunk(buf, i);
+		result = ff_stream_write(stream, buf, BULK_CHUNK_SIZE);
+		ASSERT(result == FF_SUCCESS, "cannot write bulk response");
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+static void client_server_bulk_response_rpc(struct mrpc_client *client)
+{
+	uint8_t buf[BULK_CHUNK_SIZE];
+	struct ff_stream *stream;
+	int i;
+	enum ff_result result;
+
+	stream = mrpc_client_create_request_stream(client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	bulk_fill_chunk(buf, 0);
+	result = ff_stream_write(stream, buf, BULK_CHUNK_SIZE);
+	ASSERT(result == FF_SUCCESS, "cannot write the request to the stream");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	for (i = 0; i < BULK_CHUNKS_CNT; i++)
+	{
+		result = ff_stream_read(stream, buf, BULK_CHUNK_SIZE);
+		ASSERT(result == FF_SUCCESS, "cannot read bulk response from the stream");
+		bulk_check_chunk(buf, i);
+	}
+	ff_stream_delete(stream);
+}
+
+static void test_client_server_inline_bulk_response()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10118);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_inline_requests(server, 1);
+	mrpc_server_start(server, server_bulk_response_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10118);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* the inline request waits for credits, which are read from the connection by another fiber */
+	for (i = 0; i < 3; i++)
+	{
+		client_server_bulk_response_rpc(client);
+	}
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+/* the number of chunks in the multi-packet request, which holds the only slot of the method limit */
+#define INLINE_METHOD_LIMITS_CHUNKS_CNT 4
+#define INLINE_METHOD_LIMITS_CHUNK_SIZE 0x1000
+
+static enum ff_result server_inline_method_limits_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	uint8_t buf[INLINE_METHOD_LIMITS_CHUNK_SIZE];
+	struct mrpc_method_limits *limits;
+	uint8_t chunks_cnt;
+	int i;
+	enum ff_result result;
+
+	limits = (struct mrpc_method_limits *) service_ctx;
+
+	result = ff_stream_read(stream, &chunks_cnt, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read chunks_cnt");
+	if (mrpc_method_limits_is_wait_needed(limits, 0))
+	{
+		mrpc_server_stream_handler_prepare_to_block(stream);
+	}
+	result = mrpc_method_limits_acquire_slot(limits, 0);
+	ASSERT(result == FF_SUCCESS, "queued call must acquire a slot");
+	for (i = 0; i < chunks_cnt; i++)
+	{
+		result = ff_stream_read(stream, buf, sizeof(buf));
+		ASSERT(result == FF_SUCCESS, "cannot read the chunk of the request");
+	}
+	mrpc_method_limits_release_slot(limits, 0);
+
+	result = ff_stream_write(stream, &chunks_cnt, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write chunks_cnt");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+static enum ff_result client_server_inline_method_limits_rpc(struct mrpc_client *client, uint8_t chunks_cnt, int pause)
+{
+	uint8_t buf[INLINE_METHOD_LIMITS_CHUNK_SIZE];
+	struct ff_stream *stream;
+	uint8_t response_chunks_cnt;
+	int i;
+	enum ff_result result;
+
+	stream = mrpc_client_create_request_stream(client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	result = ff_stream_write(stream, &chunks_cnt, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write chunks_cnt to the stream");
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < chunks_cnt; i++)
+	{
+		if (i == chunks_cnt / 2)
+		{
+			/* the server holds the slot of the method while it waits for the rest of the request */
+			ff_core_sleep(pause);
+		}
+		result = ff_stream_write(stream, buf, sizeof(buf));
+		ASSERT(result == FF_SUCCESS, "cannot write the chunk to the stream");
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = ff_stream_read(stream, &response_chunks_cnt, 1);
+	if (result == FF_SUCCESS)
+	{
+		ASSERT(response_chunks_cnt == chunks_cnt, "unexpected chunks_cnt");
+	}
+	ff_stream_delete(stream);
+
+	return result;
+}
+
+struct client_server_inline_method_limits_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	enum ff_result result;
+};
+
+static void client_server_inline_method_limits_fiberpool_func(void *ctx)
+{
+	struct client_server_inline_method_limits_data *data;
+
+	data = (struct client_server_inline_method_limits_data *) ctx;
+	data->result = client_server_inline_method_limits_rpc(data->client, INLINE_METHOD_LIMITS_CHUNKS_CNT, 200);
+	ff_event_set(data->event);
+}
+
+static void test_client_server_inline_method_limits()
+{
+	struct client_server_inline_method_limits_data data;
+	struct mrpc_method_limits *limits;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	enum ff_result result;
+
+	limits = mrpc_method_limits_create(1);
+	mrpc_method_limits_set(limits, 0, 1, 1);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10126);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_inline_requests(server, 1);
+	mrpc_server_start(server, server_inline_method_limits_stream_handler, limits, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10126);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* the multi-packet request holds the only slot of the method, while the inline request
+	 * waits for the slot. The inline request mustn't block reading the rest of the multi-packet request.
+	 */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.result = FF_FAILURE;
+	ff_core_fiberpool_execute_async(client_server_inline_method_limits_fiberpool_func, &data);
+	ff_core_sleep(50);
+	result = client_server_inline_method_limits_rpc(client, 0, 0);
+	ASSERT(result == FF_SUCCESS, "the inline request must be processed");
+	ff_event_wait(data.event);
+	ASSERT(data.result == FF_SUCCESS, "the multi-packet request must be processed");
+	ff_event_delete(data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+	mrpc_method_limits_delete(limits);
+}
+
+struct client_server_high_priority_flush_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+};
+
+static void client_server_high_priority_flush_fiberpool_func(void *ctx)
+{
+	struct client_server_high_priority_flush_data *data;
+
+	data = (struct client_server_high_priority_flush_data *) ctx;
+	client_server_priorities_send_request(data->client, MRPC_PRIORITY_HIGH, 0x100);
+	ff_event_set(data->event);
+}
+
+static void test_client_server_high_priority_flush()
+{
+	struct client_server_high_priority_flush_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10119);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_payload_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10119);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_set_flush_policy(client, 60 * 1000, 0x100000);
+	mrpc_client_start(client, stream_connector);
+
+	/* the high priority request must be flushed without waiting for the flush_delay */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	ff_core_fiberpool_execute_async(client_server_high_priority_flush_fiberpool_func, &data);
+	result = ff_event_wait_with_timeout(data.event, 10 * 1000);
+	ASSERT(result == FF_SUCCESS, "the high priority request must be flushed immediately");
+	ff_event_delete(data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+#define UNREAD_REQUEST_SIZE 0x100000
+
+static enum ff_result server_unread_request_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	uint8_t method_id;
+	enum ff_result result;
+
+	/* the handler responds without reading the rest of the request */
+	result = ff_stream_read(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read method_id");
+	if (method_id == 1)
+	{
+		ff_core_sleep(100);
+	}
+	result = ff_stream_write(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write method_id");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+static enum ff_result client_server_unread_request_rpc(struct mrpc_client *client, uint8_t method_id, int payload_size)
+{
+	uint8_t buf[0x1000];
+	struct ff_stream *stream;
+	uint8_t response_method_id;
+	int bytes_written;
+	enum ff_result result;
+
+	stream = mrpc_client_create_request_stream(client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	result = ff_stream_write(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write method_id to the stream");
+	memset(buf, 0, sizeof(buf));
+	for (bytes_written = 0; bytes_written < payload_size; bytes_written += sizeof(buf))
+	{
+		result = ff_stream_write(stream, buf, sizeof(buf));
+		ASSERT(result == FF_SUCCESS, "cannot write payload to the stream");
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = ff_stream_read(stream, &response_method_id, 1);
+	if (result == FF_SUCCESS)
+	{
+		ASSERT(response_method_id == method_id, "unexpected method_id");
+	}
+	ff_stream_delete(stream);
+
+	return result;
+}
+
+static void client_server_rejected_rpc(struct mrpc_client *client, int payload_size, int is_reset_needed)
+{
+	uint8_t buf[0x1000];
+	struct ff_stream *stream;
+	uint8_t method_id;
+	int bytes_written;
+	enum ff_result result;
+
+	stream = mrpc_client_create_request_stream(client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	method_id = 0;
+	result = ff_stream_write(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write method_id to the stream");
+	memset(buf, 0, sizeof(buf));
+	for (bytes_written = 0; bytes_written < payload_size; bytes_written += sizeof(buf))
+	{
+		result = ff_stream_write(stream, buf, sizeof(buf));
+		ASSERT(result == FF_SUCCESS, "cannot write payload to the stream");
+	}
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = ff_stream_read(stream, &method_id, 1);
+	ASSERT(result != FF_SUCCESS, "the request must be rejected");
+	ASSERT(mrpc_client_is_server_overloaded(client, stream), "the server must be overloaded");
+	if (is_reset_needed)
+	{
+		mrpc_client_reset_connection(client, stream);
+	}
+	ff_stream_delete(stream);
+}
+
+struct client_server_unread_request_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+};
+
+static void client_server_unread_request_fiberpool_func(void *ctx)
+{
+	struct client_server_unread_request_data *data;
+	enum ff_result result;
+
+	data = (struct client_server_unread_request_data *) ctx;
+	result = client_server_unread_request_rpc(data->client, 1, 0);
+	ASSERT(result == FF_SUCCESS, "the slow request mustn't be rejected");
+	ff_event_set(data->event);
+}
+
+static void test_client_server_unread_request()
+{
+	struct client_server_unread_request_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10120);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_load_shedding(server, 1, 0);
+	mrpc_server_start(server, server_unread_request_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10120);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* the multi-packet request must be rejected while the slow request is executed */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	ff_core_fiberpool_execute_async(client_server_unread_request_fiberpool_func, &data);
+	ff_core_sleep(20);
+	client_server_rejected_rpc(client, UNREAD_REQUEST_SIZE, 0);
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	/* the connection must stay usable for requests, which aren't read completely by the server */
+	for (i = 0; i < 3; i++)
+	{
+		result = client_server_unread_request_rpc(client, 0, UNREAD_REQUEST_SIZE);
+		ASSERT(result == FF_SUCCESS, "the request must be processed");
+	}
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+struct client_server_concurrent_batches_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int pending_requests_cnt;
+	int is_batch_ended;
+};
+
+static void client_server_concurrent_batches_response_handler(struct ff_stream *stream, void *ctx)
+{
+	struct client_server_concurrent_batches_data *data;
+	uint8_t method_id;
+	enum ff_result result;
+
+	data = (struct client_server_concurrent_batches_data *) ctx;
+
+	result = ff_stream_read(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read response from the stream");
+	ASSERT(method_id == 0, "unexpected method_id");
+	ff_stream_delete(stream);
+
+	data->pending_requests_cnt--;
+	if (data->pending_requests_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void client_server_concurrent_batches_send_requests(struct mrpc_client_batch *batch, struct client_server_concurrent_batches_data *data)
+{
+	int i;
+	enum ff_result result;
+
+	for (i = 0; i < 5; i++)
+	{
+		struct ff_stream *stream;
+		uint8_t method_id;
+
+		stream = mrpc_client_create_batch_request_stream(batch, MRPC_PRIORITY_NORMAL, client_server_concurrent_batches_response_handler, data);
+		ASSERT(stream != NULL, "client must return valid stream");
+		method_id = 0;
+		result = ff_stream_write(stream, &method_id, 1);
+		ASSERT(result == FF_SUCCESS, "cannot write method_id to the stream");
+		result = ff_stream_flush(stream);
+		ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	}
+}
+
+static void client_server_concurrent_batches_fiberpool_func(void *ctx)
+{
+	struct client_server_concurrent_batches_data *data;
+	struct mrpc_client_batch *batch;
+
+	data = (struct client_server_concurrent_batches_data *) ctx;
+
+	batch = mrpc_client_begin_batch(data->client);
+	client_server_concurrent_batches_send_requests(batch, data);
+
+	/* keep the batch open while the other caller sends its requests */
+	ff_core_sleep(500);
+	data->is_batch_ended = 1;
+	mrpc_client_end_batch(batch);
+}
+
+static void test_client_server_concurrent_batches()
+{
+	struct client_server_concurrent_batches_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10125);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_unread_request_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10125);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* requests of the caller, which doesn't use batches, mustn't wait for the end of the batch
+	 * started by another caller over the same connection.
+	 */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.pending_requests_cnt = 5;
+	data.is_batch_ended = 0;
+	ff_core_fiberpool_execute_async(client_server_concurrent_batches_fiberpool_func, &data);
+	ff_core_sleep(20);
+	for (i = 0; i < 3; i++)
+	{
+		result = client_server_unread_request_rpc(client, 0, 0);
+		ASSERT(result == FF_SUCCESS, "the request must be processed");
+		ASSERT(!data.is_batch_ended, "the request mustn't wait for the end of the batch");
+	}
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static void test_client_server_overlapping_batches()
+{
+	struct client_server_concurrent_batches_data long_batch_data;
+	struct client_server_concurrent_batches_data short_batch_data;
+	struct mrpc_client_batch *long_batch;
+	struct mrpc_client_batch *short_batch;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10127);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_unread_request_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10127);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* the short batch is ended while the long batch is active, so its requests must be sent
+	 * without waiting for the end of the long batch.
+	 */
+	long_batch_data.event = ff_event_create(FF_EVENT_MANUAL);
+	long_batch_data.client = client;
+	long_batch_data.pending_requests_cnt = 5;
+	long_batch_data.is_batch_ended = 0;
+	short_batch_data.event = ff_event_create(FF_EVENT_MANUAL);
+	short_batch_data.client = client;
+	short_batch_data.pending_requests_cnt = 5;
+	short_batch_data.is_batch_ended = 0;
+	long_batch = mrpc_client_begin_batch(client);
+	client_server_concurrent_batches_send_requests(long_batch, &long_batch_data);
+	short_batch = mrpc_client_begin_batch(client);
+	client_server_concurrent_batches_send_requests(short_batch, &short_batch_data);
+	mrpc_client_end_batch(short_batch);
+	result = ff_event_wait_with_timeout(short_batch_data.event, 2000);
+	ASSERT(result == FF_SUCCESS, "requests of the ended batch mustn't wait for the end of another batch");
+	mrpc_client_end_batch(long_batch);
+	ff_event_wait(long_batch_data.event);
+	ff_event_delete(short_batch_data.event);
+	ff_event_delete(long_batch_data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+/* parameters of the blocking call, which is executed in the thread pool
+ * the same way as generated servers execute blocking methods.
+ */
+struct server_blocking_call
+{
+	uint32_t n;
+	uint64_t sum;
+};
+
+static void server_blocking_call_func(void *ctx)
+{
+	struct server_blocking_call *call;
+	uint64_t sum;
+	uint32_t i;
+
+	/* this function is executed in a thread pool's thread, so it mustn't call fiber-framework functions */
+	call = (struct server_blocking_call *) ctx;
+	sum = 0;
+	for (i = 1; i <= call->n; i++)
+	{
+		sum += i;
+	}
+	call->sum = sum;
+}
+
+static enum ff_result server_blocking_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	struct server_blocking_call call;
+	enum ff_result result;
+
+	result = mrpc_uint32_unserialize(&call.n, stream);
+	ASSERT(result == FF_SUCCESS, "cannot read the request");
+	call.sum = 0;
+	ff_core_threadpool_execute(server_blocking_call_func, &call);
+	result = mrpc_uint64_serialize(call.sum, stream);
+	ASSERT(result == FF_SUCCESS, "cannot write the response");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+struct client_server_blocking_method_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int workers_cnt;
+	uint32_t n;
+};
+
+static void client_server_blocking_method_fiberpool_func(void *ctx)
+{
+	struct client_server_blocking_method_data *data;
+	struct ff_stream *stream;
+	uint32_t n;
+	uint64_t sum;
+	enum ff_result result;
+
+	data = (struct client_server_blocking_method_data *) ctx;
+	data->n += 100000;
+	n = data->n;
+
+	stream = mrpc_client_create_request_stream(data->client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	result = mrpc_uint32_serialize(n, stream);
+	ASSERT(result == FF_SUCCESS, "cannot write the request to the stream");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	result = mrpc_uint64_unserialize(&sum, stream);
+	ASSERT(result == FF_SUCCESS, "cannot read the response from the stream");
+	ASSERT(sum == (uint64_t) n * (n + 1) / 2, "unexpected result of the blocking call");
+	ff_stream_delete(stream);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void test_client_server_blocking_method()
+{
+	struct client_server_blocking_method_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10123);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_blocking_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10123);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* blocking calls of concurrent requests are executed simultaneously in the thread pool */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.workers_cnt = 10;
+	data.n = 0;
+	for (i = 0; i < 10; i++)
+	{
+		ff_core_fiberpool_execute_async(client_server_blocking_method_fiberpool_func, &data);
+	}
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+struct client_server_drain_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int workers_cnt;
+	int sent_requests_cnt;
+	int failed_requests_cnt;
+};
+
+static void client_server_drain_fiberpool_func(void *ctx)
+{
+	struct client_server_drain_data *data;
+	struct ff_stream *stream;
+	uint8_t method_id;
+	enum ff_result result;
+
+	data = (struct client_server_drain_data *) ctx;
+
+	stream = mrpc_client_create_request_stream(data->client);
+	ASSERT(stream != NULL, "client must return valid stream");
+	method_id = 0;
+	result = ff_stream_write(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write method_id to the stream");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+	data->sent_requests_cnt++;
+	result = ff_stream_read(stream, &method_id, 1);
+	if (result != FF_SUCCESS)
+	{
+		data->failed_requests_cnt++;
+	}
+	else
+	{
+		ASSERT(method_id == 0, "unexpected method_id");
+	}
+	ff_stream_delete(stream);
+
+	data->workers_cnt--;
+	if (data->workers_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void test_client_server_drain()
+{
+	struct client_server_drain_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10110);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_start(server, server_slow_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10110);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.workers_cnt = 10;
+	data.sent_requests_cnt = 0;
+	data.failed_requests_cnt = 0;
+	for (i = 0; i < 10; i++)
+	{
+		ff_core_fiberpool_execute_async(client_server_drain_fiberpool_func, &data);
+	}
+	while (data.sent_requests_cnt < 10)
+	{
+		ff_core_sleep(10);
+	}
+	/* in-flight requests must be completed by the draining server */
+	mrpc_server_drain(server, 1000);
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+	ASSERT(data.failed_requests_cnt == 0, "in-flight requests mustn't fail during the drain");
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+struct client_server_striped_reset_data
+{
+	struct ff_event *event;
+	struct mrpc_client *client;
+	int pending_requests_cnt;
+	int succeeded_requests_cnt;
+};
+
+static void client_server_striped_reset_fiberpool_func(void *ctx)
+{
+	struct client_server_striped_reset_data *data;
+	enum ff_result result;
+
+	data = (struct client_server_striped_reset_data *) ctx;
+	result = client_server_unread_request_rpc(data->client, 1, 0);
+	if (result == FF_SUCCESS)
+	{
+		data->succeeded_requests_cnt++;
+	}
+	data->pending_requests_cnt--;
+	if (data->pending_requests_cnt == 0)
+	{
+		ff_event_set(data->event);
+	}
+}
+
+static void test_client_server_striped_reset()
+{
+	struct client_server_striped_reset_data data;
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10124);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_load_shedding(server, 1, 0);
+	mrpc_server_start(server, server_unread_request_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10124);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(2);
+	mrpc_client_start(client, stream_connector);
+
+	/* each connection executes a slow request, so the next request is rejected
+	 * on one of the connections. Resetting the connection of the rejected request
+	 * mustn't abort the slow request on the other connection.
+	 */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	data.pending_requests_cnt = 2;
+	data.succeeded_requests_cnt = 0;
+	ff_core_fiberpool_execute_async(client_server_striped_reset_fiberpool_func, &data);
+	ff_core_fiberpool_execute_async(client_server_striped_reset_fiberpool_func, &data);
+	ff_core_sleep(20);
+	client_server_rejected_rpc(client, 0, 1);
+	ff_event_wait(data.event);
+	ASSERT(data.succeeded_requests_cnt >= 1, "the slow request on the other connection mustn't be aborted");
+	ff_event_delete(data.event);
+
+	result = client_server_unread_request_rpc(client, 0, 0);
+	ASSERT(result == FF_SUCCESS, "the request must be processed after the connection reset");
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+static void test_client_server_hibernation()
+{
+	void *server_ctx = NULL;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10128);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_hibernation_timeout(server, 20);
+	mrpc_server_start(server, server_unread_request_stream_handler, server_ctx, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10128);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_set_hibernation_timeout(client, 20);
+	mrpc_client_start(client, stream_connector);
+
+	/* the connection hibernates after two consecutive hibernation timeouts without traffic,
+	 * so both sides free their request streams and trim packet buffers. The connection
+	 * must allocate them again and serve requests after the hibernation.
+	 */
+	for (i = 0; i < 3; i++)
+	{
+		result = client_server_unread_request_rpc(client, 0, 0x10000);
+		ASSERT(result == FF_SUCCESS, "the request must be processed");
+		ff_core_sleep(100);
+	}
+	result = client_server_unread_request_rpc(client, 0, 0);
+	ASSERT(result == FF_SUCCESS, "the request must be processed after the hibernation");
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
+
+	mrpc_server_stop(server);
+	mrpc_server_delete(server);
+	ff_stream_acceptor_delete(stream_acceptor);
+}
+
+struct server_inline_fair_scheduling_data
+{
+	int active_handlers_cnt;
+	int max_active_handlers_cnt;
+};
+
+static enum ff_result server_inline_fair_scheduling_stream_handler(struct ff_stream *stream, void *service_ctx)
+{
+	struct server_inline_fair_scheduling_data *data;
+	uint8_t method_id;
+	enum ff_result result;
+
+	data = (struct server_inline_fair_scheduling_data *) service_ctx;
+
+	result = ff_stream_read(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot read method_id");
+	data->active_handlers_cnt++;
+	if (data->active_handlers_cnt > data->max_active_handlers_cnt)
+	{
+		data->max_active_handlers_cnt = data->active_handlers_cnt;
+	}
+	if (method_id == 1)
+	{
+		mrpc_server_stream_handler_prepare_to_block(stream);
+		ff_core_sleep(100);
+	}
+	data->active_handlers_cnt--;
+	result = ff_stream_write(stream, &method_id, 1);
+	ASSERT(result == FF_SUCCESS, "cannot write method_id");
+	result = ff_stream_flush(stream);
+	ASSERT(result == FF_SUCCESS, "cannot flush the stream");
+
+	return result;
+}
+
+static void test_client_server_inline_fair_scheduling()
+{
+	struct server_inline_fair_scheduling_data server_data;
+	struct client_server_unread_request_data data;
+	struct ff_arch_net_addr *addr;
+	struct ff_stream_acceptor *stream_acceptor;
+	struct ff_stream_connector *stream_connector;
+	struct mrpc_server *server;
+	struct mrpc_client *client;
+	int i;
+	enum ff_result result;
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10129);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_acceptor = ff_stream_acceptor_tcp_create(addr);
+	server = mrpc_server_create(10);
+	mrpc_server_set_inline_requests(server, 1);
+	mrpc_server_set_fair_scheduling(server, 1, NULL);
+	server_data.active_handlers_cnt = 0;
+	server_data.max_active_handlers_cnt = 0;
+	mrpc_server_start(server, server_inline_fair_scheduling_stream_handler, &server_data, stream_acceptor);
+
+	addr = ff_arch_net_addr_create();
+	result = ff_arch_net_addr_resolve(addr, L"localhost", 10129);
+	ASSERT(result == FF_SUCCESS, "cannot resolve local address");
+	stream_connector = ff_stream_connector_tcp_create(addr);
+	client = mrpc_client_create(1);
+	mrpc_client_start(client, stream_connector);
+
+	/* the slow inline request occupies the only execution slot after handing off the stream reader,
+	 * so the following small requests must wait for the slot instead of being handled inline.
+	 */
+	data.event = ff_event_create(FF_EVENT_MANUAL);
+	data.client = client;
+	ff_core_fiberpool_execute_async(client_server_unread_request_fiberpool_func, &data);
+	ff_core_sleep(20);
+	for (i = 0; i < 3; i++)
+	{
+		result = client_server_unread_request_rpc(client, 0, 0);
+		ASSERT(result == FF_SUCCESS, "the request must be processed");
+	}
+	ff_event_wait(data.event);
+	ff_event_delete(data.event);
+	ASSERT(server_data.max_active_handlers_cnt == 1, "inline requests must respect the limit of active handlers");
+
+	mrpc_client_stop(client);
+	mrpc_client_delete(client);
+	ff_stream_connector_delete(stream_connector);
 
 	mrpc_server_stop(server);
 	mrpc_server_delete(server);
@@ -1779,6 +4435,33 @@ static void test_client_server_all()
 	test_client_server_echo_rpc();
 	test_client_server_echo_rpc_multiple_clients();
 	test_client_server_echo_rpc_concurrent();
+	test_client_server_echo_rpc_packets_limit();
+	test_client_server_echo_rpc_inline();
+	test_client_server_echo_rpc_flush_delay();
+	test_client_server_load_shedding();
+	test_client_server_echo_rpc_fair_scheduling();
+	test_client_server_fair_scheduling_shares();
+	test_client_server_priorities();
+	test_client_server_priorities_order();
+	test_client_server_admission_policy();
+	test_client_server_drain();
+	test_client_server_echo_rpc_striping();
+	test_client_server_async_rpc();
+	test_client_server_batch_rpc();
+	test_client_server_concurrent_batches();
+	test_client_server_overlapping_batches();
+	test_client_server_v1_client();
+	test_client_server_v1_server();
+	test_client_server_v2_server();
+	test_client_server_handshake_transient_error();
+	test_client_server_inline_bulk_response();
+	test_client_server_inline_method_limits();
+	test_client_server_high_priority_flush();
+	test_client_server_unread_request();
+	test_client_server_blocking_method();
+	test_client_server_striped_reset();
+	test_client_server_hibernation();
+	test_client_server_inline_fair_scheduling();
 	ff_core_shutdown();
 }
 
@@ -2004,6 +4687,8 @@ static void test_all()
 	test_char_array_all();
 	test_wchar_array_all();
 	test_blob_all();
+	test_method_limits_all();
+	test_memory_all();
 	test_client_server_all();
 	test_distributed_client_all();
 }